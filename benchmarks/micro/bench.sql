@@ -0,0 +1,25 @@
+-- Runs the microbenchmarks, iterations can be set with: psql -v iterations=N
+\set ON_ERROR_STOP on
+\if :{?iterations}
+\else
+\set iterations 10000
+\endif
+
+CREATE FUNCTION pg_temp.pgtsq_bench(
+	IN iterations bigint,
+	OUT function text,
+	OUT corpus text,
+	OUT row_size integer,
+	OUT ns_per_op double precision,
+	OUT bytes_per_op double precision,
+	OUT allocs_per_op double precision
+)
+RETURNS SETOF record
+AS '$libdir/pgtsq_bench', 'pgtsq_bench'
+LANGUAGE C STRICT;
+
+SELECT corpus, function, row_size,
+	round(ns_per_op::numeric, 1) AS ns_per_op,
+	round(bytes_per_op::numeric, 1) AS bytes_per_op,
+	round(allocs_per_op::numeric, 2) AS allocs_per_op
+FROM pg_temp.pgtsq_bench(:iterations);
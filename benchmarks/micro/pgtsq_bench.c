@@ -0,0 +1,406 @@
+/*
+ * Microbenchmarks of the hot functions of pg_track_slow_queries
+ *
+ * Runs pgtsq_serialize_entry(), pgtsq_check_row(), pgtsq_parse_row() and
+ * pgtsq_store_row() on a corpus of entries inside a backend, as they are
+ * built on backend memory contexts and storage routines, and reports the time,
+ * the memory allocated and the number of allocations per call.
+ *
+ * Allocations are counted by wrapping the methods of the memory context the
+ * functions run in. Starting with PostgreSQL 16, repalloc() is dispatched on
+ * the chunk and not on the context, so it is not counted.
+ *
+ * Storage is benchmarked on a dedicated segment of pg_stat, removed when
+ * done, so this must not be run where pg_track_slow_queries is loaded.
+ */
+#include "postgres.h"
+#include <unistd.h>
+
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "lib/stringinfo.h"
+#include "port/atomics.h"
+#include "portability/instr_time.h"
+#include "storage/lwlock.h"
+#include "storage/spin.h"
+#include "utils/builtins.h"
+#include "utils/guc.h"
+#include "utils/memutils.h"
+#include "utils/timestamp.h"
+#include "pgstat.h"
+
+#include "pg_track_slow_queries.h"
+
+PG_MODULE_MAGIC;
+
+/* Number of result columns */
+#define BENCH_COLS			6
+/* Calls between two resets of the memory context, not timed */
+#define BENCH_BATCH_SIZE	256
+/* Storage segment used by the benchmark, far from the regular ones */
+#define BENCH_SEGNO			TSQ_SEGNO_MASK
+
+/* Shared state used by the storage functions, local to this backend */
+TSQSharedState *pgtsqss = NULL;
+
+typedef enum BenchFunction {
+	BENCH_SERIALIZE = 0,
+	BENCH_CHECK,
+	BENCH_PARSE,
+	BENCH_STORE,
+	BENCH_STORE_COMPRESSED,
+	BENCH_FUNCTIONS
+} BenchFunction;
+
+static const char *const function_names[BENCH_FUNCTIONS] = {
+	"serialize",
+	"check",
+	"parse",
+	"store",
+	"store_compressed"
+};
+
+/* Allocation counters of the benchmark context */
+static uint64 nallocs = 0;
+static uint64 nbytes = 0;
+static const MemoryContextMethods *alloc_methods = NULL;
+static MemoryContextMethods counting_methods;
+
+PGDLLEXPORT Datum pgtsq_bench(PG_FUNCTION_ARGS);
+
+PG_FUNCTION_INFO_V1(pgtsq_bench);
+
+#if (PG_VERSION_NUM >= 170000)
+static void *
+counting_alloc(MemoryContext context, Size size, int flags)
+{
+	nallocs++;
+	nbytes += size;
+	return alloc_methods->alloc(context, size, flags);
+}
+#else
+static void *
+counting_alloc(MemoryContext context, Size size)
+{
+	nallocs++;
+	nbytes += size;
+	return alloc_methods->alloc(context, size);
+}
+#endif
+
+#if (PG_VERSION_NUM < 160000)
+static void *
+counting_realloc(MemoryContext context, void *pointer, Size size)
+{
+	nallocs++;
+	nbytes += size;
+	return alloc_methods->realloc(context, pointer, size);
+}
+#endif
+
+/*
+ * Creates a memory context counting its allocations
+ */
+static MemoryContext
+bench_context_create(void)
+{
+	MemoryContext	context;
+
+	context = AllocSetContextCreate(CurrentMemoryContext,
+									"PGTSQBench", ALLOCSET_DEFAULT_SIZES);
+	alloc_methods = context->methods;
+	memcpy(&counting_methods, alloc_methods, sizeof(MemoryContextMethods));
+	counting_methods.alloc = counting_alloc;
+#if (PG_VERSION_NUM < 160000)
+	counting_methods.realloc = counting_realloc;
+#endif
+	context->methods = &counting_methods;
+
+	return context;
+}
+
+/*
+ * Builds an EXPLAIN (FORMAT JSON) like plan of nnodes nested join nodes
+ */
+static char *
+bench_plan(int nnodes)
+{
+	StringInfoData	buf;
+
+	initStringInfo(&buf);
+	appendStringInfoString(&buf, "{\n  \"Query Text\": \"\",\n  \"Plan\": ");
+	for (int i = 0; i < nnodes; i++)
+		appendStringInfo(&buf,
+						 "{\n    \"Node Type\": \"Hash Join\",\n"
+						 "    \"Parallel Aware\": false,\n"
+						 "    \"Join Type\": \"Inner\",\n"
+						 "    \"Startup Cost\": %d.%02d,\n"
+						 "    \"Total Cost\": %d.%02d,\n"
+						 "    \"Plan Rows\": %d,\n"
+						 "    \"Plan Width\": %d,\n"
+						 "    \"Inner Unique\": false,\n"
+						 "    \"Hash Cond\": \"(t%d.id = t%d.t%d_id)\",\n"
+						 "    \"Plans\": [\n"
+						 "      {\n        \"Node Type\": \"Hash\",\n"
+						 "        \"Parent Relationship\": \"Inner\",\n"
+						 "        \"Startup Cost\": %d.%02d,\n"
+						 "        \"Total Cost\": %d.%02d,\n"
+						 "        \"Plan Rows\": %d,\n"
+						 "        \"Plan Width\": 8,\n"
+						 "        \"Plans\": [\n"
+						 "          {\n            \"Node Type\": \"Seq Scan\",\n"
+						 "            \"Parent Relationship\": \"Outer\",\n"
+						 "            \"Relation Name\": \"t%d\",\n"
+						 "            \"Alias\": \"t%d\",\n"
+						 "            \"Startup Cost\": 0.00,\n"
+						 "            \"Total Cost\": %d.%02d,\n"
+						 "            \"Plan Rows\": %d,\n"
+						 "            \"Plan Width\": 8\n"
+						 "          }\n        ]\n      },\n"
+						 "      ",
+						 1000 * i, i % 100, 5000 * (i + 1), (7 * i) % 100,
+						 10000 * (i + 1), 8 * (i + 2), i, i + 1, i,
+						 900 * i, i % 100, 900 * i, i % 100, 1000 * i,
+						 i, i, 450 * i, (3 * i) % 100, 1000 * i);
+	appendStringInfoString(&buf,
+						   "{\n    \"Node Type\": \"Seq Scan\",\n"
+						   "    \"Relation Name\": \"t0\",\n"
+						   "    \"Alias\": \"t0\",\n"
+						   "    \"Startup Cost\": 0.00,\n"
+						   "    \"Total Cost\": 1541.00,\n"
+						   "    \"Plan Rows\": 100000,\n"
+						   "    \"Plan Width\": 8\n  }");
+	for (int i = 0; i < nnodes; i++)
+		appendStringInfoString(&buf, "\n    ]\n  }");
+	appendStringInfoString(&buf, "\n}");
+
+	return buf.data;
+}
+
+/*
+ * Builds a query joining nrels relations
+ */
+static char *
+bench_query(int nrels)
+{
+	StringInfoData	buf;
+
+	initStringInfo(&buf);
+	appendStringInfoString(&buf, "SELECT t0.id, count(*)");
+	for (int i = 1; i < nrels; i++)
+		appendStringInfo(&buf, ", sum(t%d.amount) AS amount_%d", i, i);
+	appendStringInfoString(&buf, " FROM t0");
+	for (int i = 1; i < nrels; i++)
+		appendStringInfo(&buf, " JOIN t%d ON t%d.id = t%d.t%d_id", i, i - 1, i, i - 1);
+	appendStringInfoString(&buf, " WHERE t0.created_at >= now() - interval '1 day'"
+						   " GROUP BY t0.id ORDER BY 2 DESC LIMIT 100;");
+
+	return buf.data;
+}
+
+/*
+ * Fills a corpus entry: small OLTP statement or large analytic query, with
+ * a JSON plan and no relations
+ */
+static void
+bench_entry(TSQEntry * tsqe, bool analytic)
+{
+	memset(tsqe, 0, sizeof(TSQEntry));
+	tsqe->end_time = GetCurrentTimestamp();
+	tsqe->username = "postgres";
+	tsqe->dbname = "bench";
+	if (analytic)
+	{
+		tsqe->duration = 12345.678;
+		tsqe->start_time = tsqe->end_time - 12345678;
+		tsqe->appname = "reporting";
+		tsqe->temp_blks_written = 81920;
+		tsqe->hitratio = 0.4567;
+		tsqe->ntuples = 100;
+		tsqe->querytxt = bench_query(40);
+		tsqe->plantxt = bench_plan(40);
+	}
+	else
+	{
+		tsqe->duration = 0.123;
+		tsqe->start_time = tsqe->end_time - 123;
+		tsqe->appname = "pgbench";
+		tsqe->temp_blks_written = 0;
+		tsqe->hitratio = 1.0;
+		tsqe->ntuples = 1;
+		tsqe->querytxt = "SELECT abalance FROM pgbench_accounts WHERE aid = $1;";
+		tsqe->plantxt = bench_plan(0);
+	}
+}
+
+/*
+ * Runs one function iterations times, returns the total time in ns
+ */
+static double
+bench_run(BenchFunction function, TSQEntry * tsqe, StringInfo row,
+		  int64 iterations, MemoryContext context)
+{
+	MemoryContext	oldcontext;
+	instr_time		start;
+	instr_time		duration;
+	double			total = 0;
+	TSQEntry		parsed;
+
+	for (int64 done = 0; done < iterations; done += BENCH_BATCH_SIZE)
+	{
+		int64	n = Min(BENCH_BATCH_SIZE, iterations - done);
+
+		/* The segment is rewritten from its beginning for each batch */
+		pg_atomic_write_u64(&pgtsqss->committed, TSQPosMake(BENCH_SEGNO, 0));
+
+		oldcontext = MemoryContextSwitchTo(context);
+		INSTR_TIME_SET_CURRENT(start);
+		for (int64 i = 0; i < n; i++)
+		{
+			switch (function)
+			{
+				case BENCH_SERIALIZE:
+					(void) pgtsq_serialize_entry(tsqe);
+					break;
+				case BENCH_CHECK:
+					(void) pgtsq_check_row(row->data);
+					break;
+				case BENCH_PARSE:
+					(void) pgtsq_parse_row(row->data, TSQ_FORMAT_VERSION, &parsed);
+					break;
+				case BENCH_STORE:
+					(void) pgtsq_store_row(row->data, row->len, false, -1);
+					break;
+				case BENCH_STORE_COMPRESSED:
+					(void) pgtsq_store_row(row->data, row->len, true, -1);
+					break;
+				default:
+					break;
+			}
+		}
+		INSTR_TIME_SET_CURRENT(duration);
+		INSTR_TIME_SUBTRACT(duration, start);
+		MemoryContextSwitchTo(oldcontext);
+
+		total += INSTR_TIME_GET_DOUBLE(duration) * 1000000000.0;
+		MemoryContextReset(context);
+	}
+
+	return total;
+}
+
+/*
+ * Removes the segment written by the benchmark and its relation index
+ */
+static void
+bench_remove_segment(const char * path)
+{
+	char	relpath[MAXPGPATH];
+
+	unlink(path);
+	snprintf(relpath, MAXPGPATH, "%s%s", path, TSQ_RELINDEX_SUFFIX);
+	unlink(relpath);
+}
+
+PGDLLEXPORT Datum
+pgtsq_bench(PG_FUNCTION_ARGS)
+{
+	int64			iterations = PG_GETARG_INT64(0);
+	ReturnSetInfo	*rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	MemoryContext	oldcontext;
+	MemoryContext	context;
+	TupleDesc		tupdesc;
+	Tuplestorestate	*tupstore;
+	TSQSharedState	state;
+	LWLock			lock;
+	char			path[MAXPGPATH];
+
+	if (iterations <= 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("pgtsq_bench: iterations must be greater than 0")));
+	if (GetConfigOption("pg_track_slow_queries.log_min_duration", true, false) != NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pgtsq_bench: must not be run where pg_track_slow_queries is loaded")));
+
+	/* Check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("pgtsq_bench: set-valued function called " \
+						"in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("pgtsq_bench: materialize mode required, " \
+						"but it is not allowed in this context")));
+
+	oldcontext = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		ereport(ERROR,
+				(errmsg("pgtsq_bench: return type must be a row type")));
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+	MemoryContextSwitchTo(oldcontext);
+
+	/* Storage writers only need the lock and the committed position */
+	memset(&state, 0, sizeof(TSQSharedState));
+	LWLockInitialize(&lock, LWLockNewTrancheId());
+	state.lock = &lock;
+	pg_atomic_init_u64(&state.committed, TSQPosMake(BENCH_SEGNO, 0));
+	pgtsqss = &state;
+	pgtsq_segment_path(path, BENCH_SEGNO);
+
+	context = bench_context_create();
+
+	PG_TRY();
+	{
+		for (int c = 0; c < 2; c++)
+		{
+			TSQEntry	tsqe;
+			StringInfo	row;
+
+			memset(&tsqe, 0, sizeof(TSQEntry));
+			bench_entry(&tsqe, c == 1);
+			row = pgtsq_serialize_entry(&tsqe);
+
+			for (int f = 0; f < BENCH_FUNCTIONS; f++)
+			{
+				Datum	values[BENCH_COLS];
+				bool	nulls[BENCH_COLS];
+				double	total;
+				int		i = 0;
+
+				nallocs = 0;
+				nbytes = 0;
+				total = bench_run(f, &tsqe, row, iterations, context);
+
+				memset(nulls, 0, sizeof(nulls));
+				values[i++] = CStringGetTextDatum(function_names[f]);
+				values[i++] = CStringGetTextDatum(c == 1 ? "analytic" : "oltp");
+				values[i++] = Int32GetDatum(row->len);
+				values[i++] = Float8GetDatum(total / iterations);
+				values[i++] = Float8GetDatum((double) nbytes / iterations);
+				values[i++] = Float8GetDatum((double) nallocs / iterations);
+				tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+			}
+		}
+	}
+	PG_CATCH();
+	{
+		pgtsqss = NULL;
+		bench_remove_segment(path);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	pgtsqss = NULL;
+	bench_remove_segment(path);
+	MemoryContextDelete(context);
+	tuplestore_donestoring(tupstore);
+
+	return (Datum) 0;
+}
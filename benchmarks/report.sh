@@ -0,0 +1,41 @@
+#!/bin/bash -eu
+#
+# Prints a results file written by run.sh as a markdown table, in the format
+# of the README benchmark table. The loss is computed against the "baseline"
+# configuration of the same file.
+
+if [ $# -ne 1 ]; then
+	echo "Usage: $(basename "$0") RESULTS" >&2
+	exit 1
+fi
+
+awk '
+function field(name,    re, v)
+{
+	re = "\"" name "\": (\"[^\"]*\"|[^,}]*)"
+	if (!match($0, re))
+		return ""
+	v = substr($0, RSTART + length(name) + 4, RLENGTH - length(name) - 4)
+	gsub(/"/, "", v)
+	return v
+}
+{
+	n++
+	config[n] = field("config")
+	settings[n] = field("settings")
+	tps[n] = field("tps")
+	p99[n] = field("latency_p99")
+	bytes[n] = field("storage_bytes")
+	if (config[n] == "baseline")
+		baseline = tps[n]
+}
+END {
+	print "| Configuration | Settings | TPS | Loss | p99 latency (ms) | Storage |"
+	print "|---------------|----------|-----|------|------------------|---------|"
+	for (i = 1; i <= n; i++)
+	{
+		loss = (baseline > 0 && tps[i] != "null") ? sprintf("%d%%", (1 - tps[i] / baseline) * 100 + 0.5) : "-"
+		printf "| %s | `%s` | %d | %s | %s | %.1f MB |\n", config[i], settings[i],
+			tps[i], loss, p99[i], bytes[i] / 1024 / 1024
+	}
+}' "$1"
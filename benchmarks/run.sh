@@ -0,0 +1,144 @@
+#!/bin/bash -eu
+#
+# Runs pgbench against a temporary cluster for each configuration of the
+# benchmark matrix and appends the results to a NDJSON file, one line per
+# configuration.
+#
+# The extension must be installed for the PostgreSQL version pointed by
+# PG_CONFIG.
+
+DIR="$( cd "$( dirname "${BASH_SOURCE[0]}" )" >/dev/null 2>&1 && pwd )"
+
+PG_CONFIG="${PG_CONFIG:-pg_config}"
+PGPORT="${PGPORT:-5499}"
+CLIENTS=8
+JOBS=4
+DURATION=60
+SCALE=10
+SCRIPT="${DIR}/select_only.sql"
+MATRIX="${DIR}/matrix.conf"
+RESULTS="${DIR}/results/$(date +%Y%m%d-%H%M%S).ndjson"
+ONLY=""
+
+usage()
+{
+	cat <<EOF
+Usage: $(basename "$0") [OPTIONS]
+
+Options:
+  -c CLIENTS   number of pgbench clients (default: ${CLIENTS})
+  -j JOBS      number of pgbench threads (default: ${JOBS})
+  -T SECONDS   duration of each run (default: ${DURATION})
+  -s SCALE     pgbench scale factor (default: ${SCALE})
+  -f SCRIPT    pgbench script (default: select_only.sql)
+  -m MATRIX    configuration matrix (default: matrix.conf)
+  -n NAME      only run this configuration of the matrix
+  -o RESULTS   results file (default: results/<datetime>.ndjson)
+EOF
+	exit 1
+}
+
+while getopts "c:j:T:s:f:m:n:o:h" opt; do
+	case "${opt}" in
+		c) CLIENTS="${OPTARG}" ;;
+		j) JOBS="${OPTARG}" ;;
+		T) DURATION="${OPTARG}" ;;
+		s) SCALE="${OPTARG}" ;;
+		f) SCRIPT="$(cd "$(dirname "${OPTARG}")" && pwd)/$(basename "${OPTARG}")" ;;
+		m) MATRIX="${OPTARG}" ;;
+		n) ONLY="${OPTARG}" ;;
+		o) RESULTS="${OPTARG}" ;;
+		*) usage ;;
+	esac
+done
+
+BINDIR="$(${PG_CONFIG} --bindir)"
+PGVERSION="$(${PG_CONFIG} --version)"
+WORKDIR="$(mktemp -d -t pgtsq-bench.XXXXXX)"
+PGDATA="${WORKDIR}/data"
+export PGPORT PGHOST="${WORKDIR}" PGDATABASE=bench
+
+cleanup()
+{
+	"${BINDIR}/pg_ctl" -D "${PGDATA}" -m immediate stop >/dev/null 2>&1 || true
+	rm -rf "${WORKDIR}"
+}
+trap cleanup EXIT
+
+pg_restart()
+{
+	"${BINDIR}/pg_ctl" -D "${PGDATA}" -l "${WORKDIR}/postgresql.log" -w restart >/dev/null
+}
+
+# Latency percentile, in ms, from the sorted per transaction latencies (us)
+percentile()
+{
+	awk -v p="$1" '{ a[NR] = $1 } END { if (NR == 0) { print "null"; exit }
+		i = int(NR * p / 100); if (i < 1) i = 1; printf "%.3f", a[i] / 1000 }' "$2"
+}
+
+mkdir -p "$(dirname "${RESULTS}")"
+
+# Temporary cluster, listening on a unix socket only
+"${BINDIR}/initdb" -D "${PGDATA}" -U postgres --no-sync >/dev/null
+export PGUSER=postgres
+cat >> "${PGDATA}/postgresql.conf" <<EOF
+listen_addresses = ''
+unix_socket_directories = '${WORKDIR}'
+port = ${PGPORT}
+max_connections = $(( CLIENTS + 10 ))
+shared_buffers = 256MB
+fsync = off
+EOF
+"${BINDIR}/pg_ctl" -D "${PGDATA}" -l "${WORKDIR}/postgresql.log" -w start >/dev/null
+"${BINDIR}/createdb" bench
+"${BINDIR}/pgbench" -i -q -s "${SCALE}" bench >/dev/null 2>&1
+
+grep -v '^\s*\(#\|$\)' "${MATRIX}" | while read -r name settings; do
+	if [ -n "${ONLY}" ] && [ "${ONLY}" != "${name}" ]; then
+		continue
+	fi
+	echo "Running configuration ${name}"
+
+	# Reset the configuration and the storage of the previous run
+	"${BINDIR}/psql" -q -X -c "ALTER SYSTEM RESET ALL;"
+	rm -f "${PGDATA}"/pg_stat/pg_track_slow_queries.*
+	if [ "${settings}" != "-" ]; then
+		"${BINDIR}/psql" -q -X -c \
+			"ALTER SYSTEM SET shared_preload_libraries TO 'pg_track_slow_queries';"
+		for setting in ${settings//,/ }; do
+			"${BINDIR}/psql" -q -X -c \
+				"ALTER SYSTEM SET pg_track_slow_queries.${setting%%=*} TO '${setting#*=}';"
+		done
+	fi
+	pg_restart
+
+	rm -f "${WORKDIR}"/pgbench_log.*
+	"${BINDIR}/pgbench" -n -M prepared -c "${CLIENTS}" -j "${JOBS}" \
+		-T "${DURATION}" -f "${SCRIPT}" -l --log-prefix="${WORKDIR}/pgbench_log" \
+		bench > "${WORKDIR}/pgbench.out" 2>&1
+
+	# Let the collector store its last entries
+	sleep 2
+
+	tps=$(sed -n 's/^tps = \([0-9.]*\) .*excluding.*$/\1/p' "${WORKDIR}/pgbench.out")
+	if [ -z "${tps}" ]; then
+		tps=$(sed -n 's/^tps = \([0-9.]*\) .*$/\1/p' "${WORKDIR}/pgbench.out" | tail -1)
+	fi
+	cat "${WORKDIR}"/pgbench_log.* | awk '{ print $3 }' | sort -n > "${WORKDIR}/latencies"
+	transactions=$(wc -l < "${WORKDIR}/latencies")
+	storage_bytes=$(cat "${PGDATA}"/pg_stat/pg_track_slow_queries.* 2>/dev/null | wc -c)
+
+	printf '{"config": "%s", "settings": "%s", "script": "%s", "pg_version": "%s", ' \
+		"${name}" "${settings}" "$(basename "${SCRIPT}")" "${PGVERSION}" >> "${RESULTS}"
+	printf '"clients": %s, "jobs": %s, "duration": %s, "scale": %s, ' \
+		"${CLIENTS}" "${JOBS}" "${DURATION}" "${SCALE}" >> "${RESULTS}"
+	printf '"transactions": %s, "tps": %s, ' "${transactions}" "${tps:-null}" >> "${RESULTS}"
+	printf '"latency_p50": %s, "latency_p95": %s, "latency_p99": %s, ' \
+		"$(percentile 50 "${WORKDIR}/latencies")" \
+		"$(percentile 95 "${WORKDIR}/latencies")" \
+		"$(percentile 99 "${WORKDIR}/latencies")" >> "${RESULTS}"
+	printf '"storage_bytes": %s}\n' "${storage_bytes}" >> "${RESULTS}"
+done
+
+echo "Results written to ${RESULTS}"
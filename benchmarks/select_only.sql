@@ -0,0 +1,3 @@
+-- Read only, like pgbench built-in select-only script
+\set aid random(1, 100000 * :scale)
+SELECT abalance FROM pgbench_accounts WHERE aid = :aid;
@@ -0,0 +1,1126 @@
+/*
+ * Foreign data wrapper over the storage
+ *
+ * The pg_track_slow_queries_entries foreign table reads the storage segments
+ * like pg_track_slow_queries() does, but returns the entries as the executor
+ * asks for them instead of materializing them all, so that a LIMIT stops the
+ * reads. Only the streams of the columns used by the query are decoded.
+ *
+ * Quals comparing datetime, duration, username, appname or dbname to an
+ * expression that doesn't depend on the entries set a block filter, and the
+ * blocks whose footer shows none of their entries can match are skipped
+ * without being read. Quals are still checked by the executor, so filters
+ * only have to keep the entries the quals may match.
+ *
+ * When the query orders by datetime DESC, the scan reads the blocks backward
+ * from the committed position and returns the entries most recent first. An
+ * entry is returned once no block left to read can hold a more recent one,
+ * according to the footers, so ORDER BY datetime DESC LIMIT n reads the last
+ * blocks only and needs no sort.
+ */
+#define _FILE_OFFSET_BITS 64
+
+#include "postgres.h"
+
+#include <math.h>
+#include <sys/stat.h>
+
+#include "access/stratnum.h"
+#include "access/sysattr.h"
+#include "catalog/pg_type.h"
+#include "executor/executor.h"
+#include "foreign/fdwapi.h"
+#include "miscadmin.h"
+#include "nodes/makefuncs.h"
+#include "nodes/nodeFuncs.h"
+#include "optimizer/clauses.h"
+#include "optimizer/cost.h"
+#include "optimizer/pathnode.h"
+#include "optimizer/planmain.h"
+#include "optimizer/restrictinfo.h"
+#if (PG_VERSION_NUM >= 120000)
+#include "optimizer/optimizer.h"
+#else
+#include "optimizer/var.h"
+#endif
+#include "port/atomics.h"
+#include "utils/builtins.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/rel.h"
+#include "utils/timestamp.h"
+#include "utils/typcache.h"
+
+#include "pg_track_slow_queries.h"
+
+/* Columns the quals of which may set the block filter */
+#define TSQ_FDW_DATETIME	0
+#define TSQ_FDW_DURATION	2
+#define TSQ_FDW_USERNAME	3
+#define TSQ_FDW_APPNAME		4
+#define TSQ_FDW_DBNAME		5
+#define TSQ_FDW_QUERYID		9
+
+/* Bytes per row assumed by estimates when no block footer tells better */
+#define TSQ_FDW_ROW_WIDTH	1024
+/* Number of block footers read, newest first, to estimate a scan */
+#define TSQ_FDW_SAMPLE_BLOCKS	64
+
+PGDLLEXPORT Datum pg_track_slow_queries_fdw_handler(PG_FUNCTION_ARGS);
+
+/* Types of the columns of pg_track_slow_queries() */
+static const Oid tsq_fdw_types[TSQ_COLS] = {
+	TIMESTAMPTZOID, TIMESTAMPTZOID, FLOAT8OID, VARCHAROID, VARCHAROID,
+	VARCHAROID, INT8OID, FLOAT8OID, INT8OID, INT8OID, TEXTOID, JSONOID
+};
+
+PG_FUNCTION_INFO_V1(pg_track_slow_queries_fdw_handler);
+
+/* Planning state of a scan, the fdw_private of its RelOptInfo */
+typedef struct TSQFdwPlanState {
+	AttrNumber	attnos[TSQ_COLS];	/* Attribute of each column, if any */
+	List		*columns;		/* Column of each qual used */
+	List		*strategies;	/* Btree strategy of each qual used */
+	List		*values;		/* Expression compared by each qual used */
+	TSQBlockFilter filter;		/* Set by the quals whose value is known */
+	double		nblocks;		/* Number of blocks stored */
+	double		ntuples;		/* Number of entries stored */
+	double		nmatched;		/* Entries of the blocks the filter keeps */
+	double		nbytes;			/* Size of the rows stored */
+} TSQFdwPlanState;
+
+/* Range of rows read at once by ordered scans */
+typedef struct TSQFdwBlock {
+	uint32		segno;
+	off_t		start;
+	off_t		end;
+	TimestampTz	max_end_time;	/* Greatest end datetime of its entries and
+								 * of the entries of the blocks before it */
+	MemoryContext context;		/* Holding its entries once read */
+	int			pending;		/* Entries of the heap it holds */
+} TSQFdwBlock;
+
+/* Entry read by an ordered scan, waiting for its turn */
+typedef struct TSQFdwEntry {
+	TSQEntry	*tsqe;
+	TSQFdwBlock	*block;			/* Holding the entry */
+} TSQFdwEntry;
+
+/* Execution state of a scan */
+typedef struct TSQFdwScanState {
+	List		*columns;		/* Column of each qual used */
+	List		*strategies;	/* Btree strategy of each qual used */
+	List		*values;		/* ExprState of each compared expression */
+	TSQBlockFilter filter;
+	bool		wanted[TSQ_COLS];	/* Columns used by the query */
+	int			*attcols;		/* Column of each attribute, -1 if none */
+	int			streams;		/* Streams of the columns used */
+	bool		ordered;		/* Most recent entries first */
+	MemoryContext context;		/* Reset when the scan restarts */
+	MemoryContext row_context;	/* Reset for each row */
+	uint64		pos;			/* Committed position when the scan started */
+	TSQSegmentReader reader;
+	bool		open;			/* reader is open on segno */
+	uint32		segno;
+	bool		done;
+	/* Ordered scans */
+	TSQFdwBlock	*blocks;		/* In storage order */
+	int			nblocks;
+	int			maxblocks;
+	int			next_block;		/* Next block to read, backward */
+	TSQFdwEntry	*heap;			/* Entries read, most recent on top */
+	int			nentries;
+	int			maxentries;
+} TSQFdwScanState;
+
+/* Rows of the blocks sampled by pgtsq_fdw_estimate() */
+typedef struct TSQFdwEstimate {
+	TSQBlockFilter *filter;
+	double		nblocks;
+	double		nrows;
+	double		nmatched;
+	double		nbytes;
+} TSQFdwEstimate;
+
+/*
+ * Sets the attribute of each column of pg_track_slow_queries() in the given
+ * foreign table, columns being matched by name. They must have the same type.
+ */
+static void
+pgtsq_fdw_attnos(Oid relid, AttrNumber * attnos)
+{
+	for (int c = 0; c < TSQ_COLS; c++)
+	{
+		attnos[c] = get_attnum(relid, tsq_columns[c]);
+		if (attnos[c] != InvalidAttrNumber &&
+			get_atttype(relid, attnos[c]) != tsq_fdw_types[c])
+			ereport(ERROR,
+					(errcode(ERRCODE_FDW_INVALID_DATA_TYPE),
+					 errmsg("pg_track_slow_queries: column \"%s\" of foreign table \"%s\" must be of type %s",
+							tsq_columns[c], get_rel_name(relid),
+							format_type_be(tsq_fdw_types[c]))));
+	}
+}
+
+/*
+ * Returns the column a Var of the foreign table stands for, -1 if the node
+ * is not one
+ */
+static int
+pgtsq_fdw_var_column(Node * node, Index relid, AttrNumber * attnos)
+{
+	Var		*var;
+
+	if (node != NULL && IsA(node, RelabelType))
+		node = (Node *) ((RelabelType *) node)->arg;
+	if (node == NULL || !IsA(node, Var))
+		return -1;
+	var = (Var *) node;
+	if (var->varno != relid || var->varlevelsup != 0 ||
+		var->varattno == InvalidAttrNumber)
+		return -1;
+	for (int c = 0; c < TSQ_COLS; c++)
+		if (attnos[c] == var->varattno)
+			return c;
+	return -1;
+}
+
+/*
+ * Returns the btree operator family of the comparisons of a column
+ */
+static Oid
+pgtsq_fdw_opfamily(int column)
+{
+	Oid		type;
+
+	if (column == TSQ_FDW_DATETIME)
+		type = TIMESTAMPTZOID;
+	else if (column == TSQ_FDW_DURATION)
+		type = FLOAT8OID;
+	else if (column == TSQ_FDW_QUERYID)
+		type = INT8OID;
+	else
+		type = TEXTOID;
+	return lookup_type_cache(type, TYPECACHE_BTREE_OPFAMILY)->btree_opf;
+}
+
+/*
+ * Returns true if the filter can use a comparison of a column to a value of
+ * the given type, with the given btree strategy
+ */
+static bool
+pgtsq_fdw_usable(int column, int strategy, Oid type)
+{
+	switch (column)
+	{
+		case TSQ_FDW_DATETIME:
+			return type == TIMESTAMPTZOID;
+		case TSQ_FDW_DURATION:
+			return type == FLOAT8OID &&
+				(strategy == BTEqualStrategyNumber ||
+				 strategy == BTGreaterEqualStrategyNumber ||
+				 strategy == BTGreaterStrategyNumber);
+		case TSQ_FDW_USERNAME:
+		case TSQ_FDW_APPNAME:
+		case TSQ_FDW_DBNAME:
+			return (type == TEXTOID || type == VARCHAROID) &&
+				strategy == BTEqualStrategyNumber;
+		case TSQ_FDW_QUERYID:
+			return type == INT8OID && strategy == BTEqualStrategyNumber;
+	}
+	return false;
+}
+
+/*
+ * Looks for the quals comparing a column the filter knows to an expression
+ * that doesn't depend on the entries, with an operator of the btree family
+ * of the column. Returns the column, strategy and expression compared of
+ * each in columns, strategies and values.
+ */
+static void
+pgtsq_fdw_find_quals(List * quals, Index relid, AttrNumber * attnos,
+					 List ** columns, List ** strategies, List ** values)
+{
+	ListCell	*lc;
+
+	*columns = NIL;
+	*strategies = NIL;
+	*values = NIL;
+	foreach(lc, quals)
+	{
+		Expr		*qual = ((RestrictInfo *) lfirst(lc))->clause;
+		OpExpr		*op;
+		Node		*left;
+		Node		*right;
+		Oid			opno;
+		int			column;
+		int			strategy;
+
+		if (!IsA(qual, OpExpr) || list_length(((OpExpr *) qual)->args) != 2)
+			continue;
+		op = (OpExpr *) qual;
+		left = linitial(op->args);
+		right = lsecond(op->args);
+		opno = op->opno;
+
+		/* Column on the right, look at the commuted operator */
+		if (pgtsq_fdw_var_column(left, relid, attnos) < 0)
+		{
+			Node	*tmp = left;
+
+			left = right;
+			right = tmp;
+			if ((opno = get_commutator(opno)) == InvalidOid)
+				continue;
+		}
+		if ((column = pgtsq_fdw_var_column(left, relid, attnos)) < 0 ||
+			contain_var_clause(right) || contain_volatile_functions(right) ||
+			contain_subplans(right))
+			continue;
+
+		if (right != NULL && IsA(right, RelabelType))
+			right = (Node *) ((RelabelType *) right)->arg;
+		strategy = get_op_opfamily_strategy(opno, pgtsq_fdw_opfamily(column));
+		if (strategy == 0 || !pgtsq_fdw_usable(column, strategy, exprType(right)))
+			continue;
+#if (PG_VERSION_NUM >= 120000)
+		/* Bloom filters hash the bytes of the names */
+		if (OidIsValid(op->inputcollid) &&
+			!get_collation_isdeterministic(op->inputcollid))
+			continue;
+#endif
+
+		*columns = lappend_int(*columns, column);
+		*strategies = lappend_int(*strategies, strategy);
+		*values = lappend(*values, right);
+	}
+}
+
+/*
+ * Narrows the filter to the entries whose column compares to value with the
+ * given strategy, or to a superset of them
+ */
+static void
+pgtsq_fdw_filter_value(TSQBlockFilter * filter, int column, int strategy,
+					   Datum value)
+{
+	TimestampTz	ts;
+
+	switch (column)
+	{
+		case TSQ_FDW_DATETIME:
+			ts = DatumGetTimestampTz(value);
+			if (strategy != BTLessStrategyNumber &&
+				strategy != BTLessEqualStrategyNumber &&
+				(!filter->has_since || ts > filter->since))
+			{
+				filter->has_since = true;
+				filter->since = ts;
+			}
+			/* until is excluded */
+			if (strategy != BTLessStrategyNumber && ts < DT_NOEND)
+				ts++;
+			if (strategy != BTGreaterStrategyNumber &&
+				strategy != BTGreaterEqualStrategyNumber &&
+				(!filter->has_until || ts < filter->until))
+			{
+				filter->has_until = true;
+				filter->until = ts;
+			}
+			break;
+		case TSQ_FDW_DURATION:
+			filter->min_duration = Max(filter->min_duration,
+									   DatumGetFloat8(value));
+			break;
+		case TSQ_FDW_USERNAME:
+			filter->username = TextDatumGetCString(value);
+			break;
+		case TSQ_FDW_APPNAME:
+			filter->appname = TextDatumGetCString(value);
+			break;
+		case TSQ_FDW_DBNAME:
+			filter->dbname = TextDatumGetCString(value);
+			break;
+		case TSQ_FDW_QUERYID:
+			filter->has_queryid = true;
+			filter->queryid = (uint64) DatumGetInt64(value);
+			break;
+	}
+}
+
+static bool
+pgtsq_fdw_estimate_block(void * arg, TSQSegmentReader * reader, off_t start,
+						 off_t end, TSQBlockFooter * footer)
+{
+	TSQFdwEstimate	*estimate = (TSQFdwEstimate *) arg;
+
+	estimate->nblocks++;
+	estimate->nrows += footer->nrows;
+	estimate->nbytes += end - start;
+	if (pgtsq_block_match(footer, estimate->filter))
+		estimate->nmatched += footer->nrows;
+	return estimate->nblocks < TSQ_FDW_SAMPLE_BLOCKS;
+}
+
+/*
+ * Estimates the numbers of entries stored and of entries of the blocks the
+ * filter keeps. Planning must not read every footer of the storage: only the
+ * footers of the TSQ_FDW_SAMPLE_BLOCKS newest blocks are, the size of the
+ * older ones being extrapolated from them. Rows not in blocks are counted
+ * from their size, and assumed to match.
+ */
+static void
+pgtsq_fdw_estimate(TSQFdwPlanState * fpinfo)
+{
+	TSQFdwEstimate		estimate;
+	TSQSegmentReader	reader;
+	struct stat			st;
+	uint64				pos;
+	uint32				first;
+	uint32				segno;
+	double				unsampled = 0;
+	double				other = 0;
+	double				width;
+	double				ratio;
+
+	memset(&estimate, 0, sizeof(TSQFdwEstimate));
+	estimate.filter = &fpinfo->filter;
+
+	pos = pg_atomic_read_u64(&pgtsqss->committed);
+	pg_read_barrier();
+	first = pgtsq_first_segment(pos);
+	segno = TSQPosSegno(pos);
+	for (;;)
+	{
+		if (pgtsq_open_reader(&reader, segno,
+							  segno == TSQPosSegno(pos) ? TSQPosOffset(pos) : -1) > 0)
+		{
+			off_t		start = reader.offset;
+			off_t		end = reader.end;
+			off_t		stop;
+
+			if (end == -1)
+				end = fstat(fileno(reader.file), &st) == 0 ? st.st_size : start;
+			if (estimate.nblocks >= TSQ_FDW_SAMPLE_BLOCKS)
+				unsampled += end - start;
+			else
+			{
+				stop = pgtsq_walk_blocks(&reader, pgtsq_fdw_estimate_block,
+										 &estimate);
+				/* Stopped by the sample size, or at the rows not in blocks */
+				if (estimate.nblocks >= TSQ_FDW_SAMPLE_BLOCKS)
+					unsampled += stop - start;
+				else
+					other += stop - start;
+			}
+		}
+		pgtsq_close_reader(&reader);
+
+		if (segno == first)
+			break;
+		segno = (segno - 1) & TSQ_SEGNO_MASK;
+	}
+
+	width = estimate.nrows > 0 ? estimate.nbytes / estimate.nrows : TSQ_FDW_ROW_WIDTH;
+	ratio = estimate.nrows > 0 ? estimate.nmatched / estimate.nrows : 1;
+	fpinfo->nblocks = estimate.nblocks + (estimate.nbytes > 0 ?
+		unsampled * estimate.nblocks / estimate.nbytes : 0);
+	fpinfo->nbytes = estimate.nbytes + unsampled + other;
+	fpinfo->ntuples = estimate.nrows + (unsampled + other) / width;
+	fpinfo->nmatched = estimate.nmatched + unsampled / width * ratio +
+		other / width;
+}
+
+static void
+pgtsq_fdw_rel_size(PlannerInfo * root, RelOptInfo * baserel, Oid foreigntableid)
+{
+	TSQFdwPlanState	*fpinfo;
+	ListCell		*column;
+	ListCell		*strategy;
+	ListCell		*value;
+	Selectivity		sel;
+
+	if (!pgtsqss)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pg_track_slow_queries: must be loaded via shared_preload_libraries")));
+
+	fpinfo = (TSQFdwPlanState *) palloc0(sizeof(TSQFdwPlanState));
+	pgtsq_fdw_attnos(foreigntableid, fpinfo->attnos);
+	pgtsq_fdw_find_quals(baserel->baserestrictinfo, baserel->relid,
+						 fpinfo->attnos, &fpinfo->columns, &fpinfo->strategies,
+						 &fpinfo->values);
+
+	/* Values of stable expressions are estimated, like now() */
+	fpinfo->filter.min_duration = -1;
+	forthree(column, fpinfo->columns, strategy, fpinfo->strategies,
+			 value, fpinfo->values)
+	{
+		Node	*expr = estimate_expression_value(root, (Node *) lfirst(value));
+
+		if (IsA(expr, Const) && !((Const *) expr)->constisnull)
+			pgtsq_fdw_filter_value(&fpinfo->filter, lfirst_int(column),
+								   lfirst_int(strategy),
+								   ((Const *) expr)->constvalue);
+	}
+	pgtsq_fdw_estimate(fpinfo);
+
+	/*
+	 * Without statistics, the selectivity of the quals is a guess, but the
+	 * footers bound the number of entries the quals used by the filter match
+	 */
+	sel = clauselist_selectivity(root, baserel->baserestrictinfo, 0,
+								 JOIN_INNER, NULL);
+	baserel->tuples = fpinfo->ntuples;
+	baserel->rows = clamp_row_est(Min(fpinfo->ntuples * sel, fpinfo->nmatched));
+	baserel->fdw_private = fpinfo;
+}
+
+/*
+ * Returns the pathkeys of the query if it orders the entries by datetime
+ * DESC, NIL otherwise
+ */
+static List *
+pgtsq_fdw_ordered_pathkeys(PlannerInfo * root, RelOptInfo * baserel,
+						   TSQFdwPlanState * fpinfo)
+{
+	PathKey		*pathkey;
+	ListCell	*lc;
+
+	if (list_length(root->query_pathkeys) != 1 ||
+		fpinfo->attnos[TSQ_FDW_DATETIME] == InvalidAttrNumber)
+		return NIL;
+	pathkey = (PathKey *) linitial(root->query_pathkeys);
+#if (PG_VERSION_NUM >= 180000)
+	if (pathkey->pk_cmptype != COMPARE_GT)
+#else
+	if (pathkey->pk_strategy != BTGreaterStrategyNumber)
+#endif
+		return NIL;
+	if (pathkey->pk_opfamily != pgtsq_fdw_opfamily(TSQ_FDW_DATETIME))
+		return NIL;
+
+	foreach(lc, pathkey->pk_eclass->ec_members)
+	{
+		EquivalenceMember *em = (EquivalenceMember *) lfirst(lc);
+
+		if (pgtsq_fdw_var_column((Node *) em->em_expr, baserel->relid,
+								 fpinfo->attnos) == TSQ_FDW_DATETIME)
+			return root->query_pathkeys;
+	}
+	return NIL;
+}
+
+static ForeignPath *
+pgtsq_fdw_create_path(PlannerInfo * root, RelOptInfo * baserel,
+					  Cost startup_cost, Cost total_cost, List * pathkeys,
+					  List * fdw_private)
+{
+#if (PG_VERSION_NUM >= 170000)
+	return create_foreignscan_path(root, baserel, NULL, baserel->rows,
+								   startup_cost, total_cost, pathkeys, NULL,
+								   NULL, NIL, fdw_private);
+#elif (PG_VERSION_NUM >= 90600)
+	return create_foreignscan_path(root, baserel, NULL, baserel->rows,
+								   startup_cost, total_cost, pathkeys, NULL,
+								   NULL, fdw_private);
+#else
+	return create_foreignscan_path(root, baserel, baserel->rows,
+								   startup_cost, total_cost, pathkeys, NULL,
+								   NULL, fdw_private);
+#endif
+}
+
+/*
+ * Adds the path of the scan in storage order and, when the query orders the
+ * entries by datetime DESC, the path of the ordered scan. The blocks the
+ * filter skips are not read, each block read costs a footer read more to
+ * ordered scans, all done before the first entry is returned.
+ */
+static void
+pgtsq_fdw_paths(PlannerInfo * root, RelOptInfo * baserel, Oid foreigntableid)
+{
+	TSQFdwPlanState	*fpinfo = (TSQFdwPlanState *) baserel->fdw_private;
+	Cost			startup_cost = baserel->baserestrictcost.startup;
+	Cost			run_cost;
+	double			fraction;
+	List			*pathkeys;
+
+	fraction = fpinfo->ntuples > 0 ? fpinfo->nmatched / fpinfo->ntuples : 1;
+	run_cost = seq_page_cost * ceil(fpinfo->nbytes * fraction / BLCKSZ) +
+		(cpu_tuple_cost + baserel->baserestrictcost.per_tuple) * fpinfo->nmatched;
+	add_path(baserel, (Path *)
+			 pgtsq_fdw_create_path(root, baserel, startup_cost,
+								   startup_cost + run_cost, NIL, NIL));
+
+	if ((pathkeys = pgtsq_fdw_ordered_pathkeys(root, baserel, fpinfo)) != NIL)
+	{
+		startup_cost += seq_page_cost * fpinfo->nblocks;
+		run_cost += cpu_operator_cost * fpinfo->nmatched *
+			(fpinfo->nmatched > 1 ? log2(fpinfo->nmatched) : 1);
+		add_path(baserel, (Path *)
+				 pgtsq_fdw_create_path(root, baserel, startup_cost,
+									   startup_cost + run_cost, pathkeys,
+									   list_make1(makeInteger(true))));
+	}
+}
+
+static ForeignScan *
+pgtsq_fdw_plan(PlannerInfo * root, RelOptInfo * baserel, Oid foreigntableid,
+			   ForeignPath * best_path, List * tlist, List * scan_clauses,
+			   Plan * outer_plan)
+{
+	TSQFdwPlanState	*fpinfo = (TSQFdwPlanState *) baserel->fdw_private;
+	Bitmapset		*attrs = NULL;
+	List			*attnos = NIL;
+	int				attno = -1;
+
+	scan_clauses = extract_actual_clauses(scan_clauses, false);
+
+	/* Attributes used by the query, the others are not decoded */
+#if (PG_VERSION_NUM >= 90600)
+	pull_varattnos((Node *) baserel->reltarget->exprs, baserel->relid, &attrs);
+#else
+	pull_varattnos((Node *) baserel->reltargetlist, baserel->relid, &attrs);
+#endif
+	pull_varattnos((Node *) scan_clauses, baserel->relid, &attrs);
+	while ((attno = bms_next_member(attrs, attno)) >= 0)
+		attnos = lappend_int(attnos, attno + FirstLowInvalidHeapAttributeNumber);
+
+	return make_foreignscan(tlist, scan_clauses, baserel->relid,
+							fpinfo->values,
+							list_make4(fpinfo->columns, fpinfo->strategies,
+									   attnos,
+									   makeInteger(best_path->fdw_private != NIL)),
+							NIL, NIL, outer_plan);
+}
+
+/*
+ * Adds a block to the ones an ordered scan reads
+ */
+static void
+pgtsq_fdw_add_block(TSQFdwScanState * state, uint32 segno, off_t start,
+					off_t end, TimestampTz max_end_time)
+{
+	if (state->nblocks == state->maxblocks)
+	{
+		state->maxblocks = state->maxblocks == 0 ? 64 : state->maxblocks * 2;
+		state->blocks = state->blocks == NULL ?
+			(TSQFdwBlock *) palloc(state->maxblocks * sizeof(TSQFdwBlock)) :
+			(TSQFdwBlock *) repalloc(state->blocks,
+									 state->maxblocks * sizeof(TSQFdwBlock));
+	}
+	state->blocks[state->nblocks].segno = segno;
+	state->blocks[state->nblocks].start = start;
+	state->blocks[state->nblocks].end = end;
+	state->blocks[state->nblocks].max_end_time = max_end_time;
+	state->nblocks++;
+}
+
+static bool
+pgtsq_fdw_collect_block(void * arg, TSQSegmentReader * reader, off_t start,
+						off_t end, TSQBlockFooter * footer)
+{
+	TSQFdwScanState	*state = (TSQFdwScanState *) arg;
+
+	if (pgtsq_block_match(footer, &state->filter))
+		pgtsq_fdw_add_block(state, reader->segno, start, end,
+							footer->max_end_time);
+	return true;
+}
+
+/*
+ * Lists the blocks of the segments an ordered scan reads, in storage order,
+ * from their footers. Rows not in blocks are read at once, as a block of
+ * unknown end datetimes.
+ */
+static void
+pgtsq_fdw_collect_blocks(TSQFdwScanState * state)
+{
+	TSQSegmentReader	reader;
+	uint32				segno = pgtsq_first_segment(state->pos);
+
+	for (;;)
+	{
+		int		first = state->nblocks;
+
+		if (pgtsq_open_reader(&reader, segno,
+							  segno == TSQPosSegno(state->pos) ?
+							  TSQPosOffset(state->pos) : -1) > 0)
+		{
+			off_t		start = reader.offset;
+			off_t		stop;
+
+			stop = pgtsq_walk_blocks(&reader, pgtsq_fdw_collect_block, state);
+			if (stop > start)
+				pgtsq_fdw_add_block(state, segno, start, stop, DT_NOEND);
+
+			/* Blocks are walked backward */
+			for (int i = first, j = state->nblocks - 1; i < j; i++, j--)
+			{
+				TSQFdwBlock	tmp = state->blocks[i];
+
+				state->blocks[i] = state->blocks[j];
+				state->blocks[j] = tmp;
+			}
+		}
+		pgtsq_close_reader(&reader);
+
+		if (segno == TSQPosSegno(state->pos))
+			break;
+		segno = TSQNextSegno(segno);
+	}
+
+	for (int i = 1; i < state->nblocks; i++)
+		state->blocks[i].max_end_time = Max(state->blocks[i].max_end_time,
+											state->blocks[i - 1].max_end_time);
+	state->next_block = state->nblocks - 1;
+}
+
+/*
+ * Starts reading the storage from the current committed position, the
+ * filter being set from the current values of the quals
+ */
+static void
+pgtsq_fdw_start(ForeignScanState * node, TSQFdwScanState * state)
+{
+	ExprContext		*econtext = node->ss.ps.ps_ExprContext;
+	MemoryContext	oldcontext = MemoryContextSwitchTo(state->context);
+	ListCell		*column;
+	ListCell		*strategy;
+	ListCell		*value;
+
+	memset(&state->filter, 0, sizeof(TSQBlockFilter));
+	state->filter.min_duration = -1;
+	forthree(column, state->columns, strategy, state->strategies,
+			 value, state->values)
+	{
+		Datum		datum;
+		bool		isnull;
+
+#if (PG_VERSION_NUM >= 100000)
+		datum = ExecEvalExpr((ExprState *) lfirst(value), econtext, &isnull);
+#else
+		datum = ExecEvalExpr((ExprState *) lfirst(value), econtext, &isnull,
+							 NULL);
+#endif
+		/* The qual can't match, left to the executor */
+		if (!isnull)
+			pgtsq_fdw_filter_value(&state->filter, lfirst_int(column),
+								   lfirst_int(strategy), datum);
+	}
+
+	state->pos = pg_atomic_read_u64(&pgtsqss->committed);
+	pg_read_barrier();
+	state->segno = pgtsq_first_segment(state->pos);
+	if (state->ordered)
+		pgtsq_fdw_collect_blocks(state);
+	MemoryContextSwitchTo(oldcontext);
+}
+
+/*
+ * Reads and parses the next row of the reader in context, which is reset
+ * before each row read if reset is true. Returns 1 if a row matching the
+ * filter has been read, 0 at the end of the reader, -1 on error.
+ */
+static int
+pgtsq_fdw_read_entry(TSQFdwScanState * state, TSQEntry ** tsqe,
+					 MemoryContext context, bool reset)
+{
+	MemoryContext	oldcontext = CurrentMemoryContext;
+	char			*buff = NULL;
+	uint32			row_len;
+	int				ret;
+
+	for (;;)
+	{
+		if (reset)
+			MemoryContextReset(context);
+		MemoryContextSwitchTo(context);
+		if ((ret = pgtsq_read_row(&state->reader, &buff, &row_len)) > 0)
+		{
+			*tsqe = (TSQEntry *) palloc0(sizeof(TSQEntry));
+			if (!pgtsq_parse_row(buff, state->reader.header.version, *tsqe))
+			{
+				ereport(LOG,
+						(errmsg("pg_track_slow_queries: could not parse row")));
+				ret = -1;
+			}
+		}
+		MemoryContextSwitchTo(oldcontext);
+
+		if (ret > 0 && pgtsq_filter_match(&state->filter, *tsqe))
+			return 1;
+		if (ret <= 0)
+			return ret;
+	}
+}
+
+/*
+ * Opens the reader on a segment, unless it already is
+ */
+static void
+pgtsq_fdw_open(TSQFdwScanState * state, uint32 segno, off_t end)
+{
+	MemoryContext	oldcontext;
+
+	if (state->open && state->reader.segno == segno)
+		return;
+
+	oldcontext = MemoryContextSwitchTo(state->context);
+	pgtsq_close_reader(&state->reader);
+	if (pgtsq_open_reader(&state->reader, segno, end) < 0)
+		state->done = true;
+	state->reader.streams = state->streams;
+	state->open = true;
+	MemoryContextSwitchTo(oldcontext);
+}
+
+/*
+ * Returns the next entry in storage order, NULL once all are
+ */
+static TSQEntry *
+pgtsq_fdw_next(TSQFdwScanState * state)
+{
+	TSQEntry		*tsqe = NULL;
+	MemoryContext	oldcontext;
+	int				ret;
+
+	while (!state->done)
+	{
+		if (!state->open)
+		{
+			pgtsq_fdw_open(state, state->segno,
+						   state->segno == TSQPosSegno(state->pos) ?
+						   TSQPosOffset(state->pos) : -1);
+			oldcontext = MemoryContextSwitchTo(state->context);
+			pgtsq_filter_reader(&state->reader, &state->filter);
+			MemoryContextSwitchTo(oldcontext);
+		}
+
+		if (!state->done &&
+			(ret = pgtsq_fdw_read_entry(state, &tsqe, state->row_context,
+										true)) != 0)
+		{
+			if (ret > 0)
+				return tsqe;
+			state->done = true;
+		}
+
+		pgtsq_close_reader(&state->reader);
+		state->open = false;
+		if (state->segno == TSQPosSegno(state->pos))
+			state->done = true;
+		state->segno = TSQNextSegno(state->segno);
+	}
+	return NULL;
+}
+
+/*
+ * Restores the order of the heap of entries of an ordered scan, whose node i
+ * may be less recent than its children
+ */
+static void
+pgtsq_fdw_sift_down(TSQFdwEntry * heap, int size, int i)
+{
+	for (;;)
+	{
+		int			max = i;
+		int			child = 2 * i + 1;
+		TSQFdwEntry	tmp;
+
+		if (child < size && heap[child].tsqe->end_time > heap[max].tsqe->end_time)
+			max = child;
+		if (child + 1 < size &&
+			heap[child + 1].tsqe->end_time > heap[max].tsqe->end_time)
+			max = child + 1;
+		if (max == i)
+			return;
+		tmp = heap[i];
+		heap[i] = heap[max];
+		heap[max] = tmp;
+		i = max;
+	}
+}
+
+/*
+ * Restores the order of the heap of entries of an ordered scan, whose node i
+ * may be more recent than its parent
+ */
+static void
+pgtsq_fdw_sift_up(TSQFdwEntry * heap, int i)
+{
+	while (i > 0)
+	{
+		int			parent = (i - 1) / 2;
+		TSQFdwEntry	tmp;
+
+		if (heap[parent].tsqe->end_time >= heap[i].tsqe->end_time)
+			return;
+		tmp = heap[i];
+		heap[i] = heap[parent];
+		heap[parent] = tmp;
+		i = parent;
+	}
+}
+
+/*
+ * Releases an entry returned by an ordered scan, and its block with the last
+ * of its entries
+ */
+static void
+pgtsq_fdw_release_block(TSQFdwBlock * block)
+{
+	if (--block->pending > 0)
+		return;
+	MemoryContextDelete(block->context);
+	block->context = NULL;
+}
+
+/*
+ * Adds the entries of a block matching the filter to the heap of an ordered
+ * scan, in a memory context held until all of them are returned. Returns
+ * false on error.
+ */
+static bool
+pgtsq_fdw_read_block(TSQFdwScanState * state, TSQFdwBlock * block)
+{
+	TSQFdwEntry	entry;
+	int			ret;
+
+	pgtsq_fdw_open(state, block->segno, -1);
+	if (state->done)
+		return false;
+	/* Segments removed since are skipped */
+	if (state->reader.file == NULL)
+		return true;
+
+	state->reader.offset = block->start;
+	state->reader.end = block->end;
+	if (fseeko(state->reader.file, block->start, SEEK_SET) != 0)
+	{
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("pg_track_slow_queries: could not read file \"%s\": %m",
+						state->reader.path)));
+		return false;
+	}
+
+	block->context = AllocSetContextCreate(state->context, "PGTSQFdwBlock",
+										   ALLOCSET_DEFAULT_SIZES);
+	block->pending = 0;
+	entry.block = block;
+	while ((ret = pgtsq_fdw_read_entry(state, &entry.tsqe, block->context,
+									   false)) > 0)
+	{
+		if (state->nentries == state->maxentries)
+		{
+			MemoryContext	oldcontext = MemoryContextSwitchTo(state->context);
+
+			state->maxentries = state->maxentries == 0 ? 64 : state->maxentries * 2;
+			state->heap = state->heap == NULL ?
+				(TSQFdwEntry *) palloc(state->maxentries * sizeof(TSQFdwEntry)) :
+				(TSQFdwEntry *) repalloc(state->heap,
+										 state->maxentries * sizeof(TSQFdwEntry));
+			MemoryContextSwitchTo(oldcontext);
+		}
+		state->heap[state->nentries] = entry;
+		pgtsq_fdw_sift_up(state->heap, state->nentries++);
+		block->pending++;
+	}
+	/* Nothing to keep, the rows read did not match */
+	if (block->pending == 0)
+	{
+		block->pending = 1;
+		pgtsq_fdw_release_block(block);
+	}
+	return ret == 0;
+}
+
+/*
+ * Returns the next entry of an ordered scan, the most recent of the entries
+ * read once no block left can hold a more recent one, NULL once all are. Its
+ * block is set to *block, to be released once the entry is used.
+ */
+static TSQEntry *
+pgtsq_fdw_next_ordered(TSQFdwScanState * state, TSQFdwBlock ** block)
+{
+	for (;;)
+	{
+		TimestampTz	threshold = DT_NOBEGIN;
+		TSQEntry	*tsqe;
+
+		if (state->next_block >= 0)
+			threshold = state->blocks[state->next_block].max_end_time;
+		if (state->nentries > 0 && state->heap[0].tsqe->end_time >= threshold)
+		{
+			tsqe = state->heap[0].tsqe;
+			*block = state->heap[0].block;
+			state->heap[0] = state->heap[--state->nentries];
+			pgtsq_fdw_sift_down(state->heap, state->nentries, 0);
+			return tsqe;
+		}
+
+		if (state->done || state->next_block < 0)
+			return NULL;
+		if (!pgtsq_fdw_read_block(state, &state->blocks[state->next_block--]))
+			state->done = true;
+	}
+}
+
+static void
+pgtsq_fdw_begin(ForeignScanState * node, int eflags)
+{
+	ForeignScan		*plan = (ForeignScan *) node->ss.ps.plan;
+	Relation		rel = node->ss.ss_currentRelation;
+	TupleDesc		tupdesc = RelationGetDescr(rel);
+	TSQFdwScanState	*state;
+	AttrNumber		attnos[TSQ_COLS];
+	ListCell		*lc;
+
+	if (eflags & EXEC_FLAG_EXPLAIN_ONLY)
+		return;
+	if (!pgtsqss)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pg_track_slow_queries: must be loaded via shared_preload_libraries")));
+
+	state = (TSQFdwScanState *) palloc0(sizeof(TSQFdwScanState));
+	state->columns = (List *) linitial(plan->fdw_private);
+	state->strategies = (List *) lsecond(plan->fdw_private);
+	foreach(lc, plan->fdw_exprs)
+		state->values = lappend(state->values,
+								ExecInitExpr((Expr *) lfirst(lc),
+											 (PlanState *) node));
+	state->ordered = intVal(lfourth(plan->fdw_private));
+
+	/* Columns of the attributes, and the ones the query uses */
+	pgtsq_fdw_attnos(RelationGetRelid(rel), attnos);
+	state->attcols = (int *) palloc(tupdesc->natts * sizeof(int));
+	for (int i = 0; i < tupdesc->natts; i++)
+	{
+		state->attcols[i] = -1;
+		for (int c = 0; c < TSQ_COLS; c++)
+			if (attnos[c] == i + 1)
+				state->attcols[i] = c;
+	}
+	foreach(lc, (List *) lthird(plan->fdw_private))
+	{
+		int		attno = lfirst_int(lc);
+
+		/* Whole-row references use all columns */
+		if (attno == InvalidAttrNumber)
+			memset(state->wanted, true, sizeof(state->wanted));
+		else if (attno > 0 && attno <= tupdesc->natts &&
+				 state->attcols[attno - 1] >= 0)
+			state->wanted[state->attcols[attno - 1]] = true;
+	}
+	state->streams = 1 << TSQ_STREAM_META;
+	if (state->wanted[TSQ_COLS - 2])
+		state->streams |= 1 << TSQ_STREAM_QUERY;
+	if (state->wanted[TSQ_COLS - 1])
+		state->streams |= 1 << TSQ_STREAM_PLAN;
+
+	state->context = AllocSetContextCreate(CurrentMemoryContext,
+										   "PGTSQFdw", ALLOCSET_DEFAULT_SIZES);
+	state->row_context = AllocSetContextCreate(CurrentMemoryContext,
+											   "PGTSQFdwRow",
+											   ALLOCSET_DEFAULT_SIZES);
+	node->fdw_state = state;
+	pgtsq_fdw_start(node, state);
+}
+
+static TupleTableSlot *
+pgtsq_fdw_iterate(ForeignScanState * node)
+{
+	TSQFdwScanState	*state = (TSQFdwScanState *) node->fdw_state;
+	TupleTableSlot	*slot = node->ss.ss_ScanTupleSlot;
+	MemoryContext	oldcontext;
+	TSQEntry		*tsqe;
+	TSQFdwBlock		*block = NULL;
+	Datum			values[TSQ_COLS];
+	bool			nulls[TSQ_COLS];
+
+	ExecClearTuple(slot);
+
+	/* The row returned last is not used anymore */
+	MemoryContextReset(state->row_context);
+
+	if (state->ordered)
+		tsqe = pgtsq_fdw_next_ordered(state, &block);
+	else
+		tsqe = pgtsq_fdw_next(state);
+	if (tsqe == NULL)
+		return slot;
+
+	oldcontext = MemoryContextSwitchTo(state->row_context);
+	pgtsq_entry_values(tsqe, state->wanted, values, nulls);
+	MemoryContextSwitchTo(oldcontext);
+	/* The values are copies, the entry of an ordered scan can go */
+	if (block != NULL)
+		pgtsq_fdw_release_block(block);
+
+	for (int i = 0; i < slot->tts_tupleDescriptor->natts; i++)
+	{
+		int		c = state->attcols[i];
+
+		slot->tts_values[i] = c >= 0 ? values[c] : (Datum) 0;
+		slot->tts_isnull[i] = c < 0 || nulls[c];
+	}
+	ExecStoreVirtualTuple(slot);
+	return slot;
+}
+
+/*
+ * Releases what the reads allocated, before a rescan or at the end
+ */
+static void
+pgtsq_fdw_reset(TSQFdwScanState * state)
+{
+	pgtsq_close_reader(&state->reader);
+	MemoryContextReset(state->context);
+	MemoryContextReset(state->row_context);
+	state->open = false;
+	state->done = false;
+	state->blocks = NULL;
+	state->nblocks = state->maxblocks = 0;
+	state->heap = NULL;
+	state->nentries = state->maxentries = 0;
+}
+
+static void
+pgtsq_fdw_rescan(ForeignScanState * node)
+{
+	TSQFdwScanState	*state = (TSQFdwScanState *) node->fdw_state;
+
+	pgtsq_fdw_reset(state);
+	pgtsq_fdw_start(node, state);
+}
+
+static void
+pgtsq_fdw_end(ForeignScanState * node)
+{
+	TSQFdwScanState	*state = (TSQFdwScanState *) node->fdw_state;
+
+	if (state == NULL)
+		return;
+	pgtsq_fdw_reset(state);
+	MemoryContextDelete(state->context);
+	MemoryContextDelete(state->row_context);
+}
+
+PGDLLEXPORT Datum
+pg_track_slow_queries_fdw_handler(PG_FUNCTION_ARGS)
+{
+	FdwRoutine	*routine = makeNode(FdwRoutine);
+
+	routine->GetForeignRelSize = pgtsq_fdw_rel_size;
+	routine->GetForeignPaths = pgtsq_fdw_paths;
+	routine->GetForeignPlan = pgtsq_fdw_plan;
+	routine->BeginForeignScan = pgtsq_fdw_begin;
+	routine->IterateForeignScan = pgtsq_fdw_iterate;
+	routine->ReScanForeignScan = pgtsq_fdw_rescan;
+	routine->EndForeignScan = pgtsq_fdw_end;
+
+	PG_RETURN_POINTER(routine);
+}
@@ -0,0 +1,618 @@
+/*
+ * Forwarding of captured rows to a remote aggregator
+ *
+ * When pg_track_slow_queries.forward_to is set, the collector appends each
+ * batch it stores locally to a spool file as a block: a TSQBlockHeader
+ * followed by its rows and footer, written like in storage segments, and the
+ * relations they use. Blocks are sent as they are over a TCP connection to
+ * the aggregator, which can append them to a segment of its own and index
+ * them without decoding them, and acknowledges each block by sending back its
+ * sequence number.
+ *
+ * Blocks stay in the spool until they are acknowledged, so that they are sent
+ * again after a reconnection or a restart. Sequence numbers only grow within
+ * a spool, whose creation time identifies the stream, which lets the
+ * aggregator drop the blocks it already has. The spool is truncated once all
+ * its blocks are acknowledged. The socket is non-blocking, the collector
+ * never waits for the aggregator.
+ *
+ * Only the collector uses this module.
+ */
+#define _FILE_OFFSET_BITS 64
+
+#include "postgres.h"
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <netdb.h>
+
+#if (PG_VERSION_NUM >= 100000)
+#include "common/ip.h"
+#else
+#include "libpq/ip.h"
+#endif
+#include "pgstat.h"
+#include "storage/fd.h"
+#include "utils/guc.h"
+#include "utils/timestamp.h"
+
+#include "pg_track_slow_queries.h"
+
+#define TSQ_SPOOL_FILE		PGSTAT_STAT_PERMANENT_DIRECTORY "/pg_track_slow_queries.spool"
+/* Spool header magic ("TSQS") */
+#define TSQ_SPOOL_MAGIC		0x53515354
+/* Delay before connecting again to the aggregator */
+#define TSQ_FORWARD_RETRY_MS	10000
+#define TSQ_FORWARD_BUF_SIZE	(64 * 1024)
+
+#ifdef MSG_NOSIGNAL
+#define TSQ_SEND_FLAGS		MSG_NOSIGNAL
+#else
+#define TSQ_SEND_FLAGS		0
+#endif
+
+/* Header of the spool file, followed by blocks */
+typedef struct TSQSpoolHeader {
+	uint32		magic;			/* TSQ_SPOOL_MAGIC */
+	uint32		version;		/* Format version of the rows */
+	int64		stream;			/* Spool creation time */
+	uint64		acked;			/* Last acknowledged sequence number */
+	uint64		next;			/* Sequence number of the next block */
+} TSQSpoolHeader;
+
+/* Forwarding target, empty host if disabled */
+static char forward_host[NI_MAXHOST];
+static char forward_port[NI_MAXSERV];
+static int forward_spool_size_kb = -1;
+
+/* Spool, blocks before acked_offset are acknowledged, the ones before
+ * sent_offset have been read into the send buffer */
+static FILE *spool_file = NULL;
+static TSQSpoolHeader spool_header;
+static off_t spool_end = 0;
+static off_t spool_acked_offset = 0;
+static off_t spool_sent_offset = 0;
+/* forward_spool_size was reached, rows are not forwarded until it drains */
+static bool spool_full = false;
+
+/* Connection to the aggregator */
+static pgsocket forward_sock = PGINVALID_SOCKET;
+static bool forward_connected = false;
+static bool forward_failure_logged = false;
+static TimestampTz forward_retry_time = 0;
+static char send_buf[TSQ_FORWARD_BUF_SIZE];
+static int send_len = 0;
+static int send_pos = 0;
+static char ack_buf[sizeof(uint64)];
+static int ack_len = 0;
+
+static bool pgtsq_spool_open(void);
+static bool pgtsq_spool_write_header(void);
+static void pgtsq_forward_connect(void);
+static void pgtsq_forward_disconnect(bool failed);
+static void pgtsq_forward_ack(uint64 seqno);
+
+/*
+ * Opens the spool, or creates it if it doesn't exist or is unusable, and
+ * finds the acknowledged blocks. A partial block left by an interrupted write
+ * is discarded.
+ */
+static bool
+pgtsq_spool_open(void)
+{
+	struct stat		st;
+	TSQBlockHeader	block;
+	off_t			offset;
+
+	if ((spool_file = AllocateFile(TSQ_SPOOL_FILE, TSQ_BINARY_RW)) != NULL)
+	{
+		if (fstat(fileno(spool_file), &st) < 0 ||
+			fread(&spool_header, sizeof(TSQSpoolHeader), 1, spool_file) != 1 ||
+			spool_header.magic != TSQ_SPOOL_MAGIC)
+		{
+			ereport(LOG,
+					(errmsg("pg_track_slow_queries: discarding invalid forward spool")));
+			FreeFile(spool_file);
+			spool_file = NULL;
+		}
+		else if (spool_header.version != TSQ_FORMAT_VERSION)
+		{
+			/* Blocks are sent in the format of new rows, they are kept locally */
+			ereport(LOG,
+					(errmsg("pg_track_slow_queries: discarding forward spool of format version %u",
+							spool_header.version)));
+			FreeFile(spool_file);
+			spool_file = NULL;
+		}
+	}
+	else if (errno != ENOENT)
+		goto error;
+
+	if (spool_file == NULL)
+	{
+		if ((spool_file = AllocateFile(TSQ_SPOOL_FILE, PG_BINARY_W "+")) == NULL)
+			goto error;
+		memset(&spool_header, 0, sizeof(TSQSpoolHeader));
+		spool_header.magic = TSQ_SPOOL_MAGIC;
+		spool_header.version = TSQ_FORMAT_VERSION;
+		spool_header.stream = GetCurrentTimestamp();
+		spool_header.next = 1;
+		if (!pgtsq_spool_write_header())
+			goto error;
+		st.st_size = sizeof(TSQSpoolHeader);
+	}
+
+	offset = sizeof(TSQSpoolHeader);
+	spool_acked_offset = offset;
+	while (fseeko(spool_file, offset, SEEK_SET) == 0 &&
+		   fread(&block, sizeof(TSQBlockHeader), 1, spool_file) == 1 &&
+		   block.magic == TSQ_BLOCK_MAGIC &&
+		   offset + (off_t) sizeof(TSQBlockHeader) + block.length <= st.st_size)
+	{
+		offset += sizeof(TSQBlockHeader) + block.length;
+		if (block.seqno <= spool_header.acked)
+			spool_acked_offset = offset;
+		if (block.seqno >= spool_header.next)
+			spool_header.next = block.seqno + 1;
+	}
+	if (offset < st.st_size && ftruncate(fileno(spool_file), offset) < 0)
+		goto error;
+
+	spool_end = offset;
+	spool_sent_offset = spool_acked_offset;
+	return true;
+
+error:
+	ereport(LOG,
+			(errcode_for_file_access(),
+			 errmsg("pg_track_slow_queries: could not open forward spool \"%s\": %m",
+					TSQ_SPOOL_FILE)));
+	if (spool_file)
+	{
+		FreeFile(spool_file);
+		spool_file = NULL;
+	}
+	return false;
+}
+
+/*
+ * Writes the spool header. It is not synced: after a crash, blocks already
+ * acknowledged may be sent again, and are dropped by the aggregator.
+ */
+static bool
+pgtsq_spool_write_header(void)
+{
+	return fseeko(spool_file, 0, SEEK_SET) == 0 &&
+		   fwrite(&spool_header, sizeof(TSQSpoolHeader), 1, spool_file) == 1 &&
+		   fflush(spool_file) == 0;
+}
+
+/*
+ * Sets the forwarding target from the forward_to ("host:port") and
+ * forward_spool_size GUC values. An empty target disables forwarding, the
+ * spool is kept for later.
+ */
+void
+pgtsq_forward_configure(const char * target, int spool_size_kb)
+{
+	char		host[NI_MAXHOST];
+	char		port[NI_MAXSERV];
+	const char	*sep;
+
+	forward_spool_size_kb = spool_size_kb;
+
+	host[0] = '\0';
+	port[0] = '\0';
+	if (target && *target)
+	{
+		/* The port follows the last colon, IPv6 addresses are bracketed */
+		if ((sep = strrchr(target, ':')) == NULL || sep == target ||
+			strlen(sep + 1) == 0 || strlen(sep + 1) >= NI_MAXSERV ||
+			sep - target >= NI_MAXHOST)
+		{
+			ereport(LOG,
+					(errmsg("pg_track_slow_queries: invalid forward_to value \"%s\"",
+							target)));
+		}
+		else
+		{
+			if (target[0] == '[' && sep[-1] == ']')
+				strlcpy(host, target + 1, sep - target - 1);
+			else
+				strlcpy(host, target, sep - target + 1);
+			strlcpy(port, sep + 1, NI_MAXSERV);
+		}
+	}
+
+	if (strcmp(host, forward_host) == 0 && strcmp(port, forward_port) == 0)
+		return;
+
+	pgtsq_forward_disconnect(false);
+	strlcpy(forward_host, host, NI_MAXHOST);
+	strlcpy(forward_port, port, NI_MAXSERV);
+	forward_retry_time = 0;
+
+	if (pgtsq_forward_enabled() && spool_file == NULL)
+		(void) pgtsq_spool_open();
+}
+
+/*
+ * Is forwarding enabled?
+ */
+bool
+pgtsq_forward_enabled(void)
+{
+	return forward_host[0] != '\0';
+}
+
+/*
+ * Frees the encoded rows and the relations of a block written to the spool
+ */
+static void
+pgtsq_forward_free_block(StringInfo * stored, int nrows, StringInfo relids)
+{
+	for (int i = 0; i < nrows; i++)
+	{
+		pfree(stored[i]->data);
+		pfree(stored[i]);
+	}
+	pfree(stored);
+	pfree(relids->data);
+}
+
+/*
+ * Appends a batch of rows to the spool as a block, with its footer and the
+ * relations its rows use, and sends what can be sent right away.
+ */
+void
+pgtsq_forward_rows(char ** rows, int * lengths, int nrows, bool compression)
+{
+	TSQBlockHeader	block;
+	StringInfo		*stored = NULL;
+	StringInfoData	relids;
+	bool			indexed = true;
+	int				nrelids;
+	off_t			end;
+
+	if (!pgtsq_forward_enabled() || nrows == 0)
+		return;
+	if (spool_file == NULL && !pgtsq_spool_open())
+		return;
+
+	/* Only changes of state are logged, dropped rows are counted */
+	if (forward_spool_size_kb != -1 &&
+		spool_end >= (off_t) forward_spool_size_kb * 1024)
+	{
+		if (!spool_full)
+			ereport(LOG,
+					(errmsg("pg_track_slow_queries: forward_spool_size reached, entries are not forwarded until the spool drains")));
+		spool_full = true;
+		pgtsq_report_forward_dropped(nrows);
+		return;
+	}
+	if (spool_full)
+		ereport(LOG,
+				(errmsg("pg_track_slow_queries: forward spool drained, entries are forwarded again")));
+	spool_full = false;
+
+	memset(&block, 0, sizeof(TSQBlockHeader));
+	block.magic = TSQ_BLOCK_MAGIC;
+	block.nrows = nrows;
+	block.seqno = spool_header.next;
+
+	stored = (StringInfo *) palloc(nrows * sizeof(StringInfo));
+	for (int i = 0; i < nrows; i++)
+		stored[i] = pgtsq_encode_row(rows[i], lengths[i], compression);
+	initStringInfo(&relids);
+
+	/* The length of the block is only known once it is written */
+	end = spool_end + sizeof(TSQBlockHeader);
+	if (fseeko(spool_file, end, SEEK_SET) != 0 ||
+		pgtsq_write_block(spool_file, stored, rows, lengths, nrows, -1, &end,
+						  &relids, &indexed) != nrows)
+		goto error;
+	nrelids = pgtsq_unique_relids(&relids);
+	block.nrelids = indexed ? nrelids : TSQ_BLOCK_UNINDEXED;
+	if (indexed && nrelids > 0)
+	{
+		if (fwrite(relids.data, sizeof(Oid), nrelids, spool_file) != nrelids)
+			goto error;
+		end += nrelids * sizeof(Oid);
+	}
+	block.length = (uint32) (end - spool_end - sizeof(TSQBlockHeader));
+
+	if (fseeko(spool_file, spool_end, SEEK_SET) != 0 ||
+		fwrite(&block, sizeof(TSQBlockHeader), 1, spool_file) != 1 ||
+		fflush(spool_file) != 0)
+		goto error;
+
+	spool_end = end;
+	spool_header.next++;
+	pgtsq_forward_free_block(stored, nrows, &relids);
+
+	pgtsq_forward();
+	return;
+
+error:
+	ereport(LOG,
+			(errcode_for_file_access(),
+			 errmsg("pg_track_slow_queries: could not write forward spool \"%s\": %m",
+					TSQ_SPOOL_FILE)));
+	/* Don't leave a partial block at the end of the spool */
+	if (ftruncate(fileno(spool_file), spool_end) < 0)
+	{
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("pg_track_slow_queries: could not truncate forward spool \"%s\": %m",
+						TSQ_SPOOL_FILE)));
+		FreeFile(spool_file);
+		spool_file = NULL;
+		pgtsq_forward_disconnect(false);
+	}
+	if (stored)
+		pgtsq_forward_free_block(stored, nrows, &relids);
+}
+
+/*
+ * Adds the forwarding socket to the sets the collector waits on, returns the
+ * highest descriptor added or -1 if none.
+ */
+int
+pgtsq_forward_fds(fd_set * rfds, fd_set * wfds)
+{
+	if (forward_sock == PGINVALID_SOCKET)
+		return -1;
+
+	if (!forward_connected)
+	{
+		FD_SET(forward_sock, wfds);
+		return forward_sock;
+	}
+
+	/* Acknowledgments, or end of connection */
+	FD_SET(forward_sock, rfds);
+	if (send_pos < send_len || spool_sent_offset < spool_end)
+		FD_SET(forward_sock, wfds);
+	return forward_sock;
+}
+
+/*
+ * Makes the connection to the aggregator progress without waiting: connects,
+ * reads acknowledgments and sends blocks until the socket would block.
+ */
+void
+pgtsq_forward(void)
+{
+	int		n;
+
+	if (!pgtsq_forward_enabled() || spool_file == NULL)
+		return;
+
+	if (forward_sock == PGINVALID_SOCKET)
+	{
+		if (GetCurrentTimestamp() < forward_retry_time)
+			return;
+		pgtsq_forward_connect();
+		if (forward_sock == PGINVALID_SOCKET)
+			return;
+	}
+
+	if (!forward_connected)
+	{
+		fd_set			wfds;
+		struct timeval	tv = {0, 0};
+		int				error = 0;
+		ACCEPT_TYPE_ARG3 len = sizeof(error);
+
+		FD_ZERO(&wfds);
+		FD_SET(forward_sock, &wfds);
+		if (select(forward_sock + 1, NULL, &wfds, NULL, &tv) <= 0)
+			return;
+		if (getsockopt(forward_sock, SOL_SOCKET, SO_ERROR, &error, &len) < 0 ||
+			error != 0)
+		{
+			errno = error;
+			pgtsq_forward_disconnect(true);
+			return;
+		}
+		forward_connected = true;
+	}
+
+	/* Acknowledgments may be split across reads */
+	while ((n = recv(forward_sock, ack_buf + ack_len,
+					 sizeof(ack_buf) - ack_len, 0)) > 0)
+	{
+		ack_len += n;
+		if (ack_len == sizeof(ack_buf))
+		{
+			uint64	seqno;
+
+			memcpy(&seqno, ack_buf, sizeof(uint64));
+			pgtsq_forward_ack(seqno);
+			ack_len = 0;
+		}
+	}
+	if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+	{
+		if (n == 0)
+			errno = ECONNRESET;
+		pgtsq_forward_disconnect(true);
+		return;
+	}
+
+	for (;;)
+	{
+		/* Refill the send buffer from the spool */
+		if (send_pos == send_len)
+		{
+			size_t	len;
+
+			if (spool_sent_offset >= spool_end)
+				break;
+			len = Min(spool_end - spool_sent_offset, TSQ_FORWARD_BUF_SIZE);
+			if (fseeko(spool_file, spool_sent_offset, SEEK_SET) != 0 ||
+				fread(send_buf, 1, len, spool_file) != len)
+			{
+				ereport(LOG,
+						(errcode_for_file_access(),
+						 errmsg("pg_track_slow_queries: could not read forward spool \"%s\": %m",
+								TSQ_SPOOL_FILE)));
+				pgtsq_forward_disconnect(false);
+				return;
+			}
+			send_len = len;
+			send_pos = 0;
+			spool_sent_offset += len;
+		}
+
+		if ((n = send(forward_sock, send_buf + send_pos, send_len - send_pos,
+					  TSQ_SEND_FLAGS)) < 0)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+				break;
+			pgtsq_forward_disconnect(true);
+			return;
+		}
+		send_pos += n;
+	}
+
+	/* Once every block is acknowledged, start the spool over */
+	if (spool_acked_offset == spool_end && spool_end > sizeof(TSQSpoolHeader) &&
+		send_pos == send_len)
+	{
+		if (ftruncate(fileno(spool_file), sizeof(TSQSpoolHeader)) < 0)
+			ereport(LOG,
+					(errcode_for_file_access(),
+					 errmsg("pg_track_slow_queries: could not truncate forward spool \"%s\": %m",
+							TSQ_SPOOL_FILE)));
+		else
+			spool_end = spool_acked_offset = spool_sent_offset =
+				sizeof(TSQSpoolHeader);
+	}
+}
+
+/*
+ * Marks the blocks up to seqno as acknowledged
+ */
+static void
+pgtsq_forward_ack(uint64 seqno)
+{
+	TSQBlockHeader	block;
+
+	if (seqno <= spool_header.acked)
+		return;
+
+	while (spool_acked_offset < spool_sent_offset &&
+		   fseeko(spool_file, spool_acked_offset, SEEK_SET) == 0 &&
+		   fread(&block, sizeof(TSQBlockHeader), 1, spool_file) == 1 &&
+		   block.seqno <= seqno)
+		spool_acked_offset += sizeof(TSQBlockHeader) + block.length;
+
+	spool_header.acked = seqno;
+	forward_failure_logged = false;
+	if (!pgtsq_spool_write_header())
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("pg_track_slow_queries: could not write forward spool \"%s\": %m",
+						TSQ_SPOOL_FILE)));
+}
+
+/*
+ * Starts a non-blocking connection to the aggregator, the hello message is
+ * queued to be sent first.
+ */
+static void
+pgtsq_forward_connect(void)
+{
+	struct addrinfo	*addrs = NULL, *addr, hints;
+	TSQForwardHello	hello;
+	int				ret;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	ret = pg_getaddrinfo_all(forward_host, forward_port, &hints, &addrs);
+	if (ret || !addrs)
+	{
+		if (!forward_failure_logged)
+			ereport(LOG,
+					(errmsg("pg_track_slow_queries: could not resolve \"%s\": %s",
+							forward_host, gai_strerror(ret))));
+		forward_failure_logged = true;
+		forward_retry_time = TimestampTzPlusMilliseconds(GetCurrentTimestamp(),
+														 TSQ_FORWARD_RETRY_MS);
+		if (addrs)
+			pg_freeaddrinfo_all(hints.ai_family, addrs);
+		return;
+	}
+
+	for (addr = addrs; addr; addr = addr->ai_next)
+	{
+		if ((forward_sock = socket(addr->ai_family, SOCK_STREAM, 0)) == PGINVALID_SOCKET)
+			continue;
+		if (!pg_set_noblock(forward_sock))
+		{
+			closesocket(forward_sock);
+			forward_sock = PGINVALID_SOCKET;
+			continue;
+		}
+		if (connect(forward_sock, addr->ai_addr, addr->ai_addrlen) == 0)
+		{
+			forward_connected = true;
+			break;
+		}
+		if (errno == EINPROGRESS)
+			break;
+		closesocket(forward_sock);
+		forward_sock = PGINVALID_SOCKET;
+	}
+	pg_freeaddrinfo_all(hints.ai_family, addrs);
+
+	if (forward_sock == PGINVALID_SOCKET)
+	{
+		pgtsq_forward_disconnect(true);
+		return;
+	}
+
+	/* Blocks not acknowledged yet are sent again */
+	memset(&hello, 0, sizeof(TSQForwardHello));
+	hello.magic = TSQ_FORWARD_HELLO_MAGIC;
+	hello.version = TSQ_FORMAT_VERSION;
+	hello.codec = TSQ_CODEC_PGLZ;
+	hello.stream = spool_header.stream;
+	strlcpy(hello.node, (cluster_name && *cluster_name) ? cluster_name :
+			TSQ_LOCAL_NODE, TSQ_FORWARD_NODE_LEN);
+	memcpy(send_buf, &hello, sizeof(TSQForwardHello));
+	send_len = sizeof(TSQForwardHello);
+	send_pos = 0;
+	ack_len = 0;
+	spool_sent_offset = spool_acked_offset;
+}
+
+/*
+ * Closes the connection to the aggregator. A failure is only logged once
+ * until the next successful exchange, and delays the next connection.
+ */
+static void
+pgtsq_forward_disconnect(bool failed)
+{
+	if (failed)
+	{
+		if (!forward_failure_logged)
+			ereport(LOG,
+					(errcode_for_socket_access(),
+					 errmsg("pg_track_slow_queries: could not forward to \"%s:%s\": %m",
+							forward_host, forward_port)));
+		forward_failure_logged = true;
+		forward_retry_time = TimestampTzPlusMilliseconds(GetCurrentTimestamp(),
+														 TSQ_FORWARD_RETRY_MS);
+	}
+
+	if (forward_sock != PGINVALID_SOCKET)
+		closesocket(forward_sock);
+	forward_sock = PGINVALID_SOCKET;
+	forward_connected = false;
+	send_len = send_pos = 0;
+	ack_len = 0;
+}
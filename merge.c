@@ -0,0 +1,784 @@
+/*
+ * Import and merged read of the storage files of several nodes
+ *
+ * pg_track_slow_queries_import() copies the storage files of another node to
+ * a directory of its own, converted to the current format. Each source file
+ * gets its own imported file, and the manifest of the node records the range
+ * of source rows imported so far from each of them: importing the same files
+ * again only copies the rows appended since. Imports run one at a time.
+ * Manifests are replaced atomically and imported files are never read beyond
+ * the length their manifest records, so readers need no lock.
+ *
+ * pg_track_slow_queries_merged() reads the local segment chain along with the
+ * imported ones, merged by end timestamp, each row tagged with its node.
+ */
+#include "postgres.h"
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "lib/binaryheap.h"
+#include "lib/stringinfo.h"
+#include "port/atomics.h"
+#include "storage/fd.h"
+#include "storage/ipc.h"
+#include "utils/builtins.h"
+#include "utils/guc.h"
+#include "utils/memutils.h"
+#include "utils/timestamp.h"
+
+#include "pg_track_slow_queries.h"
+
+/* Number of columns returned by pg_track_slow_queries_merged() */
+#define TSQ_MERGED_COLS		(TSQ_COLS + 1)
+/* Segment number standing for the legacy storage file */
+#define TSQ_LEGACY_SEGNO	0xFFFFFFFF
+
+/* Storage file to import */
+typedef struct TSQSourceFile {
+	uint32		segno;			/* TSQ_LEGACY_SEGNO for the legacy file */
+	char		path[MAXPGPATH];
+} TSQSourceFile;
+
+/* Imported file, as recorded in the manifest of its node */
+typedef struct TSQImportedFile {
+	uint32		segno;			/* Source segment number */
+	int64		created;		/* Source segment creation time, 0 if headerless */
+	uint64		nrows;			/* Source rows [0, nrows) have been imported */
+	off_t		src_offset;		/* Source offset of row nrows */
+	off_t		length;			/* Length of the imported file */
+} TSQImportedFile;
+
+typedef struct TSQManifest {
+	TSQImportedFile	*files;
+	int			nfiles;
+	int			size;
+} TSQManifest;
+
+/* Chain of storage files of a node, read in order */
+typedef struct TSQMergeChain {
+	const char	*node;
+	int			nfiles;
+	char		**paths;
+	off_t		*ends;			/* Offsets to stop at, -1 for end of file */
+	int			current;		/* File being read */
+	TSQSegmentReader reader;
+	MemoryContext context;		/* Holds the current entry */
+	TSQEntry	entry;			/* Current entry */
+} TSQMergeChain;
+
+PGDLLEXPORT Datum pg_track_slow_queries_import(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum pg_track_slow_queries_merged(PG_FUNCTION_ARGS);
+
+PG_FUNCTION_INFO_V1(pg_track_slow_queries_import);
+PG_FUNCTION_INFO_V1(pg_track_slow_queries_merged);
+
+/*
+ * Node names are used as directory names
+ */
+static bool
+pgtsq_valid_node_name(const char * node)
+{
+	size_t	len = strlen(node);
+
+	return len > 0 && len <= TSQ_NODE_NAME_MAXLEN &&
+		strspn(node, "abcdefghijklmnopqrstuvwxyz"
+					 "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_-") == len;
+}
+
+static void
+pgtsq_imported_path(char * path, const char * node, TSQImportedFile * file)
+{
+	snprintf(path, MAXPGPATH, "%s/%s/%08X.%016" INT64_MODIFIER "X" TSQ_SEGMENT_SUFFIX,
+			 TSQ_NODES_DIR, node, file->segno, (uint64) file->created);
+}
+
+static void
+pgtsq_manifest_path(char * path, const char * node)
+{
+	snprintf(path, MAXPGPATH, "%s/%s/" TSQ_MANIFEST_FILE, TSQ_NODES_DIR, node);
+}
+
+/*
+ * Legacy file first, then segments by number and creation time
+ */
+static int
+pgtsq_imported_cmp(const void * a, const void * b)
+{
+	const TSQImportedFile *fa = (const TSQImportedFile *) a;
+	const TSQImportedFile *fb = (const TSQImportedFile *) b;
+
+	if (fa->segno != fb->segno)
+	{
+		if (fa->segno == TSQ_LEGACY_SEGNO || fb->segno == TSQ_LEGACY_SEGNO)
+			return fa->segno == TSQ_LEGACY_SEGNO ? -1 : 1;
+		return fa->segno < fb->segno ? -1 : 1;
+	}
+	if (fa->created != fb->created)
+		return fa->created < fb->created ? -1 : 1;
+	return 0;
+}
+
+static int
+pgtsq_source_cmp(const void * a, const void * b)
+{
+	const TSQSourceFile *fa = (const TSQSourceFile *) a;
+	const TSQSourceFile *fb = (const TSQSourceFile *) b;
+
+	if (fa->segno == fb->segno)
+		return 0;
+	if (fa->segno == TSQ_LEGACY_SEGNO || fb->segno == TSQ_LEGACY_SEGNO)
+		return fa->segno == TSQ_LEGACY_SEGNO ? -1 : 1;
+	return fa->segno < fb->segno ? -1 : 1;
+}
+
+/*
+ * Reads the manifest of a node, which is empty if the node has never been
+ * imported
+ */
+static bool
+pgtsq_read_manifest(const char * node, TSQManifest * manifest)
+{
+	char		path[MAXPGPATH];
+	char		line[256];
+	FILE		*file;
+
+	memset(manifest, 0, sizeof(TSQManifest));
+	pgtsq_manifest_path(path, node);
+	if ((file = AllocateFile(path, "r")) == NULL)
+	{
+		if (errno == ENOENT)
+			return true;
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("pg_track_slow_queries: could not open file \"%s\": %m",
+						path)));
+		return false;
+	}
+
+	while (fgets(line, sizeof(line), file) != NULL)
+	{
+		TSQImportedFile	imported;
+		uint64			created;
+		int64			src_offset;
+		int64			length;
+
+		if (sscanf(line, "%X %" INT64_MODIFIER "X %" INT64_MODIFIER "u %"
+				   INT64_MODIFIER "d %" INT64_MODIFIER "d",
+				   &imported.segno, &created, &imported.nrows,
+				   &src_offset, &length) != 5)
+		{
+			ereport(LOG,
+					(errmsg("pg_track_slow_queries: invalid line in file \"%s\"",
+							path)));
+			FreeFile(file);
+			return false;
+		}
+		imported.created = (int64) created;
+		imported.src_offset = (off_t) src_offset;
+		imported.length = (off_t) length;
+
+		if (manifest->nfiles == manifest->size)
+		{
+			manifest->size = Max(manifest->size * 2, 16);
+			if (manifest->files)
+				manifest->files = repalloc(manifest->files,
+										   sizeof(TSQImportedFile) * manifest->size);
+			else
+				manifest->files = palloc(sizeof(TSQImportedFile) * manifest->size);
+		}
+		manifest->files[manifest->nfiles++] = imported;
+	}
+	FreeFile(file);
+	return true;
+}
+
+/*
+ * Writes the manifest of a node, atomically, once the imported files it
+ * refers to are durable
+ */
+static bool
+pgtsq_write_manifest(const char * node, TSQManifest * manifest)
+{
+	char		path[MAXPGPATH];
+	char		tmppath[MAXPGPATH];
+	FILE		*file;
+	bool		written = true;
+	int			i;
+
+	pgtsq_manifest_path(path, node);
+	snprintf(tmppath, MAXPGPATH, "%s" TSQ_CONVERT_SUFFIX, path);
+
+	if ((file = AllocateFile(tmppath, "w")) == NULL)
+	{
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("pg_track_slow_queries: could not open file \"%s\": %m",
+						tmppath)));
+		return false;
+	}
+
+	qsort(manifest->files, manifest->nfiles, sizeof(TSQImportedFile),
+		  pgtsq_imported_cmp);
+	for (i = 0; i < manifest->nfiles && written; i++)
+	{
+		TSQImportedFile	*imported = &manifest->files[i];
+
+		written = fprintf(file, "%08X %016" INT64_MODIFIER "X " UINT64_FORMAT " "
+						  INT64_FORMAT " " INT64_FORMAT "\n",
+						  imported->segno, (uint64) imported->created,
+						  imported->nrows, (int64) imported->src_offset,
+						  (int64) imported->length) > 0;
+	}
+	if (!written || fflush(file) != 0 || pg_fsync(fileno(file)) != 0)
+	{
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("pg_track_slow_queries: could not write file \"%s\": %m",
+						tmppath)));
+		FreeFile(file);
+		return false;
+	}
+	FreeFile(file);
+
+	return durable_rename(tmppath, path, LOG) == 0;
+}
+
+/*
+ * Returns the manifest entry of a source file, added if not found
+ */
+static TSQImportedFile *
+pgtsq_manifest_entry(TSQManifest * manifest, uint32 segno, int64 created)
+{
+	TSQImportedFile	*imported;
+	int				i;
+
+	for (i = 0; i < manifest->nfiles; i++)
+	{
+		if (manifest->files[i].segno == segno &&
+			manifest->files[i].created == created)
+			return &manifest->files[i];
+	}
+
+	if (manifest->nfiles == manifest->size)
+	{
+		manifest->size = Max(manifest->size * 2, 16);
+		if (manifest->files)
+			manifest->files = repalloc(manifest->files,
+									   sizeof(TSQImportedFile) * manifest->size);
+		else
+			manifest->files = palloc(sizeof(TSQImportedFile) * manifest->size);
+	}
+	imported = &manifest->files[manifest->nfiles++];
+	memset(imported, 0, sizeof(TSQImportedFile));
+	imported->segno = segno;
+	imported->created = created;
+	return imported;
+}
+
+/*
+ * Lists the storage files to import from path: a storage file, or the
+ * storage files of a directory, or of the pg_stat subdirectory of a data
+ * directory, in the order they have been written.
+ */
+static int
+pgtsq_source_files(const char * path, TSQSourceFile ** files)
+{
+	struct stat		st;
+	char			dirpath[MAXPGPATH];
+	const char		*name;
+	DIR				*dir;
+	struct dirent	*de;
+	int				nfiles = 0;
+	int				size = 16;
+
+	if (stat(path, &st) < 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("pg_track_slow_queries: could not stat file \"%s\": %m",
+						path)));
+
+	*files = palloc(sizeof(TSQSourceFile) * size);
+
+	if (!S_ISDIR(st.st_mode))
+	{
+		name = (name = strrchr(path, '/')) ? name + 1 : path;
+		if (strcmp(name, TSQ_LEGACY_FILE_NAME) == 0)
+			(*files)[0].segno = TSQ_LEGACY_SEGNO;
+		else if (!pgtsq_parse_segment_name(name, &(*files)[0].segno))
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("pg_track_slow_queries: \"%s\" is not a storage file",
+							path)));
+		strlcpy((*files)[0].path, path, MAXPGPATH);
+		return 1;
+	}
+
+	snprintf(dirpath, MAXPGPATH, "%s/pg_stat", path);
+	if (stat(dirpath, &st) < 0 || !S_ISDIR(st.st_mode))
+		strlcpy(dirpath, path, MAXPGPATH);
+
+	dir = AllocateDir(dirpath);
+	while ((de = ReadDir(dir, dirpath)) != NULL)
+	{
+		uint32	segno;
+
+		if (strcmp(de->d_name, TSQ_LEGACY_FILE_NAME) == 0)
+			segno = TSQ_LEGACY_SEGNO;
+		else if (!pgtsq_parse_segment_name(de->d_name, &segno))
+			continue;
+
+		if (nfiles == size)
+		{
+			size *= 2;
+			*files = repalloc(*files, sizeof(TSQSourceFile) * size);
+		}
+		(*files)[nfiles].segno = segno;
+		snprintf((*files)[nfiles].path, MAXPGPATH, "%s/%s", dirpath, de->d_name);
+		nfiles++;
+	}
+	FreeDir(dir);
+
+	qsort(*files, nfiles, sizeof(TSQSourceFile), pgtsq_source_cmp);
+	return nfiles;
+}
+
+/*
+ * Imports the rows of a source file that have not been imported yet.
+ * Returns the number of rows imported.
+ */
+static uint64
+pgtsq_import_file(const char * node, TSQSourceFile * source,
+				  TSQManifest * manifest, MemoryContext rowcontext)
+{
+	TSQSegmentReader	reader;
+	TSQImportedFile		*imported;
+	char				path[MAXPGPATH];
+	FILE				*file = NULL;
+	off_t				end;
+	int					version;
+	char				*row;
+	uint32				row_len;
+	uint64				nrows = 0;
+	int					ret;
+	bool				written;
+
+	/* A file still written to is imported up to its last complete row */
+	if ((end = pgtsq_segment_valid_length(source->path, &version)) < 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("pg_track_slow_queries: unsupported format version %d of file \"%s\"",
+						version, source->path)));
+	if ((ret = pgtsq_open_reader_path(&reader, source->path, end)) == 0)
+		return 0;
+	if (ret < 0)
+		ereport(ERROR,
+				(errmsg("pg_track_slow_queries: could not import file \"%s\"",
+						source->path)));
+
+	imported = pgtsq_manifest_entry(manifest, source->segno,
+									reader.header.created);
+
+	/* Storage files are only appended to, rows imported before are skipped */
+	if (imported->src_offset > 0)
+	{
+		if (imported->src_offset > end ||
+			fseeko(reader.file, imported->src_offset, SEEK_SET) != 0)
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("pg_track_slow_queries: file \"%s\" has been truncated since its last import",
+							source->path)));
+		reader.offset = imported->src_offset;
+	}
+	if (reader.offset >= end)
+	{
+		pgtsq_close_reader(&reader);
+		return 0;
+	}
+
+	/*
+	 * Anything after the recorded length has been left by an interrupted
+	 * import, whose rows are imported again
+	 */
+	pgtsq_imported_path(path, node, imported);
+	if (imported->length == 0)
+		written = (file = AllocateFile(path, PG_BINARY_W)) != NULL &&
+			pgtsq_write_segment_header(file);
+	else
+		written = (file = AllocateFile(path, TSQ_BINARY_RW)) != NULL &&
+			ftruncate(fileno(file), imported->length) == 0 &&
+			fseeko(file, imported->length, SEEK_SET) == 0;
+
+	while (written)
+	{
+		MemoryContext	oldcontext = MemoryContextSwitchTo(rowcontext);
+		TSQEntry		tsqe;
+		StringInfo		tsqe_s;
+
+		if ((ret = pgtsq_read_row(&reader, &row, &row_len)) > 0)
+		{
+			memset(&tsqe, 0, sizeof(TSQEntry));
+			if (!pgtsq_parse_row(row, reader.header.version, &tsqe))
+				ret = -1;
+			else
+			{
+				tsqe_s = pgtsq_serialize_entry(&tsqe);
+				written = pgtsq_write_row(file, tsqe_s->data, tsqe_s->len, true);
+			}
+		}
+		MemoryContextSwitchTo(oldcontext);
+		MemoryContextReset(rowcontext);
+
+		if (ret < 0)
+			ereport(ERROR,
+					(errmsg("pg_track_slow_queries: could not import file \"%s\"",
+							source->path)));
+		if (ret == 0)
+			break;
+		nrows++;
+	}
+
+	if (!written || fflush(file) != 0 || pg_fsync(fileno(file)) != 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("pg_track_slow_queries: could not write file \"%s\": %m",
+						path)));
+
+	imported->length = ftello(file);
+	imported->nrows += nrows;
+	imported->src_offset = reader.offset;
+	FreeFile(file);
+	pgtsq_close_reader(&reader);
+
+	return nrows;
+}
+
+/*
+ * Lets the next import run once this one ends, on error or process exit too
+ */
+static void
+pgtsq_import_cleanup(int code, Datum arg)
+{
+	pg_atomic_write_u32(&pgtsqss->importing, 0);
+}
+
+PGDLLEXPORT Datum
+pg_track_slow_queries_import(PG_FUNCTION_ARGS)
+{
+	char			*path = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	char			*node = text_to_cstring(PG_GETARG_TEXT_PP(1));
+	char			nodepath[MAXPGPATH];
+	TSQSourceFile	*files;
+	TSQManifest		manifest;
+	MemoryContext	rowcontext;
+	int				nfiles;
+	int				i;
+	volatile int64	nrows = 0;
+	uint32			expected = 0;
+
+	if (!pgtsqss)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pg_track_slow_queries: must be loaded via shared_preload_libraries")));
+	if (!pgtsq_valid_node_name(node))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("pg_track_slow_queries: invalid node name \"%s\"", node),
+				 errhint("Node names are made of up to %d letters, digits, underscores and dashes.",
+						 TSQ_NODE_NAME_MAXLEN)));
+
+	nfiles = pgtsq_source_files(path, &files);
+
+	snprintf(nodepath, MAXPGPATH, "%s/%s", TSQ_NODES_DIR, node);
+	if ((mkdir(TSQ_NODES_DIR, S_IRWXU) < 0 && errno != EEXIST) ||
+		(mkdir(nodepath, S_IRWXU) < 0 && errno != EEXIST))
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("pg_track_slow_queries: could not create directory \"%s\": %m",
+						nodepath)));
+
+	if (!pg_atomic_compare_exchange_u32(&pgtsqss->importing, &expected, 1))
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_IN_USE),
+				 errmsg("pg_track_slow_queries: an import is already running")));
+
+	rowcontext = AllocSetContextCreate(CurrentMemoryContext,
+									   "PGTSQImport", ALLOCSET_DEFAULT_SIZES);
+
+	/*
+	 * On error, the manifest is left untouched: rows written after the
+	 * lengths it records are dropped by the next import
+	 */
+	PG_ENSURE_ERROR_CLEANUP(pgtsq_import_cleanup, (Datum) 0);
+	{
+		if (!pgtsq_read_manifest(node, &manifest))
+			ereport(ERROR,
+					(errmsg("pg_track_slow_queries: could not read the manifest of node \"%s\"",
+							node)));
+
+		for (i = 0; i < nfiles; i++)
+			nrows += pgtsq_import_file(node, &files[i], &manifest, rowcontext);
+
+		if (!pgtsq_write_manifest(node, &manifest))
+			ereport(ERROR,
+					(errmsg("pg_track_slow_queries: could not write the manifest of node \"%s\"",
+							node)));
+	}
+	PG_END_ENSURE_ERROR_CLEANUP(pgtsq_import_cleanup, (Datum) 0);
+	pgtsq_import_cleanup(0, (Datum) 0);
+
+	MemoryContextDelete(rowcontext);
+	PG_RETURN_INT64(nrows);
+}
+
+/*
+ * Reads the next entry of a chain into chain->entry. Returns 1 if an entry
+ * has been read, 0 at the end of the chain, -1 on error.
+ */
+static int
+pgtsq_chain_next(TSQMergeChain * chain)
+{
+	MemoryContext	oldcontext;
+	char			*row;
+	uint32			row_len;
+	int				ret;
+
+	for (;;)
+	{
+		if (chain->reader.file == NULL)
+		{
+			if (chain->current >= chain->nfiles)
+				return 0;
+			ret = pgtsq_open_reader_path(&chain->reader,
+										 chain->paths[chain->current],
+										 chain->ends[chain->current]);
+			if (ret < 0)
+				return -1;
+			if (ret == 0)
+			{
+				chain->current++;
+				continue;
+			}
+		}
+
+		MemoryContextReset(chain->context);
+		oldcontext = MemoryContextSwitchTo(chain->context);
+		if ((ret = pgtsq_read_row(&chain->reader, &row, &row_len)) > 0)
+		{
+			memset(&chain->entry, 0, sizeof(TSQEntry));
+			if (!pgtsq_parse_row(row, chain->reader.header.version, &chain->entry))
+			{
+				ereport(LOG,
+						(errmsg("pg_track_slow_queries: could not parse row of file \"%s\"",
+								chain->reader.path)));
+				ret = -1;
+			}
+		}
+		MemoryContextSwitchTo(oldcontext);
+		if (ret != 0)
+			return ret;
+
+		pgtsq_close_reader(&chain->reader);
+		chain->current++;
+	}
+}
+
+/*
+ * binaryheap keeps the greatest element first, the chain with the earliest
+ * entry must be
+ */
+static int
+pgtsq_chain_cmp(Datum a, Datum b, void * arg)
+{
+	TSQMergeChain	*ca = (TSQMergeChain *) DatumGetPointer(a);
+	TSQMergeChain	*cb = (TSQMergeChain *) DatumGetPointer(b);
+
+	if (ca->entry.end_time != cb->entry.end_time)
+		return ca->entry.end_time < cb->entry.end_time ? 1 : -1;
+	/* Local entries, then nodes by name */
+	if (ca != cb)
+		return ca < cb ? 1 : -1;
+	return 0;
+}
+
+static int
+pgtsq_node_cmp(const void * a, const void * b)
+{
+	return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/*
+ * Builds the chain of local segments, then of each imported node. Local
+ * segments are read up to a snapshot of the committed position, imported
+ * files up to the length recorded in their manifest.
+ */
+static TSQMergeChain *
+pgtsq_merge_chains(int * nchains)
+{
+	TSQMergeChain	*chains;
+	TSQMergeChain	*chain;
+	char			**nodes;
+	int				nnodes = 0;
+	int				size = 16;
+	uint64			pos;
+	uint32			segno;
+	DIR				*dir;
+	struct dirent	*de;
+	int				i;
+	int				j;
+
+	nodes = palloc(sizeof(char *) * size);
+	if ((dir = AllocateDir(TSQ_NODES_DIR)) != NULL)
+	{
+		while ((de = ReadDir(dir, TSQ_NODES_DIR)) != NULL)
+		{
+			if (!pgtsq_valid_node_name(de->d_name))
+				continue;
+			if (nnodes == size)
+			{
+				size *= 2;
+				nodes = repalloc(nodes, sizeof(char *) * size);
+			}
+			nodes[nnodes++] = pstrdup(de->d_name);
+		}
+		FreeDir(dir);
+	}
+	qsort(nodes, nnodes, sizeof(char *), pgtsq_node_cmp);
+
+	*nchains = nnodes + 1;
+	chains = palloc0(sizeof(TSQMergeChain) * (nnodes + 1));
+
+	/* Local segments */
+	chain = &chains[0];
+	chain->node = (cluster_name && *cluster_name) ? cluster_name : TSQ_LOCAL_NODE;
+	pos = pg_atomic_read_u64(&pgtsqss->committed);
+	pg_read_barrier();
+	segno = pgtsq_first_segment(pos);
+	chain->nfiles = ((TSQPosSegno(pos) - segno) & TSQ_SEGNO_MASK) + 1;
+	chain->paths = palloc(sizeof(char *) * chain->nfiles);
+	chain->ends = palloc(sizeof(off_t) * chain->nfiles);
+	for (j = 0; j < chain->nfiles; j++, segno = TSQNextSegno(segno))
+	{
+		chain->paths[j] = palloc(MAXPGPATH);
+		pgtsq_segment_path(chain->paths[j], segno);
+		chain->ends[j] = segno == TSQPosSegno(pos) ? TSQPosOffset(pos) : -1;
+	}
+
+	/* Imported nodes */
+	for (i = 0; i < nnodes; i++)
+	{
+		TSQManifest	manifest;
+
+		chain = &chains[i + 1];
+		chain->node = nodes[i];
+		if (!pgtsq_read_manifest(nodes[i], &manifest))
+			continue;
+		chain->nfiles = manifest.nfiles;
+		chain->paths = palloc(sizeof(char *) * Max(manifest.nfiles, 1));
+		chain->ends = palloc(sizeof(off_t) * Max(manifest.nfiles, 1));
+		for (j = 0; j < manifest.nfiles; j++)
+		{
+			chain->paths[j] = palloc(MAXPGPATH);
+			pgtsq_imported_path(chain->paths[j], nodes[i], &manifest.files[j]);
+			chain->ends[j] = manifest.files[j].length;
+		}
+	}
+
+	return chains;
+}
+
+PGDLLEXPORT Datum
+pg_track_slow_queries_merged(PG_FUNCTION_ARGS)
+{
+	TupleDesc		tupdesc;
+	Tuplestorestate	*tupstore;
+	TSQMergeChain	*chains;
+	TSQMergeChain	*chain;
+	binaryheap		*heap;
+	MemoryContext	tmpcontext;
+	MemoryContext	oldcontext;
+	int				nchains;
+	int				ret;
+	int				i;
+
+	if (!pgtsqss)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pg_track_slow_queries: must be loaded via shared_preload_libraries")));
+
+	tupstore = pgtsq_begin_srf(fcinfo, &tupdesc);
+	chains = pgtsq_merge_chains(&nchains);
+	heap = binaryheap_allocate(nchains, pgtsq_chain_cmp, NULL);
+	tmpcontext = AllocSetContextCreate(CurrentMemoryContext,
+									   "PGTSQMerged", ALLOCSET_START_SMALL_SIZES);
+
+	for (i = 0; i < nchains; i++)
+	{
+		chains[i].context = AllocSetContextCreate(CurrentMemoryContext,
+												  "PGTSQMergeChain",
+												  ALLOCSET_START_SMALL_SIZES);
+		if ((ret = pgtsq_chain_next(&chains[i])) < 0)
+			goto done;
+		if (ret > 0)
+			binaryheap_add_unordered(heap, PointerGetDatum(&chains[i]));
+	}
+	binaryheap_build(heap);
+
+	/* k-way merge: the chain with the earliest entry goes first */
+	while (!binaryheap_empty(heap))
+	{
+		Datum		values[TSQ_MERGED_COLS];
+		bool		nulls[TSQ_MERGED_COLS];
+		TSQEntry	*tsqe;
+		char		*plantxt;
+		int			c = 0;
+
+		chain = (TSQMergeChain *) DatumGetPointer(binaryheap_first(heap));
+		tsqe = &chain->entry;
+
+		oldcontext = MemoryContextSwitchTo(tmpcontext);
+		memset(nulls, 0, sizeof(nulls));
+		values[c++] = CStringGetTextDatum(chain->node);
+		values[c++] = TimestampTzGetDatum(tsqe->end_time);
+		values[c++] = TimestampTzGetDatum(tsqe->start_time);
+		values[c++] = Float8GetDatumFast(tsqe->duration);
+		values[c++] = CStringGetTextDatum(tsqe->username);
+		values[c++] = CStringGetTextDatum(tsqe->appname);
+		values[c++] = CStringGetTextDatum(tsqe->dbname);
+		values[c++] = UInt32GetDatum(tsqe->temp_blks_written);
+		values[c++] = Float8GetDatumFast(tsqe->hitratio);
+		values[c++] = Int64GetDatum(tsqe->ntuples);
+		values[c++] = Int64GetDatum((int64) tsqe->queryid);
+		values[c++] = CStringGetTextDatum(tsqe->querytxt);
+		if ((plantxt = pgtsq_plan_text(tsqe)) != NULL)
+			values[c++] = CStringGetTextDatum(plantxt);
+		else
+			nulls[c++] = true;
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+		MemoryContextSwitchTo(oldcontext);
+		MemoryContextReset(tmpcontext);
+
+		if ((ret = pgtsq_chain_next(chain)) < 0)
+			goto done;
+		if (ret > 0)
+			binaryheap_replace_first(heap, PointerGetDatum(chain));
+		else
+			binaryheap_remove_first(heap);
+	}
+
+done:
+	/* On error, rows merged so far are returned, like pg_track_slow_queries() */
+	for (i = 0; i < nchains; i++)
+	{
+		pgtsq_close_reader(&chains[i].reader);
+		if (chains[i].context)
+			MemoryContextDelete(chains[i].context);
+	}
+	MemoryContextDelete(tmpcontext);
+	binaryheap_free(heap);
+
+	tuplestore_donestoring(tupstore);
+	return (Datum) 0;
+}
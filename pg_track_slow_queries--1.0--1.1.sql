@@ -0,0 +1,275 @@
+\echo Use "ALTER EXTENSION pg_track_slow_queries UPDATE TO '1.1'" to load this file. \quit
+
+SET client_encoding = 'UTF8';
+
+-- The record gains start_datetime, so the function has to be recreated.
+DROP FUNCTION pg_track_slow_queries();
+
+CREATE FUNCTION pg_track_slow_queries(
+    OUT datetime TIMESTAMP WITH TIME ZONE,
+    OUT start_datetime TIMESTAMP WITH TIME ZONE,
+    OUT duration FLOAT,
+    OUT username VARCHAR(256),
+    OUT appname VARCHAR(256),
+    OUT dbname VARCHAR(256),
+    OUT temp_blks_written BIGINT,
+    OUT hitratio FLOAT,
+    OUT ntuples BIGINT,
+    OUT queryid BIGINT,
+    OUT query TEXT,
+    OUT plan JSON
+)
+RETURNS SETOF record
+LANGUAGE c COST 1000
+AS '$libdir/pg_track_slow_queries', 'pg_track_slow_queries';
+REVOKE ALL ON FUNCTION pg_track_slow_queries() FROM public;
+
+CREATE FUNCTION pg_track_slow_queries_columns(
+    IN columns TEXT[],
+    OUT datetime TIMESTAMP WITH TIME ZONE,
+    OUT start_datetime TIMESTAMP WITH TIME ZONE,
+    OUT duration FLOAT,
+    OUT username VARCHAR(256),
+    OUT appname VARCHAR(256),
+    OUT dbname VARCHAR(256),
+    OUT temp_blks_written BIGINT,
+    OUT hitratio FLOAT,
+    OUT ntuples BIGINT,
+    OUT queryid BIGINT,
+    OUT query TEXT,
+    OUT plan JSON
+)
+RETURNS SETOF record
+LANGUAGE c COST 1000
+AS '$libdir/pg_track_slow_queries', 'pg_track_slow_queries_columns';
+REVOKE ALL ON FUNCTION pg_track_slow_queries_columns(TEXT[]) FROM public;
+
+CREATE FUNCTION pg_track_slow_queries_search(
+    IN since TIMESTAMP WITH TIME ZONE DEFAULT NULL,
+    IN until TIMESTAMP WITH TIME ZONE DEFAULT NULL,
+    IN min_duration FLOAT DEFAULT NULL,
+    IN user_name TEXT DEFAULT NULL,
+    IN db_name TEXT DEFAULT NULL,
+    IN app_name TEXT DEFAULT NULL,
+    OUT datetime TIMESTAMP WITH TIME ZONE,
+    OUT start_datetime TIMESTAMP WITH TIME ZONE,
+    OUT duration FLOAT,
+    OUT username VARCHAR(256),
+    OUT appname VARCHAR(256),
+    OUT dbname VARCHAR(256),
+    OUT temp_blks_written BIGINT,
+    OUT hitratio FLOAT,
+    OUT ntuples BIGINT,
+    OUT queryid BIGINT,
+    OUT query TEXT,
+    OUT plan JSON
+)
+RETURNS SETOF record
+LANGUAGE c COST 1000
+AS '$libdir/pg_track_slow_queries', 'pg_track_slow_queries_search';
+REVOKE ALL ON FUNCTION pg_track_slow_queries_search(TIMESTAMP WITH TIME ZONE,
+    TIMESTAMP WITH TIME ZONE, FLOAT, TEXT, TEXT, TEXT) FROM public;
+
+CREATE FUNCTION pg_track_slow_queries_by_relation(
+    IN relation REGCLASS,
+    OUT datetime TIMESTAMP WITH TIME ZONE,
+    OUT start_datetime TIMESTAMP WITH TIME ZONE,
+    OUT duration FLOAT,
+    OUT username VARCHAR(256),
+    OUT appname VARCHAR(256),
+    OUT dbname VARCHAR(256),
+    OUT temp_blks_written BIGINT,
+    OUT hitratio FLOAT,
+    OUT ntuples BIGINT,
+    OUT queryid BIGINT,
+    OUT query TEXT,
+    OUT plan JSON
+)
+RETURNS SETOF record
+LANGUAGE c STRICT COST 1000
+AS '$libdir/pg_track_slow_queries', 'pg_track_slow_queries_by_relation';
+REVOKE ALL ON FUNCTION pg_track_slow_queries_by_relation(REGCLASS) FROM public;
+
+CREATE FUNCTION pg_track_slow_queries_latest(
+    IN n INTEGER,
+    OUT datetime TIMESTAMP WITH TIME ZONE,
+    OUT start_datetime TIMESTAMP WITH TIME ZONE,
+    OUT duration FLOAT,
+    OUT username VARCHAR(256),
+    OUT appname VARCHAR(256),
+    OUT dbname VARCHAR(256),
+    OUT temp_blks_written BIGINT,
+    OUT hitratio FLOAT,
+    OUT ntuples BIGINT,
+    OUT queryid BIGINT,
+    OUT query TEXT,
+    OUT plan JSON
+)
+RETURNS SETOF record
+LANGUAGE c STRICT COST 1000
+AS '$libdir/pg_track_slow_queries', 'pg_track_slow_queries_latest';
+REVOKE ALL ON FUNCTION pg_track_slow_queries_latest(INTEGER) FROM public;
+
+CREATE FUNCTION pg_track_slow_queries_top(
+    IN n INTEGER,
+    IN order_by TEXT DEFAULT 'duration',
+    IN since TIMESTAMP WITH TIME ZONE DEFAULT NULL,
+    IN until TIMESTAMP WITH TIME ZONE DEFAULT NULL,
+    IN min_duration FLOAT DEFAULT NULL,
+    IN user_name TEXT DEFAULT NULL,
+    IN db_name TEXT DEFAULT NULL,
+    IN app_name TEXT DEFAULT NULL,
+    OUT datetime TIMESTAMP WITH TIME ZONE,
+    OUT start_datetime TIMESTAMP WITH TIME ZONE,
+    OUT duration FLOAT,
+    OUT username VARCHAR(256),
+    OUT appname VARCHAR(256),
+    OUT dbname VARCHAR(256),
+    OUT temp_blks_written BIGINT,
+    OUT hitratio FLOAT,
+    OUT ntuples BIGINT,
+    OUT queryid BIGINT,
+    OUT query TEXT,
+    OUT plan JSON
+)
+RETURNS SETOF record
+LANGUAGE c COST 1000
+AS '$libdir/pg_track_slow_queries', 'pg_track_slow_queries_top';
+REVOKE ALL ON FUNCTION pg_track_slow_queries_top(INTEGER, TEXT,
+    TIMESTAMP WITH TIME ZONE, TIMESTAMP WITH TIME ZONE, FLOAT, TEXT, TEXT,
+    TEXT) FROM public;
+
+CREATE FUNCTION pg_track_slow_queries_fdw_handler()
+    RETURNS fdw_handler
+    LANGUAGE c STRICT
+    AS '$libdir/pg_track_slow_queries', 'pg_track_slow_queries_fdw_handler';
+REVOKE ALL ON FUNCTION pg_track_slow_queries_fdw_handler() FROM public;
+
+CREATE FOREIGN DATA WRAPPER pg_track_slow_queries_fdw
+    HANDLER pg_track_slow_queries_fdw_handler;
+
+CREATE SERVER pg_track_slow_queries_server
+    FOREIGN DATA WRAPPER pg_track_slow_queries_fdw;
+
+CREATE FOREIGN TABLE pg_track_slow_queries_entries (
+    datetime TIMESTAMP WITH TIME ZONE,
+    start_datetime TIMESTAMP WITH TIME ZONE,
+    duration FLOAT,
+    username VARCHAR(256),
+    appname VARCHAR(256),
+    dbname VARCHAR(256),
+    temp_blks_written BIGINT,
+    hitratio FLOAT,
+    ntuples BIGINT,
+    queryid BIGINT,
+    query TEXT,
+    plan JSON
+) SERVER pg_track_slow_queries_server;
+REVOKE ALL ON pg_track_slow_queries_entries FROM public;
+
+CREATE FUNCTION pg_track_slow_queries_stats(
+    OUT entries BIGINT,
+    OUT batches BIGINT,
+    OUT bytes BIGINT,
+    OUT wakeup_messages_max INTEGER,
+    OUT latency_avg FLOAT,
+    OUT latency_max FLOAT,
+    OUT latency_histogram BIGINT[],
+    OUT compress_time FLOAT,
+    OUT compress_time_max FLOAT,
+    OUT write_time FLOAT,
+    OUT write_time_max FLOAT,
+    OUT forward_dropped BIGINT,
+    OUT stats_reset TIMESTAMP WITH TIME ZONE
+)
+RETURNS SETOF record
+LANGUAGE c COST 1000
+AS '$libdir/pg_track_slow_queries', 'pg_track_slow_queries_stats';
+REVOKE ALL ON FUNCTION pg_track_slow_queries_stats() FROM public;
+
+CREATE FUNCTION pg_track_slow_queries_stats_reset()
+    RETURNS void
+    LANGUAGE c COST 1000
+    AS '$libdir/pg_track_slow_queries', 'pg_track_slow_queries_stats_reset';
+REVOKE ALL ON FUNCTION pg_track_slow_queries_stats_reset() FROM public;
+
+CREATE FUNCTION pg_track_slow_queries_overhead(
+    OUT phase TEXT,
+    OUT calls BIGINT,
+    OUT total_time FLOAT,
+    OUT max_time FLOAT,
+    OUT histogram BIGINT[]
+)
+RETURNS SETOF record
+LANGUAGE c COST 1000
+AS '$libdir/pg_track_slow_queries', 'pg_track_slow_queries_overhead';
+REVOKE ALL ON FUNCTION pg_track_slow_queries_overhead() FROM public;
+
+CREATE FUNCTION pg_track_slow_queries_plan_changes(
+    IN regressions_only BOOLEAN DEFAULT false,
+    OUT queryid BIGINT,
+    OUT dbname TEXT,
+    OUT query TEXT,
+    OUT planid BIGINT,
+    OUT previous_planid BIGINT,
+    OUT first_seen TIMESTAMP WITH TIME ZONE,
+    OUT last_seen TIMESTAMP WITH TIME ZONE,
+    OUT calls BIGINT,
+    OUT median_duration FLOAT,
+    OUT mean_duration FLOAT,
+    OUT max_duration FLOAT,
+    OUT regressed_at TIMESTAMP WITH TIME ZONE,
+    OUT regression_ratio FLOAT
+)
+RETURNS SETOF record
+LANGUAGE c STRICT COST 1000
+AS '$libdir/pg_track_slow_queries', 'pg_track_slow_queries_plan_changes';
+REVOKE ALL ON FUNCTION pg_track_slow_queries_plan_changes(BOOLEAN) FROM public;
+
+CREATE FUNCTION pg_track_slow_queries_stress(
+    IN processes INTEGER DEFAULT 8,
+    IN rate INTEGER DEFAULT 100,
+    IN duration INTEGER DEFAULT 10,
+    IN entry_size INTEGER DEFAULT 1024,
+    OUT sent BIGINT,
+    OUT send_failures BIGINT,
+    OUT stored BIGINT,
+    OUT loss_rate FLOAT,
+    OUT collector_cpu FLOAT,
+    OUT latency_avg FLOAT,
+    OUT latency_p99 FLOAT,
+    OUT elapsed FLOAT
+)
+RETURNS SETOF record
+LANGUAGE c STRICT COST 1000
+AS '$libdir/pg_track_slow_queries', 'pg_track_slow_queries_stress';
+REVOKE ALL ON FUNCTION pg_track_slow_queries_stress(INTEGER, INTEGER, INTEGER, INTEGER) FROM public;
+
+CREATE FUNCTION pg_track_slow_queries_import(
+    IN path TEXT,
+    IN node_name TEXT
+)
+RETURNS BIGINT
+LANGUAGE c STRICT COST 1000
+AS '$libdir/pg_track_slow_queries', 'pg_track_slow_queries_import';
+REVOKE ALL ON FUNCTION pg_track_slow_queries_import(TEXT, TEXT) FROM public;
+
+CREATE FUNCTION pg_track_slow_queries_merged(
+    OUT node TEXT,
+    OUT datetime TIMESTAMP WITH TIME ZONE,
+    OUT start_datetime TIMESTAMP WITH TIME ZONE,
+    OUT duration FLOAT,
+    OUT username VARCHAR(256),
+    OUT appname VARCHAR(256),
+    OUT dbname VARCHAR(256),
+    OUT temp_blks_written BIGINT,
+    OUT hitratio FLOAT,
+    OUT ntuples BIGINT,
+    OUT queryid BIGINT,
+    OUT query TEXT,
+    OUT plan JSON
+)
+RETURNS SETOF record
+LANGUAGE c COST 1000
+AS '$libdir/pg_track_slow_queries', 'pg_track_slow_queries_merged';
+REVOKE ALL ON FUNCTION pg_track_slow_queries_merged() FROM public;
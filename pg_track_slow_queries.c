@@ -27,6 +27,8 @@
 #include "funcapi.h"
 #include "miscadmin.h"
 #include "pgstat.h"
+#include "access/xact.h"
+#include "catalog/pg_type.h"
 #include "commands/dbcommands.h"
 #include "commands/explain.h"
 
@@ -43,11 +45,14 @@
 #include "common/pg_lzcompress.h"
 #include "executor/executor.h"
 #include "lib/stringinfo.h"
+#include "port/atomics.h"
 #include "postmaster/bgworker.h"
 #include "storage/ipc.h"
 #include "storage/proc.h"
 #include "storage/shmem.h"
+#include "storage/spin.h"
 #include "storage/fd.h"
+#include "utils/array.h"
 #include "utils/builtins.h"
 #include "utils/guc.h"
 #include "fmgr.h"
@@ -60,9 +65,17 @@ PG_MODULE_MAGIC;
 void _PG_init(void);
 void _PG_fini(void);
 
-static void pg_track_slow_queries_internal(FunctionCallInfo fcinfo);
+static void pg_track_slow_queries_internal(FunctionCallInfo fcinfo, const bool * wanted,
+										   TSQBlockFilter * filter);
+static void pgtsq_put_entry(Tuplestorestate * tupstore, TupleDesc tupdesc,
+							TSQEntry * tsqe, const bool * wanted);
 PGDLLEXPORT Datum pg_track_slow_queries_reset(PG_FUNCTION_ARGS);
 PGDLLEXPORT Datum pg_track_slow_queries(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum pg_track_slow_queries_columns(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum pg_track_slow_queries_search(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum pg_track_slow_queries_by_relation(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum pg_track_slow_queries_latest(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum pg_track_slow_queries_top(PG_FUNCTION_ARGS);
 static void pgtsq_ExecutorEnd(QueryDesc *queryDesc);
 static void pgtsq_ExecutorStart(QueryDesc *queryDesc, int eflags);
 #if (PG_VERSION_NUM >= 100000)
@@ -80,6 +93,7 @@ static void pgtsq_ExecutorRun(QueryDesc *queryDesc,
 #endif
 static void pgtsq_ExecutorFinish(QueryDesc *queryDesc);
 static void pgtsq_shmem_startup(void);
+static Size pgtsq_memsize(void);
 static int pgtsq_init_socket(void);
 
 /* GUC variable */
@@ -87,9 +101,32 @@ static int tsq_log_min_duration = -1;	/* ms (>=0) or -1 (disabled) */
 static bool tsq_compression = true; 	/* enable row compression */
 static int tsq_max_file_size_kb = -1;	/* storage file max size in kB */
 static bool tsq_log_plan = true;    	/* enable row compression */
+static int tsq_plan_format = TSQ_PLAN_FORMAT_JSON;	/* captured plan format */
 /* Enables timers, rows and buffers instrumentalization options when query
  * total cost is greater than this value. -1 means the feature is disabled */
 static int tsq_cost_analyze = -1;
+/* Fraction of captures whose own overhead is measured, 0 disables it */
+static double tsq_overhead_sample_rate = 0.0;
+/* Aggregator to forward rows to, as host:port, empty if disabled */
+static char *tsq_forward_to = NULL;
+/* Forward spool max size in kB */
+static int tsq_forward_spool_size_kb = 1024 * 1024;
+/* Database of the sink table, empty if disabled */
+static char *tsq_sink_database = NULL;
+/* Sink table, possibly schema-qualified */
+static char *tsq_sink_table = NULL;
+/* Days sink partitions are kept, -1 to keep them all */
+static int tsq_sink_retention = 30;
+/* Maximum number of queries whose plan changes are tracked */
+static int tsq_track_plans = 1000;
+/* Ratio of median durations beyond which a new plan is a regression */
+static double tsq_plan_regression_ratio = 2.0;
+
+static const struct config_enum_entry plan_format_options[] = {
+	{"json", TSQ_PLAN_FORMAT_JSON, false},
+	{"binary", TSQ_PLAN_FORMAT_BINARY, false},
+	{NULL, 0, false}
+};
 
 /* Saved hook values in case of unload */
 static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
@@ -101,6 +138,49 @@ static ExecutorFinish_hook_type prev_ExecutorFinish = NULL;
 /* Current nesting depth of ExecutorRun calls */
 static int nesting_level = 0;
 
+/*
+ * Top-level executions tracked until ExecutorEnd. A cursor can keep one open
+ * while other queries run, hence the few slots. Slots of executions aborted
+ * by an error are released when their (sub)transaction aborts.
+ */
+#define TSQ_QUERY_SLOTS		8
+
+typedef struct TSQQuerySlot {
+	QueryDesc	*queryDesc;		/* NULL if the slot is free */
+	TimestampTz	start_time;		/* ExecutorStart timestamp */
+	instr_time	total;			/* Time spent in ExecutorRun and ExecutorFinish */
+	BufferUsage	bufusage;		/* pgBufferUsage at ExecutorStart */
+	uint64		ntuples;		/* Rows processed by all its ExecutorRun calls */
+	SubTransactionId subxid;	/* Subtransaction it started in */
+} TSQQuerySlot;
+
+static TSQQuerySlot query_slots[TSQ_QUERY_SLOTS];
+static int query_slots_used = 0;
+static int query_slots_next = 0;
+
+/* Entries still to return by pg_track_slow_queries_latest() */
+typedef struct TSQLatestState {
+	Tuplestorestate *tupstore;
+	TupleDesc	tupdesc;
+	const bool	*wanted;
+	int64		remaining;
+	bool		failed;
+} TSQLatestState;
+
+/* Entry ranked by pg_track_slow_queries_top() */
+typedef struct TSQTopCandidate {
+	double		value;			/* Value of the column ranked by */
+	int			seq;			/* Order of its segment in the storage */
+	uint32		segno;
+	off_t		offset;			/* Offset of its row in the segment */
+	TSQEntry	*tsqe;			/* Whole entry, once read again */
+} TSQTopCandidate;
+
+/* Decides whether the overhead of the current capture has to be measured */
+#define tsq_overhead_sampled() \
+	(tsq_overhead_sample_rate > 0 && \
+	 random() < tsq_overhead_sample_rate * MAX_RANDOM_VALUE)
+
 /* Link to shared memory state */
 TSQSharedState * pgtsqss = NULL;
 
@@ -108,15 +188,161 @@ static struct sockaddr_storage pgStatAddr;
 
 PG_FUNCTION_INFO_V1(pg_track_slow_queries_reset);
 PG_FUNCTION_INFO_V1(pg_track_slow_queries);
+PG_FUNCTION_INFO_V1(pg_track_slow_queries_columns);
+PG_FUNCTION_INFO_V1(pg_track_slow_queries_search);
+PG_FUNCTION_INFO_V1(pg_track_slow_queries_by_relation);
+PG_FUNCTION_INFO_V1(pg_track_slow_queries_latest);
+PG_FUNCTION_INFO_V1(pg_track_slow_queries_top);
+
+/* Names of the columns of pg_track_slow_queries() */
+const char *const tsq_columns[TSQ_COLS] = {
+	"datetime", "start_datetime", "duration", "username", "appname", "dbname",
+	"temp_blks_written", "hitratio", "ntuples", "queryid", "query", "plan"
+};
+
+/* Columns pg_track_slow_queries_top() can rank entries by */
+static const bool tsq_rank_columns[TSQ_COLS] = {
+	true, true, true, false, false, false, true, true, true, false, false, false
+};
+
+/*
+ * Adds the time elapsed since *start to *ms, then moves *start to now
+ */
+static void
+pgtsq_phase_done(instr_time * start, double * ms)
+{
+	instr_time	now;
+	instr_time	duration;
+
+	INSTR_TIME_SET_CURRENT(now);
+	duration = now;
+	INSTR_TIME_SUBTRACT(duration, *start);
+	*ms = INSTR_TIME_GET_MILLISEC(duration);
+	*start = now;
+}
+
+/*
+ * Returns the slot tracking the execution of queryDesc, NULL if none
+ */
+static TSQQuerySlot *
+pgtsq_find_slot(QueryDesc *queryDesc)
+{
+	int		i;
+
+	if (query_slots_used == 0)
+		return NULL;
+	for (i = 0; i < TSQ_QUERY_SLOTS; i++)
+	{
+		if (query_slots[i].queryDesc == queryDesc)
+			return &query_slots[i];
+	}
+	return NULL;
+}
+
+/*
+ * Starts tracking the execution of queryDesc. A slot left by a previous
+ * execution of the same QueryDesc address is taken over, otherwise a free
+ * one, otherwise the next one in turn.
+ */
+static void
+pgtsq_start_slot(QueryDesc *queryDesc)
+{
+	TSQQuerySlot *slot = pgtsq_find_slot(queryDesc);
+	int		i;
+
+	for (i = 0; slot == NULL && i < TSQ_QUERY_SLOTS; i++)
+	{
+		if (query_slots[i].queryDesc == NULL)
+		{
+			slot = &query_slots[i];
+			query_slots_used++;
+		}
+	}
+	if (slot == NULL)
+	{
+		slot = &query_slots[query_slots_next];
+		query_slots_next = (query_slots_next + 1) % TSQ_QUERY_SLOTS;
+	}
+
+	slot->queryDesc = queryDesc;
+	slot->start_time = GetCurrentTimestamp();
+	INSTR_TIME_SET_ZERO(slot->total);
+	slot->bufusage = pgBufferUsage;
+	slot->ntuples = 0;
+	slot->subxid = GetCurrentSubTransactionId();
+}
+
+/*
+ * Releases a slot
+ */
+static void
+pgtsq_release_slot(TSQQuerySlot *slot)
+{
+	slot->queryDesc = NULL;
+	query_slots_used--;
+}
+
+/*
+ * Releases the slots of the executions started in subtransaction subxid or
+ * in its children, which have greater identifiers
+ */
+static void
+pgtsq_release_slots(SubTransactionId subxid)
+{
+	for (int i = 0; i < TSQ_QUERY_SLOTS; i++)
+	{
+		if (query_slots[i].queryDesc != NULL && query_slots[i].subxid >= subxid)
+			pgtsq_release_slot(&query_slots[i]);
+	}
+}
 
 /*
- * ExecutorStart Hook function that only starts query timing
- * instrumentalization if the feature is enabled.
+ * Transaction callback: executions aborted by an error never reach
+ * ExecutorEnd, their QueryDesc address could be reused by another one
+ */
+static void
+pgtsq_xact_callback(XactEvent event, void *arg)
+{
+	if (event == XACT_EVENT_ABORT || event == XACT_EVENT_PARALLEL_ABORT)
+		pgtsq_release_slots(TopSubTransactionId);
+}
+
+/*
+ * Subtransaction callback, same as pgtsq_xact_callback()
+ */
+static void
+pgtsq_subxact_callback(SubXactEvent event, SubTransactionId mySubid,
+					   SubTransactionId parentSubid, void *arg)
+{
+	if (event == SUBXACT_EVENT_ABORT_SUB)
+		pgtsq_release_slots(mySubid);
+}
+
+/*
+ * Adds the time elapsed since start to the execution time of a slot
+ */
+static void
+pgtsq_slot_accum(TSQQuerySlot *slot, instr_time start)
+{
+	instr_time	now;
+
+	INSTR_TIME_SET_CURRENT(now);
+	INSTR_TIME_ACCUM_DIFF(slot->total, now, start);
+}
+
+/*
+ * ExecutorStart Hook function that only records the start of top-level
+ * queries if the feature is enabled. Nothing else is done until the query
+ * is known to be slow: the buffer usage is obtained by diffing the global
+ * counters in ExecutorEnd.
  */
 static void
 pgtsq_ExecutorStart(QueryDesc *queryDesc, int eflags)
 {
 	Cost total_cost;
+	bool		sampled;
+	instr_time	phase_start;
+
 	/* Enables timers, rows and buffers instrumentalization options if query
 	 * total cost exceeds tsq_cost_analyze. */
 	total_cost = queryDesc->plannedstmt->planTree->total_cost;
@@ -133,14 +359,18 @@ pgtsq_ExecutorStart(QueryDesc *queryDesc, int eflags)
 	else
 		standard_ExecutorStart(queryDesc, eflags);
 
-	if (tsq_enabled() && queryDesc->totaltime == NULL && nesting_level == 0)
+	if (tsq_enabled() && nesting_level == 0)
 	{
-		MemoryContext oldcxt;
-		/* Move to query memory context */
-		oldcxt = MemoryContextSwitchTo(queryDesc->estate->es_query_cxt);
-		queryDesc->totaltime = InstrAlloc(1, INSTRUMENT_ALL);
-		/* Back to previous mem. context */
-		MemoryContextSwitchTo(oldcxt);
+		if ((sampled = tsq_overhead_sampled()))
+			INSTR_TIME_SET_CURRENT(phase_start);
+		pgtsq_start_slot(queryDesc);
+		if (sampled)
+		{
+			double	phases[TSQ_PHASES];
+
+			pgtsq_phase_done(&phase_start, &phases[TSQ_PHASE_START]);
+			pgtsq_report_overhead(phases, 1 << TSQ_PHASE_START);
+		}
 	}
 }
 
@@ -151,21 +381,56 @@ pgtsq_ExecutorStart(QueryDesc *queryDesc, int eflags)
 static void
 pgtsq_ExecutorEnd(QueryDesc *queryDesc)
 {
-	if (tsq_enabled() && queryDesc->totaltime)
+	TSQQuerySlot	*slot = NULL;
+	double			duration = 0;
+	TimestampTz		start_time = 0;
+	uint64			ntuples = 0;
+	BufferUsage		bu;
+#ifdef TSQ_USE_PROBES
+	instr_time		probe_start;
+
+	INSTR_TIME_SET_CURRENT(probe_start);
+#endif
+
+	TSQ_PROBE0(capture__start);
+
+	memset(&bu, 0, sizeof(BufferUsage));
+
+	/* Nested executions are not tracked, see pgtsq_ExecutorStart() */
+	if (nesting_level == 0 && (slot = pgtsq_find_slot(queryDesc)) != NULL)
 	{
-		/* End query timing instrumentalization */
-		InstrEndLoop(queryDesc->totaltime);
+		duration = INSTR_TIME_GET_MILLISEC(slot->total);
+		start_time = slot->start_time;
+		ntuples = slot->ntuples;
+		/* Buffers used since ExecutorStart, only needed for slow queries */
+		if (duration > tsq_log_min_duration)
+		{
+			bu.shared_blks_hit = pgBufferUsage.shared_blks_hit - slot->bufusage.shared_blks_hit;
+			bu.shared_blks_read = pgBufferUsage.shared_blks_read - slot->bufusage.shared_blks_read;
+			bu.local_blks_hit = pgBufferUsage.local_blks_hit - slot->bufusage.local_blks_hit;
+			bu.local_blks_read = pgBufferUsage.local_blks_read - slot->bufusage.local_blks_read;
+			bu.temp_blks_written = pgBufferUsage.temp_blks_written - slot->bufusage.temp_blks_written;
+		}
+		pgtsq_release_slot(slot);
 	}
-	if (tsq_enabled() && queryDesc->totaltime &&
-		(queryDesc->totaltime->total * 1000.0) > tsq_log_min_duration)
+	if (tsq_enabled() && slot != NULL && duration > tsq_log_min_duration)
 	{
 		ExplainState	*es = NULL;
 		TSQEntry		*tsqe = NULL;
-		BufferUsage		bu = queryDesc->totaltime->bufusage;
 		StringInfo		tsqe_s;
-		ssize_t			sent;
+		TSQMsgHeader	header;
 		MemoryContext	tmpcontext;
 		MemoryContext	oldcontext;
+		bool			sampled;
+		instr_time		phase_start;
+		double			phases[TSQ_PHASES];
+		int				phase_mask = 0;
+#ifdef TSQ_USE_PROBES
+		instr_time		probe_phase;
+#endif
+
+		if ((sampled = tsq_overhead_sampled()))
+			INSTR_TIME_SET_CURRENT(phase_start);
 
 		tmpcontext = AllocSetContextCreate(CurrentMemoryContext,
 						"PGTSQExecutorEnd", ALLOCSET_START_SMALL_SIZES);
@@ -186,10 +451,14 @@ pgtsq_ExecutorEnd(QueryDesc *queryDesc)
 			tsqe->appname = "unknown";
 		else
 			tsqe->appname = application_name;
-		/* Get current timestamp as query's end of execution datetime */
-		tsqe->datetime = pstrdup(timestamptz_to_str(GetCurrentTimestamp()));
+		/* Get current timestamp as query's end of execution time */
+		memset(&header, 0, sizeof(TSQMsgHeader));
+		header.captured = GetCurrentTimestamp();
+		header.duration = duration;
+		tsqe->end_time = header.captured;
 		/* Duration time in ms */
-		tsqe->duration = queryDesc->totaltime->total * 1000.0;
+		tsqe->duration = duration;
+		tsqe->start_time = start_time;
 		tsqe->querytxt = pstrdup(queryDesc->sourceText);
 		tsqe->temp_blks_written = bu.temp_blks_written;
 		/* Shared buffers hit ratio */
@@ -201,9 +470,37 @@ pgtsq_ExecutorEnd(QueryDesc *queryDesc)
 									   bu.shared_blks_read + bu.local_blks_read)) * 100;
 		} else
 			tsqe->hitratio = 100.0;
-		tsqe->ntuples = (uint64) queryDesc->totaltime->ntuples;
+		/* Rows of every fetch, a cursor runs the executor once per FETCH */
+		tsqe->ntuples = ntuples;
+		header.queryid = tsqe->queryid = pgtsq_identify_query(queryDesc);
+		/* Tables and indexes used, for pg_track_slow_queries_by_relation() */
+		pgtsq_plan_relations(queryDesc, &tsqe->relids, &tsqe->nrelids);
+		/* Plan fingerprint, for pg_track_slow_queries_plan_changes() */
+		if (tsq_track_plans > 0)
+			pgtsq_identify_plan(queryDesc, &header);
+
+		if (sampled)
+		{
+			pgtsq_phase_done(&phase_start, &phases[TSQ_PHASE_METADATA]);
+			phase_mask |= 1 << TSQ_PHASE_METADATA;
+		}
 
-		if (tsq_log_plan_enabled())
+		if (tsq_log_plan_enabled() && tsq_plan_format == TSQ_PLAN_FORMAT_BINARY)
+		{
+			/* Binary snapshot, rendered when read */
+			StringInfo	plan = makeStringInfo();
+
+			pgtsq_encode_plan(queryDesc, plan);
+			tsqe->plantxt = plan->data;
+			tsqe->planlen = plan->len;
+
+			if (sampled)
+			{
+				pgtsq_phase_done(&phase_start, &phases[TSQ_PHASE_EXPLAIN]);
+				phase_mask |= 1 << TSQ_PHASE_EXPLAIN;
+			}
+		}
+		else if (tsq_log_plan_enabled())
 		{
 			es = NewExplainState();
 			/* Get Execution Plan as JSON */
@@ -225,36 +522,75 @@ pgtsq_ExecutorEnd(QueryDesc *queryDesc)
 			es->str->data[0] = '{';
 			es->str->data[es->str->len - 1] = '}';
 			tsqe->plantxt = es->str->data;
+
+			if (sampled)
+			{
+				pgtsq_phase_done(&phase_start, &phases[TSQ_PHASE_EXPLAIN]);
+				phase_mask |= 1 << TSQ_PHASE_EXPLAIN;
+			}
 		} else
 			tsqe->plantxt = "\0";
 
 		/* Data serialization */
+#ifdef TSQ_USE_PROBES
+		INSTR_TIME_SET_CURRENT(probe_phase);
+#endif
 		tsqe_s = pgtsq_serialize_entry(tsqe);
+		TSQ_PROBE2(serialize__done, tsqe_s->len,
+				   pgtsq_probe_elapsed_us(probe_phase));
+
+		if (sampled)
+		{
+			pgtsq_phase_done(&phase_start, &phases[TSQ_PHASE_SERIALIZE]);
+			phase_mask |= 1 << TSQ_PHASE_SERIALIZE;
+		}
 
 		if (pgtsqss->socket != PGINVALID_SOCKET && tsqe_s->len < 65000)
 		{
 			/* If row length is lower to 65kiB (UDP datagram max size) then we try to
 			 * send it to the collector */
-			sent = send(pgtsqss->socket, tsqe_s->data, tsqe_s->len, 0);
-			if (sent != tsqe_s->len)
+			if (!pgtsq_send_row(&header, tsqe_s->data, tsqe_s->len))
 			{
 				ereport(LOG,
 						(errmsg("pg_track_slow_queries: could not send data to the collector")));
 			}
+			if (sampled)
+			{
+				pgtsq_phase_done(&phase_start, &phases[TSQ_PHASE_TRANSPORT]);
+				phase_mask |= 1 << TSQ_PHASE_TRANSPORT;
+			}
 		} else {
+			TSQStoreStats	stats;
+
 			/* Row storage is done by the backend itself */
-			if (pgtsq_store_row(tsqe_s->data, tsqe_s->len, tsq_compression_enabled(),
-					tsq_max_file_size_kb) == -1)
+			if (pgtsq_store_rows(&tsqe_s->data, &tsqe_s->len, 1,
+					tsq_compression_enabled(), tsq_max_file_size_kb, &stats) != 1)
 			{
 				ereport(LOG,
 						(errmsg("pg_track_slow_queries: could not store data")));
 			}
+			else if (sampled)
+			{
+				/* Compression is done by the storage function itself */
+				phases[TSQ_PHASE_COMPRESS] = stats.compress_time;
+				phases[TSQ_PHASE_TRANSPORT] = stats.write_time;
+				phase_mask |= (1 << TSQ_PHASE_COMPRESS) | (1 << TSQ_PHASE_TRANSPORT);
+			}
+			/* The collector won't see this entry */
+			pgtsq_track_plans(&header, &tsqe_s->data, 1, tsq_plan_regression_ratio);
 		}
+
+		if (sampled)
+			pgtsq_report_overhead(phases, phase_mask);
+
 		MemoryContextSwitchTo(oldcontext);
 		MemoryContextDelete(tmpcontext);
 	}
 
 end:
+	TSQ_PROBE2(capture__done, (uint64) (duration * 1000.0),
+			   pgtsq_probe_elapsed_us(probe_start));
+
 	if (prev_ExecutorEnd)
 		prev_ExecutorEnd(queryDesc);
 	else
@@ -262,7 +598,8 @@ end:
 }
 
 /*
- * ExecutorRun hook: all we need do is track nesting depth
+ * ExecutorRun hook: tracks nesting depth and the execution time of top-level
+ * queries
  */
 static void
 #if (PG_VERSION_NUM >= 100000)
@@ -276,6 +613,12 @@ pgtsq_ExecutorRun(QueryDesc *queryDesc, ScanDirection direction,
 				  int64 count)
 #endif
 {
+	TSQQuerySlot *slot = nesting_level == 0 ? pgtsq_find_slot(queryDesc) : NULL;
+	instr_time	start;
+
+	if (slot)
+		INSTR_TIME_SET_CURRENT(start);
+
 	nesting_level++;
 	PG_TRY();
 	{
@@ -299,14 +642,28 @@ pgtsq_ExecutorRun(QueryDesc *queryDesc, ScanDirection direction,
 		PG_RE_THROW();
 	}
 	PG_END_TRY();
+
+	if (slot)
+	{
+		pgtsq_slot_accum(slot, start);
+		/* es_processed only counts the rows of this run */
+		slot->ntuples += (uint64) queryDesc->estate->es_processed;
+	}
 }
 
 /*
- * ExecutorFinish hook: all we need do is track nesting depth
+ * ExecutorFinish hook: tracks nesting depth and the execution time of
+ * top-level queries
  */
 static void
 pgtsq_ExecutorFinish(QueryDesc *queryDesc)
 {
+	TSQQuerySlot *slot = nesting_level == 0 ? pgtsq_find_slot(queryDesc) : NULL;
+	instr_time	start;
+
+	if (slot)
+		INSTR_TIME_SET_CURRENT(start);
+
 	nesting_level++;
 	PG_TRY();
 	{
@@ -322,6 +679,9 @@ pgtsq_ExecutorFinish(QueryDesc *queryDesc)
 		PG_RE_THROW();
 	}
 	PG_END_TRY();
+
+	if (slot)
+		pgtsq_slot_accum(slot, start);
 }
 
 /*
@@ -343,7 +703,7 @@ pgtsq_shmem_startup(void)
 
 	/* Storage file access lock */
 	pgtsqss = ShmemInitStruct("pg_track_slow_queries",
-							  sizeof(TSQSharedState),
+							  pgtsq_memsize(),
 							  &found);
 
 	if (!found)
@@ -355,13 +715,38 @@ pgtsq_shmem_startup(void)
 #endif
 		/* Init socket for backends to collector IPC */
 		pgtsqss->socket = pgtsq_init_socket();
+		/* Find out where writers have to resume */
+		pg_atomic_init_u64(&pgtsqss->committed, 0);
+		pgtsq_init_storage();
+		pgtsq_init_stats();
+		pgtsq_init_stress();
+		pgtsqss->collector_pid = 0;
+		pg_atomic_init_u32(&pgtsqss->importing, 0);
+#if (PG_VERSION_NUM >= 90600)
+		pgtsqss->plans_lock = &(GetNamedLWLockTranche("pg_track_slow_queries"))[1].lock;
+#else
+		pgtsqss->plans_lock = LWLockAssign();
+#endif
 	}
 
+	/* Plans tracked, attached to by each process */
+	pgtsq_init_plan_changes(tsq_track_plans);
+
 	LWLockRelease(AddinShmemInitLock);
 
 	ereport(LOG, (errmsg("pg_track_slow_queries: extension loaded")));
 }
 
+/*
+ * Estimate shared memory space needed
+ */
+static Size
+pgtsq_memsize(void)
+{
+	return add_size(MAXALIGN(sizeof(TSQSharedState)),
+					pgtsq_plan_changes_memsize(tsq_track_plans));
+}
+
 /*
  * Extension init function
  */
@@ -424,6 +809,31 @@ _PG_init(void)
 							NULL,
 							NULL);
 
+	DefineCustomEnumVariable("pg_track_slow_queries.plan_format",
+							"Sets the format execution plans are captured in.",
+							"binary captures a snapshot of the plan tree, " \
+							"rendered as JSON when read.",
+							&tsq_plan_format,
+							TSQ_PLAN_FORMAT_JSON,
+							plan_format_options,
+							PGC_SUSET,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomRealVariable("pg_track_slow_queries.overhead_sample_rate",
+							"Fraction of captures whose own overhead is measured.",
+							"0 turns this feature off.",
+							&tsq_overhead_sample_rate,
+							0.0,
+							0.0, 1.0,
+							PGC_SUSET,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
 	DefineCustomIntVariable("pg_track_slow_queries.cost_analyze",
 							"Enables query execution analyzing when " \
 							"estimated total cost exceeds this value.",
@@ -437,18 +847,101 @@ _PG_init(void)
 							NULL,
 							NULL);
 
+	DefineCustomStringVariable("pg_track_slow_queries.forward_to",
+							"Sets the aggregator rows are forwarded to, as host:port.",
+							"An empty string turns this feature off.",
+							&tsq_forward_to,
+							"",
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_track_slow_queries.forward_spool_size",
+							"Sets the maximum size of the rows waiting to be forwarded.",
+							"-1 turns this feature off.",
+							&tsq_forward_spool_size_kb,
+							1024 * 1024,
+							-1, MAX_KILOBYTES,
+							PGC_SIGHUP,
+							GUC_UNIT_KB,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomStringVariable("pg_track_slow_queries.sink_database",
+							"Sets the database entries are copied to, in the sink table.",
+							"An empty string turns this feature off.",
+							&tsq_sink_database,
+							"",
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomStringVariable("pg_track_slow_queries.sink_table",
+							"Sets the table entries are copied to, partitioned by day.",
+							NULL,
+							&tsq_sink_table,
+							"pg_track_slow_queries_history",
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_track_slow_queries.sink_retention",
+							"Sets the number of days the sink table partitions are kept.",
+							"-1 turns this feature off.",
+							&tsq_sink_retention,
+							30,
+							-1, INT_MAX,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_track_slow_queries.track_plans",
+							"Sets the maximum number of queries whose plan changes are tracked.",
+							"0 turns this feature off.",
+							&tsq_track_plans,
+							1000,
+							0, INT_MAX / 2,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomRealVariable("pg_track_slow_queries.plan_regression_ratio",
+							"Sets the ratio of median durations beyond which a new plan " \
+							"of a query is a regression.",
+							NULL,
+							&tsq_plan_regression_ratio,
+							2.0,
+							1.0, 1000000.0,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
 
 	EmitWarningsOnPlaceholders("pg_track_slow_queries");
 
+	RequestAddinShmemSpace(pgtsq_memsize());
 #if (PG_VERSION_NUM >= 90600)
-	RequestNamedLWLockTranche("pg_track_slow_queries", 1);
+	RequestNamedLWLockTranche("pg_track_slow_queries", 2);
 #else
-	RequestAddinLWLocks(1);
+	RequestAddinLWLocks(2);
 #endif
 
 	/* Register background worker */
 	memset(&worker, 0, sizeof(worker));
-	worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+	worker.bgw_start_time = BgWorkerStart_ConsistentState;
 	worker.bgw_restart_time = -1;
 	worker.bgw_flags = BGWORKER_SHMEM_ACCESS;
 #if (PG_VERSION_NUM >= 100000)
@@ -465,6 +958,10 @@ _PG_init(void)
 	worker.bgw_main_arg = (Datum) 0;
 	RegisterBackgroundWorker(&worker);
 
+	/* Table sink worker, if enabled */
+	if (tsq_sink_database && *tsq_sink_database)
+		pgtsq_register_sink();
+
 	/* Install hooks. */
 	prev_shmem_startup_hook = shmem_startup_hook;
 	shmem_startup_hook = pgtsq_shmem_startup;
@@ -476,6 +973,8 @@ _PG_init(void)
 	ExecutorFinish_hook = pgtsq_ExecutorFinish;
 	prev_ExecutorEnd = ExecutorEnd_hook;
 	ExecutorEnd_hook = pgtsq_ExecutorEnd;
+	RegisterXactCallback(pgtsq_xact_callback, NULL);
+	RegisterSubXactCallback(pgtsq_subxact_callback, NULL);
 }
 
 void
@@ -487,6 +986,8 @@ _PG_fini(void)
 	ExecutorRun_hook = prev_ExecutorRun;
 	ExecutorFinish_hook = prev_ExecutorFinish;
 	ExecutorEnd_hook = prev_ExecutorEnd;
+	UnregisterXactCallback(pgtsq_xact_callback, NULL);
+	UnregisterSubXactCallback(pgtsq_subxact_callback, NULL);
 }
 
 PGDLLEXPORT Datum
@@ -497,40 +998,616 @@ pg_track_slow_queries_reset(PG_FUNCTION_ARGS)
 				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
 				 errmsg("pg_track_slow_queries: must be loaded via shared_preload_libraries")));
 
-	pgtsq_truncate_file();
+	pgtsq_switch_segment();
 	PG_RETURN_VOID();
 }
 
 PGDLLEXPORT Datum
 pg_track_slow_queries(PG_FUNCTION_ARGS)
 {
+	bool		wanted[TSQ_COLS];
+
+	if (!pgtsqss)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pg_track_slow_queries: must be loaded via shared_preload_libraries")));
+
+	memset(wanted, true, sizeof(wanted));
+	pg_track_slow_queries_internal(fcinfo, wanted, NULL);
+	return (Datum) 0;
+}
+
+/*
+ * Same as pg_track_slow_queries(), but only returns the given columns, the
+ * others are NULL. The query and plan of entries are only decompressed when
+ * requested.
+ */
+PGDLLEXPORT Datum
+pg_track_slow_queries_columns(PG_FUNCTION_ARGS)
+{
+	bool		wanted[TSQ_COLS];
+	Datum		*elems;
+	bool		*elemnulls;
+	int			nelems;
+
+	if (!pgtsqss)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pg_track_slow_queries: must be loaded via shared_preload_libraries")));
+
+	memset(wanted, false, sizeof(wanted));
+	deconstruct_array(PG_GETARG_ARRAYTYPE_P(0), TEXTOID, -1, false, 'i',
+					  &elems, &elemnulls, &nelems);
+	for (int i = 0; i < nelems; i++)
+	{
+		char	*name;
+		int		c;
+
+		if (elemnulls[i])
+			continue;
+		name = TextDatumGetCString(elems[i]);
+		for (c = 0; c < TSQ_COLS; c++)
+			if (strcmp(name, tsq_columns[c]) == 0)
+				break;
+		if (c == TSQ_COLS)
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("pg_track_slow_queries: unknown column \"%s\"", name)));
+		wanted[c] = true;
+	}
+
+	pg_track_slow_queries_internal(fcinfo, wanted, NULL);
+	return (Datum) 0;
+}
+
+/*
+ * Sets a filter from the since, until, min_duration, user_name, db_name and
+ * app_name arguments of a function, the first of which is argument arg
+ */
+static void
+pgtsq_get_filter_args(FunctionCallInfo fcinfo, int arg, TSQBlockFilter * filter)
+{
+	memset(filter, 0, sizeof(TSQBlockFilter));
+	if ((filter->has_since = !PG_ARGISNULL(arg)))
+		filter->since = PG_GETARG_TIMESTAMPTZ(arg);
+	if ((filter->has_until = !PG_ARGISNULL(arg + 1)))
+		filter->until = PG_GETARG_TIMESTAMPTZ(arg + 1);
+	filter->min_duration = PG_ARGISNULL(arg + 2) ? -1 : PG_GETARG_FLOAT8(arg + 2);
+	if (!PG_ARGISNULL(arg + 3))
+		filter->username = text_to_cstring(PG_GETARG_TEXT_PP(arg + 3));
+	if (!PG_ARGISNULL(arg + 4))
+		filter->dbname = text_to_cstring(PG_GETARG_TEXT_PP(arg + 4));
+	if (!PG_ARGISNULL(arg + 5))
+		filter->appname = text_to_cstring(PG_GETARG_TEXT_PP(arg + 5));
+}
+
+/*
+ * Same as pg_track_slow_queries(), but only returns the entries ended in
+ * [since, until), lasting at least min_duration, run by the given user, on
+ * the given database and by the given application, NULL arguments matching
+ * any entry. Blocks of rows whose footer shows none can match are skipped
+ * without being read.
+ */
+PGDLLEXPORT Datum
+pg_track_slow_queries_search(PG_FUNCTION_ARGS)
+{
+	bool			wanted[TSQ_COLS];
+	TSQBlockFilter	filter;
+
+	if (!pgtsqss)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pg_track_slow_queries: must be loaded via shared_preload_libraries")));
+
+	pgtsq_get_filter_args(fcinfo, 0, &filter);
+
+	memset(wanted, true, sizeof(wanted));
+	pg_track_slow_queries_internal(fcinfo, wanted, &filter);
+	return (Datum) 0;
+}
+
+/*
+ * Same as pg_track_slow_queries(), but only returns the entries whose query
+ * used the given table or index of the current database. The blocks of entries the relation index of
+ * each segment shows don't use it are skipped without being read.
+ */
+PGDLLEXPORT Datum
+pg_track_slow_queries_by_relation(PG_FUNCTION_ARGS)
+{
+	bool			wanted[TSQ_COLS];
+	TSQBlockFilter	filter;
+
 	if (!pgtsqss)
 		ereport(ERROR,
 				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
 				 errmsg("pg_track_slow_queries: must be loaded via shared_preload_libraries")));
 
-	pg_track_slow_queries_internal(fcinfo);
+	memset(&filter, 0, sizeof(TSQBlockFilter));
+	filter.min_duration = -1;
+	filter.relid = PG_GETARG_OID(0);
+	/* OIDs are local to each database */
+	filter.dbname = get_database_name(MyDatabaseId);
+
+	memset(wanted, true, sizeof(wanted));
+	pg_track_slow_queries_internal(fcinfo, wanted, &filter);
 	return (Datum) 0;
 }
 
 /*
- * Reads, parses, and returns data as a tuple set
+ * Reads the rows of a segment between start and end, and adds the last ones
+ * still to return to the tuple set, most recent first. Each row kept is
+ * parsed in its own memory context, deleted once the row is replaced by a
+ * more recent one or returned, so that memory use doesn't depend on the
+ * number of rows read. Returns false on error.
+ */
+static bool
+pgtsq_latest_rows(TSQLatestState * state, TSQSegmentReader * reader,
+				  off_t start, off_t end)
+{
+	MemoryContext	oldcontext = CurrentMemoryContext;
+	MemoryContext	*contexts = NULL;
+	TSQEntry		**entries = NULL;
+	int64			nentries = 0;
+	int64			maxentries = 0;
+	int64			oldest = 0;
+	char			*buff = NULL;
+	uint32			row_len;
+	int				ret;
+
+	reader->offset = start;
+	reader->end = end;
+	if (fseeko(reader->file, start, SEEK_SET) != 0)
+	{
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("pg_track_slow_queries: could not read file \"%s\": %m",
+						reader->path)));
+		return false;
+	}
+
+	for (;;)
+	{
+		MemoryContext	rowcontext;
+		TSQEntry		*tsqe = NULL;
+
+		rowcontext = AllocSetContextCreate(oldcontext, "PGTSQLatest",
+										   ALLOCSET_START_SMALL_SIZES);
+		MemoryContextSwitchTo(rowcontext);
+		if ((ret = pgtsq_read_row(reader, &buff, &row_len)) > 0)
+		{
+			tsqe = (TSQEntry *) palloc0(sizeof(TSQEntry));
+			if (!pgtsq_parse_row(buff, reader->header.version, tsqe))
+			{
+				ereport(LOG,
+						(errmsg("pg_track_slow_queries: could not parse row")));
+				ret = -1;
+			}
+		}
+		MemoryContextSwitchTo(oldcontext);
+		if (ret <= 0)
+		{
+			MemoryContextDelete(rowcontext);
+			break;
+		}
+
+		/* Only the last rows are kept, in a ring once enough are */
+		if (nentries < state->remaining)
+		{
+			if (nentries == maxentries)
+			{
+				maxentries = maxentries == 0 ? 64 : maxentries * 2;
+				contexts = contexts == NULL ?
+					(MemoryContext *) palloc(maxentries * sizeof(MemoryContext)) :
+					(MemoryContext *) repalloc(contexts,
+											   maxentries * sizeof(MemoryContext));
+				entries = entries == NULL ?
+					(TSQEntry **) palloc(maxentries * sizeof(TSQEntry *)) :
+					(TSQEntry **) repalloc(entries,
+										   maxentries * sizeof(TSQEntry *));
+			}
+			contexts[nentries] = rowcontext;
+			entries[nentries++] = tsqe;
+		}
+		else
+		{
+			MemoryContextDelete(contexts[oldest]);
+			contexts[oldest] = rowcontext;
+			entries[oldest] = tsqe;
+			oldest = (oldest + 1) % nentries;
+		}
+	}
+
+	for (int64 i = nentries - 1; i >= 0; i--)
+	{
+		int64		j = (oldest + i) % nentries;
+
+		if (ret == 0)
+		{
+			MemoryContextSwitchTo(contexts[j]);
+			pgtsq_put_entry(state->tupstore, state->tupdesc, entries[j],
+							state->wanted);
+			MemoryContextSwitchTo(oldcontext);
+		}
+		MemoryContextDelete(contexts[j]);
+	}
+	if (ret == 0)
+		state->remaining -= nentries;
+
+	if (contexts != NULL)
+		pfree(contexts);
+	if (entries != NULL)
+		pfree(entries);
+	return ret == 0;
+}
+
+/*
+ * Adds the last rows of a block to the tuple set, stops the walk once all
+ * the entries to return have been
+ */
+static bool
+pgtsq_latest_block(void * arg, TSQSegmentReader * reader, off_t start,
+				   off_t end, TSQBlockFooter * footer)
+{
+	TSQLatestState	*state = (TSQLatestState *) arg;
+
+	if (!pgtsq_latest_rows(state, reader, start, end))
+	{
+		state->failed = true;
+		return false;
+	}
+	return state->remaining > 0;
+}
+
+/*
+ * Same as pg_track_slow_queries(), but only returns the last n entries
+ * stored, most recent first. Segments are read backward from the committed
+ * position, a block of rows at a time thanks to their footers, so that only
+ * the blocks holding these entries are read.
+ */
+PGDLLEXPORT Datum
+pg_track_slow_queries_latest(PG_FUNCTION_ARGS)
+{
+	bool				wanted[TSQ_COLS];
+	TSQLatestState		state;
+	TSQSegmentReader	reader;
+	uint64				pos;
+	uint32				segno;
+	uint32				first;
+	off_t				start;
+	off_t				stop;
+	int					ret;
+
+	if (!pgtsqss)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pg_track_slow_queries: must be loaded via shared_preload_libraries")));
+
+	memset(wanted, true, sizeof(wanted));
+	memset(&state, 0, sizeof(TSQLatestState));
+	state.tupstore = pgtsq_begin_srf(fcinfo, &state.tupdesc);
+	state.wanted = wanted;
+	state.remaining = PG_GETARG_INT32(0);
+	memset(&reader, 0, sizeof(TSQSegmentReader));
+
+	/* Same snapshot of the committed position as pg_track_slow_queries() */
+	pos = pg_atomic_read_u64(&pgtsqss->committed);
+	pg_read_barrier();
+	first = pgtsq_first_segment(pos);
+	segno = TSQPosSegno(pos);
+
+	while (state.remaining > 0)
+	{
+		ret = pgtsq_open_reader(&reader, segno,
+								segno == TSQPosSegno(pos) ? TSQPosOffset(pos) : -1);
+		if (ret < 0)
+			break;
+		if (ret > 0)
+		{
+			reader.streams = TSQ_STREAMS_ALL & ~(1 << TSQ_STREAM_RELATIONS);
+			start = reader.offset;
+			stop = pgtsq_walk_blocks(&reader, pgtsq_latest_block, &state);
+
+			/* Rows before the blocks, stored before block footers existed */
+			if (!state.failed && state.remaining > 0 && stop > start &&
+				!pgtsq_latest_rows(&state, &reader, start, stop))
+				state.failed = true;
+		}
+		pgtsq_close_reader(&reader);
+
+		if (state.failed || segno == first)
+			break;
+		segno = TSQPrevSegno(segno);
+	}
+
+	tuplestore_donestoring(state.tupstore);
+	return (Datum) 0;
+}
+
+/*
+ * Returns the value of a column pg_track_slow_queries_top() can rank entries
+ * by, columns being numbered as in tsq_columns
+ */
+static double
+pgtsq_rank_value(TSQEntry * tsqe, int column)
+{
+	switch (column)
+	{
+		case 0:
+			return (double) tsqe->end_time;
+		case 1:
+			return (double) tsqe->start_time;
+		case 2:
+			return tsqe->duration;
+		case 6:
+			return (double) tsqe->temp_blks_written;
+		case 7:
+			return tsqe->hitratio;
+		case 8:
+			return (double) tsqe->ntuples;
+	}
+	return 0;
+}
+
+/*
+ * Restores the order of a min-heap of candidates whose node i may be greater
+ * than its children
+ */
+static void
+pgtsq_top_sift_down(TSQTopCandidate * heap, int size, int i)
+{
+	for (;;)
+	{
+		int				min = i;
+		int				child = 2 * i + 1;
+		TSQTopCandidate	tmp;
+
+		if (child < size && heap[child].value < heap[min].value)
+			min = child;
+		if (child + 1 < size && heap[child + 1].value < heap[min].value)
+			min = child + 1;
+		if (min == i)
+			return;
+		tmp = heap[i];
+		heap[i] = heap[min];
+		heap[min] = tmp;
+		i = min;
+	}
+}
+
+/*
+ * Restores the order of a min-heap of candidates whose node i may be lower
+ * than its parent
  */
 static void
-pg_track_slow_queries_internal(FunctionCallInfo fcinfo)
+pgtsq_top_sift_up(TSQTopCandidate * heap, int i)
+{
+	while (i > 0)
+	{
+		int				parent = (i - 1) / 2;
+		TSQTopCandidate	tmp;
+
+		if (heap[parent].value <= heap[i].value)
+			return;
+		tmp = heap[i];
+		heap[i] = heap[parent];
+		heap[parent] = tmp;
+		i = parent;
+	}
+}
+
+/* Storage order */
+static int
+pgtsq_top_position_cmp(const void * a, const void * b)
+{
+	const TSQTopCandidate *ca = (const TSQTopCandidate *) a;
+	const TSQTopCandidate *cb = (const TSQTopCandidate *) b;
+
+	if (ca->seq != cb->seq)
+		return ca->seq < cb->seq ? -1 : 1;
+	return ca->offset < cb->offset ? -1 : (ca->offset > cb->offset ? 1 : 0);
+}
+
+/* Greatest values first, most recent entries first among equal ones */
+static int
+pgtsq_top_rank_cmp(const void * a, const void * b)
+{
+	const TSQTopCandidate *ca = (const TSQTopCandidate *) a;
+	const TSQTopCandidate *cb = (const TSQTopCandidate *) b;
+
+	if (ca->value != cb->value)
+		return ca->value > cb->value ? -1 : 1;
+	return -pgtsq_top_position_cmp(a, b);
+}
+
+/*
+ * Same as pg_track_slow_queries_search(), but only returns the n entries
+ * with the greatest values of the order_by column, greatest first. Only the
+ * metadata stream of the rows is decoded to rank them, in a heap of at most
+ * n entries, the queries and plans of the entries returned are then read
+ * again from their rows.
+ */
+PGDLLEXPORT Datum
+pg_track_slow_queries_top(PG_FUNCTION_ARGS)
+{
+	bool				wanted[TSQ_COLS];
+	TSQBlockFilter		filter;
+	TupleDesc			tupdesc;
+	Tuplestorestate		*tupstore;
+	TSQSegmentReader	reader;
+	MemoryContext		oldcontext = CurrentMemoryContext;
+	MemoryContext		tmpcontext;
+	TSQTopCandidate		*heap = NULL;
+	int					size = 0;
+	int					maxsize = 0;
+	int64				n;
+	int					column;
+	char				*order_by;
+	uint64				pos;
+	uint32				segno;
+	int					seq = 0;
+	char				*buff = NULL;
+	uint32				row_len;
+	int					ret;
+
+	if (!pgtsqss)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pg_track_slow_queries: must be loaded via shared_preload_libraries")));
+
+	if (PG_ARGISNULL(1))
+		ereport(ERROR,
+				(errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+				 errmsg("pg_track_slow_queries: order_by must not be NULL")));
+	order_by = text_to_cstring(PG_GETARG_TEXT_PP(1));
+	for (column = 0; column < TSQ_COLS; column++)
+		if (strcmp(order_by, tsq_columns[column]) == 0)
+			break;
+	if (column == TSQ_COLS || !tsq_rank_columns[column])
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("pg_track_slow_queries: cannot rank entries by \"%s\"",
+						order_by)));
+	n = PG_ARGISNULL(0) ? 0 : PG_GETARG_INT32(0);
+	pgtsq_get_filter_args(fcinfo, 2, &filter);
+	memset(wanted, true, sizeof(wanted));
+
+	tupstore = pgtsq_begin_srf(fcinfo, &tupdesc);
+	memset(&reader, 0, sizeof(TSQSegmentReader));
+	tmpcontext = AllocSetContextCreate(CurrentMemoryContext,
+									   "PGTSQTop", ALLOCSET_START_SMALL_SIZES);
+
+	/* Same snapshot of the committed position as pg_track_slow_queries() */
+	pos = pg_atomic_read_u64(&pgtsqss->committed);
+	pg_read_barrier();
+	segno = pgtsq_first_segment(pos);
+
+	/* Rank the entries from their metadata only */
+	while (n > 0)
+	{
+		ret = pgtsq_open_reader(&reader, segno,
+								segno == TSQPosSegno(pos) ? TSQPosOffset(pos) : -1);
+		if (ret < 0)
+			goto fail;
+		reader.streams = 1 << TSQ_STREAM_META;
+		pgtsq_filter_reader(&reader, &filter);
+
+		while (ret > 0)
+		{
+			TSQEntry		tsqe;
+			TSQTopCandidate	candidate;
+
+			MemoryContextReset(tmpcontext);
+			MemoryContextSwitchTo(tmpcontext);
+			ret = pgtsq_read_row(&reader, &buff, &row_len);
+			if (ret > 0)
+			{
+				memset(&tsqe, 0, sizeof(TSQEntry));
+				if (!pgtsq_parse_row(buff, reader.header.version, &tsqe))
+				{
+					ereport(LOG,
+							(errmsg("pg_track_slow_queries: could not parse row")));
+					ret = -1;
+				}
+			}
+			MemoryContextSwitchTo(oldcontext);
+			if (ret < 0)
+				goto fail;
+			if (ret == 0 || !pgtsq_filter_match(&filter, &tsqe))
+				continue;
+
+			candidate.value = pgtsq_rank_value(&tsqe, column);
+			candidate.seq = seq;
+			candidate.segno = segno;
+			candidate.offset = reader.row_offset;
+			candidate.tsqe = NULL;
+			if (size < n)
+			{
+				if (size == maxsize)
+				{
+					maxsize = maxsize == 0 ? 64 : Min(maxsize * 2, n);
+					heap = heap == NULL ?
+						(TSQTopCandidate *) palloc(maxsize * sizeof(TSQTopCandidate)) :
+						(TSQTopCandidate *) repalloc(heap,
+													 maxsize * sizeof(TSQTopCandidate));
+				}
+				heap[size] = candidate;
+				pgtsq_top_sift_up(heap, size++);
+			}
+			else if (candidate.value > heap[0].value)
+			{
+				/* Replaces the lowest of the candidates */
+				heap[0] = candidate;
+				pgtsq_top_sift_down(heap, size, 0);
+			}
+		}
+		pgtsq_close_reader(&reader);
+
+		if (segno == TSQPosSegno(pos))
+			break;
+		segno = TSQNextSegno(segno);
+		seq++;
+	}
+	MemoryContextDelete(tmpcontext);
+
+	/* Read the whole rows of the entries ranked, in storage order */
+	if (size > 1)
+		qsort(heap, size, sizeof(TSQTopCandidate), pgtsq_top_position_cmp);
+	for (int i = 0; i < size; i++)
+	{
+		TSQTopCandidate	*candidate = &heap[i];
+		TSQEntry		*tsqe;
+
+		if (i == 0 || candidate->seq != heap[i - 1].seq)
+		{
+			pgtsq_close_reader(&reader);
+			if (pgtsq_open_reader(&reader, candidate->segno, -1) <= 0)
+				continue;
+			reader.streams = TSQ_STREAMS_ALL & ~(1 << TSQ_STREAM_RELATIONS);
+		}
+		if (reader.file == NULL)
+			continue;
+
+		reader.offset = candidate->offset;
+		if (fseeko(reader.file, reader.offset, SEEK_SET) != 0 ||
+			pgtsq_read_row(&reader, &buff, &row_len) <= 0)
+			continue;
+		tsqe = (TSQEntry *) palloc0(sizeof(TSQEntry));
+
+		/* Segments removed or converted since are left out */
+		if (pgtsq_parse_row(buff, reader.header.version, tsqe) &&
+			pgtsq_rank_value(tsqe, column) == candidate->value)
+			candidate->tsqe = tsqe;
+	}
+	pgtsq_close_reader(&reader);
+
+	if (size > 1)
+		qsort(heap, size, sizeof(TSQTopCandidate), pgtsq_top_rank_cmp);
+	for (int i = 0; i < size; i++)
+		if (heap[i].tsqe != NULL)
+			pgtsq_put_entry(tupstore, tupdesc, heap[i].tsqe, wanted);
+
+	tuplestore_donestoring(tupstore);
+	return (Datum) 0;
+
+fail:
+	MemoryContextSwitchTo(oldcontext);
+	MemoryContextDelete(tmpcontext);
+	pgtsq_close_reader(&reader);
+	tuplestore_donestoring(tupstore);
+	return (Datum) 0;
+}
+
+/*
+ * Checks that the caller of a set-returning function accepts a tuplestore,
+ * then sets it up along with the tuple descriptor of the result.
+ */
+Tuplestorestate *
+pgtsq_begin_srf(FunctionCallInfo fcinfo, TupleDesc * tupdesc)
 {
 	ReturnSetInfo	*rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
 	MemoryContext	per_query_ctx;
 	MemoryContext	oldcontext;
-	MemoryContext	tmpcontext = NULL;
-	TupleDesc		tupdesc;
 	Tuplestorestate	*tupstore;
-	FILE			*file = NULL;
-	uint32			row_len = 0;
-	uint32			row_lz_len = 0;
-	char			*lz_buff = NULL;
-	char			*buff = NULL;
-	TSQEntry		*tsqe = NULL;
 
 	/* Check to see if caller supports us returning a tuplestore */
 	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
@@ -549,7 +1626,7 @@ pg_track_slow_queries_internal(FunctionCallInfo fcinfo)
 	oldcontext = MemoryContextSwitchTo(per_query_ctx);
 
 	/* Build a tuple descriptor for our result type */
-	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+	if (get_call_result_type(fcinfo, NULL, tupdesc) != TYPEFUNC_COMPOSITE)
 		ereport(ERROR,
 				(errmsg("pg_track_slow_queries: return type must be a row " \
 						"type")));
@@ -557,103 +1634,158 @@ pg_track_slow_queries_internal(FunctionCallInfo fcinfo)
 	tupstore = tuplestore_begin_heap(true, false, work_mem);
 	rsinfo->returnMode = SFRM_Materialize;
 	rsinfo->setResult = tupstore;
-	rsinfo->setDesc = tupdesc;
+	rsinfo->setDesc = *tupdesc;
 
 	MemoryContextSwitchTo(oldcontext);
 
-	/* Acquire shared lock for reading storage file */
-	LWLockAcquire(pgtsqss->lock, LW_SHARED);
+	return tupstore;
+}
 
-	file = AllocateFile(TSQ_FILE, PG_BINARY_R);
-	if (file == NULL)
-		goto read_error;
+/*
+ * Builds the columns of pg_track_slow_queries() from an entry, in the order
+ * of tsq_columns. Columns not wanted are NULL.
+ */
+void
+pgtsq_entry_values(TSQEntry * tsqe, const bool * wanted, Datum * values,
+				   bool * nulls)
+{
+	char		*plantxt;
+	int			i = 0;
+
+	memset(values, 0, TSQ_COLS * sizeof(Datum));
+	memset(nulls, 0, TSQ_COLS * sizeof(bool));
+
+	values[i++] = TimestampTzGetDatum(tsqe->end_time);
+	values[i++] = TimestampTzGetDatum(tsqe->start_time);
+	values[i++] = Float8GetDatumFast(tsqe->duration);
+	values[i++] = CStringGetTextDatum(tsqe->username);
+	values[i++] = CStringGetTextDatum(tsqe->appname);
+	values[i++] = CStringGetTextDatum(tsqe->dbname);
+	values[i++] = UInt32GetDatum(tsqe->temp_blks_written);
+	values[i++] = Float8GetDatumFast(tsqe->hitratio);
+	values[i++] = Int64GetDatum(tsqe->ntuples);
+	values[i++] = Int64GetDatum((int64) tsqe->queryid);
+	values[i++] = CStringGetTextDatum(tsqe->querytxt);
+	if (wanted[i] && (plantxt = pgtsq_plan_text(tsqe)) != NULL)
+		values[i++] = CStringGetTextDatum(plantxt);
+	else
+		nulls[i++] = true;
 
-	/* Start by reading compressed row length */
-	while (fread(&row_lz_len, sizeof(uint32), 1, file) == 1)
-	{
-		Datum			values[TSQ_COLS];
-		bool			nulls[TSQ_COLS];
-		int 			i = 0;
+	for (i = 0; i < TSQ_COLS; i++)
+		if (!wanted[i])
+			nulls[i] = true;
+}
 
-		/* Move to dedicated MemoryContext */
-		tmpcontext = AllocSetContextCreate(CurrentMemoryContext,
-						"PGTSQInternal", ALLOCSET_START_SMALL_SIZES);
-		oldcontext = MemoryContextSwitchTo(tmpcontext);
+/*
+ * Adds an entry to a tuple set
+ */
+static void
+pgtsq_put_entry(Tuplestorestate * tupstore, TupleDesc tupdesc, TSQEntry * tsqe,
+				const bool * wanted)
+{
+	Datum		values[TSQ_COLS];
+	bool		nulls[TSQ_COLS];
 
-		memset(values, 0, sizeof(values));
-		memset(nulls, 0, sizeof(nulls));
+	pgtsq_entry_values(tsqe, wanted, values, nulls);
+	tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+}
 
-		/* Read row length */
-		if (fread(&row_len, sizeof(uint32), 1, file) != 1)
-			goto read_error;
+/*
+ * Reads, parses, and returns data as a tuple set. Columns not wanted are
+ * NULL, entries not matching the filter, if any, are left out.
+ */
+static void
+pg_track_slow_queries_internal(FunctionCallInfo fcinfo, const bool * wanted,
+							   TSQBlockFilter * filter)
+{
+	MemoryContext		oldcontext = CurrentMemoryContext;
+	MemoryContext		tmpcontext = NULL;
+	TupleDesc			tupdesc;
+	Tuplestorestate		*tupstore;
+	TSQSegmentReader	reader;
+	uint64				pos;
+	uint32				segno;
+	char				*buff = NULL;
+	uint32				row_len;
+	int					ret;
+	TSQEntry			*tsqe = NULL;
+	int					streams = 1 << TSQ_STREAM_META;
+
+	tupstore = pgtsq_begin_srf(fcinfo, &tupdesc);
+	if (wanted[TSQ_COLS - 2])
+		streams |= 1 << TSQ_STREAM_QUERY;
+	if (wanted[TSQ_COLS - 1])
+		streams |= 1 << TSQ_STREAM_PLAN;
+	if (filter && OidIsValid(filter->relid))
+		streams |= 1 << TSQ_STREAM_RELATIONS;
+	memset(&reader, 0, sizeof(TSQSegmentReader));
 
-		/* Allocate new buffer */
-		if ((buff = (char *) palloc0(row_len)) == NULL)
-			goto alloc_error;
+	/*
+	 * Take a snapshot of the committed position: rows before it are
+	 * entirely written and won't change, so no lock is needed to read them.
+	 * Segments before the current one are complete and read up to their end.
+	 */
+	pos = pg_atomic_read_u64(&pgtsqss->committed);
+	pg_read_barrier();
+	segno = pgtsq_first_segment(pos);
 
-		if (row_lz_len > 0)
+	for (;;)
+	{
+		ret = pgtsq_open_reader(&reader, segno,
+								segno == TSQPosSegno(pos) ? TSQPosOffset(pos) : -1);
+		if (ret < 0)
+			goto fail;
+		reader.streams = streams;
+		if (filter)
+			pgtsq_filter_reader(&reader, filter);
+
+		while (ret > 0)
 		{
-			/* If compressed part length is > 0 then read and decompress it */
-			if ((lz_buff = (char *) palloc0(row_lz_len)) == NULL)
+			/* Move to dedicated MemoryContext */
+			tmpcontext = AllocSetContextCreate(CurrentMemoryContext,
+							"PGTSQInternal", ALLOCSET_START_SMALL_SIZES);
+			oldcontext = MemoryContextSwitchTo(tmpcontext);
+
+			if ((ret = pgtsq_read_row(&reader, &buff, &row_len)) < 0)
+				goto fail;
+			if (ret == 0)
+			{
+				MemoryContextSwitchTo(oldcontext);
+				MemoryContextDelete(tmpcontext);
+				tmpcontext = NULL;
+				break;
+			}
+
+			/* Parse row */
+			if ((tsqe = (TSQEntry *) palloc0(sizeof(TSQEntry))) == NULL)
 				goto alloc_error;
-			if (fread(lz_buff, row_lz_len, 1, file) != 1)
-				goto read_error;
-			if (pglz_decompress(lz_buff, row_lz_len, buff, row_len) \
-					!= row_len)
-				goto decompress_error;
-		} else {
-			/* Uncompressed row */
-			if (fread(buff, row_len, 1, file) != 1)
-				goto read_error;
-		}
+			if (!(pgtsq_parse_row(buff, reader.header.version, tsqe)))
+				goto parse_error;
+			if (filter && !pgtsq_filter_match(filter, tsqe))
+			{
+				MemoryContextSwitchTo(oldcontext);
+				MemoryContextDelete(tmpcontext);
+				tmpcontext = NULL;
+				continue;
+			}
 
-		/* Parse row */
-		if ((tsqe = (TSQEntry *) palloc0(sizeof(TSQEntry))) == NULL)
-			goto alloc_error;
-		if (!(pgtsq_parse_row(buff, tsqe)))
-			goto parse_error;
-
-		/* Build the tuple */
-		values[i++] = DirectFunctionCall3(timestamptz_in,
-										  CStringGetDatum(tsqe->datetime),
-										  ObjectIdGetDatum(InvalidOid),
-										  Int32GetDatum(-1));
-		values[i++] = Float8GetDatumFast(tsqe->duration);
-		values[i++] = CStringGetTextDatum(tsqe->username);
-		values[i++] = CStringGetTextDatum(tsqe->appname);
-		values[i++] = CStringGetTextDatum(tsqe->dbname);
-		values[i++] = UInt32GetDatum(tsqe->temp_blks_written);
-		values[i++] = Float8GetDatumFast(tsqe->hitratio);
-		values[i++] = Int64GetDatum(tsqe->ntuples);
-		values[i++] = CStringGetTextDatum(tsqe->querytxt);
-		values[i++] = CStringGetTextDatum(tsqe->plantxt);
-
-		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+			pgtsq_put_entry(tupstore, tupdesc, tsqe, wanted);
 
-		MemoryContextSwitchTo(oldcontext);
-		MemoryContextDelete(tmpcontext);
-	}
+			MemoryContextSwitchTo(oldcontext);
+			MemoryContextDelete(tmpcontext);
+			tmpcontext = NULL;
+		}
+		pgtsq_close_reader(&reader);
 
-	LWLockRelease(pgtsqss->lock);
-	FreeFile(file);
+		if (segno == TSQPosSegno(pos))
+			break;
+		segno = TSQNextSegno(segno);
+	}
 
 	/* Clean up and return the tuplestore */
 	tuplestore_donestoring(tupstore);
 	return;
 
-read_error:
-	ereport(LOG,
-		    (errcode_for_file_access(),
-		     errmsg("pg_track_slow_queries: could not read file \"%s\": %m",
-				    TSQ_FILE)));
-	goto fail;
-
-decompress_error:
-	ereport(LOG,
-		    (errcode_for_file_access(),
-		     errmsg("pg_track_slow_queries: could not decompress row")));
-	goto fail;
-
 parse_error:
 	ereport(LOG,
 			(errcode_for_file_access(),
@@ -672,10 +1804,7 @@ fail:
 		MemoryContextSwitchTo(oldcontext);
 		MemoryContextDelete(tmpcontext);
 	}
-	if (file)
-		FreeFile(file);
-	if (pgtsqss->lock)
-		LWLockRelease(pgtsqss->lock);
+	pgtsq_close_reader(&reader);
 }
 
 /*
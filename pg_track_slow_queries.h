@@ -1,11 +1,80 @@
 #ifndef _PG_TRACK_SLOW_QUERIES_H_
 #define _PG_TRACK_SLOW_QUERIES_H_
 
-#define TSQ_FILE PGSTAT_STAT_PERMANENT_DIRECTORY "/pg_track_slow_queries.stat"
+#include "pg_track_slow_queries_format.h"
+
+/* Legacy single storage file, renamed as the first segment on startup */
+#define TSQ_FILE PGSTAT_STAT_PERMANENT_DIRECTORY "/" TSQ_LEGACY_FILE_NAME
+/* Storage segment files, rows are only appended to the newest one */
+#define TSQ_SEGMENT_FILE	PGSTAT_STAT_PERMANENT_DIRECTORY "/" TSQ_SEGMENT_PREFIX \
+							"%08X" TSQ_SEGMENT_SUFFIX
+#define TSQ_BINARY_RW		"r+b"
+/* Temporary file a legacy segment is converted into */
+#define TSQ_CONVERT_SUFFIX	".tmp"
+/* Storage files imported from other nodes, one directory per node */
+#define TSQ_NODES_DIR		PGSTAT_STAT_PERMANENT_DIRECTORY "/pg_track_slow_queries.nodes"
+#define TSQ_MANIFEST_FILE	"manifest"
+#define TSQ_NODE_NAME_MAXLEN	63
+/* Node of local entries when cluster_name is not set */
+#define TSQ_LOCAL_NODE		"local"
+/* Rows converted per call of pgtsq_convert_segment() */
+#define TSQ_CONVERT_CHUNK_ROWS	256
 /* Number of columns */
-#define TSQ_COLS			10
+#define TSQ_COLS			12
 #define PGSTAT_MIN_RCVBUF	(100 * 1024)
 #define MSG_BUFFER_SIZE		(64 * 1024)
+/* Collector batches are flushed when one of these limits is reached */
+#define TSQ_BATCH_SIZE		64
+#define TSQ_BATCH_MAX_SIZE	(1024 * 1024)
+/* Number of histogram buckets: < 1us, then powers of two in us */
+#define TSQ_HIST_BUCKETS	32
+/* Plans kept for each query whose plan changes are tracked */
+#define TSQ_PLANS_PER_QUERY	4
+/* Length of the query text kept with each query tracked, NUL included */
+#define TSQ_PLAN_QUERY_LEN	512
+/* Calls of a plan needed before its median duration is compared */
+#define TSQ_PLAN_MIN_CALLS	5
+
+/*
+ * Storage position: segment number in the upper bits, committed end offset
+ * in the lower ones, so that readers get both with a single atomic read.
+ */
+#define TSQ_OFFSET_BITS		40
+#define TSQ_SEGNO_MASK		((uint32) 0xFFFFFF)
+#define TSQPosMake(segno, offset) \
+	((((uint64) (segno) & TSQ_SEGNO_MASK) << TSQ_OFFSET_BITS) | (uint64) (offset))
+#define TSQPosSegno(pos) \
+	((uint32) ((pos) >> TSQ_OFFSET_BITS))
+#define TSQPosOffset(pos) \
+	((off_t) ((pos) & ((UINT64CONST(1) << TSQ_OFFSET_BITS) - 1)))
+#define TSQNextSegno(segno) \
+	(((segno) + 1) & TSQ_SEGNO_MASK)
+#define TSQPrevSegno(segno) \
+	(((segno) - 1) & TSQ_SEGNO_MASK)
+
+/*
+ * USDT probes, only built with USE_PROBES. Probe arguments are not evaluated
+ * otherwise.
+ */
+#ifdef TSQ_USE_PROBES
+#include <sys/sdt.h>
+#define TSQ_PROBE0(name) \
+	DTRACE_PROBE(pg_track_slow_queries, name)
+#define TSQ_PROBE1(name, a) \
+	DTRACE_PROBE1(pg_track_slow_queries, name, a)
+#define TSQ_PROBE2(name, a, b) \
+	DTRACE_PROBE2(pg_track_slow_queries, name, a, b)
+#define TSQ_PROBE3(name, a, b, c) \
+	DTRACE_PROBE3(pg_track_slow_queries, name, a, b, c)
+#define TSQ_PROBE4(name, a, b, c, d) \
+	DTRACE_PROBE4(pg_track_slow_queries, name, a, b, c, d)
+#else
+#define TSQ_PROBE0(name) do {} while (0)
+#define TSQ_PROBE1(name, a) do {} while (0)
+#define TSQ_PROBE2(name, a, b) do {} while (0)
+#define TSQ_PROBE3(name, a, b, c) do {} while (0)
+#define TSQ_PROBE4(name, a, b, c, d) do {} while (0)
+#endif
 
 #define tsq_enabled() \
 	(tsq_log_min_duration >= 0)
@@ -16,8 +85,15 @@
 #define tsq_log_plan_enabled() \
 	(tsq_log_plan == true)
 
+/* Values of pg_track_slow_queries.plan_format */
+typedef enum TSQPlanFormat {
+	TSQ_PLAN_FORMAT_JSON = 0,	/* EXPLAIN (FORMAT JSON) output */
+	TSQ_PLAN_FORMAT_BINARY		/* Binary snapshot, rendered when read */
+} TSQPlanFormat;
+
 typedef struct TSQEntry {
-	char	*datetime;			/* Execution end datetime */
+	TimestampTz	end_time;		/* Execution end time */
+	TimestampTz	start_time;		/* Execution start time */
 	double	duration;			/* Duration in ms */
 	char	*username;			/* Username running the query */
 	char	*appname;			/* Application name */
@@ -25,14 +101,151 @@ typedef struct TSQEntry {
 	long	temp_blks_written;	/* Blocks written for temp. files usage */
 	float	hitratio;			/* Cache hit-ratio */
 	uint64	ntuples;			/* Number of tuples returned or affected */
+	uint64	queryid;			/* Query identifier */
 	char	*querytxt;			/* Text representation of the query */
-	char	*plantxt;			/* JSON representation of the exec. plan */
+	char	*plantxt;			/* JSON representation of the exec. plan, or
+								 * binary snapshot */
+	uint32	planlen;			/* Length of plantxt, 0 if NUL-terminated */
+	Oid		*relids;			/* Tables and indexes used, sorted */
+	uint32	nrelids;
 } TSQEntry;
 
-typedef struct TSQSharedState {
-	LWLockId	lock;	/* Lock to prevent concurrent updates on the storage file */
-	int			socket;	/* UDP socket file descriptor */
+/* Capture phases timed by the overhead sampling */
+typedef enum TSQPhase {
+	TSQ_PHASE_START = 0,		/* ExecutorStart bookkeeping */
+	TSQ_PHASE_METADATA,			/* Entry metadata fetch */
+	TSQ_PHASE_EXPLAIN,			/* EXPLAIN rendering */
+	TSQ_PHASE_SERIALIZE,		/* Entry serialization */
+	TSQ_PHASE_COMPRESS,			/* Compression, when stored by the backend */
+	TSQ_PHASE_TRANSPORT,		/* Sending to the collector or storage */
+	TSQ_PHASES
+} TSQPhase;
+
+/*
+ * Filter of the entries read, NULL strings, a negative min_duration and an
+ * invalid relid match any entry
+ */
+typedef struct TSQBlockFilter {
+	bool		has_since;
+	TimestampTz	since;			/* Entries ended at or after it */
+	bool		has_until;
+	TimestampTz	until;			/* Entries ended before it */
+	double		min_duration;
+	char		*username;
+	char		*dbname;
+	char		*appname;
+	bool		has_queryid;
+	uint64		queryid;
+	Oid			relid;			/* Entries using this table or index */
+} TSQBlockFilter;
+
+/* Rows of a storage segment skipped by a filtered reader, footer included */
+typedef struct TSQBlockRange {
+	off_t		start;
+	off_t		end;
+} TSQBlockRange;
+
+/* Sequential reader of a storage segment */
+typedef struct TSQSegmentReader {
+	FILE		*file;
+	uint32		segno;
+	TSQSegmentHeader header;	/* Zeroed for legacy segments */
+	off_t		offset;			/* Offset of the next row */
+	off_t		row_offset;		/* Offset of the last row read */
+	off_t		end;			/* Offset to stop at, -1 for end of file */
+	int			streams;		/* Mask of the row streams to decode, the
+								 * others read as empty items */
+	TSQBlockRange *skipped;		/* Blocks none of whose rows match the
+								 * filter, in order, see pgtsq_filter_reader() */
+	int			nskipped;
+	int			maxskipped;
+	int			next_skipped;
+	char		path[MAXPGPATH];
+} TSQSegmentReader;
+
+/*
+ * Called on each block of a segment by pgtsq_walk_blocks(), the block goes
+ * from start to end, its footer included. Returns false to stop the walk.
+ */
+typedef bool (*TSQBlockVisitor) (void * arg, TSQSegmentReader * reader,
+								 off_t start, off_t end, TSQBlockFooter * footer);
 
+/* Header of the messages sent by backends to the collector */
+typedef struct TSQMsgHeader {
+	TimestampTz	captured;		/* Capture timestamp, taken in ExecutorEnd */
+	uint64		queryid;		/* Query identifier */
+	uint64		planid;			/* Plan fingerprint, 0 if its plan changes
+								 * are not tracked */
+	Oid			dbid;			/* Database the query ran on */
+	double		duration;		/* Duration in ms */
+} TSQMsgHeader;
+
+/* Outcome of a storage write */
+typedef struct TSQStoreStats {
+	int			nrows;			/* Number of rows stored */
+	uint64		bytes;			/* Number of bytes written */
+	double		compress_time;	/* Compression time in ms */
+	double		write_time;		/* Write time in ms, lock wait included */
+} TSQStoreStats;
+
+/* Durations histogram */
+typedef struct TSQHistogram {
+	uint64		count;			/* Number of values */
+	double		total;			/* Sum of values in ms */
+	double		max;			/* Max value in ms */
+	uint64		buckets[TSQ_HIST_BUCKETS];
+} TSQHistogram;
+
+/* Collector statistics, protected by mutex */
+typedef struct TSQCollectorStats {
+	slock_t		mutex;
+	uint64		entries;			/* Entries stored by the collector */
+	uint64		batches;			/* Number of batches written */
+	uint64		bytes;				/* Number of bytes written */
+	uint32		wakeup_messages_max;	/* Max messages read from the socket
+										 * on one wakeup, not the depth of
+										 * the kernel queue */
+	TSQHistogram latency;			/* From ExecutorEnd until written */
+	double		compress_time;		/* Compression time of batches in ms */
+	double		compress_time_max;
+	double		write_time;			/* Write time of batches in ms */
+	double		write_time_max;
+	uint64		forward_dropped;	/* Rows the forward spool had no room for */
+	TimestampTz	stats_reset;
+} TSQCollectorStats;
+
+/* Capture overhead statistics, protected by mutex */
+typedef struct TSQOverheadStats {
+	slock_t		mutex;
+	TSQHistogram phases[TSQ_PHASES];
+} TSQOverheadStats;
+
+/* Counters of the synthetic stress test workers */
+typedef struct TSQStressState {
+	pg_atomic_uint32	running;	/* Set while a stress test runs */
+	pg_atomic_uint64	sent;		/* Messages sent by the stress workers */
+	pg_atomic_uint64	failed;		/* Messages that could not be sent */
+} TSQStressState;
+
+typedef struct TSQSharedState {
+	LWLockId			lock;		/* Serializes writers of the storage segment */
+	int					socket;		/* UDP socket file descriptor */
+	pg_atomic_uint64	committed;	/* Storage position published by writers */
+	pg_atomic_uint32	first_segno;	/* First segment visible to readers,
+										 * older ones only wait for removal */
+	uint32				oldest_segno;	/* Oldest segment not removed yet,
+										 * only the collector updates it */
+	bool				convert_pending;	/* A legacy segment is waiting
+											 * for conversion */
+	uint32				convert_segno;	/* Segment to convert */
+	TSQCollectorStats	stats;		/* Collector pipeline statistics */
+	TSQOverheadStats	overhead;	/* Capture overhead statistics */
+	TSQStressState		stress;		/* Stress test counters */
+	LWLockId			plans_lock;	/* Protects the plans tracked, see
+									 * plan_changes.c */
+	pid_t				collector_pid;	/* PID of the collector, 0 until
+										 * it is started */
+	pg_atomic_uint32	importing;	/* Set while an import runs */
 } TSQSharedState;
 
 typedef struct TSQItem {
@@ -42,16 +255,88 @@ typedef struct TSQItem {
 
 
 extern uint32 pgtsq_store_row(char * row, int length, bool compression, int max_file_size_kb);
-extern void pgtsq_truncate_file(void);
+extern int pgtsq_store_rows(char ** rows, int * lengths, int nrows, bool compression,
+							int max_file_size_kb, TSQStoreStats * stats);
+extern bool pgtsq_send_row(TSQMsgHeader * header, char * row, int length);
+extern void pgtsq_init_storage(void);
+extern void pgtsq_segment_path(char * path, uint32 segno);
+extern bool pgtsq_parse_segment_name(const char * name, uint32 * segno);
+extern off_t pgtsq_segment_valid_length(const char * path, int * version);
+extern bool pgtsq_write_segment_header(FILE * file);
+extern StringInfo pgtsq_encode_row(char * row, uint32 length, bool compression);
+extern int pgtsq_write_block(FILE * file, StringInfo * stored, char ** rows,
+							 int * lengths, int nrows, off_t max_size,
+							 off_t * end, StringInfo relids, bool * indexed);
+extern int pgtsq_unique_relids(StringInfo relids);
+extern bool pgtsq_write_row(FILE * file, char * row, uint32 length, bool compression);
+extern void pgtsq_switch_segment(void);
+extern void pgtsq_remove_old_segments(void);
+extern bool pgtsq_convert_segment(bool compression);
+extern uint32 pgtsq_first_segment(uint64 pos);
+extern int pgtsq_open_reader(TSQSegmentReader * reader, uint32 segno, off_t end);
+extern int pgtsq_open_reader_path(TSQSegmentReader * reader, const char * path, off_t end);
+extern int pgtsq_read_row(TSQSegmentReader * reader, char ** row, uint32 * length);
+extern void pgtsq_close_reader(TSQSegmentReader * reader);
+extern bool pgtsq_block_match(TSQBlockFooter * footer, TSQBlockFilter * filter);
+extern off_t pgtsq_walk_blocks(TSQSegmentReader * reader, TSQBlockVisitor visit,
+							   void * arg);
+extern void pgtsq_filter_reader(TSQSegmentReader * reader, TSQBlockFilter * filter);
+extern bool pgtsq_filter_match(TSQBlockFilter * filter, TSQEntry * tsqe);
 extern bool pgtsq_check_row(char * row);
-extern bool pgtsq_parse_row(char * row, TSQEntry * tsqe);
+extern bool pgtsq_parse_row(char * row, int version, TSQEntry * tsqe);
 extern void pgtsq_worker(Datum main_arg);
 extern void pgtsq_worker_sigterm(SIGNAL_ARGS);
 extern void pgtsq_worker_sighup(SIGNAL_ARGS);
 extern StringInfo pgtsq_serialize_entry(TSQEntry * tsqe);
 extern void pgtsq_parse_item(char * buffer, uint32 p, TSQItem * item);
+extern Tuplestorestate * pgtsq_begin_srf(FunctionCallInfo fcinfo, TupleDesc * tupdesc);
+extern void pgtsq_entry_values(TSQEntry * tsqe, const bool * wanted, Datum * values,
+							   bool * nulls);
+extern void pgtsq_init_stats(void);
+extern void pgtsq_histogram_add(TSQHistogram * hist, double ms);
+extern void pgtsq_histogram_merge(TSQHistogram * dst, TSQHistogram * src);
+extern double pgtsq_histogram_quantile(TSQHistogram * hist, double q);
+extern Datum pgtsq_histogram_array(TSQHistogram * hist);
+extern void pgtsq_report_batch(TSQStoreStats * stats, TSQHistogram * latency, uint32 nmessages);
+extern void pgtsq_report_overhead(double * phases, int phase_mask);
+extern void pgtsq_report_forward_dropped(int nrows);
+extern void pgtsq_init_stress(void);
+extern void pgtsq_stress_worker(Datum main_arg);
+extern void pgtsq_forward_configure(const char * target, int spool_size_kb);
+extern bool pgtsq_forward_enabled(void);
+extern void pgtsq_forward_rows(char ** rows, int * lengths, int nrows, bool compression);
+extern int pgtsq_forward_fds(fd_set * rfds, fd_set * wfds);
+extern void pgtsq_forward(void);
+extern void pgtsq_encode_plan(struct QueryDesc * queryDesc, StringInfo buf);
+extern void pgtsq_plan_relations(struct QueryDesc * queryDesc, Oid ** relids,
+								 uint32 * nrelids);
+extern char * pgtsq_plan_text(TSQEntry * tsqe);
+extern uint64 pgtsq_plan_fingerprint(struct QueryDesc * queryDesc);
+extern uint64 pgtsq_hash_bytes(uint64 hash, const void * data, Size len);
+extern Size pgtsq_plan_changes_memsize(int max_queries);
+extern void pgtsq_init_plan_changes(int max_queries);
+extern uint64 pgtsq_identify_query(struct QueryDesc * queryDesc);
+extern void pgtsq_identify_plan(struct QueryDesc * queryDesc, TSQMsgHeader * header);
+extern void pgtsq_track_plans(TSQMsgHeader * headers, char ** rows, int nrows,
+							  double regression_ratio);
+extern void pgtsq_register_sink(void);
+extern void pgtsq_sink_worker(Datum main_arg);
 
 extern TSQSharedState * pgtsqss;
+extern const char *const tsq_columns[TSQ_COLS];
+
+#ifdef TSQ_USE_PROBES
+/* Microseconds elapsed since start, used as probe argument */
+static inline uint64
+pgtsq_probe_elapsed_us(instr_time start)
+{
+	instr_time	now;
+
+	INSTR_TIME_SET_CURRENT(now);
+	INSTR_TIME_SUBTRACT(now, start);
+	return INSTR_TIME_GET_MICROSEC(now);
+}
+#endif
 
 
 #endif
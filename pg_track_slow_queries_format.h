@@ -0,0 +1,371 @@
+/*
+ * Storage format definitions, shared by the extension and the pg_tsq_dump
+ * frontend tool: only base types may be used here.
+ */
+#ifndef _PG_TRACK_SLOW_QUERIES_FORMAT_H_
+#define _PG_TRACK_SLOW_QUERIES_FORMAT_H_
+
+/* Legacy single storage file name */
+#define TSQ_LEGACY_FILE_NAME	"pg_track_slow_queries.stat"
+/* Storage segment file names: prefix, 8 hex digits segment number, suffix */
+#define TSQ_SEGMENT_PREFIX	"pg_track_slow_queries."
+#define TSQ_SEGMENT_SUFFIX	".stat"
+/* Segment header magic ("TSQ\0") and current format version */
+#define TSQ_SEGMENT_MAGIC	0x00515354
+#define TSQ_FORMAT_VERSION	1
+/* Format version of headerless segments */
+#define TSQ_FORMAT_LEGACY	0
+/* Codecs of compressed rows */
+#define TSQ_CODEC_PGLZ		1
+/* Number of items of a serialized entry */
+#define TSQ_ROW_ITEMS		13
+/* FNV-1a offset basis and prime, see pgtsq_hash_bytes() */
+#define TSQ_HASH_INIT		UINT64CONST(0xcbf29ce484222325)
+#define TSQ_HASH_PRIME		UINT64CONST(0x100000001b3)
+
+/*
+ * Header written at the beginning of each storage segment, legacy segments
+ * have none.
+ */
+typedef struct TSQSegmentHeader {
+	uint32		magic;			/* TSQ_SEGMENT_MAGIC */
+	uint16		version;		/* Format version of the rows */
+	uint16		codec;			/* Codec of compressed rows */
+	int64		created;		/* Segment creation time (TimestampTz) */
+} TSQSegmentHeader;
+
+/*
+ * Rows of segments with a header are not compressed as a whole, unlike legacy
+ * ones: their data is made of streams, the metadata items, the query item,
+ * the plan item and the relations item, each a TSQStreamHeader followed by
+ * its data, compressed on its own. Readers skip the streams of the columns
+ * they don't return.
+ */
+typedef enum TSQStream {
+	TSQ_STREAM_META = 0,
+	TSQ_STREAM_QUERY,
+	TSQ_STREAM_PLAN,
+	TSQ_STREAM_RELATIONS,
+	TSQ_STREAMS
+} TSQStream;
+
+#define TSQ_STREAMS_ALL		((1 << TSQ_STREAMS) - 1)
+
+typedef struct TSQStreamHeader {
+	uint32		lz_len;			/* Compressed length, 0 if not compressed */
+	uint32		len;			/* Uncompressed length */
+} TSQStreamHeader;
+
+/*
+ * The rows written at once by the collector form a block, followed in
+ * segments with a header by a footer: a frame whose compressed length is
+ * TSQ_FOOTER_MARKER and whose length is the size of the footer. Footers
+ * summarize the rows of their block, filtered readers find them walking
+ * backward from the end of the segment and skip the blocks whose rows can't
+ * match without reading them. Rows written by imports are not in blocks,
+ * readers always read them.
+ *
+ * A footer holds a TSQBlockFooter whose Bloom filter is folded to the size its
+ * block needs, from TSQ_BLOOM_MIN_BITS up to TSQ_BLOOM_BITS, then the size of
+ * the footer so that readers can find its beginning.
+ */
+#define TSQ_FOOTER_MARKER	0xFFFFFFFF
+/* Footer magic ("TSQF") */
+#define TSQ_FOOTER_MAGIC	0x46515354
+#define TSQ_BLOOM_BITS		1024
+#define TSQ_BLOOM_MIN_BITS	64
+/* Bloom filter bits per row of a block, rounded up to a power of two */
+#define TSQ_BLOOM_ROW_BITS	32
+#define TSQ_BLOOM_HASHES	3
+
+/* Kinds of the values of the Bloom filters, hashed along with them */
+typedef enum TSQBloomKind {
+	TSQ_BLOOM_USERNAME = 'u',
+	TSQ_BLOOM_APPNAME = 'a',
+	TSQ_BLOOM_DBNAME = 'd',
+	TSQ_BLOOM_QUERYID = 'q'
+} TSQBloomKind;
+
+typedef struct TSQBlockFooter {
+	uint32		magic;			/* TSQ_FOOTER_MAGIC */
+	uint32		nrows;			/* Number of rows of the block */
+	uint64		length;			/* Length of the rows, before the footer */
+	int64		min_end_time;	/* Range of the end times (TimestampTz) */
+	int64		max_end_time;
+	double		min_duration;	/* Range of the durations */
+	double		max_duration;
+	uint8		bloom[TSQ_BLOOM_BITS / 8];	/* Bloom filter of the usernames,
+											 * appnames, dbnames and query
+											 * identifiers */
+} TSQBlockFooter;
+
+/* Size of a footer, frame excluded, and of its Bloom filter */
+#define TSQ_FOOTER_SIZE(bloom_size) \
+	(offsetof(TSQBlockFooter, bloom) + (bloom_size) + sizeof(uint32))
+#define TSQ_FOOTER_BLOOM_SIZE(size) \
+	((size) - offsetof(TSQBlockFooter, bloom) - sizeof(uint32))
+
+/* FNV-1a hash of a value of the Bloom filters */
+static inline uint64
+pgtsq_bloom_hash(char kind, const char *data, uint32 length)
+{
+	uint64		hash = TSQ_HASH_INIT;
+
+	hash = (hash ^ (unsigned char) kind) * TSQ_HASH_PRIME;
+	for (uint32 i = 0; i < length; i++)
+		hash = (hash ^ (unsigned char) data[i]) * TSQ_HASH_PRIME;
+	return hash;
+}
+
+/* Bit of the Bloom filters set by the nth hash of a value */
+#define pgtsq_bloom_bit(hash, n) \
+	(((uint32) (hash) + (n) * ((uint32) ((hash) >> 32) | 1)) % TSQ_BLOOM_BITS)
+
+static inline void
+pgtsq_bloom_add(uint8 *bloom, char kind, const char *data, uint32 length)
+{
+	uint64		hash = pgtsq_bloom_hash(kind, data, length);
+
+	for (uint32 n = 0; n < TSQ_BLOOM_HASHES; n++)
+	{
+		uint32		bit = pgtsq_bloom_bit(hash, n);
+
+		bloom[bit / 8] |= 1 << (bit % 8);
+	}
+}
+
+/* Returns false if no value of the filter equals the given one */
+static inline bool
+pgtsq_bloom_test(const uint8 *bloom, char kind, const char *data, uint32 length)
+{
+	uint64		hash = pgtsq_bloom_hash(kind, data, length);
+
+	for (uint32 n = 0; n < TSQ_BLOOM_HASHES; n++)
+	{
+		uint32		bit = pgtsq_bloom_bit(hash, n);
+
+		if ((bloom[bit / 8] & (1 << (bit % 8))) == 0)
+			return false;
+	}
+	return true;
+}
+
+/* Size in bytes of the Bloom filter of a block of nrows rows */
+static inline uint32
+pgtsq_bloom_size(uint32 nrows)
+{
+	uint32		bits = TSQ_BLOOM_MIN_BITS;
+
+	while (bits < TSQ_BLOOM_BITS && bits < (uint64) nrows * TSQ_BLOOM_ROW_BITS)
+		bits <<= 1;
+	return bits / 8;
+}
+
+/*
+ * Folds a Bloom filter into its first size bytes, size being a power of two:
+ * the bits set modulo TSQ_BLOOM_BITS are then set modulo size * 8
+ */
+static inline void
+pgtsq_bloom_fold(uint8 *bloom, uint32 size)
+{
+	for (uint32 i = size; i < TSQ_BLOOM_BITS / 8; i++)
+		bloom[i % size] |= bloom[i];
+}
+
+/* Repeats a Bloom filter folded into its first size bytes to test it */
+static inline void
+pgtsq_bloom_unfold(uint8 *bloom, uint32 size)
+{
+	for (uint32 i = size; i < TSQ_BLOOM_BITS / 8; i++)
+		bloom[i] = bloom[i % size];
+}
+
+/*
+ * The relations item of a row is the array of the OIDs of the tables and
+ * indexes its query used, as uint32 in host byte order, sorted.
+ *
+ * Each segment written by the collector has a relation index, a file named
+ * like the segment with the TSQ_RELINDEX_SUFFIX suffix. For each block, it
+ * holds a TSQRelIndexEntry per relation used by its rows, then one whose
+ * relid is 0 marking the block as indexed, so that a block whose entries have
+ * not all been written is not. Readers looking for the entries using a
+ * relation skip the indexed blocks without an entry for it.
+ */
+#define TSQ_RELINDEX_SUFFIX	".rel"
+
+typedef struct TSQRelIndexEntry {
+	uint32		relid;			/* Relation OID, 0 for the block end */
+	uint32		padding;
+	uint64		start;			/* Offset of the first row of the block */
+	uint64		end;			/* Offset after the block footer */
+} TSQRelIndexEntry;
+
+/*
+ * Binary plan snapshots, stored in the plan item instead of the EXPLAIN JSON
+ * text and rendered as JSON when read. They start with TSQ_PLAN_MAGIC, a
+ * byte that never starts a JSON text, and their version, followed by the
+ * table of the relation, schema, alias and index names, each stored once,
+ * then the tree of nodes in prefix order, each node being:
+ *
+ *   uint8 type (TSQPlanNodeType), uint8 subtype, uint8 parent
+ *   (TSQPlanParent), uint8 flags, startup cost, total cost, rows, width,
+ *   if TSQ_PLAN_RELATION: relation name, schema and alias,
+ *   if TSQ_PLAN_INDEX: index name,
+ *   if TSQ_PLAN_TIMING: actual startup time, actual total time,
+ *   if TSQ_PLAN_INSTR: actual rows, loops,
+ *   number of children, then the children.
+ *
+ * Numbers are unsigned LEB128 varints: costs in hundredths, times in us,
+ * rows rounded, as EXPLAIN prints them. Names are varint indexes in the
+ * table, which is a varint number of strings, each a varint length followed
+ * by its bytes.
+ *
+ * Version 1 snapshots have no table and no varints: costs, rows and times
+ * are float8, width an int32 and the number of children an uint32, all in
+ * host byte order, names are inline, a uint16 length followed by the bytes.
+ */
+#define TSQ_PLAN_MAGIC		0x01
+#define TSQ_PLAN_VERSION	2
+#define TSQ_PLAN_VERSION_FIXED	1	/* Fixed-size numbers, inline names */
+
+/* Scales of the costs and times (ms) stored as varints */
+#define TSQ_PLAN_COST_SCALE		100.0
+#define TSQ_PLAN_TIME_SCALE		1000.0
+
+/* Node flags */
+#define TSQ_PLAN_INSTR		0x01	/* Actual rows and loops */
+#define TSQ_PLAN_TIMING		0x02	/* Actual times */
+#define TSQ_PLAN_RELATION	0x04
+#define TSQ_PLAN_INDEX		0x08
+
+/* Node types, as named by EXPLAIN. Numbers are stored, only append. */
+typedef enum TSQPlanNodeType {
+	TSQ_NODE_UNKNOWN = 0,
+	TSQ_NODE_RESULT,
+	TSQ_NODE_PROJECT_SET,
+	TSQ_NODE_MODIFY_TABLE,
+	TSQ_NODE_APPEND,
+	TSQ_NODE_MERGE_APPEND,
+	TSQ_NODE_RECURSIVE_UNION,
+	TSQ_NODE_BITMAP_AND,
+	TSQ_NODE_BITMAP_OR,
+	TSQ_NODE_NESTED_LOOP,
+	TSQ_NODE_MERGE_JOIN,
+	TSQ_NODE_HASH_JOIN,
+	TSQ_NODE_SEQ_SCAN,
+	TSQ_NODE_SAMPLE_SCAN,
+	TSQ_NODE_GATHER,
+	TSQ_NODE_GATHER_MERGE,
+	TSQ_NODE_INDEX_SCAN,
+	TSQ_NODE_INDEX_ONLY_SCAN,
+	TSQ_NODE_BITMAP_INDEX_SCAN,
+	TSQ_NODE_BITMAP_HEAP_SCAN,
+	TSQ_NODE_TID_SCAN,
+	TSQ_NODE_SUBQUERY_SCAN,
+	TSQ_NODE_FUNCTION_SCAN,
+	TSQ_NODE_TABLE_FUNCTION_SCAN,
+	TSQ_NODE_VALUES_SCAN,
+	TSQ_NODE_CTE_SCAN,
+	TSQ_NODE_NAMED_TUPLESTORE_SCAN,
+	TSQ_NODE_WORKTABLE_SCAN,
+	TSQ_NODE_FOREIGN_SCAN,
+	TSQ_NODE_CUSTOM_SCAN,
+	TSQ_NODE_MATERIALIZE,
+	TSQ_NODE_SORT,
+	TSQ_NODE_GROUP,
+	TSQ_NODE_AGGREGATE,
+	TSQ_NODE_WINDOW_AGG,
+	TSQ_NODE_UNIQUE,
+	TSQ_NODE_SETOP,
+	TSQ_NODE_LOCK_ROWS,
+	TSQ_NODE_LIMIT,
+	TSQ_NODE_HASH,
+	TSQ_NODE_TYPES
+} TSQPlanNodeType;
+
+/* Node subtypes: join type of joins, strategy of aggregates and set
+ * operations, operation of table modifications, 0 if none */
+typedef enum TSQPlanSubtype {
+	TSQ_SUBTYPE_NONE = 0,
+	TSQ_SUBTYPE_INNER,
+	TSQ_SUBTYPE_LEFT,
+	TSQ_SUBTYPE_FULL,
+	TSQ_SUBTYPE_RIGHT,
+	TSQ_SUBTYPE_SEMI,
+	TSQ_SUBTYPE_ANTI,
+	TSQ_SUBTYPE_PLAIN,
+	TSQ_SUBTYPE_SORTED,
+	TSQ_SUBTYPE_HASHED,
+	TSQ_SUBTYPE_MIXED,
+	TSQ_SUBTYPE_INSERT,
+	TSQ_SUBTYPE_UPDATE,
+	TSQ_SUBTYPE_DELETE,
+	TSQ_SUBTYPES
+} TSQPlanSubtype;
+
+/* Relationship of a node with its parent */
+typedef enum TSQPlanParent {
+	TSQ_PARENT_NONE = 0,
+	TSQ_PARENT_OUTER,
+	TSQ_PARENT_INNER,
+	TSQ_PARENT_MEMBER,
+	TSQ_PARENT_SUBQUERY,
+	TSQ_PARENT_INITPLAN,
+	TSQ_PARENT_SUBPLAN,
+	TSQ_PARENTS
+} TSQPlanParent;
+
+/* Output of the plan renderer */
+typedef void (*TSQPlanAppend) (void *arg, const char *data, size_t len);
+
+/*
+ * Renders a binary plan snapshot as JSON, like EXPLAIN does. Returns false if
+ * the snapshot is invalid, with partial output.
+ */
+extern bool pgtsq_render_plan(const char *data, uint32 length,
+							  TSQPlanAppend append, void *arg);
+
+#define pgtsq_is_binary_plan(data, length) \
+	((length) > 0 && (unsigned char) (data)[0] == TSQ_PLAN_MAGIC)
+
+/*
+ * Forwarding protocol, spoken over TCP by the collector to a remote
+ * aggregator. Integers are in host byte order, like in storage segments.
+ */
+/* Magics of the hello message ("TSQH") and of blocks ("TSQB") */
+#define TSQ_FORWARD_HELLO_MAGIC	0x48515354
+#define TSQ_BLOCK_MAGIC		0x42515354
+#define TSQ_FORWARD_NODE_LEN	64
+
+/*
+ * Sent by the collector once per connection, before any block
+ */
+typedef struct TSQForwardHello {
+	uint32		magic;			/* TSQ_FORWARD_HELLO_MAGIC */
+	uint16		version;		/* Format version of the rows */
+	uint16		codec;			/* Codec of compressed rows */
+	int64		stream;			/* Stream of blocks, sequence numbers only
+								 * grow within a stream */
+	char		node[TSQ_FORWARD_NODE_LEN];	/* Sender node name */
+} TSQForwardHello;
+
+/*
+ * Header of a block, followed by length bytes: the block exactly as stored in
+ * segments, its rows then their footer, then the nrelids relation OIDs its
+ * rows use, sorted, for the relation index of the segment the aggregator
+ * appends the block to. The aggregator acknowledges a block by sending back
+ * its sequence number as a uint64 once the block is stored.
+ */
+typedef struct TSQBlockHeader {
+	uint32		magic;			/* TSQ_BLOCK_MAGIC */
+	uint32		nrows;			/* Number of rows */
+	uint32		length;			/* Length of the block and its relations */
+	uint32		nrelids;		/* Number of relation OIDs, or
+								 * TSQ_BLOCK_UNINDEXED */
+	uint64		seqno;			/* Sequence number in the stream, from 1 */
+} TSQBlockHeader;
+
+/* nrelids of a block with a malformed row, which must not be indexed */
+#define TSQ_BLOCK_UNINDEXED	0xFFFFFFFF
+
+#endif
@@ -0,0 +1,1212 @@
+/*
+ * pg_tsq_dump
+ *
+ * Dumps pg_track_slow_queries storage files as NDJSON or CSV, without any
+ * server. Files are read sequentially by the main thread, in chunks of whole
+ * rows, while the previous chunks are decompressed, parsed, filtered and
+ * formatted by worker threads, one per chunk. Outputs are written in the
+ * order of the rows.
+ */
+
+#include "postgres_fe.h"
+
+#include <pthread.h>
+#include <time.h>
+
+#include "common/pg_lzcompress.h"
+#include "getopt_long.h"
+
+#include "pg_track_slow_queries_format.h"
+
+/* Raw rows read per chunk */
+#define DUMP_CHUNK_SIZE		(8 * 1024 * 1024)
+#define DUMP_MAX_JOBS		64
+/* Seconds between the Unix and PostgreSQL epochs */
+#define DUMP_EPOCH_OFFSET	INT64CONST(946684800)
+#define DUMP_USECS_PER_SEC	INT64CONST(1000000)
+
+typedef enum DumpFormat {
+	DUMP_FORMAT_NDJSON = 0,
+	DUMP_FORMAT_CSV
+} DumpFormat;
+
+/* Row items, in the order of the current format */
+typedef enum DumpItemId {
+	ITEM_END_TIME = 0,
+	ITEM_START_TIME,
+	ITEM_DURATION,
+	ITEM_USERNAME,
+	ITEM_APPNAME,
+	ITEM_DBNAME,
+	ITEM_TEMP_BLKS_WRITTEN,
+	ITEM_HITRATIO,
+	ITEM_NTUPLES,
+	ITEM_QUERYID,
+	ITEM_QUERY,
+	ITEM_PLAN,
+	ITEM_RELATIONS
+} DumpItemId;
+
+/* Item of a row, not NUL-terminated */
+typedef struct DumpItem {
+	const char	*data;
+	uint32		length;
+} DumpItem;
+
+/* Growable output buffer */
+typedef struct DumpBuffer {
+	char		*data;
+	size_t		len;
+	size_t		size;
+} DumpBuffer;
+
+/* Storage file to dump */
+typedef struct DumpFile {
+	char		path[MAXPGPATH];
+	int			version;		/* Format version of the rows */
+	int			codec;			/* Codec of compressed rows */
+} DumpFile;
+
+/* Rows of a single file, as stored, and their formatted output */
+typedef struct DumpChunk {
+	DumpFile	*file;
+	DumpBuffer	raw;
+	DumpBuffer	row;			/* Decompression buffer */
+	DumpBuffer	out;
+	DumpBuffer	plan;			/* Rendering buffer of binary plans */
+	uint64		nrows;			/* Rows written to out */
+	uint64		nerrors;		/* Rows that could not be decoded */
+} DumpChunk;
+
+/* Block of rows none of which pass the filters, footer included */
+typedef struct DumpRange {
+	off_t		start;
+	off_t		end;
+} DumpRange;
+
+/* Sequential reader of the files to dump */
+typedef struct DumpReader {
+	DumpFile	*files;
+	int			nfiles;
+	int			current;		/* File being read */
+	FILE		*fd;
+	off_t		offset;			/* Offset of the next row */
+	off_t		size;			/* Size of the file */
+	DumpRange	*skipped;		/* Blocks of the file to skip, in order */
+	int			nskipped;
+	int			next_skipped;
+	int			nerrors;		/* Files that could not be read */
+} DumpReader;
+
+static const char *progname;
+
+/* Options, read-only once the dump has started */
+static DumpFormat format = DUMP_FORMAT_NDJSON;
+static const char *dbname = NULL;
+static bool has_since = false;
+static int64 since = 0;
+static bool has_until = false;
+static int64 until = 0;
+
+static const char *columns[] = {
+	"datetime", "start_datetime", "duration", "username", "appname", "dbname",
+	"temp_blks_written", "hitratio", "ntuples", "queryid", "query", "plan"
+};
+
+static void
+usage(void)
+{
+	printf("%s dumps pg_track_slow_queries storage files, without any server.\n\n", progname);
+	printf("Usage:\n");
+	printf("  %s [OPTION]... [FILE|DIRECTORY]...\n", progname);
+	printf("\nDirectories are searched for storage files, a data directory is\n");
+	printf("searched in its pg_stat subdirectory. Defaults to the current one.\n");
+	printf("\nOptions:\n");
+	printf("  -F, --format=FORMAT    output format, ndjson (default) or csv\n");
+	printf("  -d, --dbname=NAME      only dump the queries run on this database\n");
+	printf("  -s, --since=TIMESTAMP  only dump the queries ended at or after TIMESTAMP\n");
+	printf("  -u, --until=TIMESTAMP  only dump the queries ended before TIMESTAMP\n");
+	printf("  -j, --jobs=NUM         use this many decompression threads\n");
+	printf("  -o, --output=FILE      output file, defaults to stdout\n");
+	printf("  -?, --help             show this help, then exit\n");
+	printf("\nTimestamps are in the ISO format, \"YYYY-MM-DD[ HH:MM:SS[.US]][+TZ]\",\n");
+	printf("UTC when TZ is not specified.\n");
+}
+
+static void
+buffer_reserve(DumpBuffer *buf, size_t needed)
+{
+	if (buf->len + needed <= buf->size)
+		return;
+	buf->size = Max(buf->size * 2, buf->len + needed);
+	buf->size = Max(buf->size, 1024);
+	buf->data = pg_realloc(buf->data, buf->size);
+}
+
+static void
+buffer_append(DumpBuffer *buf, const char *data, size_t len)
+{
+	buffer_reserve(buf, len);
+	memcpy(buf->data + buf->len, data, len);
+	buf->len += len;
+}
+
+static void
+buffer_append_char(DumpBuffer *buf, char c)
+{
+	buffer_reserve(buf, 1);
+	buf->data[buf->len++] = c;
+}
+
+static void
+buffer_printf(DumpBuffer *buf, const char *fmt,...) pg_attribute_printf(2, 3);
+
+static void
+buffer_printf(DumpBuffer *buf, const char *fmt,...)
+{
+	va_list		args;
+	int			len;
+
+	buffer_reserve(buf, 64);
+	va_start(args, fmt);
+	len = vsnprintf(buf->data + buf->len, buf->size - buf->len, fmt, args);
+	va_end(args);
+	if (len >= (int) (buf->size - buf->len))
+	{
+		buffer_reserve(buf, len + 1);
+		va_start(args, fmt);
+		vsnprintf(buf->data + buf->len, buf->size - buf->len, fmt, args);
+		va_end(args);
+	}
+	buf->len += len;
+}
+
+/*
+ * Days since 1970-01-01 of a proleptic Gregorian date
+ */
+static int64
+days_from_civil(int y, int m, int d)
+{
+	int64	era;
+	int		yoe;
+	int		doy;
+
+	y -= m <= 2;
+	era = (y >= 0 ? y : y - 399) / 400;
+	yoe = (int) (y - era * 400);
+	doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+	return era * 146097 + yoe * 365 + yoe / 4 - yoe / 100 + doy - 719468;
+}
+
+/*
+ * Parses an ISO timestamp, "YYYY-MM-DD[ HH:MM:SS[.US]][+TZ]" ('T' is also
+ * accepted as separator), as output by PostgreSQL with the ISO DateStyle.
+ * Sets *ts to microseconds since the PostgreSQL epoch, returns false if the
+ * text can't be parsed.
+ */
+static bool
+parse_timestamp(const char *text, size_t len, int64 *ts)
+{
+	char	buf[64];
+	char	*p;
+	int		y, mo, d, h = 0, mi = 0, s = 0;
+	int64	usec = 0;
+	int		tz = 0;
+	int		n = 0;
+
+	if (len >= sizeof(buf))
+		return false;
+	memcpy(buf, text, len);
+	buf[len] = '\0';
+
+	if (sscanf(buf, "%4d-%2d-%2d%n", &y, &mo, &d, &n) != 3)
+		return false;
+	p = buf + n;
+	if (*p == ' ' || *p == 'T')
+	{
+		if (sscanf(p + 1, "%2d:%2d:%2d%n", &h, &mi, &s, &n) != 3)
+			return false;
+		p += 1 + n;
+		if (*p == '.')
+		{
+			int64	scale = 100000;
+
+			for (p++; *p >= '0' && *p <= '9'; p++, scale /= 10)
+				usec += (*p - '0') * scale;
+		}
+	}
+	if (*p == '+' || *p == '-')
+	{
+		int		sign = (*p == '+') ? 1 : -1;
+		int		tzh = 0, tzm = 0, tzs = 0;
+
+		if (sscanf(p + 1, "%2d%n", &tzh, &n) != 1)
+			return false;
+		p += 1 + n;
+		if (*p == ':' && sscanf(p + 1, "%2d%n", &tzm, &n) == 1)
+		{
+			p += 1 + n;
+			if (*p == ':' && sscanf(p + 1, "%2d%n", &tzs, &n) == 1)
+				p += 1 + n;
+		}
+		tz = sign * (tzh * 3600 + tzm * 60 + tzs);
+	}
+	else if (*p == 'Z')
+		p++;
+	if (*p != '\0' || mo < 1 || mo > 12 || d < 1 || d > 31 ||
+		h > 23 || mi > 59 || s > 60)
+		return false;
+
+	*ts = ((days_from_civil(y, mo, d) * 86400 + h * 3600 + mi * 60 + s - tz) -
+		   DUMP_EPOCH_OFFSET) * DUMP_USECS_PER_SEC + usec;
+	return true;
+}
+
+/*
+ * Formats a timestamp in UTC, in the ISO format
+ */
+static void
+format_timestamp(DumpBuffer *buf, int64 ts)
+{
+	int64		secs = ts / DUMP_USECS_PER_SEC;
+	int64		usec = ts % DUMP_USECS_PER_SEC;
+	time_t		t;
+	struct tm	tm;
+
+	if (usec < 0)
+	{
+		secs--;
+		usec += DUMP_USECS_PER_SEC;
+	}
+	t = (time_t) (secs + DUMP_EPOCH_OFFSET);
+	gmtime_r(&t, &tm);
+	buffer_printf(buf, "%04d-%02d-%02d %02d:%02d:%02d.%06d+00",
+				  tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+				  tm.tm_hour, tm.tm_min, tm.tm_sec, (int) usec);
+}
+
+/*
+ * Parses the items of a row, see pgtsq_serialize_entry(). Items of legacy
+ * rows are moved to their current position, the start time and the relations
+ * are left empty.
+ */
+static bool
+parse_items(const char *row, uint32 length, int version, DumpItem *items)
+{
+	bool		legacy = (version == TSQ_FORMAT_LEGACY);
+	uint32		p = 0;
+	int			i;
+
+	memset(items, 0, sizeof(DumpItem) * TSQ_ROW_ITEMS);
+	for (i = 0; i < TSQ_ROW_ITEMS; i++)
+	{
+		DumpItem	*item;
+		char		header[9];
+		char		*end;
+
+		if (legacy && (i == ITEM_START_TIME || i == ITEM_QUERYID ||
+					   i == ITEM_RELATIONS))
+			continue;
+		item = &items[i];
+		if (length - p < 8)
+			return false;
+		memcpy(header, row + p, 8);
+		header[8] = '\0';
+		item->length = (uint32) strtoul(header, &end, 16);
+		if (*end != '\0' || item->length > length - p - 8)
+			return false;
+		item->data = row + p + 8;
+		p += 8 + item->length;
+	}
+	return true;
+}
+
+static double
+item_double(DumpItem *item)
+{
+	char	buf[64];
+
+	if (item->length >= sizeof(buf))
+		return 0;
+	memcpy(buf, item->data, item->length);
+	buf[item->length] = '\0';
+	return strtod(buf, NULL);
+}
+
+static int64
+item_int64(DumpItem *item)
+{
+	char	buf[64];
+
+	if (item->length >= sizeof(buf))
+		return 0;
+	memcpy(buf, item->data, item->length);
+	buf[item->length] = '\0';
+	return strtoll(buf, NULL, 10);
+}
+
+static void
+append_json_string(DumpBuffer *buf, const char *data, uint32 length)
+{
+	uint32	i;
+
+	buffer_append_char(buf, '"');
+	for (i = 0; i < length; i++)
+	{
+		unsigned char c = (unsigned char) data[i];
+
+		switch (c)
+		{
+			case '"':
+				buffer_append(buf, "\\\"", 2);
+				break;
+			case '\\':
+				buffer_append(buf, "\\\\", 2);
+				break;
+			case '\n':
+				buffer_append(buf, "\\n", 2);
+				break;
+			case '\r':
+				buffer_append(buf, "\\r", 2);
+				break;
+			case '\t':
+				buffer_append(buf, "\\t", 2);
+				break;
+			default:
+				if (c < 0x20)
+					buffer_printf(buf, "\\u%04x", c);
+				else
+					buffer_append_char(buf, c);
+		}
+	}
+	buffer_append_char(buf, '"');
+}
+
+/*
+ * Appends a CSV field, quoted if empty or if it contains a separator, a quote
+ * or a line break
+ */
+static void
+append_csv_string(DumpBuffer *buf, const char *data, uint32 length)
+{
+	uint32	i;
+
+	for (i = 0; i < length; i++)
+	{
+		if (data[i] == ',' || data[i] == '"' || data[i] == '\n' || data[i] == '\r')
+			break;
+	}
+	if (length > 0 && i == length)
+	{
+		buffer_append(buf, data, length);
+		return;
+	}
+	buffer_append_char(buf, '"');
+	for (i = 0; i < length; i++)
+	{
+		if (data[i] == '"')
+			buffer_append_char(buf, '"');
+		buffer_append_char(buf, data[i]);
+	}
+	buffer_append_char(buf, '"');
+}
+
+static void
+buffer_append_plan(void *arg, const char *data, size_t len)
+{
+	buffer_append((DumpBuffer *) arg, data, len);
+}
+
+/*
+ * Renders the plan item as JSON into buf, rendering binary snapshots. Returns
+ * false if the plan is empty or invalid.
+ */
+static bool
+format_plan(DumpBuffer *buf, DumpItem *item)
+{
+	size_t		start = buf->len;
+
+	if (item->length == 0)
+		return false;
+	if (!pgtsq_is_binary_plan(item->data, item->length))
+	{
+		buffer_append(buf, item->data, item->length);
+		return true;
+	}
+	if (pgtsq_render_plan(item->data, item->length, buffer_append_plan, buf))
+		return true;
+	buf->len = start;
+	return false;
+}
+
+/*
+ * Formats a row if it passes the filters
+ */
+static void
+format_row(DumpChunk *chunk, DumpItem *items)
+{
+	DumpBuffer	*out = &chunk->out;
+	DumpItem	*end_item = &items[ITEM_END_TIME];
+	int64		end_time = 0;
+	int64		start_time = 0;
+	bool		has_time;
+	double		duration;
+	int			i;
+
+	if (dbname != NULL &&
+		(items[ITEM_DBNAME].length != strlen(dbname) ||
+		 memcmp(items[ITEM_DBNAME].data, dbname, items[ITEM_DBNAME].length) != 0))
+		return;
+
+	duration = item_double(&items[ITEM_DURATION]);
+	if (chunk->file->version != TSQ_FORMAT_LEGACY)
+	{
+		end_time = item_int64(end_item);
+		start_time = item_int64(&items[ITEM_START_TIME]);
+		has_time = true;
+	}
+	else if ((has_time = parse_timestamp(end_item->data, end_item->length, &end_time)))
+		start_time = end_time - (int64) (duration * 1000.0);
+
+	/* Legacy rows whose end time can't be parsed never pass time filters */
+	if ((has_since || has_until) &&
+		(!has_time || (has_since && end_time < since) ||
+		 (has_until && end_time >= until)))
+		return;
+
+	if (format == DUMP_FORMAT_NDJSON)
+	{
+		buffer_append(out, "{\"datetime\":\"", 13);
+		if (has_time)
+			format_timestamp(out, end_time);
+		else
+			buffer_append(out, end_item->data, end_item->length);
+		buffer_append(out, "\",\"start_datetime\":", 19);
+		if (has_time)
+		{
+			buffer_append_char(out, '"');
+			format_timestamp(out, start_time);
+			buffer_append_char(out, '"');
+		}
+		else
+			buffer_append(out, "null", 4);
+		buffer_printf(out, ",\"duration\":%.2f", duration);
+		for (i = ITEM_USERNAME; i <= ITEM_DBNAME; i++)
+		{
+			buffer_printf(out, ",\"%s\":", columns[i]);
+			append_json_string(out, items[i].data, items[i].length);
+		}
+		buffer_printf(out, ",\"temp_blks_written\":" INT64_FORMAT
+					  ",\"hitratio\":%g,\"ntuples\":" INT64_FORMAT
+					  ",\"queryid\":" INT64_FORMAT ",\"query\":",
+					  item_int64(&items[ITEM_TEMP_BLKS_WRITTEN]),
+					  item_double(&items[ITEM_HITRATIO]),
+					  item_int64(&items[ITEM_NTUPLES]),
+					  item_int64(&items[ITEM_QUERYID]));
+		append_json_string(out, items[ITEM_QUERY].data, items[ITEM_QUERY].length);
+		/* Plans are JSON objects, or binary snapshots rendered as such */
+		buffer_append(out, ",\"plan\":", 8);
+		if (!format_plan(out, &items[ITEM_PLAN]))
+			buffer_append(out, "null", 4);
+		buffer_append(out, "}\n", 2);
+	}
+	else
+	{
+		if (has_time)
+			format_timestamp(out, end_time);
+		else
+			append_csv_string(out, end_item->data, end_item->length);
+		buffer_append_char(out, ',');
+		if (has_time)
+			format_timestamp(out, start_time);
+		buffer_printf(out, ",%.2f", duration);
+		for (i = ITEM_USERNAME; i <= ITEM_DBNAME; i++)
+		{
+			buffer_append_char(out, ',');
+			append_csv_string(out, items[i].data, items[i].length);
+		}
+		buffer_printf(out, "," INT64_FORMAT ",%g," INT64_FORMAT "," INT64_FORMAT ",",
+					  item_int64(&items[ITEM_TEMP_BLKS_WRITTEN]),
+					  item_double(&items[ITEM_HITRATIO]),
+					  item_int64(&items[ITEM_NTUPLES]),
+					  item_int64(&items[ITEM_QUERYID]));
+		append_csv_string(out, items[ITEM_QUERY].data, items[ITEM_QUERY].length);
+		buffer_append_char(out, ',');
+		chunk->plan.len = 0;
+		if (format_plan(&chunk->plan, &items[ITEM_PLAN]))
+			append_csv_string(out, chunk->plan.data, chunk->plan.len);
+		buffer_append_char(out, '\n');
+	}
+	chunk->nrows++;
+}
+
+/*
+ * Decompresses the streams of a row of a file in the current format, size
+ * bytes at data, into buf
+ */
+static bool
+decode_streams(const char *data, uint32 size, DumpBuffer *buf)
+{
+	TSQStreamHeader header;
+	uint32		p = 0;
+	int			s;
+
+	buf->len = 0;
+	for (s = 0; s < TSQ_STREAMS; s++)
+	{
+		uint32		stored;
+
+		if (size - p < sizeof(TSQStreamHeader))
+			return false;
+		memcpy(&header, data + p, sizeof(TSQStreamHeader));
+		p += sizeof(TSQStreamHeader);
+		stored = header.lz_len > 0 ? header.lz_len : header.len;
+		if (size - p < stored)
+			return false;
+		if (header.len > 0)
+		{
+			buffer_reserve(buf, header.len);
+			if (header.lz_len > 0)
+			{
+				if (pglz_decompress(data + p, header.lz_len, buf->data + buf->len,
+									header.len) != (int32) header.len)
+					return false;
+			}
+			else
+				memcpy(buf->data + buf->len, data + p, header.len);
+			buf->len += header.len;
+		}
+		p += stored;
+	}
+	return p == size;
+}
+
+/*
+ * Decompresses, parses, filters and formats the rows of a chunk. Run by the
+ * worker threads.
+ */
+static void *
+process_chunk(void *arg)
+{
+	DumpChunk	*chunk = (DumpChunk *) arg;
+	DumpFile	*file = chunk->file;
+	DumpItem	items[TSQ_ROW_ITEMS];
+	size_t		p = 0;
+
+	while (p + 2 * sizeof(uint32) <= chunk->raw.len)
+	{
+		uint32		row_lz_len;
+		uint32		row_len;
+		const char	*data;
+		const char	*row;
+
+		memcpy(&row_lz_len, chunk->raw.data + p, sizeof(uint32));
+		memcpy(&row_len, chunk->raw.data + p + sizeof(uint32), sizeof(uint32));
+		data = chunk->raw.data + p + 2 * sizeof(uint32);
+		p += 2 * sizeof(uint32) + (row_lz_len > 0 ? row_lz_len : row_len);
+
+		if (file->version != TSQ_FORMAT_LEGACY)
+		{
+			/* Streams are compressed on their own, not the whole row */
+			if (row_lz_len > 0 || file->codec != TSQ_CODEC_PGLZ ||
+				!decode_streams(data, row_len, &chunk->row))
+			{
+				chunk->nerrors++;
+				continue;
+			}
+			row = chunk->row.data;
+			row_len = (uint32) chunk->row.len;
+		}
+		else if (row_lz_len > 0)
+		{
+			/* Legacy rows are compressed with pglz as a whole */
+			chunk->row.len = 0;
+			buffer_reserve(&chunk->row, row_len);
+			if (pglz_decompress(data, row_lz_len, chunk->row.data, row_len) != (int32) row_len)
+			{
+				chunk->nerrors++;
+				continue;
+			}
+			row = chunk->row.data;
+		}
+		else
+			row = data;
+
+		if (!parse_items(row, row_len, file->version, items))
+		{
+			chunk->nerrors++;
+			continue;
+		}
+		format_row(chunk, items);
+	}
+	return NULL;
+}
+
+/*
+ * Returns false if the footer of a block shows none of its rows pass the
+ * filters
+ */
+static bool
+block_match(const TSQBlockFooter *footer)
+{
+	if ((has_since && footer->max_end_time < since) ||
+		(has_until && footer->min_end_time >= until))
+		return false;
+	return dbname == NULL ||
+		pgtsq_bloom_test(footer->bloom, TSQ_BLOOM_DBNAME, dbname, strlen(dbname));
+}
+
+/*
+ * Reads the footer of the block of the file being opened ending at end.
+ * Returns the offset of the frame of the footer, or -1 if there is no valid
+ * footer.
+ */
+static off_t
+read_footer(DumpReader *reader, off_t end, TSQBlockFooter *footer)
+{
+	uint32		frame[2];
+	uint32		size;
+	uint32		bloom_size;
+	off_t		footer_start;
+
+	/* The footer ends with its size */
+	if (end - reader->offset < (off_t) sizeof(uint32) ||
+		fseeko(reader->fd, end - sizeof(uint32), SEEK_SET) != 0 ||
+		fread(&size, sizeof(uint32), 1, reader->fd) != 1 ||
+		size < TSQ_FOOTER_SIZE(TSQ_BLOOM_MIN_BITS / 8) ||
+		size > TSQ_FOOTER_SIZE(TSQ_BLOOM_BITS / 8))
+		return -1;
+	bloom_size = TSQ_FOOTER_BLOOM_SIZE(size);
+	if ((bloom_size & (bloom_size - 1)) != 0 ||
+		end - reader->offset < (off_t) (sizeof(frame) + size))
+		return -1;
+
+	footer_start = end - sizeof(frame) - size;
+	if (fseeko(reader->fd, footer_start, SEEK_SET) != 0 ||
+		fread(frame, sizeof(frame), 1, reader->fd) != 1 ||
+		fread(footer, offsetof(TSQBlockFooter, bloom) + bloom_size, 1,
+			  reader->fd) != 1)
+		return -1;
+	if (frame[0] != TSQ_FOOTER_MARKER || frame[1] != size ||
+		footer->magic != TSQ_FOOTER_MAGIC ||
+		footer->length > (uint64) (footer_start - reader->offset))
+		return -1;
+
+	pgtsq_bloom_unfold(footer->bloom, bloom_size);
+	return footer_start;
+}
+
+/*
+ * Finds the blocks of the file being opened none of whose rows pass the
+ * filters, walking their footers backward from the end of the file, then
+ * goes back to its first row
+ */
+static bool
+find_skipped_blocks(DumpReader *reader)
+{
+	off_t		end = reader->size;
+	off_t		footer_start;
+	int			allocated = 0;
+	TSQBlockFooter footer;
+
+	reader->nskipped = reader->next_skipped = 0;
+	while ((footer_start = read_footer(reader, end, &footer)) >= 0)
+	{
+		if (!block_match(&footer))
+		{
+			if (reader->nskipped == allocated)
+			{
+				allocated = allocated == 0 ? 16 : allocated * 2;
+				reader->skipped = pg_realloc(reader->skipped,
+											 allocated * sizeof(DumpRange));
+			}
+			reader->skipped[reader->nskipped].start = footer_start - footer.length;
+			reader->skipped[reader->nskipped].end = end;
+			reader->nskipped++;
+		}
+		end = footer_start - footer.length;
+	}
+
+	/* Blocks have been found last first */
+	for (int i = 0; i < reader->nskipped / 2; i++)
+	{
+		DumpRange	range = reader->skipped[i];
+
+		reader->skipped[i] = reader->skipped[reader->nskipped - 1 - i];
+		reader->skipped[reader->nskipped - 1 - i] = range;
+	}
+	return fseeko(reader->fd, reader->offset, SEEK_SET) == 0;
+}
+
+/*
+ * Opens a storage file and reads its header, returns false if it can't be
+ * dumped
+ */
+static bool
+open_file(DumpReader *reader, DumpFile *file)
+{
+	TSQSegmentHeader	header;
+	struct stat			st;
+
+	if ((reader->fd = fopen(file->path, PG_BINARY_R)) == NULL ||
+		fstat(fileno(reader->fd), &st) < 0)
+	{
+		fprintf(stderr, _("%s: could not open file \"%s\": %s\n"),
+				progname, file->path, strerror(errno));
+		if (reader->fd)
+			fclose(reader->fd);
+		reader->fd = NULL;
+		return false;
+	}
+	reader->size = st.st_size;
+
+	if (fread(&header, sizeof(TSQSegmentHeader), 1, reader->fd) == 1 &&
+		header.magic == TSQ_SEGMENT_MAGIC)
+	{
+		if (header.version > TSQ_FORMAT_VERSION)
+		{
+			fprintf(stderr, _("%s: unsupported format version %d of file \"%s\"\n"),
+					progname, header.version, file->path);
+			fclose(reader->fd);
+			reader->fd = NULL;
+			return false;
+		}
+		file->version = header.version;
+		file->codec = header.codec;
+		reader->offset = sizeof(TSQSegmentHeader);
+		reader->nskipped = 0;
+		if (file->version != TSQ_FORMAT_LEGACY &&
+			(dbname != NULL || has_since || has_until) &&
+			!find_skipped_blocks(reader))
+		{
+			fprintf(stderr, _("%s: could not read file \"%s\": %s\n"),
+					progname, file->path, strerror(errno));
+			fclose(reader->fd);
+			reader->fd = NULL;
+			return false;
+		}
+	}
+	else
+	{
+		file->version = TSQ_FORMAT_LEGACY;
+		file->codec = TSQ_CODEC_PGLZ;
+		reader->offset = 0;
+		reader->nskipped = 0;
+		if (fseeko(reader->fd, 0, SEEK_SET) != 0)
+		{
+			fprintf(stderr, _("%s: could not read file \"%s\": %s\n"),
+					progname, file->path, strerror(errno));
+			fclose(reader->fd);
+			reader->fd = NULL;
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * Reads the next rows, up to DUMP_CHUNK_SIZE bytes, all from the same file.
+ * Returns false once all files have been read.
+ */
+static bool
+read_chunk(DumpReader *reader, DumpChunk *chunk)
+{
+	bool	file_end = false;
+
+	chunk->raw.len = 0;
+	chunk->out.len = 0;
+	chunk->nrows = 0;
+	chunk->nerrors = 0;
+
+	while (reader->fd == NULL)
+	{
+		if (reader->current >= reader->nfiles)
+			return false;
+		if (!open_file(reader, &reader->files[reader->current]))
+		{
+			reader->nerrors++;
+			reader->current++;
+		}
+	}
+	chunk->file = &reader->files[reader->current];
+
+	while (chunk->raw.len < DUMP_CHUNK_SIZE)
+	{
+		uint32	lengths[2];
+		size_t	size;
+
+		while (reader->next_skipped < reader->nskipped &&
+			   reader->offset == reader->skipped[reader->next_skipped].start)
+		{
+			reader->offset = reader->skipped[reader->next_skipped++].end;
+			if (fseeko(reader->fd, reader->offset, SEEK_SET) != 0)
+				file_end = true;
+		}
+		if (file_end)
+			break;
+
+		if (fread(lengths, sizeof(uint32), 2, reader->fd) != 2)
+		{
+			file_end = true;
+			break;
+		}
+		/* Block footers are only read by find_skipped_blocks() */
+		if (lengths[0] == TSQ_FOOTER_MARKER)
+		{
+			if (reader->offset + 2 * sizeof(uint32) + lengths[1] > reader->size ||
+				fseeko(reader->fd, lengths[1], SEEK_CUR) != 0)
+			{
+				file_end = true;
+				break;
+			}
+			reader->offset += 2 * sizeof(uint32) + lengths[1];
+			continue;
+		}
+		size = lengths[0] > 0 ? lengths[0] : lengths[1];
+		/* Anything after an incomplete row has been left by an interrupted write */
+		if (lengths[1] == 0 ||
+			reader->offset + 2 * sizeof(uint32) + size > reader->size)
+		{
+			file_end = true;
+			break;
+		}
+		buffer_reserve(&chunk->raw, 2 * sizeof(uint32) + size);
+		memcpy(chunk->raw.data + chunk->raw.len, lengths, 2 * sizeof(uint32));
+		if (fread(chunk->raw.data + chunk->raw.len + 2 * sizeof(uint32), 1, size,
+				  reader->fd) != size)
+		{
+			file_end = true;
+			break;
+		}
+		chunk->raw.len += 2 * sizeof(uint32) + size;
+		reader->offset += 2 * sizeof(uint32) + size;
+	}
+
+	if (file_end)
+	{
+		if (ferror(reader->fd))
+		{
+			fprintf(stderr, _("%s: could not read file \"%s\": %s\n"),
+					progname, chunk->file->path, strerror(errno));
+			reader->nerrors++;
+		}
+		fclose(reader->fd);
+		reader->fd = NULL;
+		reader->current++;
+	}
+	return true;
+}
+
+/* Storage file found in a directory */
+typedef struct DumpDirEntry {
+	bool		legacy;
+	uint32		segno;
+	char		name[64];
+} DumpDirEntry;
+
+static int
+dir_entry_cmp(const void *a, const void *b)
+{
+	const DumpDirEntry *ea = (const DumpDirEntry *) a;
+	const DumpDirEntry *eb = (const DumpDirEntry *) b;
+
+	if (ea->legacy != eb->legacy)
+		return ea->legacy ? -1 : 1;
+	if (ea->segno != eb->segno)
+		return ea->segno < eb->segno ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Extracts the segment number from a file name, returns false if the file is
+ * not a storage segment
+ */
+static bool
+parse_segment_name(const char *name, uint32 *segno)
+{
+	size_t	prefix_len = strlen(TSQ_SEGMENT_PREFIX);
+
+	if (strlen(name) != prefix_len + 8 + strlen(TSQ_SEGMENT_SUFFIX))
+		return false;
+	if (strncmp(name, TSQ_SEGMENT_PREFIX, prefix_len) != 0 ||
+		strcmp(name + prefix_len + 8, TSQ_SEGMENT_SUFFIX) != 0)
+		return false;
+	if (strspn(name + prefix_len, "0123456789ABCDEF") != 8)
+		return false;
+
+	*segno = (uint32) strtoul(name + prefix_len, NULL, 16);
+	return true;
+}
+
+static void
+add_file(DumpReader *reader, const char *path)
+{
+	reader->files = pg_realloc(reader->files, sizeof(DumpFile) * (reader->nfiles + 1));
+	memset(&reader->files[reader->nfiles], 0, sizeof(DumpFile));
+	strlcpy(reader->files[reader->nfiles].path, path, MAXPGPATH);
+	reader->nfiles++;
+}
+
+/*
+ * Adds a file, or the storage files of a directory in the order they have
+ * been written: the legacy file, then segments by number. Segment numbers
+ * are assumed not to have wrapped around.
+ */
+static void
+add_path(DumpReader *reader, const char *path)
+{
+	char			dirpath[MAXPGPATH];
+	char			filepath[MAXPGPATH];
+	struct stat		st;
+	DIR				*dir;
+	struct dirent	*de;
+	DumpDirEntry	*entries = NULL;
+	int				nentries = 0;
+	int				i;
+
+	if (stat(path, &st) < 0)
+	{
+		fprintf(stderr, _("%s: could not stat \"%s\": %s\n"),
+				progname, path, strerror(errno));
+		exit(1);
+	}
+	if (!S_ISDIR(st.st_mode))
+	{
+		add_file(reader, path);
+		return;
+	}
+
+	/* Data directory */
+	snprintf(dirpath, MAXPGPATH, "%s/pg_stat", path);
+	if (stat(dirpath, &st) < 0 || !S_ISDIR(st.st_mode))
+		strlcpy(dirpath, path, MAXPGPATH);
+
+	if ((dir = opendir(dirpath)) == NULL)
+	{
+		fprintf(stderr, _("%s: could not open directory \"%s\": %s\n"),
+				progname, dirpath, strerror(errno));
+		exit(1);
+	}
+	while ((de = readdir(dir)) != NULL)
+	{
+		DumpDirEntry	entry;
+
+		entry.legacy = (strcmp(de->d_name, TSQ_LEGACY_FILE_NAME) == 0);
+		entry.segno = 0;
+		if (!entry.legacy && !parse_segment_name(de->d_name, &entry.segno))
+			continue;
+		strlcpy(entry.name, de->d_name, sizeof(entry.name));
+		entries = pg_realloc(entries, sizeof(DumpDirEntry) * (nentries + 1));
+		entries[nentries++] = entry;
+	}
+	closedir(dir);
+
+	if (nentries == 0)
+		fprintf(stderr, _("%s: no storage file found in \"%s\"\n"),
+				progname, dirpath);
+	else
+		qsort(entries, nentries, sizeof(DumpDirEntry), dir_entry_cmp);
+	for (i = 0; i < nentries; i++)
+	{
+		if (snprintf(filepath, MAXPGPATH, "%s/%s", dirpath,
+					 entries[i].name) >= MAXPGPATH)
+		{
+			fprintf(stderr, _("%s: path \"%s\" is too long\n"),
+					progname, dirpath);
+			exit(1);
+		}
+		add_file(reader, filepath);
+	}
+	if (entries)
+		pg_free(entries);
+}
+
+/*
+ * Reads up to n chunks, returns the number read
+ */
+static int
+read_chunks(DumpReader *reader, DumpChunk *chunks, int n)
+{
+	int		i;
+
+	for (i = 0; i < n && read_chunk(reader, &chunks[i]); i++)
+		;
+	return i;
+}
+
+int
+main(int argc, char **argv)
+{
+	static struct option long_options[] = {
+		{"format", required_argument, NULL, 'F'},
+		{"dbname", required_argument, NULL, 'd'},
+		{"since", required_argument, NULL, 's'},
+		{"until", required_argument, NULL, 'u'},
+		{"jobs", required_argument, NULL, 'j'},
+		{"output", required_argument, NULL, 'o'},
+		{"help", no_argument, NULL, '?'},
+		{NULL, 0, NULL, 0}
+	};
+	DumpReader	reader;
+	DumpChunk	*chunks;
+	DumpChunk	*current;
+	DumpChunk	*next;
+	pthread_t	*threads;
+	bool		*started;
+	FILE		*output = stdout;
+	const char	*output_path = NULL;
+	int			jobs;
+	int			ncurrent;
+	int			nnext;
+	int			c;
+	int			i;
+	uint64		nrows = 0;
+	uint64		nerrors = 0;
+
+	progname = get_progname(argv[0]);
+
+	if (argc > 1 &&
+		(strcmp(argv[1], "--help") == 0 || strcmp(argv[1], "-?") == 0))
+	{
+		usage();
+		exit(0);
+	}
+
+	jobs = (int) sysconf(_SC_NPROCESSORS_ONLN);
+
+	while ((c = getopt_long(argc, argv, "F:d:s:u:j:o:?", long_options, NULL)) != -1)
+	{
+		switch (c)
+		{
+			case 'F':
+				if (pg_strcasecmp(optarg, "ndjson") == 0)
+					format = DUMP_FORMAT_NDJSON;
+				else if (pg_strcasecmp(optarg, "csv") == 0)
+					format = DUMP_FORMAT_CSV;
+				else
+				{
+					fprintf(stderr, _("%s: invalid output format \"%s\"\n"),
+							progname, optarg);
+					exit(1);
+				}
+				break;
+			case 'd':
+				dbname = optarg;
+				break;
+			case 's':
+				if (!(has_since = parse_timestamp(optarg, strlen(optarg), &since)))
+				{
+					fprintf(stderr, _("%s: invalid timestamp \"%s\"\n"),
+							progname, optarg);
+					exit(1);
+				}
+				break;
+			case 'u':
+				if (!(has_until = parse_timestamp(optarg, strlen(optarg), &until)))
+				{
+					fprintf(stderr, _("%s: invalid timestamp \"%s\"\n"),
+							progname, optarg);
+					exit(1);
+				}
+				break;
+			case 'j':
+				jobs = atoi(optarg);
+				if (jobs < 1)
+				{
+					fprintf(stderr, _("%s: invalid number of jobs \"%s\"\n"),
+							progname, optarg);
+					exit(1);
+				}
+				break;
+			case 'o':
+				output_path = optarg;
+				break;
+			default:
+				fprintf(stderr, _("Try \"%s --help\" for more information.\n"),
+						progname);
+				exit(1);
+		}
+	}
+	jobs = Min(Max(jobs, 1), DUMP_MAX_JOBS);
+
+	memset(&reader, 0, sizeof(DumpReader));
+	if (optind < argc)
+	{
+		for (i = optind; i < argc; i++)
+			add_path(&reader, argv[i]);
+	}
+	else
+		add_path(&reader, ".");
+
+	if (output_path && (output = fopen(output_path, "w")) == NULL)
+	{
+		fprintf(stderr, _("%s: could not open file \"%s\": %s\n"),
+				progname, output_path, strerror(errno));
+		exit(1);
+	}
+
+	if (format == DUMP_FORMAT_CSV)
+	{
+		for (i = 0; i < (int) lengthof(columns); i++)
+			fprintf(output, "%s%s", i > 0 ? "," : "", columns[i]);
+		fputc('\n', output);
+	}
+
+	/*
+	 * Chunks are processed by sets of jobs: the next set is read while the
+	 * current one is processed.
+	 */
+	chunks = pg_malloc0(sizeof(DumpChunk) * jobs * 2);
+	threads = pg_malloc(sizeof(pthread_t) * jobs);
+	started = pg_malloc(sizeof(bool) * jobs);
+	current = chunks;
+	next = chunks + jobs;
+
+	ncurrent = read_chunks(&reader, current, jobs);
+	while (ncurrent > 0)
+	{
+		DumpChunk	*swap;
+
+		for (i = 0; i < ncurrent; i++)
+			started[i] = (pthread_create(&threads[i], NULL, process_chunk,
+										 &current[i]) == 0);
+		nnext = read_chunks(&reader, next, jobs);
+
+		for (i = 0; i < ncurrent; i++)
+		{
+			/* Processed here if no thread could be started */
+			if (started[i])
+				pthread_join(threads[i], NULL);
+			else
+				process_chunk(&current[i]);
+
+			if (current[i].out.len > 0 &&
+				fwrite(current[i].out.data, 1, current[i].out.len, output) != current[i].out.len)
+			{
+				fprintf(stderr, _("%s: could not write output: %s\n"),
+						progname, strerror(errno));
+				exit(1);
+			}
+			nrows += current[i].nrows;
+			nerrors += current[i].nerrors;
+		}
+
+		swap = current;
+		current = next;
+		next = swap;
+		ncurrent = nnext;
+	}
+
+	if (fflush(output) != 0 || (output != stdout && fclose(output) != 0))
+	{
+		fprintf(stderr, _("%s: could not write output: %s\n"),
+				progname, strerror(errno));
+		exit(1);
+	}
+
+	if (nerrors > 0)
+		fprintf(stderr, _("%s: " UINT64_FORMAT " rows could not be decoded\n"),
+				progname, nerrors);
+
+	exit(nerrors > 0 || reader.nerrors > 0 ? 1 : 0);
+}
@@ -0,0 +1,682 @@
+/*
+ * Binary plan snapshots
+ *
+ * Instead of rendering EXPLAIN output, which deparses every expression of
+ * the plan, backends can capture a binary snapshot of the plan tree: node
+ * types, costs, relation and index names, and instrumentation counters. The
+ * snapshot is stored as is and rendered as JSON when the plan is read, see
+ * plan_render.c.
+ */
+#include "postgres.h"
+
+#include "executor/executor.h"
+#include "executor/instrument.h"
+#include "lib/stringinfo.h"
+#include "nodes/execnodes.h"
+#include "nodes/plannodes.h"
+#include "parser/parsetree.h"
+#include "utils/hsearch.h"
+#include "utils/lsyscache.h"
+
+#include "pg_track_slow_queries.h"
+
+/* Snapshot being encoded */
+typedef struct TSQPlanWriter {
+	QueryDesc	*queryDesc;
+	StringInfoData nodes;		/* Encoded nodes */
+	StringInfoData names;		/* Names table, without its size */
+	uint32		nnames;
+	HTAB		*interned;		/* Index of each name in the table */
+} TSQPlanWriter;
+
+/* Entry of TSQPlanWriter.interned */
+typedef struct TSQPlanName {
+	char		name[NAMEDATALEN];	/* Hash key */
+	uint32		index;
+} TSQPlanName;
+
+/* Called on each child of a node, see plan_foreach_child() */
+typedef void (*TSQPlanVisitor) (void * arg, PlanState * planstate, uint8 parent);
+
+static void pgtsq_encode_node(TSQPlanWriter * writer, PlanState * planstate,
+							  uint8 parent);
+
+static void
+plan_write_varint(StringInfo buf, uint64 value)
+{
+	while (value >= 0x80)
+	{
+		appendStringInfoChar(buf, (char) ((value & 0x7F) | 0x80));
+		value >>= 7;
+	}
+	appendStringInfoChar(buf, (char) value);
+}
+
+/*
+ * Writes a cost, row count or time multiplied by scale, rounded
+ */
+static void
+plan_write_number(StringInfo buf, double value, double scale)
+{
+	value = value * scale + 0.5;
+	if (!(value > 0))
+		plan_write_varint(buf, 0);
+	else if (value >= 18446744073709551615.0)
+		plan_write_varint(buf, PG_UINT64_MAX);
+	else
+		plan_write_varint(buf, (uint64) value);
+}
+
+/*
+ * Writes the index of a name in the table, adding it if needed. Names are
+ * identifiers, shorter than NAMEDATALEN.
+ */
+static void
+plan_write_name(TSQPlanWriter * writer, const char * name)
+{
+	char		key[NAMEDATALEN];
+	TSQPlanName *entry;
+	bool		found;
+
+	memset(key, 0, NAMEDATALEN);
+	if (name != NULL)
+		strlcpy(key, name, NAMEDATALEN);
+	entry = (TSQPlanName *) hash_search(writer->interned, key, HASH_ENTER, &found);
+	if (!found)
+	{
+		size_t		len = strlen(key);
+
+		entry->index = writer->nnames++;
+		plan_write_varint(&writer->names, len);
+		appendBinaryStringInfo(&writer->names, key, (int) len);
+	}
+	plan_write_varint(&writer->nodes, entry->index);
+}
+
+/*
+ * Maps an executor node to its snapshot node type and subtype
+ */
+static uint8
+plan_node_type(Plan * plan, uint8 * subtype)
+{
+	*subtype = TSQ_SUBTYPE_NONE;
+
+	switch (nodeTag(plan))
+	{
+		case T_Result:
+			return TSQ_NODE_RESULT;
+#if (PG_VERSION_NUM >= 100000)
+		case T_ProjectSet:
+			return TSQ_NODE_PROJECT_SET;
+#endif
+		case T_ModifyTable:
+			switch (((ModifyTable *) plan)->operation)
+			{
+				case CMD_INSERT:
+					*subtype = TSQ_SUBTYPE_INSERT;
+					break;
+				case CMD_UPDATE:
+					*subtype = TSQ_SUBTYPE_UPDATE;
+					break;
+				case CMD_DELETE:
+					*subtype = TSQ_SUBTYPE_DELETE;
+					break;
+				default:
+					break;
+			}
+			return TSQ_NODE_MODIFY_TABLE;
+		case T_Append:
+			return TSQ_NODE_APPEND;
+		case T_MergeAppend:
+			return TSQ_NODE_MERGE_APPEND;
+		case T_RecursiveUnion:
+			return TSQ_NODE_RECURSIVE_UNION;
+		case T_BitmapAnd:
+			return TSQ_NODE_BITMAP_AND;
+		case T_BitmapOr:
+			return TSQ_NODE_BITMAP_OR;
+		case T_NestLoop:
+		case T_MergeJoin:
+		case T_HashJoin:
+			switch (((Join *) plan)->jointype)
+			{
+				case JOIN_INNER:
+					*subtype = TSQ_SUBTYPE_INNER;
+					break;
+				case JOIN_LEFT:
+					*subtype = TSQ_SUBTYPE_LEFT;
+					break;
+				case JOIN_FULL:
+					*subtype = TSQ_SUBTYPE_FULL;
+					break;
+				case JOIN_RIGHT:
+					*subtype = TSQ_SUBTYPE_RIGHT;
+					break;
+				case JOIN_SEMI:
+					*subtype = TSQ_SUBTYPE_SEMI;
+					break;
+				case JOIN_ANTI:
+					*subtype = TSQ_SUBTYPE_ANTI;
+					break;
+				default:
+					break;
+			}
+			if (IsA(plan, NestLoop))
+				return TSQ_NODE_NESTED_LOOP;
+			if (IsA(plan, MergeJoin))
+				return TSQ_NODE_MERGE_JOIN;
+			return TSQ_NODE_HASH_JOIN;
+		case T_SeqScan:
+			return TSQ_NODE_SEQ_SCAN;
+		case T_SampleScan:
+			return TSQ_NODE_SAMPLE_SCAN;
+#if (PG_VERSION_NUM >= 90600)
+		case T_Gather:
+			return TSQ_NODE_GATHER;
+#endif
+#if (PG_VERSION_NUM >= 100000)
+		case T_GatherMerge:
+			return TSQ_NODE_GATHER_MERGE;
+#endif
+		case T_IndexScan:
+			return TSQ_NODE_INDEX_SCAN;
+		case T_IndexOnlyScan:
+			return TSQ_NODE_INDEX_ONLY_SCAN;
+		case T_BitmapIndexScan:
+			return TSQ_NODE_BITMAP_INDEX_SCAN;
+		case T_BitmapHeapScan:
+			return TSQ_NODE_BITMAP_HEAP_SCAN;
+		case T_TidScan:
+			return TSQ_NODE_TID_SCAN;
+		case T_SubqueryScan:
+			return TSQ_NODE_SUBQUERY_SCAN;
+		case T_FunctionScan:
+			return TSQ_NODE_FUNCTION_SCAN;
+#if (PG_VERSION_NUM >= 100000)
+		case T_TableFuncScan:
+			return TSQ_NODE_TABLE_FUNCTION_SCAN;
+#endif
+		case T_ValuesScan:
+			return TSQ_NODE_VALUES_SCAN;
+		case T_CteScan:
+			return TSQ_NODE_CTE_SCAN;
+#if (PG_VERSION_NUM >= 100000)
+		case T_NamedTuplestoreScan:
+			return TSQ_NODE_NAMED_TUPLESTORE_SCAN;
+#endif
+		case T_WorkTableScan:
+			return TSQ_NODE_WORKTABLE_SCAN;
+		case T_ForeignScan:
+			return TSQ_NODE_FOREIGN_SCAN;
+		case T_CustomScan:
+			return TSQ_NODE_CUSTOM_SCAN;
+		case T_Material:
+			return TSQ_NODE_MATERIALIZE;
+		case T_Sort:
+			return TSQ_NODE_SORT;
+		case T_Group:
+			return TSQ_NODE_GROUP;
+		case T_Agg:
+			switch (((Agg *) plan)->aggstrategy)
+			{
+				case AGG_PLAIN:
+					*subtype = TSQ_SUBTYPE_PLAIN;
+					break;
+				case AGG_SORTED:
+					*subtype = TSQ_SUBTYPE_SORTED;
+					break;
+				case AGG_HASHED:
+					*subtype = TSQ_SUBTYPE_HASHED;
+					break;
+#if (PG_VERSION_NUM >= 110000)
+				case AGG_MIXED:
+					*subtype = TSQ_SUBTYPE_MIXED;
+					break;
+#endif
+				default:
+					break;
+			}
+			return TSQ_NODE_AGGREGATE;
+		case T_WindowAgg:
+			return TSQ_NODE_WINDOW_AGG;
+		case T_Unique:
+			return TSQ_NODE_UNIQUE;
+		case T_SetOp:
+			*subtype = (((SetOp *) plan)->strategy == SETOP_HASHED) ?
+				TSQ_SUBTYPE_HASHED : TSQ_SUBTYPE_SORTED;
+			return TSQ_NODE_SETOP;
+		case T_LockRows:
+			return TSQ_NODE_LOCK_ROWS;
+		case T_Limit:
+			return TSQ_NODE_LIMIT;
+		case T_Hash:
+			return TSQ_NODE_HASH;
+		default:
+			return TSQ_NODE_UNKNOWN;
+	}
+}
+
+/*
+ * Returns the range table index of the relation a node reads or modifies,
+ * 0 if none
+ */
+static Index
+plan_node_relid(Plan * plan)
+{
+	switch (nodeTag(plan))
+	{
+		case T_SeqScan:
+		case T_SampleScan:
+		case T_IndexScan:
+		case T_IndexOnlyScan:
+		case T_BitmapHeapScan:
+		case T_TidScan:
+		case T_ForeignScan:
+		case T_CustomScan:
+			return ((Scan *) plan)->scanrelid;
+		case T_ModifyTable:
+			return ((ModifyTable *) plan)->nominalRelation;
+		default:
+			return 0;
+	}
+}
+
+static Oid
+plan_node_indexid(Plan * plan)
+{
+	switch (nodeTag(plan))
+	{
+		case T_IndexScan:
+			return ((IndexScan *) plan)->indexid;
+		case T_IndexOnlyScan:
+			return ((IndexOnlyScan *) plan)->indexid;
+		case T_BitmapIndexScan:
+			return ((BitmapIndexScan *) plan)->indexid;
+		default:
+			return InvalidOid;
+	}
+}
+
+/*
+ * Returns the number of children of a node, in the snapshot
+ */
+static uint32
+plan_node_nchildren(PlanState * planstate)
+{
+	uint32		n = list_length(planstate->initPlan) + list_length(planstate->subPlan);
+
+	if (outerPlanState(planstate))
+		n++;
+	if (innerPlanState(planstate))
+		n++;
+
+	switch (nodeTag(planstate->plan))
+	{
+		case T_ModifyTable:
+			return n + ((ModifyTableState *) planstate)->mt_nplans;
+		case T_Append:
+			return n + ((AppendState *) planstate)->as_nplans;
+		case T_MergeAppend:
+			return n + ((MergeAppendState *) planstate)->ms_nplans;
+		case T_BitmapAnd:
+			return n + ((BitmapAndState *) planstate)->nplans;
+		case T_BitmapOr:
+			return n + ((BitmapOrState *) planstate)->nplans;
+		case T_SubqueryScan:
+			return n + 1;
+		case T_CustomScan:
+			return n + list_length(((CustomScanState *) planstate)->custom_ps);
+		default:
+			return n;
+	}
+}
+
+/*
+ * Visits an array of child plan states
+ */
+static void
+plan_visit_members(PlanState ** planstates, int nplans, TSQPlanVisitor visit,
+				   void * arg)
+{
+	for (int i = 0; i < nplans; i++)
+		visit(arg, planstates[i], TSQ_PARENT_MEMBER);
+}
+
+/*
+ * Visits a list of SubPlanStates
+ */
+static void
+plan_visit_subplans(List * plans, uint8 parent, TSQPlanVisitor visit, void * arg)
+{
+	ListCell	*lc;
+
+	foreach(lc, plans)
+		visit(arg, ((SubPlanState *) lfirst(lc))->planstate, parent);
+}
+
+/*
+ * Visits the children of a node, in the order EXPLAIN shows them
+ */
+static void
+plan_foreach_child(PlanState * planstate, TSQPlanVisitor visit, void * arg)
+{
+	plan_visit_subplans(planstate->initPlan, TSQ_PARENT_INITPLAN, visit, arg);
+	if (outerPlanState(planstate))
+		visit(arg, outerPlanState(planstate), TSQ_PARENT_OUTER);
+	if (innerPlanState(planstate))
+		visit(arg, innerPlanState(planstate), TSQ_PARENT_INNER);
+
+	switch (nodeTag(planstate->plan))
+	{
+		case T_ModifyTable:
+			plan_visit_members(((ModifyTableState *) planstate)->mt_plans,
+							   ((ModifyTableState *) planstate)->mt_nplans,
+							   visit, arg);
+			break;
+		case T_Append:
+			plan_visit_members(((AppendState *) planstate)->appendplans,
+							   ((AppendState *) planstate)->as_nplans,
+							   visit, arg);
+			break;
+		case T_MergeAppend:
+			plan_visit_members(((MergeAppendState *) planstate)->mergeplans,
+							   ((MergeAppendState *) planstate)->ms_nplans,
+							   visit, arg);
+			break;
+		case T_BitmapAnd:
+			plan_visit_members(((BitmapAndState *) planstate)->bitmapplans,
+							   ((BitmapAndState *) planstate)->nplans,
+							   visit, arg);
+			break;
+		case T_BitmapOr:
+			plan_visit_members(((BitmapOrState *) planstate)->bitmapplans,
+							   ((BitmapOrState *) planstate)->nplans,
+							   visit, arg);
+			break;
+		case T_SubqueryScan:
+			visit(arg, ((SubqueryScanState *) planstate)->subplan,
+				  TSQ_PARENT_SUBQUERY);
+			break;
+		case T_CustomScan:
+			{
+				ListCell   *lc;
+
+				foreach(lc, ((CustomScanState *) planstate)->custom_ps)
+					visit(arg, (PlanState *) lfirst(lc), TSQ_PARENT_MEMBER);
+			}
+			break;
+		default:
+			break;
+	}
+
+	plan_visit_subplans(planstate->subPlan, TSQ_PARENT_SUBPLAN, visit, arg);
+}
+
+static void
+plan_encode_child(void * arg, PlanState * planstate, uint8 parent)
+{
+	pgtsq_encode_node((TSQPlanWriter *) arg, planstate, parent);
+}
+
+/*
+ * Appends a node and its children to the snapshot. Children come in the
+ * order EXPLAIN shows them.
+ */
+static void
+pgtsq_encode_node(TSQPlanWriter * writer, PlanState * planstate, uint8 parent)
+{
+	StringInfo	buf = &writer->nodes;
+	Plan	   *plan = planstate->plan;
+	Instrumentation *instr = planstate->instrument;
+	uint8		type, subtype, flags = 0;
+	Index		relid = plan_node_relid(plan);
+	Oid			indexid = plan_node_indexid(plan);
+	RangeTblEntry *rte = NULL;
+
+	check_stack_depth();
+
+	type = plan_node_type(plan, &subtype);
+	if (relid > 0)
+	{
+		rte = rt_fetch(relid, writer->queryDesc->plannedstmt->rtable);
+		if (rte->rtekind == RTE_RELATION)
+			flags |= TSQ_PLAN_RELATION;
+	}
+	if (OidIsValid(indexid))
+		flags |= TSQ_PLAN_INDEX;
+	if (instr != NULL)
+	{
+		/* Finishes the current loop, as EXPLAIN ANALYZE does */
+		InstrEndLoop(instr);
+		flags |= TSQ_PLAN_INSTR;
+		if (writer->queryDesc->instrument_options & INSTRUMENT_TIMER)
+			flags |= TSQ_PLAN_TIMING;
+	}
+
+	appendStringInfoChar(buf, (char) type);
+	appendStringInfoChar(buf, (char) subtype);
+	appendStringInfoChar(buf, (char) parent);
+	appendStringInfoChar(buf, (char) flags);
+	plan_write_number(buf, plan->startup_cost, TSQ_PLAN_COST_SCALE);
+	plan_write_number(buf, plan->total_cost, TSQ_PLAN_COST_SCALE);
+	plan_write_number(buf, plan->plan_rows, 1.0);
+	plan_write_number(buf, plan->plan_width, 1.0);
+
+	if (flags & TSQ_PLAN_RELATION)
+	{
+		plan_write_name(writer, get_rel_name(rte->relid));
+		plan_write_name(writer, get_namespace_name(get_rel_namespace(rte->relid)));
+		plan_write_name(writer, rte->eref->aliasname);
+	}
+	if (flags & TSQ_PLAN_INDEX)
+		plan_write_name(writer, get_rel_name(indexid));
+
+	if (flags & TSQ_PLAN_INSTR)
+	{
+		double		nloops = instr->nloops;
+
+		if (flags & TSQ_PLAN_TIMING)
+		{
+			plan_write_number(buf, nloops > 0 ? 1000.0 * instr->startup / nloops : 0,
+							  TSQ_PLAN_TIME_SCALE);
+			plan_write_number(buf, nloops > 0 ? 1000.0 * instr->total / nloops : 0,
+							  TSQ_PLAN_TIME_SCALE);
+		}
+		plan_write_number(buf, nloops > 0 ? instr->ntuples / nloops : 0, 1.0);
+		plan_write_number(buf, nloops, 1.0);
+	}
+
+	plan_write_varint(buf, plan_node_nchildren(planstate));
+	plan_foreach_child(planstate, plan_encode_child, writer);
+}
+
+/*
+ * Appends the binary snapshot of the plan of a finished query to buf
+ */
+void
+pgtsq_encode_plan(QueryDesc * queryDesc, StringInfo buf)
+{
+	TSQPlanWriter writer;
+	HASHCTL		ctl;
+
+	memset(&ctl, 0, sizeof(HASHCTL));
+	ctl.keysize = NAMEDATALEN;
+	ctl.entrysize = sizeof(TSQPlanName);
+	ctl.hcxt = CurrentMemoryContext;
+
+	writer.queryDesc = queryDesc;
+	initStringInfo(&writer.nodes);
+	initStringInfo(&writer.names);
+	writer.nnames = 0;
+	writer.interned = hash_create("pg_track_slow_queries plan names", 16, &ctl,
+								  HASH_ELEM | HASH_CONTEXT);
+
+	pgtsq_encode_node(&writer, queryDesc->planstate, TSQ_PARENT_NONE);
+
+	appendStringInfoChar(buf, (char) TSQ_PLAN_MAGIC);
+	appendStringInfoChar(buf, (char) TSQ_PLAN_VERSION);
+	plan_write_varint(buf, writer.nnames);
+	appendBinaryStringInfo(buf, writer.names.data, writer.names.len);
+	appendBinaryStringInfo(buf, writer.nodes.data, writer.nodes.len);
+
+	hash_destroy(writer.interned);
+	pfree(writer.nodes.data);
+	pfree(writer.names.data);
+}
+
+/* Plan fingerprint being computed */
+typedef struct TSQPlanHash {
+	QueryDesc	*queryDesc;
+	uint64		hash;
+} TSQPlanHash;
+
+/*
+ * Adds a node and its children to a plan fingerprint: their types, the
+ * relations and indexes they scan and the shape of the tree, but neither
+ * costs nor counters.
+ */
+static void
+plan_hash_node(void * arg, PlanState * planstate, uint8 parent)
+{
+	TSQPlanHash *ph = (TSQPlanHash *) arg;
+	Plan	   *plan = planstate->plan;
+	Index		relid = plan_node_relid(plan);
+	Oid			reloid = InvalidOid;
+	Oid			indexid = plan_node_indexid(plan);
+	uint32		nchildren = plan_node_nchildren(planstate);
+	uint8		node[3];
+
+	check_stack_depth();
+
+	node[0] = plan_node_type(plan, &node[1]);
+	node[2] = parent;
+	if (relid > 0)
+		reloid = rt_fetch(relid, ph->queryDesc->plannedstmt->rtable)->relid;
+
+	ph->hash = pgtsq_hash_bytes(ph->hash, node, sizeof(node));
+	ph->hash = pgtsq_hash_bytes(ph->hash, &reloid, sizeof(Oid));
+	ph->hash = pgtsq_hash_bytes(ph->hash, &indexid, sizeof(Oid));
+	ph->hash = pgtsq_hash_bytes(ph->hash, &nchildren, sizeof(uint32));
+	plan_foreach_child(planstate, plan_hash_node, arg);
+}
+
+/*
+ * Returns the fingerprint of the plan of a query, identical for the plans
+ * of the same shape, see pg_track_slow_queries_plan_changes()
+ */
+uint64
+pgtsq_plan_fingerprint(QueryDesc * queryDesc)
+{
+	TSQPlanHash	ph;
+
+	ph.queryDesc = queryDesc;
+	ph.hash = TSQ_HASH_INIT;
+	if (queryDesc->planstate != NULL)
+		plan_hash_node(&ph, queryDesc->planstate, TSQ_PARENT_NONE);
+	return ph.hash;
+}
+
+/* Relations a query uses, being collected */
+typedef struct TSQRelationSet {
+	Oid			*relids;
+	uint32		nrelids;
+	uint32		size;
+} TSQRelationSet;
+
+static void
+plan_add_relid(TSQRelationSet * set, Oid relid)
+{
+	if (set->nrelids == set->size)
+	{
+		set->size *= 2;
+		set->relids = (Oid *) repalloc(set->relids, set->size * sizeof(Oid));
+	}
+	set->relids[set->nrelids++] = relid;
+}
+
+/*
+ * Adds the indexes scanned by a node and its children
+ */
+static void
+plan_collect_indexes(void * arg, PlanState * planstate, uint8 parent)
+{
+	Oid			indexid = plan_node_indexid(planstate->plan);
+
+	check_stack_depth();
+
+	if (OidIsValid(indexid))
+		plan_add_relid((TSQRelationSet *) arg, indexid);
+	plan_foreach_child(planstate, plan_collect_indexes, arg);
+}
+
+static int
+plan_relid_cmp(const void * a, const void * b)
+{
+	Oid			ra = *(const Oid *) a;
+	Oid			rb = *(const Oid *) b;
+
+	return ra < rb ? -1 : (ra > rb ? 1 : 0);
+}
+
+/*
+ * Returns the tables a finished query read or modified, from its range
+ * table, and the indexes its scans used, sorted and without duplicates
+ */
+void
+pgtsq_plan_relations(QueryDesc * queryDesc, Oid ** relids, uint32 * nrelids)
+{
+	TSQRelationSet set;
+	ListCell	*lc;
+	uint32		n = 0;
+
+	set.size = 8;
+	set.nrelids = 0;
+	set.relids = (Oid *) palloc(set.size * sizeof(Oid));
+
+	foreach(lc, queryDesc->plannedstmt->rtable)
+	{
+		RangeTblEntry *rte = (RangeTblEntry *) lfirst(lc);
+
+		if (rte->rtekind == RTE_RELATION)
+			plan_add_relid(&set, rte->relid);
+	}
+	if (queryDesc->planstate != NULL)
+		plan_collect_indexes(&set, queryDesc->planstate, TSQ_PARENT_NONE);
+
+	if (set.nrelids > 1)
+		qsort(set.relids, set.nrelids, sizeof(Oid), plan_relid_cmp);
+	for (uint32 i = 0; i < set.nrelids; i++)
+		if (n == 0 || set.relids[n - 1] != set.relids[i])
+			set.relids[n++] = set.relids[i];
+
+	*relids = set.relids;
+	*nrelids = n;
+}
+
+static void
+plan_append_stringinfo(void * arg, const char * data, size_t len)
+{
+	appendBinaryStringInfo((StringInfo) arg, data, (int) len);
+}
+
+/*
+ * Returns the JSON text of the plan of an entry, rendering binary snapshots.
+ * Returns NULL if the snapshot is invalid.
+ */
+char *
+pgtsq_plan_text(TSQEntry * tsqe)
+{
+	StringInfoData buf;
+
+	if (!pgtsq_is_binary_plan(tsqe->plantxt, tsqe->planlen))
+		return tsqe->plantxt;
+
+	initStringInfo(&buf);
+	if (!pgtsq_render_plan(tsqe->plantxt, tsqe->planlen,
+						   plan_append_stringinfo, &buf))
+	{
+		pfree(buf.data);
+		return NULL;
+	}
+	return buf.data;
+}
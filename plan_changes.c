@@ -0,0 +1,397 @@
+/*
+ * Plan change and regression detection
+ *
+ * Backends identify the query and the plan of each slow query they capture,
+ * in the message sent to the collector: the query identifier computed by the
+ * core or an extension like pg_stat_statements, or else a hash of the query
+ * text, and a fingerprint of the shape of the plan, see
+ * pgtsq_plan_fingerprint().
+ *
+ * As it receives entries, the collector keeps, for each query, the plans it
+ * has seen, when they were first and last seen, and the histogram of their
+ * durations. When a new plan has been seen TSQ_PLAN_MIN_CALLS times and its
+ * median duration is pg_track_slow_queries.plan_regression_ratio times the
+ * one of the plan in use before, it is marked as a regression. Nothing is
+ * read back from the storage.
+ *
+ * Queries are kept in a shared hash table of pg_track_slow_queries.track_plans
+ * entries, the least recently seen query is dropped to make room for a new
+ * one, and the least recently seen plan of a query for a new plan.
+ */
+#include "postgres.h"
+
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "catalog/pg_type.h"
+#include "executor/executor.h"
+#include "mb/pg_wchar.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "utils/builtins.h"
+#include "utils/hsearch.h"
+#include "utils/timestamp.h"
+
+#include "pg_track_slow_queries.h"
+
+/* Number of columns returned by pg_track_slow_queries_plan_changes() */
+#define TSQ_PLAN_CHANGES_COLS	13
+
+/* Key of the queries tracked */
+typedef struct TSQPlanKey {
+	Oid			dbid;
+	uint64		queryid;
+} TSQPlanKey;
+
+/* Plan of a query */
+typedef struct TSQPlanStats {
+	uint64		planid;			/* Plan fingerprint */
+	uint64		previous;		/* Plan in use when this one was first
+								 * seen, 0 for the first plan */
+	TimestampTz	first_seen;
+	TimestampTz	last_seen;
+	TimestampTz	regressed_at;	/* 0 unless this plan is a regression */
+	double		regression_ratio;	/* Ratio of the median durations of
+									 * this plan and the previous one */
+	TSQHistogram durations;
+} TSQPlanStats;
+
+/* Entry of the shared hash table */
+typedef struct TSQPlanQuery {
+	TSQPlanKey	key;			/* Hash key */
+	TimestampTz	last_seen;
+	uint64		plans_seen;		/* Number of plans seen, dropped included */
+	int			nplans;
+	TSQPlanStats plans[TSQ_PLANS_PER_QUERY];
+	char		query[TSQ_PLAN_QUERY_LEN];	/* Query text, may be cut */
+} TSQPlanQuery;
+
+/* Queries tracked, NULL if pg_track_slow_queries.track_plans is 0 */
+static HTAB *tsq_plans = NULL;
+static int tsq_plans_max = 0;
+
+PGDLLEXPORT Datum pg_track_slow_queries_plan_changes(PG_FUNCTION_ARGS);
+
+PG_FUNCTION_INFO_V1(pg_track_slow_queries_plan_changes);
+
+/*
+ * Adds data to a FNV-1a hash, start from TSQ_HASH_INIT
+ */
+uint64
+pgtsq_hash_bytes(uint64 hash, const void * data, Size len)
+{
+	const unsigned char *p = (const unsigned char *) data;
+
+	for (Size i = 0; i < len; i++)
+	{
+		hash ^= p[i];
+		hash *= TSQ_HASH_PRIME;
+	}
+	return hash;
+}
+
+/*
+ * Estimates the shared memory needed to track the plans of max_queries
+ * queries
+ */
+Size
+pgtsq_plan_changes_memsize(int max_queries)
+{
+	if (max_queries <= 0)
+		return 0;
+	return hash_estimate_size(max_queries, sizeof(TSQPlanQuery));
+}
+
+/*
+ * Creates or attaches to the shared hash table of the queries tracked, the
+ * caller holds AddinShmemInitLock
+ */
+void
+pgtsq_init_plan_changes(int max_queries)
+{
+	HASHCTL		info;
+
+	tsq_plans = NULL;
+	tsq_plans_max = max_queries;
+	if (max_queries <= 0)
+		return;
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(TSQPlanKey);
+	info.entrysize = sizeof(TSQPlanQuery);
+	tsq_plans = ShmemInitHash("pg_track_slow_queries plans",
+							  max_queries, max_queries, &info,
+							  HASH_ELEM | HASH_BLOBS);
+}
+
+/*
+ * Returns the identifier of a query: the one computed by the core or an
+ * extension if any, else a hash of its text. It is never 0.
+ */
+uint64
+pgtsq_identify_query(QueryDesc * queryDesc)
+{
+	uint64		queryid = (uint64) queryDesc->plannedstmt->queryId;
+
+	if (queryid == 0)
+		queryid = pgtsq_hash_bytes(TSQ_HASH_INIT, queryDesc->sourceText,
+								   strlen(queryDesc->sourceText));
+	return queryid != 0 ? queryid : 1;
+}
+
+/*
+ * Sets the plan fingerprint of a finished query in the message sent to the
+ * collector, its query identifier being already set
+ */
+void
+pgtsq_identify_plan(QueryDesc * queryDesc, TSQMsgHeader * header)
+{
+	header->planid = pgtsq_plan_fingerprint(queryDesc);
+	/* 0 means that the plan changes of the query are not tracked */
+	if (header->planid == 0)
+		header->planid = 1;
+	header->dbid = MyDatabaseId;
+}
+
+static TSQPlanStats *
+pgtsq_find_plan(TSQPlanQuery * query, uint64 planid)
+{
+	for (int i = 0; i < query->nplans; i++)
+		if (query->plans[i].planid == planid)
+			return &query->plans[i];
+	return NULL;
+}
+
+/*
+ * Drops the least recently seen query
+ */
+static void
+pgtsq_evict_query(void)
+{
+	HASH_SEQ_STATUS	status;
+	TSQPlanQuery	*query;
+	TSQPlanKey		victim;
+	bool			found = false;
+	TimestampTz		oldest = 0;
+
+	hash_seq_init(&status, tsq_plans);
+	while ((query = hash_seq_search(&status)) != NULL)
+	{
+		if (!found || query->last_seen < oldest)
+		{
+			victim = query->key;
+			oldest = query->last_seen;
+			found = true;
+		}
+	}
+	if (found)
+		hash_search(tsq_plans, &victim, HASH_REMOVE, NULL);
+}
+
+/*
+ * Returns the plan of a query identified by header, adding it if it was not
+ * seen yet
+ */
+static TSQPlanStats *
+pgtsq_add_plan(TSQPlanQuery * query, TSQMsgHeader * header)
+{
+	TSQPlanStats	*plan;
+	int				latest = -1;
+	int				victim = -1;
+
+	if ((plan = pgtsq_find_plan(query, header->planid)) != NULL)
+		return plan;
+
+	/* The plan in use is the one seen last, the one dropped the oldest */
+	for (int i = 0; i < query->nplans; i++)
+		if (latest < 0 || query->plans[i].last_seen > query->plans[latest].last_seen)
+			latest = i;
+	if (query->nplans < TSQ_PLANS_PER_QUERY)
+		victim = query->nplans++;
+	else
+	{
+		for (int i = 0; i < query->nplans; i++)
+			if (i != latest && (victim < 0 ||
+								query->plans[i].last_seen < query->plans[victim].last_seen))
+				victim = i;
+	}
+
+	plan = &query->plans[victim];
+	plan->previous = latest >= 0 ? query->plans[latest].planid : 0;
+	plan->planid = header->planid;
+	plan->first_seen = header->captured;
+	plan->last_seen = header->captured;
+	plan->regressed_at = 0;
+	plan->regression_ratio = 0;
+	memset(&plan->durations, 0, sizeof(TSQHistogram));
+	query->plans_seen++;
+	return plan;
+}
+
+/*
+ * Accounts a call of the plan of a query, the caller holds plans_lock
+ */
+static void
+pgtsq_track_plan(TSQMsgHeader * header, char * row, double regression_ratio)
+{
+	TSQPlanKey		key;
+	TSQPlanQuery	*query;
+	TSQPlanStats	*plan;
+	TSQPlanStats	*previous;
+	double			median;
+	double			previous_median;
+
+	memset(&key, 0, sizeof(TSQPlanKey));
+	key.dbid = header->dbid;
+	key.queryid = header->queryid;
+
+	if ((query = hash_search(tsq_plans, &key, HASH_FIND, NULL)) == NULL)
+	{
+		TSQEntry	tsqe;
+
+		if (hash_get_num_entries(tsq_plans) >= tsq_plans_max)
+			pgtsq_evict_query();
+		if ((query = hash_search(tsq_plans, &key, HASH_ENTER_NULL, NULL)) == NULL)
+			return;
+
+		query->last_seen = header->captured;
+		query->plans_seen = 0;
+		query->nplans = 0;
+		query->query[0] = '\0';
+		/* The query text is only parsed for new queries */
+		memset(&tsqe, 0, sizeof(TSQEntry));
+		if (pgtsq_parse_row(row, TSQ_FORMAT_VERSION, &tsqe) && tsqe.querytxt != NULL)
+			strlcpy(query->query, tsqe.querytxt, TSQ_PLAN_QUERY_LEN);
+	}
+
+	plan = pgtsq_add_plan(query, header);
+	plan->last_seen = Max(plan->last_seen, header->captured);
+	query->last_seen = Max(query->last_seen, header->captured);
+	pgtsq_histogram_add(&plan->durations, header->duration);
+
+	/* Compare new plans with the previous one once both were seen enough */
+	if (plan->previous == 0 || plan->regressed_at != 0 ||
+		plan->durations.count < TSQ_PLAN_MIN_CALLS ||
+		(previous = pgtsq_find_plan(query, plan->previous)) == NULL ||
+		previous->durations.count < TSQ_PLAN_MIN_CALLS)
+		return;
+
+	median = pgtsq_histogram_quantile(&plan->durations, 0.5);
+	previous_median = pgtsq_histogram_quantile(&previous->durations, 0.5);
+	if (previous_median > 0 && median >= previous_median * regression_ratio)
+	{
+		plan->regressed_at = header->captured;
+		plan->regression_ratio = median / previous_median;
+		ereport(LOG,
+				(errmsg("pg_track_slow_queries: plan of query " UINT64_FORMAT
+						" regressed, median duration %.3f ms instead of %.3f ms",
+						header->queryid, median, previous_median)));
+	}
+}
+
+/*
+ * Accounts the plans of rows received, rows being the serialized entries
+ * the headers came with. Rows whose planid is 0 are not tracked.
+ */
+void
+pgtsq_track_plans(TSQMsgHeader * headers, char ** rows, int nrows,
+				  double regression_ratio)
+{
+	if (tsq_plans == NULL)
+		return;
+
+	LWLockAcquire(pgtsqss->plans_lock, LW_EXCLUSIVE);
+	for (int i = 0; i < nrows; i++)
+		if (headers[i].planid != 0)
+			pgtsq_track_plan(&headers[i], rows[i], regression_ratio);
+	LWLockRelease(pgtsqss->plans_lock);
+}
+
+PGDLLEXPORT Datum
+pg_track_slow_queries_plan_changes(PG_FUNCTION_ARGS)
+{
+	bool			regressions_only = PG_GETARG_BOOL(0);
+	TupleDesc		tupdesc;
+	Tuplestorestate	*tupstore;
+	TSQPlanQuery	*queries;
+	TSQPlanQuery	*query;
+	HASH_SEQ_STATUS	status;
+	int				nqueries = 0;
+
+	if (!pgtsqss)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pg_track_slow_queries: must be loaded via shared_preload_libraries")));
+	if (tsq_plans == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pg_track_slow_queries: plan changes are not tracked"),
+				 errhint("Set pg_track_slow_queries.track_plans to a positive value.")));
+
+	tupstore = pgtsq_begin_srf(fcinfo, &tupdesc);
+
+	/* Work on a copy of the queries whose plan changed, outside of the lock */
+	LWLockAcquire(pgtsqss->plans_lock, LW_SHARED);
+	queries = (TSQPlanQuery *) palloc(Max(hash_get_num_entries(tsq_plans), 1) *
+									  sizeof(TSQPlanQuery));
+	hash_seq_init(&status, tsq_plans);
+	while ((query = hash_seq_search(&status)) != NULL)
+		if (query->plans_seen > 1)
+			memcpy(&queries[nqueries++], query, sizeof(TSQPlanQuery));
+	LWLockRelease(pgtsqss->plans_lock);
+
+	for (int q = 0; q < nqueries; q++)
+	{
+		char	*dbname = get_database_name(queries[q].key.dbid);
+		int		len = strlen(queries[q].query);
+
+		/* Don't return a multibyte character cut in half */
+		if (len == TSQ_PLAN_QUERY_LEN - 1)
+			queries[q].query[pg_mbcliplen(queries[q].query, len, len)] = '\0';
+
+		for (int p = 0; p < queries[q].nplans; p++)
+		{
+			TSQPlanStats	*plan = &queries[q].plans[p];
+			Datum			values[TSQ_PLAN_CHANGES_COLS];
+			bool			nulls[TSQ_PLAN_CHANGES_COLS];
+			int				i = 0;
+
+			if (regressions_only && plan->regressed_at == 0)
+				continue;
+
+			memset(nulls, 0, sizeof(nulls));
+
+			values[i++] = Int64GetDatum((int64) queries[q].key.queryid);
+			if (dbname != NULL)
+				values[i++] = CStringGetTextDatum(dbname);
+			else
+				nulls[i++] = true;
+			values[i++] = CStringGetTextDatum(queries[q].query);
+			values[i++] = Int64GetDatum((int64) plan->planid);
+			if (plan->previous != 0)
+				values[i++] = Int64GetDatum((int64) plan->previous);
+			else
+				nulls[i++] = true;
+			values[i++] = TimestampTzGetDatum(plan->first_seen);
+			values[i++] = TimestampTzGetDatum(plan->last_seen);
+			values[i++] = Int64GetDatum((int64) plan->durations.count);
+			values[i++] = Float8GetDatum(pgtsq_histogram_quantile(&plan->durations, 0.5));
+			values[i++] = Float8GetDatum(plan->durations.total / plan->durations.count);
+			values[i++] = Float8GetDatumFast(plan->durations.max);
+			if (plan->regressed_at != 0)
+			{
+				values[i++] = TimestampTzGetDatum(plan->regressed_at);
+				values[i++] = Float8GetDatumFast(plan->regression_ratio);
+			}
+			else
+			{
+				nulls[i++] = true;
+				nulls[i++] = true;
+			}
+
+			tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+		}
+	}
+	tuplestore_donestoring(tupstore);
+
+	return (Datum) 0;
+}
@@ -0,0 +1,408 @@
+/*
+ * Rendering of binary plan snapshots as JSON
+ *
+ * Shared by the extension and the pg_tsq_dump frontend tool, which builds it
+ * with FRONTEND defined: only base types may be used here. The output mimics
+ * EXPLAIN (FORMAT JSON), restricted to what snapshots keep.
+ */
+#ifndef FRONTEND
+#include "postgres.h"
+#else
+#include "postgres_fe.h"
+#endif
+
+#include "pg_track_slow_queries_format.h"
+
+/* Snapshots deeper than this are considered invalid */
+#define TSQ_PLAN_MAX_DEPTH	1000
+
+/* String of the names table */
+typedef struct TSQPlanString {
+	const char	*data;
+	uint32		length;
+} TSQPlanString;
+
+/* Position in a snapshot being rendered */
+typedef struct TSQPlanReader {
+	const char	*data;
+	uint32		length;
+	uint32		pos;
+	int			version;
+	TSQPlanString *strings;		/* Names table, NULL for version 1 */
+	uint64		nstrings;
+	TSQPlanAppend append;
+	void		*arg;
+} TSQPlanReader;
+
+static const char *const node_names[TSQ_NODE_TYPES] = {
+	"???",
+	"Result",
+	"ProjectSet",
+	"ModifyTable",
+	"Append",
+	"Merge Append",
+	"Recursive Union",
+	"BitmapAnd",
+	"BitmapOr",
+	"Nested Loop",
+	"Merge Join",
+	"Hash Join",
+	"Seq Scan",
+	"Sample Scan",
+	"Gather",
+	"Gather Merge",
+	"Index Scan",
+	"Index Only Scan",
+	"Bitmap Index Scan",
+	"Bitmap Heap Scan",
+	"Tid Scan",
+	"Subquery Scan",
+	"Function Scan",
+	"Table Function Scan",
+	"Values Scan",
+	"CTE Scan",
+	"Named Tuplestore Scan",
+	"WorkTable Scan",
+	"Foreign Scan",
+	"Custom Scan",
+	"Materialize",
+	"Sort",
+	"Group",
+	"Aggregate",
+	"WindowAgg",
+	"Unique",
+	"SetOp",
+	"LockRows",
+	"Limit",
+	"Hash"
+};
+
+static const char *const subtype_names[TSQ_SUBTYPES] = {
+	NULL,
+	"Inner", "Left", "Full", "Right", "Semi", "Anti",
+	"Plain", "Sorted", "Hashed", "Mixed",
+	"Insert", "Update", "Delete"
+};
+
+static const char *const parent_names[TSQ_PARENTS] = {
+	NULL, "Outer", "Inner", "Member", "Subquery", "InitPlan", "SubPlan"
+};
+
+static void
+plan_append_str(TSQPlanReader *reader, const char *str)
+{
+	reader->append(reader->arg, str, strlen(str));
+}
+
+/*
+ * Appends a JSON string, escaped
+ */
+static void
+plan_append_json(TSQPlanReader *reader, const char *data, uint32 length)
+{
+	uint32		start = 0;
+
+	reader->append(reader->arg, "\"", 1);
+	for (uint32 i = 0; i < length; i++)
+	{
+		unsigned char c = (unsigned char) data[i];
+		char		esc[8];
+
+		if (c >= 0x20 && c != '"' && c != '\\')
+			continue;
+		reader->append(reader->arg, data + start, i - start);
+		if (c == '"' || c == '\\')
+			snprintf(esc, sizeof(esc), "\\%c", c);
+		else
+			snprintf(esc, sizeof(esc), "\\u%04x", c);
+		plan_append_str(reader, esc);
+		start = i + 1;
+	}
+	reader->append(reader->arg, data + start, length - start);
+	reader->append(reader->arg, "\"", 1);
+}
+
+/*
+ * Appends a property whose value is already JSON
+ */
+static void
+plan_append_prop(TSQPlanReader *reader, const char *key, const char *value)
+{
+	reader->append(reader->arg, ", \"", 3);
+	plan_append_str(reader, key);
+	reader->append(reader->arg, "\": ", 3);
+	plan_append_str(reader, value);
+}
+
+static void
+plan_append_number(TSQPlanReader *reader, const char *key, const char *fmt,
+				   double value)
+{
+	char	buf[64];
+
+	snprintf(buf, sizeof(buf), fmt, value);
+	plan_append_prop(reader, key, buf);
+}
+
+static bool
+plan_read(TSQPlanReader *reader, void *dst, uint32 len)
+{
+	if (reader->length - reader->pos < len)
+		return false;
+	memcpy(dst, reader->data + reader->pos, len);
+	reader->pos += len;
+	return true;
+}
+
+static bool
+plan_read_varint(TSQPlanReader *reader, uint64 *value)
+{
+	*value = 0;
+	for (int shift = 0; shift < 64; shift += 7)
+	{
+		unsigned char byte;
+
+		if (reader->pos >= reader->length)
+			return false;
+		byte = (unsigned char) reader->data[reader->pos++];
+		*value |= (uint64) (byte & 0x7F) << shift;
+		if ((byte & 0x80) == 0)
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Reads a cost, row count or time, stored multiplied by scale
+ */
+static bool
+plan_read_number(TSQPlanReader *reader, double scale, double *value)
+{
+	uint64		v;
+
+	if (reader->version == TSQ_PLAN_VERSION_FIXED)
+		return plan_read(reader, value, sizeof(double));
+	if (!plan_read_varint(reader, &v))
+		return false;
+	*value = (double) v / scale;
+	return true;
+}
+
+static bool
+plan_read_count(TSQPlanReader *reader, uint32 *value)
+{
+	uint64		v;
+
+	if (reader->version == TSQ_PLAN_VERSION_FIXED)
+		return plan_read(reader, value, sizeof(uint32));
+	if (!plan_read_varint(reader, &v) || v > PG_UINT32_MAX)
+		return false;
+	*value = (uint32) v;
+	return true;
+}
+
+/*
+ * Reads a name, and appends it as a property
+ */
+static bool
+plan_read_string(TSQPlanReader *reader, const char *key)
+{
+	const char	*data;
+	uint32		len;
+
+	if (reader->version == TSQ_PLAN_VERSION_FIXED)
+	{
+		uint16		len16;
+
+		if (!plan_read(reader, &len16, sizeof(uint16)) ||
+			reader->length - reader->pos < len16)
+			return false;
+		data = reader->data + reader->pos;
+		len = len16;
+		reader->pos += len16;
+	}
+	else
+	{
+		uint64		idx;
+
+		if (!plan_read_varint(reader, &idx) || idx >= reader->nstrings)
+			return false;
+		data = reader->strings[idx].data;
+		len = reader->strings[idx].length;
+	}
+
+	reader->append(reader->arg, ", \"", 3);
+	plan_append_str(reader, key);
+	reader->append(reader->arg, "\": ", 3);
+	plan_append_json(reader, data, len);
+	return true;
+}
+
+/*
+ * Reads the names table of version 2 snapshots
+ */
+static bool
+plan_read_strings(TSQPlanReader *reader)
+{
+	if (!plan_read_varint(reader, &reader->nstrings) ||
+		reader->nstrings > reader->length - reader->pos)
+		return false;
+	if (reader->nstrings == 0)
+		return true;
+
+	reader->strings = palloc(sizeof(TSQPlanString) * reader->nstrings);
+	for (uint64 i = 0; i < reader->nstrings; i++)
+	{
+		uint64		len;
+
+		if (!plan_read_varint(reader, &len) || len > reader->length - reader->pos)
+			return false;
+		reader->strings[i].data = reader->data + reader->pos;
+		reader->strings[i].length = (uint32) len;
+		reader->pos += (uint32) len;
+	}
+	return true;
+}
+
+static bool
+plan_render_node(TSQPlanReader *reader, int depth)
+{
+	uint8		type, subtype, parent, flags;
+	double		startup_cost, total_cost, rows, width;
+	uint32		nchildren;
+	const char	*name;
+
+	if (depth > TSQ_PLAN_MAX_DEPTH ||
+		!plan_read(reader, &type, 1) || !plan_read(reader, &subtype, 1) ||
+		!plan_read(reader, &parent, 1) || !plan_read(reader, &flags, 1) ||
+		!plan_read_number(reader, TSQ_PLAN_COST_SCALE, &startup_cost) ||
+		!plan_read_number(reader, TSQ_PLAN_COST_SCALE, &total_cost) ||
+		!plan_read_number(reader, 1.0, &rows))
+		return false;
+	if (reader->version == TSQ_PLAN_VERSION_FIXED)
+	{
+		int32		width32;
+
+		if (!plan_read(reader, &width32, sizeof(int32)))
+			return false;
+		width = width32;
+	}
+	else if (!plan_read_number(reader, 1.0, &width))
+		return false;
+
+	name = node_names[type < TSQ_NODE_TYPES ? type : TSQ_NODE_UNKNOWN];
+	plan_append_str(reader, "{\"Node Type\": ");
+	plan_append_json(reader, name, strlen(name));
+
+	if (subtype > TSQ_SUBTYPE_NONE && subtype < TSQ_SUBTYPES)
+	{
+		const char *key;
+
+		if (subtype <= TSQ_SUBTYPE_ANTI)
+			key = "Join Type";
+		else if (subtype <= TSQ_SUBTYPE_MIXED)
+			key = "Strategy";
+		else
+			key = "Operation";
+		reader->append(reader->arg, ", \"", 3);
+		plan_append_str(reader, key);
+		reader->append(reader->arg, "\": ", 3);
+		plan_append_json(reader, subtype_names[subtype],
+						 strlen(subtype_names[subtype]));
+	}
+	if (parent > TSQ_PARENT_NONE && parent < TSQ_PARENTS)
+	{
+		reader->append(reader->arg, ", \"Parent Relationship\": ", 25);
+		plan_append_json(reader, parent_names[parent],
+						 strlen(parent_names[parent]));
+	}
+
+	if (flags & TSQ_PLAN_RELATION)
+	{
+		if (!plan_read_string(reader, "Relation Name") ||
+			!plan_read_string(reader, "Schema") ||
+			!plan_read_string(reader, "Alias"))
+			return false;
+	}
+	if (flags & TSQ_PLAN_INDEX)
+	{
+		if (!plan_read_string(reader, "Index Name"))
+			return false;
+	}
+
+	plan_append_number(reader, "Startup Cost", "%.2f", startup_cost);
+	plan_append_number(reader, "Total Cost", "%.2f", total_cost);
+	plan_append_number(reader, "Plan Rows", "%.0f", rows);
+	plan_append_number(reader, "Plan Width", "%.0f", width);
+
+	if (flags & TSQ_PLAN_TIMING)
+	{
+		double		startup_time, total_time;
+
+		if (!plan_read_number(reader, TSQ_PLAN_TIME_SCALE, &startup_time) ||
+			!plan_read_number(reader, TSQ_PLAN_TIME_SCALE, &total_time))
+			return false;
+		plan_append_number(reader, "Actual Startup Time", "%.3f", startup_time);
+		plan_append_number(reader, "Actual Total Time", "%.3f", total_time);
+	}
+	if (flags & TSQ_PLAN_INSTR)
+	{
+		double		actual_rows, loops;
+
+		if (!plan_read_number(reader, 1.0, &actual_rows) ||
+			!plan_read_number(reader, 1.0, &loops))
+			return false;
+		plan_append_number(reader, "Actual Rows", "%.0f", actual_rows);
+		plan_append_number(reader, "Actual Loops", "%.0f", loops);
+	}
+
+	if (!plan_read_count(reader, &nchildren))
+		return false;
+	if (nchildren > 0)
+	{
+		plan_append_str(reader, ", \"Plans\": [");
+		for (uint32 i = 0; i < nchildren; i++)
+		{
+			if (i > 0)
+				reader->append(reader->arg, ", ", 2);
+			if (!plan_render_node(reader, depth + 1))
+				return false;
+		}
+		plan_append_str(reader, "]");
+	}
+	plan_append_str(reader, "}");
+	return true;
+}
+
+bool
+pgtsq_render_plan(const char *data, uint32 length, TSQPlanAppend append,
+				  void *arg)
+{
+	TSQPlanReader reader;
+	bool		ok;
+
+	if (length < 2 || (unsigned char) data[0] != TSQ_PLAN_MAGIC ||
+		((unsigned char) data[1] != TSQ_PLAN_VERSION &&
+		 (unsigned char) data[1] != TSQ_PLAN_VERSION_FIXED))
+		return false;
+
+	memset(&reader, 0, sizeof(TSQPlanReader));
+	reader.data = data;
+	reader.length = length;
+	reader.pos = 2;
+	reader.version = (unsigned char) data[1];
+	reader.append = append;
+	reader.arg = arg;
+
+	ok = (reader.version == TSQ_PLAN_VERSION_FIXED || plan_read_strings(&reader));
+	if (ok)
+	{
+		plan_append_str(&reader, "{\"Plan\": ");
+		ok = plan_render_node(&reader, 0);
+	}
+	if (ok)
+		plan_append_str(&reader, "}");
+	if (reader.strings != NULL)
+		pfree(reader.strings);
+	return ok && reader.pos == length;
+}
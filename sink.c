@@ -0,0 +1,624 @@
+/*
+ * Table sink
+ *
+ * When pg_track_slow_queries.sink_database is set, a background worker
+ * connected to this database copies the stored entries into a table
+ * partitioned by day on datetime, where they can be indexed and joined. It
+ * follows the committed storage position like readers do, without any lock,
+ * and inserts rows by batches of up to TSQ_SINK_BATCH_ROWS with a single
+ * prepared INSERT ... SELECT FROM unnest() each: nothing is added to the
+ * capture path, and rows are never inserted one at a time.
+ *
+ * The storage position reached is saved in the <table>_position table by the
+ * transaction inserting the batch, so that rows are inserted once even if the
+ * worker is interrupted. Missing partitions are created before a batch is
+ * inserted, and the ones older than sink_retention days are dropped.
+ *
+ * Partitioned tables need PostgreSQL 10 or later.
+ */
+#define _FILE_OFFSET_BITS 64
+
+#include "postgres.h"
+
+#include "access/xact.h"
+#include "catalog/pg_type.h"
+#include "executor/spi.h"
+#include "funcapi.h"
+#include "lib/stringinfo.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "port/atomics.h"
+#include "postmaster/bgworker.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/lwlock.h"
+#include "storage/spin.h"
+#include "tcop/tcopprot.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/datetime.h"
+#include "utils/guc.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/snapmgr.h"
+#include "utils/timestamp.h"
+#if (PG_VERSION_NUM >= 100000)
+#include "utils/varlena.h"
+#endif
+
+#include "pg_track_slow_queries.h"
+
+#if (PG_VERSION_NUM >= 100000)
+
+/* Max number of rows inserted by a single statement */
+#define TSQ_SINK_BATCH_ROWS		1000
+#define TSQ_SINK_NAPTIME_MS		1000
+/* Old partitions are looked for at most once per interval */
+#define TSQ_SINK_RETENTION_INTERVAL_MS	(3600 * 1000)
+#define TSQ_SINK_POSITION_SUFFIX	"_position"
+/* Partitions are named <table>_YYYYMMDD */
+#define TSQ_SINK_PARTITION_SUFFIX_LEN	9
+
+/* Rows of a batch, one array of values per column */
+typedef struct TSQSinkBatch {
+	int			nrows;
+	Datum		values[TSQ_COLS][TSQ_SINK_BATCH_ROWS];
+	List		*days;			/* Days of the rows, as integers */
+} TSQSinkBatch;
+
+/* Types of the columns, in the order of TSQEntry */
+static const Oid sink_types[TSQ_COLS] = {
+	TIMESTAMPTZOID, TIMESTAMPTZOID, FLOAT8OID, TEXTOID, TEXTOID, TEXTOID,
+	INT8OID, FLOAT8OID, INT8OID, INT8OID, TEXTOID, TEXTOID
+};
+static int16 sink_typlen[TSQ_COLS];
+static bool sink_typbyval[TSQ_COLS];
+static char sink_typalign[TSQ_COLS];
+
+static char *sink_schema = NULL;
+static char *sink_relname = NULL;
+static SPIPlanPtr insert_plan = NULL;
+static SPIPlanPtr position_plan = NULL;
+/* Days whose partition is known to exist */
+static List *sink_days = NIL;
+static int sink_retention_days = -1;
+static TimestampTz retention_time = 0;
+
+static volatile sig_atomic_t got_sighup = false;
+
+static void pgtsq_sink_sighup(SIGNAL_ARGS);
+static char *pgtsq_sink_relation(const char * suffix);
+static void pgtsq_sink_setup(uint32 * segno, off_t * offset);
+static bool pgtsq_sink_read(TSQSinkBatch * batch, uint32 * segno,
+							off_t * offset, int cutoff);
+static void pgtsq_sink_write(TSQSinkBatch * batch, uint32 segno, off_t offset);
+static void pgtsq_sink_retention(int cutoff);
+static void pgtsq_sink_begin(const char * activity);
+static void pgtsq_sink_commit(void);
+
+#endif
+
+/*
+ * Registers the sink worker, called at library load
+ */
+void
+pgtsq_register_sink(void)
+{
+#if (PG_VERSION_NUM >= 100000)
+	BackgroundWorker worker;
+
+	memset(&worker, 0, sizeof(worker));
+	worker.bgw_flags = BGWORKER_SHMEM_ACCESS |
+		BGWORKER_BACKEND_DATABASE_CONNECTION;
+	worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+	worker.bgw_restart_time = 60;
+	snprintf(worker.bgw_library_name, BGW_MAXLEN, "pg_track_slow_queries");
+	snprintf(worker.bgw_function_name, BGW_MAXLEN, "pgtsq_sink_worker");
+	snprintf(worker.bgw_name, BGW_MAXLEN, "pg_track_slow_queries sink");
+#if (PG_VERSION_NUM >= 110000)
+	snprintf(worker.bgw_type, BGW_MAXLEN, "pgtsq_sink_worker");
+#endif
+	worker.bgw_notify_pid = 0;
+	worker.bgw_main_arg = (Datum) 0;
+	RegisterBackgroundWorker(&worker);
+#else
+	ereport(LOG,
+			(errmsg("pg_track_slow_queries: the table sink needs PostgreSQL 10 or later")));
+#endif
+}
+
+#if (PG_VERSION_NUM >= 100000)
+
+/*
+ * Sink worker main function
+ */
+void
+pgtsq_sink_worker(Datum main_arg)
+{
+	MemoryContext	batch_context;
+	TSQSinkBatch	*batch;
+	const char		*value;
+	uint32			segno;
+	off_t			offset;
+	int				rc;
+
+	pqsignal(SIGHUP, pgtsq_sink_sighup);
+	pqsignal(SIGTERM, die);
+	BackgroundWorkerUnblockSignals();
+
+	if ((value = GetConfigOption("pg_track_slow_queries.sink_database",
+								 true, false)) == NULL || *value == '\0')
+		proc_exit(0);
+#if (PG_VERSION_NUM >= 110000)
+	BackgroundWorkerInitializeConnection(value, NULL, 0);
+#else
+	BackgroundWorkerInitializeConnection((char *) value, NULL);
+#endif
+
+	/* Our own statements must not be captured, they would be synced again */
+	SetConfigOption("pg_track_slow_queries.log_min_duration", "-1",
+					PGC_SUSET, PGC_S_OVERRIDE);
+
+	if ((value = GetConfigOption("pg_track_slow_queries.sink_retention",
+								 true, false)) != NULL)
+		sink_retention_days = (int) strtol(value, (char **) NULL, 10);
+
+	batch_context = AllocSetContextCreate(TopMemoryContext,
+						"PGTSQSinkBatch", ALLOCSET_DEFAULT_SIZES);
+	batch = (TSQSinkBatch *) MemoryContextAlloc(TopMemoryContext,
+												sizeof(TSQSinkBatch));
+
+	pgtsq_sink_setup(&segno, &offset);
+
+	for (;;)
+	{
+		int		cutoff = INT_MIN;
+		bool	more = true;
+
+		if (got_sighup)
+		{
+			got_sighup = false;
+			ProcessConfigFile(PGC_SIGHUP);
+			if ((value = GetConfigOption("pg_track_slow_queries.sink_retention",
+										 true, false)) != NULL)
+				sink_retention_days = (int) strtol(value, (char **) NULL, 10);
+			retention_time = 0;
+		}
+
+		/* Rows older than the retention are not inserted */
+		if (sink_retention_days >= 0)
+		{
+			cutoff = (int) (GetCurrentTimestamp() / USECS_PER_DAY) -
+				sink_retention_days;
+			if (GetCurrentTimestamp() >= retention_time)
+			{
+				pgtsq_sink_retention(cutoff);
+				retention_time = TimestampTzPlusMilliseconds(GetCurrentTimestamp(),
+										TSQ_SINK_RETENTION_INTERVAL_MS);
+			}
+		}
+
+		while (more)
+		{
+			MemoryContext	oldcontext = MemoryContextSwitchTo(batch_context);
+			uint32			prev_segno = segno;
+			off_t			prev_offset = offset;
+
+			more = pgtsq_sink_read(batch, &segno, &offset, cutoff);
+			if (batch->nrows > 0 || segno != prev_segno || offset != prev_offset)
+				pgtsq_sink_write(batch, segno, offset);
+
+			MemoryContextSwitchTo(oldcontext);
+			MemoryContextReset(batch_context);
+			CHECK_FOR_INTERRUPTS();
+		}
+
+		rc = WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+					   TSQ_SINK_NAPTIME_MS, PG_WAIT_EXTENSION);
+		if (rc & WL_POSTMASTER_DEATH)
+			proc_exit(1);
+		ResetLatch(MyLatch);
+		CHECK_FOR_INTERRUPTS();
+	}
+}
+
+/*
+ * Signal handler for SIGHUP
+ */
+static void
+pgtsq_sink_sighup(SIGNAL_ARGS)
+{
+	int			save_errno = errno;
+
+	got_sighup = true;
+	SetLatch(MyLatch);
+
+	errno = save_errno;
+}
+
+/*
+ * Starts a transaction to run SPI statements
+ */
+static void
+pgtsq_sink_begin(const char * activity)
+{
+	SetCurrentStatementStartTimestamp();
+	StartTransactionCommand();
+	if (SPI_connect() != SPI_OK_CONNECT)
+		ereport(ERROR,
+				(errmsg("pg_track_slow_queries: could not connect to SPI")));
+	PushActiveSnapshot(GetTransactionSnapshot());
+	pgstat_report_activity(STATE_RUNNING, activity);
+}
+
+static void
+pgtsq_sink_commit(void)
+{
+	SPI_finish();
+	PopActiveSnapshot();
+	CommitTransactionCommand();
+	pgstat_report_activity(STATE_IDLE, NULL);
+}
+
+/*
+ * Qualified and quoted name of the sink table followed by suffix
+ */
+static char *
+pgtsq_sink_relation(const char * suffix)
+{
+	return quote_qualified_identifier(sink_schema,
+									  psprintf("%s%s", sink_relname, suffix));
+}
+
+/*
+ * Creates the sink table and its position table if they don't exist,
+ * prepares the statements and gets the storage position to start from.
+ */
+static void
+pgtsq_sink_setup(uint32 * segno, off_t * offset)
+{
+	const char	*value;
+	char		*rawname;
+	List		*names;
+	char		*table;
+	char		*position;
+	Oid			argtypes[TSQ_COLS];
+	StringInfoData	sql;
+
+	value = GetConfigOption("pg_track_slow_queries.sink_table", true, false);
+	rawname = pstrdup(value ? value : "");
+	if (!SplitIdentifierString(rawname, '.', &names) ||
+		list_length(names) < 1 || list_length(names) > 2)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("pg_track_slow_queries: invalid sink_table value \"%s\"",
+						value)));
+	sink_schema = list_length(names) == 2 ? linitial(names) : "public";
+	sink_relname = llast(names);
+	if (strlen(sink_relname) + Max(TSQ_SINK_PARTITION_SUFFIX_LEN,
+								   strlen(TSQ_SINK_POSITION_SUFFIX)) >= NAMEDATALEN)
+		ereport(ERROR,
+				(errcode(ERRCODE_NAME_TOO_LONG),
+				 errmsg("pg_track_slow_queries: sink_table name \"%s\" is too long",
+						sink_relname)));
+
+	table = pgtsq_sink_relation("");
+	position = pgtsq_sink_relation(TSQ_SINK_POSITION_SUFFIX);
+
+	pgtsq_sink_begin("pg_track_slow_queries sink setup");
+
+	initStringInfo(&sql);
+	appendStringInfo(&sql,
+					 "CREATE TABLE IF NOT EXISTS %s ("
+					 "datetime timestamptz NOT NULL, "
+					 "start_datetime timestamptz, "
+					 "duration float8, "
+					 "username text, "
+					 "appname text, "
+					 "dbname text, "
+					 "temp_blks_written int8, "
+					 "hitratio float8, "
+					 "ntuples int8, "
+					 "queryid int8, "
+					 "query text, "
+					 "plan json) PARTITION BY RANGE (datetime)", table);
+	SPI_execute(sql.data, false, 0);
+
+	resetStringInfo(&sql);
+	appendStringInfo(&sql,
+					 "CREATE TABLE IF NOT EXISTS %s ("
+					 "segno int8 NOT NULL, \"offset\" int8 NOT NULL)", position);
+	SPI_execute(sql.data, false, 0);
+
+	resetStringInfo(&sql);
+	appendStringInfo(&sql, "SELECT segno, \"offset\" FROM %s", position);
+	if (SPI_execute(sql.data, true, 0) != SPI_OK_SELECT)
+		ereport(ERROR,
+				(errmsg("pg_track_slow_queries: could not read \"%s\"", position)));
+	if (SPI_processed > 0)
+	{
+		bool	isnull;
+
+		*segno = (uint32) DatumGetInt64(SPI_getbinval(SPI_tuptable->vals[0],
+								SPI_tuptable->tupdesc, 1, &isnull));
+		*offset = (off_t) DatumGetInt64(SPI_getbinval(SPI_tuptable->vals[0],
+								SPI_tuptable->tupdesc, 2, &isnull));
+	}
+	else
+	{
+		/* Everything stored so far goes to the table */
+		*segno = pgtsq_first_segment(pg_atomic_read_u64(&pgtsqss->committed));
+		*offset = 0;
+		resetStringInfo(&sql);
+		appendStringInfo(&sql, "INSERT INTO %s VALUES (%u, 0)", position, *segno);
+		SPI_execute(sql.data, false, 0);
+	}
+
+	/* Rows are inserted from one array per column */
+	for (int i = 0; i < TSQ_COLS; i++)
+	{
+		get_typlenbyvalalign(sink_types[i], &sink_typlen[i],
+							 &sink_typbyval[i], &sink_typalign[i]);
+		argtypes[i] = get_array_type(sink_types[i]);
+	}
+
+	resetStringInfo(&sql);
+	appendStringInfo(&sql,
+					 "INSERT INTO %s SELECT d, s, du, u, a, db, t, h, n, qi, q, NULLIF(p, '')::json "
+					 "FROM unnest($1, $2, $3, $4, $5, $6, $7, $8, $9, $10, $11, $12) "
+					 "AS r(d, s, du, u, a, db, t, h, n, qi, q, p)", table);
+	insert_plan = SPI_prepare(sql.data, TSQ_COLS, argtypes);
+
+	argtypes[0] = argtypes[1] = INT8OID;
+	resetStringInfo(&sql);
+	appendStringInfo(&sql, "UPDATE %s SET segno = $1, \"offset\" = $2",
+					 position);
+	position_plan = SPI_prepare(sql.data, 2, argtypes);
+
+	if (insert_plan == NULL || position_plan == NULL ||
+		SPI_keepplan(insert_plan) != 0 || SPI_keepplan(position_plan) != 0)
+		ereport(ERROR,
+				(errmsg("pg_track_slow_queries: could not prepare sink statements")));
+
+	pgtsq_sink_commit();
+}
+
+/*
+ * Reads the rows stored from segno and offset into batch, and moves them
+ * forward. Returns true if rows are left to read.
+ */
+static bool
+pgtsq_sink_read(TSQSinkBatch * batch, uint32 * segno, off_t * offset, int cutoff)
+{
+	TSQSegmentReader	reader;
+	uint64		pos;
+	uint32		first;
+	uint32		current;
+	char		*row;
+	uint32		row_len;
+	TSQEntry	tsqe;
+	int			ret;
+
+	batch->nrows = 0;
+	batch->days = NIL;
+
+	pos = pg_atomic_read_u64(&pgtsqss->committed);
+	pg_read_barrier();
+	first = pgtsq_first_segment(pos);
+	current = TSQPosSegno(pos);
+
+	/* Segments removed by a reset, or position from a previous storage */
+	if (((*segno - first) & TSQ_SEGNO_MASK) > ((current - first) & TSQ_SEGNO_MASK))
+	{
+		*segno = first;
+		*offset = 0;
+	}
+
+	ret = pgtsq_open_reader(&reader, *segno,
+							*segno == current ? TSQPosOffset(pos) : -1);
+	if (ret > 0 && *offset > 0)
+	{
+		if (fseeko(reader.file, *offset, SEEK_SET) != 0)
+			ret = -1;
+		reader.offset = *offset;
+	}
+
+	while (ret > 0 && batch->nrows < TSQ_SINK_BATCH_ROWS)
+	{
+		int		day;
+		int		i = 0;
+		char	*plantxt;
+
+		if ((ret = pgtsq_read_row(&reader, &row, &row_len)) <= 0)
+			break;
+		*offset = reader.offset;
+
+		memset(&tsqe, 0, sizeof(TSQEntry));
+		if (!pgtsq_parse_row(row, reader.header.version, &tsqe))
+		{
+			ereport(LOG,
+					(errmsg("pg_track_slow_queries: could not parse row of segment %08X",
+							*segno)));
+			continue;
+		}
+		day = (int) (tsqe.end_time / USECS_PER_DAY);
+		if (day < cutoff)
+			continue;
+		if (!list_member_int(batch->days, day))
+			batch->days = lappend_int(batch->days, day);
+
+		batch->values[i++][batch->nrows] = TimestampTzGetDatum(tsqe.end_time);
+		batch->values[i++][batch->nrows] = TimestampTzGetDatum(tsqe.start_time);
+		batch->values[i++][batch->nrows] = Float8GetDatum(tsqe.duration);
+		batch->values[i++][batch->nrows] = CStringGetTextDatum(tsqe.username);
+		batch->values[i++][batch->nrows] = CStringGetTextDatum(tsqe.appname);
+		batch->values[i++][batch->nrows] = CStringGetTextDatum(tsqe.dbname);
+		batch->values[i++][batch->nrows] = Int64GetDatum(tsqe.temp_blks_written);
+		batch->values[i++][batch->nrows] = Float8GetDatum(tsqe.hitratio);
+		batch->values[i++][batch->nrows] = Int64GetDatum(tsqe.ntuples);
+		batch->values[i++][batch->nrows] = Int64GetDatum((int64) tsqe.queryid);
+		batch->values[i++][batch->nrows] = CStringGetTextDatum(tsqe.querytxt);
+		/* Invalid plan snapshots are stored as NULL, like empty plans */
+		plantxt = pgtsq_plan_text(&tsqe);
+		batch->values[i++][batch->nrows] = CStringGetTextDatum(plantxt ? plantxt : "");
+		batch->nrows++;
+	}
+	pgtsq_close_reader(&reader);
+
+	if (ret < 0)
+	{
+		/* Retried on next wakeup */
+		ereport(LOG,
+				(errmsg("pg_track_slow_queries: could not read segment %08X",
+						*segno)));
+		return false;
+	}
+	if (batch->nrows == TSQ_SINK_BATCH_ROWS)
+		return true;
+
+	/* Segments before the current one are complete */
+	if (*segno != current)
+	{
+		*segno = TSQNextSegno(*segno);
+		*offset = 0;
+		return true;
+	}
+	return false;
+}
+
+/*
+ * Name of the partition of a day
+ */
+static char *
+pgtsq_sink_partition(int day, int * year, int * month, int * mday)
+{
+	j2date(day + POSTGRES_EPOCH_JDATE, year, month, mday);
+	return pgtsq_sink_relation(psprintf("_%04d%02d%02d", *year, *month, *mday));
+}
+
+/*
+ * Inserts a batch in the partitions of its days, created if needed, and saves
+ * the position reached in the same transaction.
+ */
+static void
+pgtsq_sink_write(TSQSinkBatch * batch, uint32 segno, off_t offset)
+{
+	Datum		args[TSQ_COLS];
+	ListCell	*lc;
+	int			ret;
+
+	/* Arrays are built out of the transaction, in the batch context */
+	for (int i = 0; batch->nrows > 0 && i < TSQ_COLS; i++)
+		args[i] = PointerGetDatum(construct_array(batch->values[i], batch->nrows,
+									sink_types[i], sink_typlen[i],
+									sink_typbyval[i], sink_typalign[i]));
+
+	pgtsq_sink_begin("pg_track_slow_queries sink insert");
+
+	foreach(lc, batch->days)
+	{
+		int		day = lfirst_int(lc);
+		int		y1, m1, d1, y2, m2, d2;
+		char	*partition;
+		MemoryContext	oldcontext;
+
+		if (list_member_int(sink_days, day))
+			continue;
+
+		partition = pgtsq_sink_partition(day, &y1, &m1, &d1);
+		j2date(day + 1 + POSTGRES_EPOCH_JDATE, &y2, &m2, &d2);
+		ret = SPI_execute(psprintf("CREATE TABLE IF NOT EXISTS %s PARTITION OF %s "
+								   "FOR VALUES FROM ('%04d-%02d-%02d 00:00:00+00') "
+								   "TO ('%04d-%02d-%02d 00:00:00+00')",
+								   partition, pgtsq_sink_relation(""),
+								   y1, m1, d1, y2, m2, d2), false, 0);
+		if (ret != SPI_OK_UTILITY)
+			ereport(ERROR,
+					(errmsg("pg_track_slow_queries: could not create partition %s",
+							partition)));
+
+		oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+		sink_days = lappend_int(sink_days, day);
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	if (batch->nrows > 0 &&
+		(ret = SPI_execute_plan(insert_plan, args, NULL, false, 0)) != SPI_OK_INSERT)
+		ereport(ERROR,
+				(errmsg("pg_track_slow_queries: could not insert into sink table: %s",
+						SPI_result_code_string(ret))));
+
+	args[0] = Int64GetDatum((int64) segno);
+	args[1] = Int64GetDatum((int64) offset);
+	if ((ret = SPI_execute_plan(position_plan, args, NULL, false, 0)) != SPI_OK_UPDATE)
+		ereport(ERROR,
+				(errmsg("pg_track_slow_queries: could not save sink position: %s",
+						SPI_result_code_string(ret))));
+
+	pgtsq_sink_commit();
+}
+
+/*
+ * Drops the partitions of the days before cutoff
+ */
+static void
+pgtsq_sink_retention(int cutoff)
+{
+	StringInfoData	sql;
+	List		*drop = NIL;
+	ListCell	*lc;
+	size_t		prefix_len = strlen(sink_relname) + 1;
+
+	pgtsq_sink_begin("pg_track_slow_queries sink retention");
+
+	initStringInfo(&sql);
+	appendStringInfo(&sql,
+					 "SELECT c.relname::text FROM pg_catalog.pg_inherits i "
+					 "JOIN pg_catalog.pg_class c ON c.oid = i.inhrelid "
+					 "WHERE i.inhparent = %s::regclass",
+					 quote_literal_cstr(pgtsq_sink_relation("")));
+	if (SPI_execute(sql.data, true, 0) != SPI_OK_SELECT)
+		ereport(ERROR,
+				(errmsg("pg_track_slow_queries: could not list partitions")));
+
+	/* Only the partitions named after their day are considered */
+	for (uint64 i = 0; i < SPI_processed; i++)
+	{
+		char	*name = SPI_getvalue(SPI_tuptable->vals[i], SPI_tuptable->tupdesc, 1);
+		int		year, month, mday;
+
+		if (strlen(name) != prefix_len + 8 ||
+			strncmp(name, sink_relname, prefix_len - 1) != 0 ||
+			name[prefix_len - 1] != '_' ||
+			strspn(name + prefix_len, "0123456789") != 8 ||
+			sscanf(name + prefix_len, "%4d%2d%2d", &year, &month, &mday) != 3)
+			continue;
+		if (date2j(year, month, mday) - POSTGRES_EPOCH_JDATE < cutoff)
+			drop = lappend(drop, quote_qualified_identifier(sink_schema, name));
+	}
+
+	foreach(lc, drop)
+	{
+		resetStringInfo(&sql);
+		appendStringInfo(&sql, "DROP TABLE %s", (char *) lfirst(lc));
+		SPI_execute(sql.data, false, 0);
+		ereport(LOG,
+				(errmsg("pg_track_slow_queries: dropped sink partition %s",
+						(char *) lfirst(lc))));
+	}
+
+	pgtsq_sink_commit();
+
+	/* Partitions of the days before cutoff are created again if needed */
+	foreach(lc, sink_days)
+	{
+		if (lfirst_int(lc) < cutoff)
+		{
+			list_free(sink_days);
+			sink_days = NIL;
+			break;
+		}
+	}
+}
+
+#endif
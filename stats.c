@@ -0,0 +1,325 @@
+/*
+ * Collector pipeline and capture overhead statistics
+ *
+ * The collector records, for each batch it writes, the time spent compressing
+ * and writing rows, the number of messages it read from its socket on one
+ * wakeup and the end-to-end latency of each entry, from ExecutorEnd until it
+ * is written.
+ *
+ * Backends record the time spent in each phase of the capture of a sample of
+ * the queries, as set by pg_track_slow_queries.overhead_sample_rate.
+ */
+#include "postgres.h"
+
+#include <math.h>
+
+#include "funcapi.h"
+#include "catalog/pg_type.h"
+#include "port/atomics.h"
+#include "storage/lwlock.h"
+#include "storage/spin.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/timestamp.h"
+
+#include "pg_track_slow_queries.h"
+
+/* Number of columns returned by pg_track_slow_queries_stats() */
+#define TSQ_STATS_COLS		13
+/* Number of columns returned by pg_track_slow_queries_overhead() */
+#define TSQ_OVERHEAD_COLS	5
+
+/* Capture phase names, in TSQPhase order */
+static const char *const phase_names[TSQ_PHASES] = {
+	"start",
+	"metadata",
+	"explain",
+	"serialize",
+	"compress",
+	"transport"
+};
+
+PGDLLEXPORT Datum pg_track_slow_queries_stats(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum pg_track_slow_queries_stats_reset(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum pg_track_slow_queries_overhead(PG_FUNCTION_ARGS);
+
+PG_FUNCTION_INFO_V1(pg_track_slow_queries_stats);
+PG_FUNCTION_INFO_V1(pg_track_slow_queries_stats_reset);
+PG_FUNCTION_INFO_V1(pg_track_slow_queries_overhead);
+
+/*
+ * Resets collector statistics, the caller must hold the mutex unless the
+ * shared state is being initialized.
+ */
+static void
+pgtsq_reset_stats(volatile TSQCollectorStats * stats, TimestampTz now)
+{
+	stats->entries = 0;
+	stats->batches = 0;
+	stats->bytes = 0;
+	stats->wakeup_messages_max = 0;
+	memset((TSQHistogram *) &stats->latency, 0, sizeof(TSQHistogram));
+	stats->compress_time = 0;
+	stats->compress_time_max = 0;
+	stats->write_time = 0;
+	stats->write_time_max = 0;
+	stats->forward_dropped = 0;
+	stats->stats_reset = now;
+}
+
+/*
+ * Initializes statistics in shared memory
+ */
+void
+pgtsq_init_stats(void)
+{
+	SpinLockInit(&pgtsqss->stats.mutex);
+	pgtsq_reset_stats(&pgtsqss->stats, GetCurrentTimestamp());
+	SpinLockInit(&pgtsqss->overhead.mutex);
+	memset(pgtsqss->overhead.phases, 0, sizeof(pgtsqss->overhead.phases));
+}
+
+/*
+ * Adds a duration, in ms, to a histogram. Bucket 0 counts durations lower
+ * than 1us, bucket n those in [2^(n-1), 2^n) us, the last one has no upper
+ * bound.
+ */
+void
+pgtsq_histogram_add(TSQHistogram * hist, double ms)
+{
+	uint64	us = (uint64) (ms * 1000.0);
+	int		bucket = 0;
+
+	while (us > 0 && bucket < TSQ_HIST_BUCKETS - 1)
+	{
+		us >>= 1;
+		bucket++;
+	}
+	hist->buckets[bucket]++;
+	hist->count++;
+	hist->total += ms;
+	if (ms > hist->max)
+		hist->max = ms;
+}
+
+/*
+ * Adds the values of src to dst
+ */
+void
+pgtsq_histogram_merge(TSQHistogram * dst, TSQHistogram * src)
+{
+	for (int i = 0; i < TSQ_HIST_BUCKETS; i++)
+		dst->buckets[i] += src->buckets[i];
+	dst->count += src->count;
+	dst->total += src->total;
+	if (src->max > dst->max)
+		dst->max = src->max;
+}
+
+/*
+ * Returns an estimate, in ms, of the q quantile of the values of a
+ * histogram, interpolated within its bucket and capped by the max value
+ */
+double
+pgtsq_histogram_quantile(TSQHistogram * hist, double q)
+{
+	double	rank = q * hist->count;
+	uint64	seen = 0;
+
+	if (hist->count == 0)
+		return 0.0;
+
+	for (int i = 0; i < TSQ_HIST_BUCKETS; i++)
+	{
+		double	lower, upper;
+
+		if (hist->buckets[i] == 0 || seen + hist->buckets[i] < rank)
+		{
+			seen += hist->buckets[i];
+			continue;
+		}
+		lower = i == 0 ? 0.0 : ldexp(1.0, i - 1) / 1000.0;
+		upper = i == TSQ_HIST_BUCKETS - 1 ? hist->max : ldexp(1.0, i) / 1000.0;
+		return Min(lower + (upper - lower) * (rank - seen) / hist->buckets[i],
+				   hist->max);
+	}
+	return hist->max;
+}
+
+/*
+ * Returns histogram buckets as a bigint[] Datum
+ */
+Datum
+pgtsq_histogram_array(TSQHistogram * hist)
+{
+	Datum	elems[TSQ_HIST_BUCKETS];
+
+	for (int i = 0; i < TSQ_HIST_BUCKETS; i++)
+		elems[i] = Int64GetDatum((int64) hist->buckets[i]);
+
+	return PointerGetDatum(construct_array(elems, TSQ_HIST_BUCKETS, INT8OID,
+										   sizeof(int64), FLOAT8PASSBYVAL, 'd'));
+}
+
+/*
+ * Accounts a batch written by the collector
+ */
+void
+pgtsq_report_batch(TSQStoreStats * stats, TSQHistogram * latency, uint32 nmessages)
+{
+	volatile TSQCollectorStats *s = &pgtsqss->stats;
+
+	SpinLockAcquire(&s->mutex);
+	s->entries += stats->nrows;
+	s->batches++;
+	s->bytes += stats->bytes;
+	if (nmessages > s->wakeup_messages_max)
+		s->wakeup_messages_max = nmessages;
+	pgtsq_histogram_merge((TSQHistogram *) &s->latency, latency);
+	s->compress_time += stats->compress_time;
+	if (stats->compress_time > s->compress_time_max)
+		s->compress_time_max = stats->compress_time;
+	s->write_time += stats->write_time;
+	if (stats->write_time > s->write_time_max)
+		s->write_time_max = stats->write_time;
+	SpinLockRelease(&s->mutex);
+}
+
+/*
+ * Accounts rows not forwarded because the forward spool is full
+ */
+void
+pgtsq_report_forward_dropped(int nrows)
+{
+	volatile TSQCollectorStats *s = &pgtsqss->stats;
+
+	SpinLockAcquire(&s->mutex);
+	s->forward_dropped += nrows;
+	SpinLockRelease(&s->mutex);
+}
+
+/*
+ * Accounts the duration of the capture phases set in phase_mask
+ */
+void
+pgtsq_report_overhead(double * phases, int phase_mask)
+{
+	volatile TSQOverheadStats *s = &pgtsqss->overhead;
+
+	SpinLockAcquire(&s->mutex);
+	for (int i = 0; i < TSQ_PHASES; i++)
+		if (phase_mask & (1 << i))
+			pgtsq_histogram_add((TSQHistogram *) &s->phases[i], phases[i]);
+	SpinLockRelease(&s->mutex);
+}
+
+PGDLLEXPORT Datum
+pg_track_slow_queries_stats(PG_FUNCTION_ARGS)
+{
+	TupleDesc			tupdesc;
+	Tuplestorestate		*tupstore;
+	TSQCollectorStats	stats;
+	Datum				values[TSQ_STATS_COLS];
+	bool				nulls[TSQ_STATS_COLS];
+	int					i = 0;
+
+	if (!pgtsqss)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pg_track_slow_queries: must be loaded via shared_preload_libraries")));
+
+	tupstore = pgtsq_begin_srf(fcinfo, &tupdesc);
+
+	/* Work on a copy to keep the spinlock held as short as possible */
+	SpinLockAcquire(&pgtsqss->stats.mutex);
+	memcpy(&stats, (TSQCollectorStats *) &pgtsqss->stats, sizeof(TSQCollectorStats));
+	SpinLockRelease(&pgtsqss->stats.mutex);
+
+	memset(values, 0, sizeof(values));
+	memset(nulls, 0, sizeof(nulls));
+
+	values[i++] = Int64GetDatum(stats.entries);
+	values[i++] = Int64GetDatum(stats.batches);
+	values[i++] = Int64GetDatum(stats.bytes);
+	values[i++] = Int32GetDatum(stats.wakeup_messages_max);
+	if (stats.latency.count > 0)
+		values[i++] = Float8GetDatum(stats.latency.total / stats.latency.count);
+	else
+		nulls[i++] = true;
+	values[i++] = Float8GetDatumFast(stats.latency.max);
+	values[i++] = pgtsq_histogram_array(&stats.latency);
+	values[i++] = Float8GetDatumFast(stats.compress_time);
+	values[i++] = Float8GetDatumFast(stats.compress_time_max);
+	values[i++] = Float8GetDatumFast(stats.write_time);
+	values[i++] = Float8GetDatumFast(stats.write_time_max);
+	values[i++] = Int64GetDatum(stats.forward_dropped);
+	values[i++] = TimestampTzGetDatum(stats.stats_reset);
+
+	tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	tuplestore_donestoring(tupstore);
+
+	return (Datum) 0;
+}
+
+PGDLLEXPORT Datum
+pg_track_slow_queries_stats_reset(PG_FUNCTION_ARGS)
+{
+	TimestampTz	now;
+
+	if (!pgtsqss)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pg_track_slow_queries: must be loaded via shared_preload_libraries")));
+
+	now = GetCurrentTimestamp();
+
+	SpinLockAcquire(&pgtsqss->stats.mutex);
+	pgtsq_reset_stats(&pgtsqss->stats, now);
+	SpinLockRelease(&pgtsqss->stats.mutex);
+
+	SpinLockAcquire(&pgtsqss->overhead.mutex);
+	memset((TSQHistogram *) pgtsqss->overhead.phases, 0,
+		   sizeof(pgtsqss->overhead.phases));
+	SpinLockRelease(&pgtsqss->overhead.mutex);
+
+	PG_RETURN_VOID();
+}
+
+PGDLLEXPORT Datum
+pg_track_slow_queries_overhead(PG_FUNCTION_ARGS)
+{
+	TupleDesc			tupdesc;
+	Tuplestorestate		*tupstore;
+	TSQHistogram		phases[TSQ_PHASES];
+
+	if (!pgtsqss)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pg_track_slow_queries: must be loaded via shared_preload_libraries")));
+
+	tupstore = pgtsq_begin_srf(fcinfo, &tupdesc);
+
+	SpinLockAcquire(&pgtsqss->overhead.mutex);
+	memcpy(phases, (TSQHistogram *) pgtsqss->overhead.phases, sizeof(phases));
+	SpinLockRelease(&pgtsqss->overhead.mutex);
+
+	for (int p = 0; p < TSQ_PHASES; p++)
+	{
+		Datum	values[TSQ_OVERHEAD_COLS];
+		bool	nulls[TSQ_OVERHEAD_COLS];
+		int		i = 0;
+
+		memset(nulls, 0, sizeof(nulls));
+
+		values[i++] = CStringGetTextDatum(phase_names[p]);
+		values[i++] = Int64GetDatum(phases[p].count);
+		values[i++] = Float8GetDatumFast(phases[p].total);
+		values[i++] = Float8GetDatumFast(phases[p].max);
+		values[i++] = pgtsq_histogram_array(&phases[p]);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+	tuplestore_donestoring(tupstore);
+
+	return (Datum) 0;
+}
@@ -0,0 +1,398 @@
+/*
+ * Synthetic stress test of the capture pipeline
+ *
+ * pg_track_slow_queries_stress() starts a number of background workers that
+ * send synthetic entries to the collector at a given rate, through the same
+ * socket and message format as the backends. Once they are done, it waits for
+ * the collector to store what it received and reports the loss rate, the CPU
+ * time used by the collector and the latency of the entries.
+ *
+ * Loss and latency are computed from the collector statistics, so entries
+ * captured by regular queries during the test are accounted too.
+ */
+#include "postgres.h"
+#include <unistd.h>
+
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "lib/stringinfo.h"
+#include "port/atomics.h"
+#include "postmaster/bgworker.h"
+#include "storage/fd.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/spin.h"
+#include "utils/builtins.h"
+#include "utils/timestamp.h"
+
+#include "pg_track_slow_queries.h"
+
+/* Number of columns returned by pg_track_slow_queries_stress() */
+#define TSQ_STRESS_COLS		8
+/* Time given to the collector to store the last entries, in ms */
+#define TSQ_STRESS_DRAIN_TIMEOUT	10000
+/* Entry size bounds, entries must fit in a datagram */
+#define TSQ_STRESS_MIN_SIZE	256
+#define TSQ_STRESS_MAX_SIZE	60000
+
+/* Stress worker parameters, passed through bgw_extra */
+typedef struct TSQStressParams {
+	int			rate;			/* Entries per second */
+	int			duration;		/* Duration in ms */
+	int			entry_size;		/* Approximate serialized entry size */
+} TSQStressParams;
+
+PGDLLEXPORT Datum pg_track_slow_queries_stress(PG_FUNCTION_ARGS);
+
+PG_FUNCTION_INFO_V1(pg_track_slow_queries_stress);
+
+/* Workers of a stress test, stopped if it is interrupted */
+typedef struct TSQStressWorkers {
+	BackgroundWorkerHandle **handles;
+	int			processes;
+} TSQStressWorkers;
+
+/*
+ * Initializes stress test counters in shared memory
+ */
+void
+pgtsq_init_stress(void)
+{
+	pg_atomic_init_u32(&pgtsqss->stress.running, 0);
+	pg_atomic_init_u64(&pgtsqss->stress.sent, 0);
+	pg_atomic_init_u64(&pgtsqss->stress.failed, 0);
+}
+
+/*
+ * Stress worker main function: sends params.rate entries per second during
+ * params.duration ms.
+ */
+void
+pgtsq_stress_worker(Datum main_arg)
+{
+	TSQStressParams	params;
+	TSQEntry		tsqe;
+	TSQMsgHeader	header;
+	StringInfo		row;
+	StringInfoData	query;
+	TimestampTz		start;
+	int64			total;
+	int64			target;
+	int64			sent = 0;
+	int64			failed = 0;
+
+	BackgroundWorkerUnblockSignals();
+
+	/* Synthetic entries are left out of plan changes */
+	memset(&header, 0, sizeof(TSQMsgHeader));
+
+	memcpy(&params, MyBgworkerEntry->bgw_extra, sizeof(TSQStressParams));
+
+	/* Synthetic entry, the query text is padded up to the requested size */
+	initStringInfo(&query);
+	appendStringInfo(&query,
+					 "SELECT abalance FROM pgbench_accounts WHERE aid = %d; -- ",
+					 DatumGetInt32(main_arg));
+	while (query.len < params.entry_size - TSQ_STRESS_MIN_SIZE)
+		appendStringInfoChar(&query, 'x');
+
+	start = GetCurrentTimestamp();
+	memset(&tsqe, 0, sizeof(TSQEntry));
+	tsqe.end_time = start;
+	tsqe.start_time = start - 1000;
+	tsqe.duration = 1.0;
+	tsqe.username = "postgres";
+	tsqe.appname = "pg_track_slow_queries stress";
+	tsqe.dbname = "postgres";
+	tsqe.temp_blks_written = 0;
+	tsqe.hitratio = 100.0;
+	tsqe.ntuples = 1;
+	tsqe.querytxt = query.data;
+	tsqe.plantxt = "{\"Plan\": {\"Node Type\": \"Index Scan\", "
+				   "\"Relation Name\": \"pgbench_accounts\"}}";
+	tsqe.planlen = 0;
+	row = pgtsq_serialize_entry(&tsqe);
+
+	/* Messages are sent as soon as they are due, then we sleep for 1ms */
+	total = (int64) params.rate * params.duration / 1000;
+	while (sent + failed < total)
+	{
+		target = Min(total, (int64) params.rate *
+					 ((GetCurrentTimestamp() - start) / 1000) / 1000);
+		while (sent + failed < target)
+		{
+			header.captured = GetCurrentTimestamp();
+			if (pgtsq_send_row(&header, row->data, row->len))
+				sent++;
+			else
+				failed++;
+		}
+		CHECK_FOR_INTERRUPTS();
+		pg_usleep(1000L);
+	}
+
+	pg_atomic_fetch_add_u64(&pgtsqss->stress.sent, sent);
+	pg_atomic_fetch_add_u64(&pgtsqss->stress.failed, failed);
+
+	proc_exit(0);
+}
+
+/*
+ * Returns the CPU time used by a process in s, or -1 if unknown. Linux only.
+ */
+static double
+pgtsq_stress_cpu_time(pid_t pid)
+{
+	char			path[MAXPGPATH];
+	char			buf[1024];
+	char			*p;
+	FILE			*file;
+	size_t			n;
+	unsigned long	utime;
+	unsigned long	stime;
+
+	if (pid <= 0)
+		return -1;
+
+	snprintf(path, MAXPGPATH, "/proc/%d/stat", (int) pid);
+	if ((file = AllocateFile(path, PG_BINARY_R)) == NULL)
+		return -1;
+	n = fread(buf, 1, sizeof(buf) - 1, file);
+	FreeFile(file);
+	buf[n] = '\0';
+
+	/* The command name may contain spaces, fields are read after it */
+	if ((p = strrchr(buf, ')')) == NULL ||
+		sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+			   &utime, &stime) != 2)
+		return -1;
+
+	return (double) (utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+/*
+ * Copies collector statistics
+ */
+static void
+pgtsq_stress_stats(TSQCollectorStats * stats)
+{
+	SpinLockAcquire(&pgtsqss->stats.mutex);
+	memcpy(stats, (TSQCollectorStats *) &pgtsqss->stats, sizeof(TSQCollectorStats));
+	SpinLockRelease(&pgtsqss->stats.mutex);
+}
+
+/*
+ * Starts the stress workers, waits for them and for the collector to store
+ * their entries. Workers started are terminated on error.
+ */
+static void
+pgtsq_stress_run(BackgroundWorkerHandle ** handles, int processes,
+				 TSQStressParams * params, TSQCollectorStats * before,
+				 TSQCollectorStats * after)
+{
+	BackgroundWorker	worker;
+	TimestampTz			start;
+	TimestampTz			progress;
+	uint64				stored = 0;
+	uint64				sent;
+
+	memset(&worker, 0, sizeof(worker));
+	worker.bgw_flags = BGWORKER_SHMEM_ACCESS;
+	worker.bgw_start_time = BgWorkerStart_ConsistentState;
+	worker.bgw_restart_time = BGW_NEVER_RESTART;
+	snprintf(worker.bgw_library_name, BGW_MAXLEN, "pg_track_slow_queries");
+	snprintf(worker.bgw_function_name, BGW_MAXLEN, "pgtsq_stress_worker");
+#if (PG_VERSION_NUM >= 110000)
+	snprintf(worker.bgw_type, BGW_MAXLEN, "pgtsq_stress_worker");
+#endif
+	worker.bgw_notify_pid = MyProcPid;
+	memcpy(worker.bgw_extra, params, sizeof(TSQStressParams));
+
+	for (int i = 0; i < processes; i++)
+	{
+		snprintf(worker.bgw_name, BGW_MAXLEN, "pg_track_slow_queries stress %d", i);
+		worker.bgw_main_arg = Int32GetDatum(i);
+		if (!RegisterDynamicBackgroundWorker(&worker, &handles[i]))
+			ereport(ERROR,
+					(errcode(ERRCODE_INSUFFICIENT_RESOURCES),
+					 errmsg("pg_track_slow_queries: could not register stress worker %d", i),
+					 errhint("You may need to increase max_worker_processes.")));
+	}
+
+	for (int i = 0; i < processes; i++)
+	{
+		if (WaitForBackgroundWorkerShutdown(handles[i]) == BGWH_POSTMASTER_DIED)
+			ereport(ERROR,
+					(errcode(ERRCODE_ADMIN_SHUTDOWN),
+					 errmsg("pg_track_slow_queries: postmaster died during stress test")));
+		handles[i] = NULL;
+	}
+
+	/*
+	 * Wait for the collector to store everything it received: until the
+	 * number of entries stored reaches the number sent, or stops growing.
+	 */
+	sent = pg_atomic_read_u64(&pgtsqss->stress.sent);
+	start = progress = GetCurrentTimestamp();
+	for (;;)
+	{
+		TimestampTz	now;
+
+		pgtsq_stress_stats(after);
+		now = GetCurrentTimestamp();
+		if (after->entries - before->entries > stored)
+		{
+			stored = after->entries - before->entries;
+			progress = now;
+		}
+		if (stored >= sent ||
+			TimestampDifferenceExceeds(progress, now, 2000) ||
+			TimestampDifferenceExceeds(start, now, TSQ_STRESS_DRAIN_TIMEOUT))
+			break;
+
+		CHECK_FOR_INTERRUPTS();
+		pg_usleep(100000L);
+	}
+}
+
+/*
+ * Stops the workers of an interrupted stress test and lets the next one run,
+ * on error or process exit
+ */
+static void
+pgtsq_stress_cleanup(int code, Datum arg)
+{
+	TSQStressWorkers *workers = (TSQStressWorkers *) DatumGetPointer(arg);
+
+	for (int w = 0; w < workers->processes; w++)
+		if (workers->handles[w] != NULL)
+			TerminateBackgroundWorker(workers->handles[w]);
+	pg_atomic_write_u32(&pgtsqss->stress.running, 0);
+}
+
+PGDLLEXPORT Datum
+pg_track_slow_queries_stress(PG_FUNCTION_ARGS)
+{
+	int					processes = PG_GETARG_INT32(0);
+	TSQStressParams		params;
+	TSQStressWorkers	workers;
+	TupleDesc			tupdesc;
+	Tuplestorestate		*tupstore;
+	TSQCollectorStats	before;
+	TSQCollectorStats	after;
+	TSQHistogram		latency;
+	TimestampTz			start;
+	long				secs;
+	int					usecs;
+	double				cpu_before;
+	double				cpu_after;
+	uint64				sent;
+	uint64				failed;
+	uint64				stored;
+	uint64				count;
+	uint32				expected = 0;
+	Datum				values[TSQ_STRESS_COLS];
+	bool				nulls[TSQ_STRESS_COLS];
+	int					i = 0;
+
+	params.rate = PG_GETARG_INT32(1);
+	params.duration = PG_GETARG_INT32(2);
+	params.entry_size = PG_GETARG_INT32(3);
+
+	if (!pgtsqss)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pg_track_slow_queries: must be loaded via shared_preload_libraries")));
+	if (pgtsqss->socket == PGINVALID_SOCKET)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pg_track_slow_queries: collector socket is not available")));
+	if (processes <= 0 || params.rate <= 0 || params.duration <= 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("pg_track_slow_queries: processes, rate and duration must be greater than 0")));
+	if (params.entry_size < TSQ_STRESS_MIN_SIZE ||
+		params.entry_size > TSQ_STRESS_MAX_SIZE)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("pg_track_slow_queries: entry_size must be between %d and %d",
+						TSQ_STRESS_MIN_SIZE, TSQ_STRESS_MAX_SIZE)));
+	/* Duration is given in s */
+	params.duration = Min(params.duration, INT_MAX / 1000) * 1000;
+
+	if (!pg_atomic_compare_exchange_u32(&pgtsqss->stress.running, &expected, 1))
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_IN_USE),
+				 errmsg("pg_track_slow_queries: a stress test is already running")));
+
+	tupstore = pgtsq_begin_srf(fcinfo, &tupdesc);
+	workers.handles = (BackgroundWorkerHandle **) palloc0(processes * sizeof(BackgroundWorkerHandle *));
+	workers.processes = processes;
+
+	pg_atomic_write_u64(&pgtsqss->stress.sent, 0);
+	pg_atomic_write_u64(&pgtsqss->stress.failed, 0);
+	pgtsq_stress_stats(&before);
+	cpu_before = pgtsq_stress_cpu_time(pgtsqss->collector_pid);
+	start = GetCurrentTimestamp();
+
+	PG_ENSURE_ERROR_CLEANUP(pgtsq_stress_cleanup, PointerGetDatum(&workers));
+	{
+		pgtsq_stress_run(workers.handles, processes, &params, &before, &after);
+	}
+	PG_END_ENSURE_ERROR_CLEANUP(pgtsq_stress_cleanup, PointerGetDatum(&workers));
+
+	cpu_after = pgtsq_stress_cpu_time(pgtsqss->collector_pid);
+	TimestampDifference(start, GetCurrentTimestamp(), &secs, &usecs);
+	sent = pg_atomic_read_u64(&pgtsqss->stress.sent);
+	failed = pg_atomic_read_u64(&pgtsqss->stress.failed);
+	pg_atomic_write_u32(&pgtsqss->stress.running, 0);
+
+	/* Entries stored and their latency during the test */
+	stored = after.entries - before.entries;
+	memset(&latency, 0, sizeof(latency));
+	latency.count = after.latency.count - before.latency.count;
+	latency.total = after.latency.total - before.latency.total;
+	for (int b = 0; b < TSQ_HIST_BUCKETS; b++)
+		latency.buckets[b] = after.latency.buckets[b] - before.latency.buckets[b];
+
+	memset(values, 0, sizeof(values));
+	memset(nulls, 0, sizeof(nulls));
+
+	values[i++] = Int64GetDatum(sent);
+	values[i++] = Int64GetDatum(failed);
+	values[i++] = Int64GetDatum(stored);
+	if (sent + failed > 0)
+		values[i++] = Float8GetDatum(stored >= sent + failed ? 0.0 :
+			1.0 - (double) stored / (double) (sent + failed));
+	else
+		nulls[i++] = true;
+	/* Collector CPU usage, in percent of one CPU */
+	if (cpu_before >= 0 && cpu_after >= 0 && (secs > 0 || usecs > 0))
+		values[i++] = Float8GetDatum((cpu_after - cpu_before) * 100.0 /
+										 (secs + usecs / 1000000.0));
+	else
+		nulls[i++] = true;
+	if (latency.count > 0)
+	{
+		/* p99 is the upper bound of the bucket it falls in */
+		int		b = 0;
+
+		values[i++] = Float8GetDatum(latency.total / latency.count);
+		count = latency.buckets[0];
+		while (b < TSQ_HIST_BUCKETS - 1 && count < latency.count * 0.99)
+			count += latency.buckets[++b];
+		values[i++] = Float8GetDatum((double) (UINT64CONST(1) << b) / 1000.0);
+	}
+	else
+	{
+		nulls[i++] = true;
+		nulls[i++] = true;
+	}
+	values[i++] = Float8GetDatum(secs + usecs / 1000000.0);
+
+	tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	tuplestore_donestoring(tupstore);
+
+	return (Datum) 0;
+}
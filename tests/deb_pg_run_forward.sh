@@ -0,0 +1,70 @@
+#!/bin/bash -eux
+#
+# Forwards entries to a local listener standing in for the aggregator: first
+# while it is down, so that they wait in the spool, then while it is up.
+
+DIR="$( cd "$( dirname "${BASH_SOURCE[0]}" )" >/dev/null 2>&1 && pwd )"
+
+PGPORT="${PGPORT:-5433}"
+PGVERSION="${PGVERSION:-11}"
+FORWARD_PORT="${FORWARD_PORT:-5999}"
+ENTRIES="${ENTRIES:-20}"
+PG_CONFIG=/usr/lib/postgresql/$PGVERSION/bin/pg_config
+OUTDIR=$(mktemp -d)
+LISTENER_PID=
+
+cleanup()
+{
+	[ -n "${LISTENER_PID}" ] && kill ${LISTENER_PID} || true
+	rm -rf ${OUTDIR}
+}
+trap cleanup EXIT
+
+# Runs queries tagged with $1
+run_queries()
+{
+	for i in $(seq 1 ${ENTRIES}); do
+		sudo -u postgres psql -p $PGPORT -Atc "SELECT 'forward-test-$1-$i';" > /dev/null
+	done
+}
+
+# Waits until the listener got $2 entries tagged with $1
+wait_entries()
+{
+	for i in $(seq 1 60); do
+		count=$($($PG_CONFIG --bindir)/pg_tsq_dump ${OUTDIR}/* 2>/dev/null | grep -c "forward-test-$1-" || true)
+		[ "${count}" -eq "$2" ] && return 0
+		sleep 1
+	done
+	echo "expected $2 entries tagged $1, got ${count}"
+	return 1
+}
+
+pg_ctlcluster $PGVERSION main start
+
+PG_CONFIG=$PG_CONFIG make -C ${DIR}/.. clean install
+PG_CONFIG=$PG_CONFIG make -C ${DIR}/.. clean
+
+sudo -u postgres psql -p $PGPORT -c "ALTER SYSTEM SET shared_preload_libraries TO 'pg_track_slow_queries';"
+sudo -u postgres psql -p $PGPORT -c "ALTER SYSTEM SET pg_track_slow_queries.log_min_duration TO 0;"
+sudo -u postgres psql -p $PGPORT -c "ALTER SYSTEM SET pg_track_slow_queries.forward_to TO '127.0.0.1:${FORWARD_PORT}';"
+
+pg_ctlcluster $PGVERSION main restart
+
+# Aggregator down: entries wait in the spool
+run_queries spooled
+sleep 2
+
+perl ${DIR}/forward_listener.pl ${FORWARD_PORT} ${OUTDIR} &
+LISTENER_PID=$!
+wait_entries spooled ${ENTRIES}
+
+# Aggregator up
+run_queries live
+wait_entries live ${ENTRIES}
+
+# Acknowledged entries are not sent again after a restart
+pg_ctlcluster $PGVERSION main restart
+run_queries restarted
+wait_entries restarted ${ENTRIES}
+wait_entries spooled ${ENTRIES}
@@ -0,0 +1,53 @@
+#!/bin/bash -eux
+#
+# Copies entries to the sink table and checks they are all inserted once,
+# including across a restart of the server.
+
+DIR="$( cd "$( dirname "${BASH_SOURCE[0]}" )" >/dev/null 2>&1 && pwd )"
+
+PGPORT="${PGPORT:-5433}"
+PGVERSION="${PGVERSION:-11}"
+ENTRIES="${ENTRIES:-20}"
+
+# Runs queries tagged with $1
+run_queries()
+{
+	for i in $(seq 1 ${ENTRIES}); do
+		sudo -u postgres psql -p $PGPORT -Atc "SELECT 'sink-test-$1-$i';" > /dev/null
+	done
+}
+
+# Waits until the sink table holds $2 entries tagged with $1
+wait_entries()
+{
+	for i in $(seq 1 60); do
+		count=$(sudo -u postgres psql -p $PGPORT -Atc "SELECT count(*) FROM pg_track_slow_queries_history WHERE query LIKE '%sink-test-$1-%' AND query NOT LIKE '%count(*)%';" 2>/dev/null || echo 0)
+		[ "${count}" -eq "$2" ] && return 0
+		sleep 1
+	done
+	echo "expected $2 entries tagged $1, got ${count}"
+	return 1
+}
+
+pg_ctlcluster $PGVERSION main start
+
+PG_CONFIG=/usr/lib/postgresql/$PGVERSION/bin/pg_config make -C ${DIR}/.. clean install
+PG_CONFIG=/usr/lib/postgresql/$PGVERSION/bin/pg_config make -C ${DIR}/.. clean
+
+sudo -u postgres psql -p $PGPORT -c "ALTER SYSTEM SET shared_preload_libraries TO 'pg_track_slow_queries';"
+sudo -u postgres psql -p $PGPORT -c "ALTER SYSTEM SET pg_track_slow_queries.log_min_duration TO 0;"
+sudo -u postgres psql -p $PGPORT -c "ALTER SYSTEM SET pg_track_slow_queries.sink_database TO 'postgres';"
+
+pg_ctlcluster $PGVERSION main restart
+
+run_queries first
+wait_entries first ${ENTRIES}
+
+# The position saved along with the rows prevents duplicates
+pg_ctlcluster $PGVERSION main restart
+run_queries second
+wait_entries second ${ENTRIES}
+wait_entries first ${ENTRIES}
+
+# Rows land in the partition of their day
+sudo -u postgres psql -p $PGPORT -Atc "SELECT count(*) FROM pg_inherits WHERE inhparent = 'pg_track_slow_queries_history'::regclass;" | grep -qv '^0$'
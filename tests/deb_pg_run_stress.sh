@@ -0,0 +1,23 @@
+#!/bin/bash -eux
+
+DIR="$( cd "$( dirname "${BASH_SOURCE[0]}" )" >/dev/null 2>&1 && pwd )"
+
+PGPORT="${PGPORT:-5433}"
+PGVERSION="${PGVERSION:-11}"
+# Number of processes, entries per second and per process, duration in s
+STRESS_PROCESSES="${STRESS_PROCESSES:-500}"
+STRESS_RATE="${STRESS_RATE:-20}"
+STRESS_DURATION="${STRESS_DURATION:-30}"
+
+pg_ctlcluster $PGVERSION main start
+
+PG_CONFIG=/usr/lib/postgresql/$PGVERSION/bin/pg_config make -C ${DIR}/.. clean install
+PG_CONFIG=/usr/lib/postgresql/$PGVERSION/bin/pg_config make -C ${DIR}/.. clean
+
+sudo -u postgres psql -p $PGPORT -c "ALTER SYSTEM SET shared_preload_libraries TO 'pg_track_slow_queries';"
+sudo -u postgres psql -p $PGPORT -c "ALTER SYSTEM SET max_worker_processes TO $(( STRESS_PROCESSES + 8 ));"
+
+pg_ctlcluster $PGVERSION main restart
+
+sudo -u postgres psql -p $PGPORT -c "CREATE EXTENSION pg_track_slow_queries;"
+sudo -u postgres psql -p $PGPORT -x -c "SELECT * FROM pg_track_slow_queries_stress(${STRESS_PROCESSES}, ${STRESS_RATE}, ${STRESS_DURATION});"
@@ -18,6 +18,7 @@ pg_ctlcluster $PGVERSION main restart
 
 sudo -u postgres psql -p $PGPORT -c "CREATE DATABASE tap;"
 sudo -u postgres psql -p $PGPORT -d tap -c "CREATE EXTENSION pgtap;"
-sudo -u postgres psql -p $PGPORT -d tap -c "CREATE EXTENSION pg_track_slow_queries;"
+sudo -u postgres psql -p $PGPORT -d tap -c "CREATE EXTENSION pg_track_slow_queries VERSION '1.0';"
+sudo -u postgres psql -p $PGPORT -d tap -c "ALTER EXTENSION pg_track_slow_queries UPDATE;"
 cp ${DIR}/sql/t.sql /tmp/t.sql
 sudo -u postgres pg_prove -f -p $PGPORT -d tap /tmp/t.sql
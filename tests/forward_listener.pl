@@ -0,0 +1,176 @@
+#!/usr/bin/perl
+#
+# Stands in for a remote aggregator in the forwarding tests: accepts the
+# connections of pg_track_slow_queries collectors and appends the blocks they
+# send, rows and footer, to DIRECTORY/<node>/pg_track_slow_queries.<segment>.stat,
+# storage segments pg_tsq_dump and pg_track_slow_queries_import() can read,
+# and the relations of the blocks to the relation index of the segment.
+# A new segment is started when a collector sends rows of another format.
+#
+# The last sequence number stored for each node and stream is kept in
+# DIRECTORY/<node>/stream, blocks sent again are acknowledged and dropped.
+#
+# Usage: forward_listener.pl PORT DIRECTORY
+
+use strict;
+use warnings;
+use IO::Socket::INET;
+use File::Path qw(make_path);
+
+use constant {
+	HELLO_MAGIC		=> 0x48515354,
+	BLOCK_MAGIC		=> 0x42515354,
+	SEGMENT_MAGIC	=> 0x00515354,
+	HELLO_SIZE		=> 80,
+	BLOCK_SIZE		=> 24,
+	BLOCK_UNINDEXED	=> 0xFFFFFFFF,
+	# Seconds between the Unix and the PostgreSQL epochs
+	PG_EPOCH		=> 946684800,
+};
+
+my ($port, $dir) = @ARGV;
+die "Usage: $0 PORT DIRECTORY\n" unless defined $dir;
+
+$SIG{TERM} = $SIG{INT} = sub { exit 0 };
+
+my $server = IO::Socket::INET->new(
+	LocalAddr	=> '127.0.0.1',
+	LocalPort	=> $port,
+	Proto		=> 'tcp',
+	Listen		=> 5,
+	ReuseAddr	=> 1,
+) or die "could not listen on port $port: $!\n";
+
+# Reads exactly $len bytes, returns undef at end of connection
+sub read_exactly
+{
+	my ($sock, $len) = @_;
+	my $buf = '';
+
+	while (length($buf) < $len)
+	{
+		my $n = sysread($sock, $buf, $len - length($buf), length($buf));
+		return undef unless $n;
+	}
+	return $buf;
+}
+
+sub read_state
+{
+	my ($path) = @_;
+
+	open(my $fh, '<', $path) or return (0, 0);
+	my ($stream, $seqno) = split(/\s+/, <$fh>);
+	close($fh);
+	return ($stream, $seqno);
+}
+
+sub write_state
+{
+	my ($path, $stream, $seqno) = @_;
+
+	open(my $fh, '>', "$path.tmp") or die "could not write $path.tmp: $!\n";
+	print $fh "$stream $seqno\n";
+	close($fh);
+	rename("$path.tmp", $path) or die "could not rename $path.tmp: $!\n";
+}
+
+# Returns the segment rows of the given format version are appended to
+sub segment_path
+{
+	my ($nodedir, $version) = @_;
+	my $segno = 1;
+
+	my @segments = sort glob("$nodedir/pg_track_slow_queries.*.stat");
+	if (@segments)
+	{
+		my $last = $segments[-1];
+		($segno) = $last =~ /\.([0-9A-F]{8})\.stat$/;
+		$segno = hex($segno);
+
+		open(my $fh, '<:raw', $last) or die "could not open $last: $!\n";
+		my $header = '';
+		read($fh, $header, 8);
+		close($fh);
+		my (undef, $last_version) = unpack('L S', $header . "\0" x 8);
+		$segno++ if length($header) == 8 && $last_version != $version;
+	}
+	return sprintf("%s/pg_track_slow_queries.%08X.stat", $nodedir, $segno);
+}
+
+sub handle_connection
+{
+	my ($sock) = @_;
+	my $hello = read_exactly($sock, HELLO_SIZE) or return;
+	my ($magic, $version, $codec, $stream, $node) = unpack('L S S q Z64', $hello);
+
+	if ($magic != HELLO_MAGIC)
+	{
+		warn "invalid hello message\n";
+		return;
+	}
+
+	# Node names end up in paths
+	$node =~ s/[^A-Za-z0-9_-]/_/g;
+	my $nodedir = "$dir/$node";
+	my $state = "$nodedir/stream";
+	make_path($nodedir);
+	my $segment = segment_path($nodedir, $version);
+
+	my ($last_stream, $last_seqno) = read_state($state);
+	$last_seqno = 0 if $last_stream != $stream;
+
+	open(my $out, '>>:raw', $segment) or die "could not open $segment: $!\n";
+	if (-s $segment == 0)
+	{
+		my $created = int((time() - PG_EPOCH) * 1000000);
+		syswrite($out, pack('L S S q', SEGMENT_MAGIC, $version, $codec, $created));
+	}
+	my $offset = -s $segment;
+	open(my $relout, '>>:raw', "$segment.rel")
+		or die "could not open $segment.rel: $!\n";
+
+	while (defined(my $header = read_exactly($sock, BLOCK_SIZE)))
+	{
+		my ($bmagic, $nrows, $length, $nrelids, $seqno) = unpack('L L L L Q', $header);
+
+		die "invalid block from $node\n" if $bmagic != BLOCK_MAGIC;
+		my $data = $length > 0 ? read_exactly($sock, $length) : '';
+		last unless defined $data;
+
+		# The block as stored in segments, then the relations of its rows
+		my $relids_len = $nrelids == BLOCK_UNINDEXED ? 0 : 4 * $nrelids;
+		die "invalid block from $node\n" if $relids_len > $length;
+		my $block_len = $length - $relids_len;
+
+		if ($seqno > $last_seqno)
+		{
+			syswrite($out, substr($data, 0, $block_len)) == $block_len
+				or die "could not write $segment: $!\n";
+			if ($nrelids != BLOCK_UNINDEXED)
+			{
+				my $end = $offset + $block_len;
+				my $entries = '';
+
+				$entries .= pack('L L Q Q', $_, 0, $offset, $end)
+					foreach unpack('L*', substr($data, $block_len));
+				$entries .= pack('L L Q Q', 0, 0, $offset, $end);
+				syswrite($relout, $entries) == length($entries)
+					or die "could not write $segment.rel: $!\n";
+			}
+			$offset += $block_len;
+			$last_seqno = $seqno;
+			write_state($state, $stream, $last_seqno);
+		}
+		syswrite($sock, pack('Q', $seqno));
+	}
+	close($relout);
+	close($out);
+}
+
+while (my $sock = $server->accept())
+{
+	binmode($sock);
+	handle_connection($sock);
+	close($sock);
+}
@@ -1,9 +1,10 @@
 SET pg_track_slow_queries.log_min_duration TO 500;
 SET pg_track_slow_queries.log_plan TO on;
 SET pg_track_slow_queries.cost_analyze TO 20;
+SET pg_track_slow_queries.overhead_sample_rate TO 1;
 
 BEGIN;
-SELECT plan(14);
+SELECT plan(47);
 
 
 SELECT is(
@@ -53,6 +54,7 @@ SELECT ok(
 SELECT ok(
   (SELECT (
     datetime IS NOT NULL AND
+    start_datetime <= datetime AND
     duration is NOT NULL AND
     username IS NOT NULL AND
     appname IS NOT NULL AND
@@ -60,12 +62,37 @@ SELECT ok(
     temp_blks_written IS NOT NULL AND
     hitratio IS NOT NULL AND
     ntuples IS NOT NULL AND
+    queryid IS NOT NULL AND
     query IS NOT NULL AND
     plan IS NOT NULL
   ) FROM pg_track_slow_queries() LIMIT 1)::BOOL,
   'no null value'
 );
 
+SELECT ok(
+  (SELECT entries > 0 AND batches > 0 AND latency_max >= 0 AND
+          forward_dropped = 0
+   FROM pg_track_slow_queries_stats())::BOOL,
+  'collector statistics account stored entries'
+);
+
+SELECT ok(
+  (SELECT calls > 0 FROM pg_track_slow_queries_overhead()
+   WHERE phase = 'serialize')::BOOL,
+  'capture overhead is sampled'
+);
+
+SELECT ok(
+  (SELECT true FROM pg_track_slow_queries_stats_reset())::BOOL,
+  'pg_track_slow_queries_stats_reset() ran without error'
+);
+
+SELECT is(
+  (SELECT entries FROM pg_track_slow_queries_stats())::INT,
+  0,
+  'collector statistics are reset'
+);
+
 
 -- Costly query
 SELECT a FROM generate_series(1, 50000) a, pg_sleep(0.6)
@@ -79,6 +106,33 @@ SELECT is(
 );
 
 
+SELECT ok(
+  (SELECT true FROM pg_track_slow_queries_reset())::BOOL,
+  'pg_track_slow_queries_reset() ran without error'
+);
+
+SET pg_track_slow_queries.plan_format TO binary;
+
+-- Costly query
+SELECT a FROM generate_series(1, 50000) a, pg_sleep(0.6)
+GROUP BY a ORDER BY a DESC;
+
+SELECT is(
+  (SELECT COUNT(*) FROM pg_track_slow_queries()
+   WHERE plan->'Plan'->'Plans'->0->>'Node Type' IS NOT NULL)::INT,
+  1,
+  'binary plan snapshot is rendered as JSON'
+);
+
+SELECT is(
+  (SELECT COUNT(*) FROM pg_track_slow_queries()
+   WHERE plan->'Plan'->'Actual Total Time' IS NOT NULL)::INT,
+  1,
+  'binary plan snapshot contains timings'
+);
+
+SET pg_track_slow_queries.plan_format TO json;
+
 SELECT ok(
   (SELECT true FROM pg_track_slow_queries_reset())::BOOL,
   'pg_track_slow_queries_reset() ran without error'
@@ -97,10 +151,208 @@ SELECT is(
   'log file contains 1 row'
 );
 
+SELECT ok(
+  (SELECT duration IS NOT NULL AND dbname IS NOT NULL AND query IS NULL AND plan IS NULL
+   FROM pg_track_slow_queries_columns(ARRAY['duration', 'dbname']))::BOOL,
+  'pg_track_slow_queries_columns() only returns the given columns'
+);
+
+SELECT throws_ok(
+  $$SELECT * FROM pg_track_slow_queries_columns(ARRAY['nope'])$$,
+  '22023',
+  'pg_track_slow_queries: unknown column "nope"',
+  'pg_track_slow_queries_columns() rejects unknown columns'
+);
+
+SELECT is(
+  (SELECT COUNT(*) FROM pg_track_slow_queries_search(
+     since => now() - interval '1 hour', min_duration => 500,
+     db_name => current_database()))::INT,
+  1,
+  'pg_track_slow_queries_search() returns matching entries'
+);
+
+SELECT is(
+  (SELECT COUNT(*) FROM pg_track_slow_queries_search(user_name => 'nobody'))::INT,
+  0,
+  'pg_track_slow_queries_search() leaves out entries of other users'
+);
+
+SELECT is(
+  (SELECT COUNT(*) FROM pg_track_slow_queries_search(since => now() + interval '1 hour'))::INT,
+  0,
+  'pg_track_slow_queries_search() leaves out entries out of the time range'
+);
+
+CREATE TABLE tsq_relation AS SELECT generate_series(1, 10) AS a;
+
+-- Slow query on tsq_relation
+SELECT COUNT(*) FROM tsq_relation, pg_sleep(0.6);
+
+SELECT is(
+  (SELECT COUNT(*) FROM pg_track_slow_queries_by_relation('tsq_relation'))::INT,
+  1,
+  'pg_track_slow_queries_by_relation() returns the entries using the table'
+);
+
+SELECT is(
+  (SELECT COUNT(*) FROM pg_track_slow_queries_by_relation('pg_class'))::INT,
+  0,
+  'pg_track_slow_queries_by_relation() leaves out entries using other tables'
+);
+
+SELECT is(
+  (SELECT query FROM pg_track_slow_queries_latest(1)),
+  'SELECT COUNT(*) FROM tsq_relation, pg_sleep(0.6);',
+  'pg_track_slow_queries_latest() returns the last entry stored'
+);
+
+SELECT is(
+  (SELECT array_agg(datetime) FROM pg_track_slow_queries_latest(1000)),
+  (SELECT array_agg(datetime ORDER BY ord DESC)
+   FROM pg_track_slow_queries() WITH ORDINALITY AS t(datetime, start_datetime,
+     duration, username, appname, dbname, temp_blks_written, hitratio, ntuples,
+     queryid, query, plan, ord)),
+  'pg_track_slow_queries_latest() returns the entries most recent first'
+);
+
+SELECT is(
+  (SELECT array_agg(duration) FROM pg_track_slow_queries_top(2)),
+  (SELECT array_agg(duration) FROM (SELECT duration FROM pg_track_slow_queries()
+   ORDER BY duration DESC LIMIT 2) t),
+  'pg_track_slow_queries_top() returns the longest entries first'
+);
+
+SELECT is(
+  (SELECT query FROM pg_track_slow_queries_top(1, 'datetime')),
+  'SELECT COUNT(*) FROM tsq_relation, pg_sleep(0.6);',
+  'pg_track_slow_queries_top() ranks entries by the given column'
+);
+
+SELECT throws_ok(
+  $$SELECT * FROM pg_track_slow_queries_top(1, 'query')$$,
+  '22023',
+  'pg_track_slow_queries: cannot rank entries by "query"',
+  'pg_track_slow_queries_top() only ranks by numeric columns'
+);
+
+SELECT is(
+  (SELECT COUNT(*) FROM pg_track_slow_queries_entries),
+  (SELECT COUNT(*) FROM pg_track_slow_queries()),
+  'pg_track_slow_queries_entries returns all the entries'
+);
+
+SELECT is(
+  (SELECT query FROM pg_track_slow_queries_entries ORDER BY datetime DESC LIMIT 1),
+  (SELECT query FROM pg_track_slow_queries() ORDER BY datetime DESC LIMIT 1),
+  'pg_track_slow_queries_entries returns the most recent entry first'
+);
+
+SELECT is(
+  (SELECT COUNT(*) FROM pg_track_slow_queries_entries
+   WHERE datetime >= now() - interval '1 hour' AND duration >= 500
+     AND dbname = current_database()),
+  (SELECT COUNT(*) FROM pg_track_slow_queries()
+   WHERE datetime >= now() - interval '1 hour' AND duration >= 500
+     AND dbname = current_database()),
+  'pg_track_slow_queries_entries returns the entries matching the quals'
+);
+
+SELECT is(
+  (SELECT COUNT(*) FROM pg_track_slow_queries_entries WHERE username = 'nobody'),
+  0::BIGINT,
+  'pg_track_slow_queries_entries leaves out entries of other users'
+);
+
+SELECT ok(
+  (SELECT bool_and((SELECT COUNT(*) FROM pg_track_slow_queries_entries e
+                    WHERE e.queryid = q.queryid) = q.n)
+   FROM (SELECT queryid, COUNT(*) AS n FROM pg_track_slow_queries()
+         GROUP BY queryid) q)::BOOL,
+  'pg_track_slow_queries_entries returns the entries of a query identifier'
+);
+
 SELECT ok(
   (SELECT LENGTH(plan::TEXT) = 0 FROM pg_track_slow_queries() LIMIT 1)::BOOL,
   'plan column is empty'
 );
 
+SELECT ok(
+  (SELECT bool_and(pg_read_binary_file('pg_stat/' || f, 0, 4) = '\x54535100'::BYTEA)
+   FROM pg_ls_dir('pg_stat') f
+   WHERE f ~ '^pg_track_slow_queries\.[0-9A-F]{8}\.stat$'
+     AND (pg_stat_file('pg_stat/' || f)).size > 0)::BOOL,
+  'storage segments start with a header'
+);
+
+SELECT ok(
+  (SELECT pg_track_slow_queries_import('pg_stat', 'test_node') > 0)::BOOL,
+  'local storage files are imported as a node'
+);
+
+SELECT is(
+  (SELECT pg_track_slow_queries_import('pg_stat', 'test_node'))::INT,
+  0,
+  'import of the same files again is idempotent'
+);
+
+SELECT ok(
+  (SELECT n.imported > 0 AND n.local > 0 AND n.ordered
+   FROM (SELECT COUNT(*) FILTER (WHERE node = 'test_node') AS imported,
+                COUNT(*) FILTER (WHERE node <> 'test_node') AS local,
+                bool_and(prev IS NULL OR prev <= datetime) AS ordered
+         FROM (SELECT node, datetime, lag(datetime) OVER () AS prev
+               FROM pg_track_slow_queries_merged()) m) n)::BOOL,
+  'merged entries of local and imported nodes are ordered by datetime'
+);
+
+-- Slow cursor, its rows are fetched in several runs of the executor
+DECLARE tsq_cursor CURSOR FOR
+  SELECT a, pg_sleep(0.15) FROM generate_series(1, 6) a;
+FETCH 2 FROM tsq_cursor;
+FETCH 2 FROM tsq_cursor;
+FETCH 2 FROM tsq_cursor;
+CLOSE tsq_cursor;
+
+SELECT is(
+  (SELECT ntuples FROM pg_sleep(0.2), pg_track_slow_queries()
+   WHERE query LIKE 'DECLARE tsq_cursor%')::INT,
+  6,
+  'ntuples counts the rows of every FETCH of a cursor'
+);
+
+SET LOCAL pg_track_slow_queries.log_min_duration TO 0;
+SET LOCAL enable_indexscan TO off;
+SET LOCAL enable_bitmapscan TO off;
+
+SELECT ok(
+  (SELECT COUNT(*) = 1 FROM pg_class WHERE oid = 'pg_class'::REGCLASS)::BOOL,
+  'pg_class is read with two plans'
+);
+
+SET LOCAL enable_indexscan TO on;
+SET LOCAL enable_seqscan TO off;
+
+SELECT ok(
+  (SELECT COUNT(*) = 1 FROM pg_class WHERE oid = 'pg_class'::REGCLASS)::BOOL,
+  'pg_class is read with two plans'
+);
+
+SET LOCAL enable_seqscan TO on;
+SET LOCAL pg_track_slow_queries.log_min_duration TO 500;
+
+SELECT ok(
+  (SELECT COUNT(DISTINCT planid) = 2 AND COUNT(previous_planid) = 1
+   FROM pg_sleep(0.2), pg_track_slow_queries_plan_changes()
+   WHERE query LIKE '%pg_class is read with two plans%')::BOOL,
+  'pg_track_slow_queries_plan_changes() returns the plans of a query'
+);
+
+SELECT ok(
+  (SELECT sent + send_failures = 100 AND stored > 0
+   FROM pg_track_slow_queries_stress(2, 50, 1))::BOOL,
+  'stress test sends and stores synthetic entries'
+);
+
 
 ROLLBACK;
@@ -1,148 +1,1669 @@
 #define _FILE_OFFSET_BITS 64
 
 #include "postgres.h"
+#include <float.h>
 #include <unistd.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "access/xlog.h"
 #include "common/pg_lzcompress.h"
+#include "funcapi.h"
+#include "port/atomics.h"
+#include "portability/instr_time.h"
 #include "storage/lwlock.h"
 #include "storage/fd.h"
+#include "storage/spin.h"
 #include "lib/stringinfo.h"
 #include "pgstat.h"
+#include "utils/builtins.h"
+#include "utils/memutils.h"
+#include "utils/timestamp.h"
 
 #include "pg_track_slow_queries.h"
 
+/* Recovery configuration file before PostgreSQL 12 */
+#define TSQ_RECOVERY_COMMAND_FILE	"recovery.conf"
+
+/*
+ * TSQEntry serialization function
+ */
+StringInfo pgtsq_serialize_entry(TSQEntry * tsqe)
+{
+	StringInfo	si;
+	uint32		plan_length;
+	si = makeStringInfo();
+	appendStringInfo(si, "%08x%020" INT64_MODIFIER "d",
+					 20, tsqe->end_time);
+	appendStringInfo(si, "%08x%020" INT64_MODIFIER "d",
+					 20, tsqe->start_time);
+	appendStringInfo(si, "%08x%016.02f",
+					 16, tsqe->duration);
+	appendStringInfo(si, "%08x%s",
+					 (int) strlen(tsqe->username), tsqe->username);
+	appendStringInfo(si, "%08x%s",
+					 (int) strlen(tsqe->appname), tsqe->appname);
+	appendStringInfo(si, "%08x%s",
+					 (int) strlen(tsqe->dbname), tsqe->dbname);
+	appendStringInfo(si, "%08x%016li",
+					 16, tsqe->temp_blks_written);
+	appendStringInfo(si, "%08x%010.06f",
+					 10, tsqe->hitratio);
+	appendStringInfo(si, "%08x%016lu",
+					 16, tsqe->ntuples);
+	appendStringInfo(si, "%08x%020" INT64_MODIFIER "d",
+					 20, (int64) tsqe->queryid);
+	appendStringInfo(si, "%08x%s",
+					 (uint32) strlen(tsqe->querytxt), tsqe->querytxt);
+	/* Binary plan snapshots may contain NUL bytes */
+	plan_length = tsqe->planlen > 0 ? tsqe->planlen : (uint32) strlen(tsqe->plantxt);
+	appendStringInfo(si, "%08x", plan_length);
+	appendBinaryStringInfo(si, tsqe->plantxt, plan_length);
+	appendStringInfo(si, "%08x", (uint32) (tsqe->nrelids * sizeof(Oid)));
+	if (tsqe->nrelids > 0)
+		appendBinaryStringInfo(si, (char *) tsqe->relids,
+							   tsqe->nrelids * sizeof(Oid));
+	return si;
+}
+
+/*
+ * Builds the path of a storage segment file
+ */
+void
+pgtsq_segment_path(char * path, uint32 segno)
+{
+	snprintf(path, MAXPGPATH, TSQ_SEGMENT_FILE, segno);
+}
+
+/*
+ * Builds the path of the relation index of a storage segment
+ */
+static void
+pgtsq_relindex_path(char * path, uint32 segno)
+{
+	pgtsq_segment_path(path, segno);
+	strlcat(path, TSQ_RELINDEX_SUFFIX, MAXPGPATH);
+}
+
+/*
+ * Removes the relation index of a storage segment, if any
+ */
+static void
+pgtsq_remove_relindex(uint32 segno)
+{
+	char	path[MAXPGPATH];
+
+	pgtsq_relindex_path(path, segno);
+	if (unlink(path) < 0 && errno != ENOENT)
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("pg_track_slow_queries: could not remove file \"%s\": %m",
+						path)));
+}
+
+/*
+ * Extracts the segment number from a file name, returns false if the file is
+ * not a storage segment.
+ */
+bool
+pgtsq_parse_segment_name(const char * name, uint32 * segno)
+{
+	size_t	prefix_len = strlen(TSQ_SEGMENT_PREFIX);
+
+	if (strlen(name) != prefix_len + 8 + strlen(TSQ_SEGMENT_SUFFIX))
+		return false;
+	if (strncmp(name, TSQ_SEGMENT_PREFIX, prefix_len) != 0 ||
+		strcmp(name + prefix_len + 8, TSQ_SEGMENT_SUFFIX) != 0)
+		return false;
+	if (strspn(name + prefix_len, "0123456789ABCDEF") != 8)
+		return false;
+
+	*segno = (uint32) strtoul(name + prefix_len, NULL, 16);
+	return true;
+}
+
+/*
+ * Reads the header of a segment opened at its beginning and leaves the file
+ * at its first row. Legacy segments have no header, their rows start at
+ * offset 0. Returns false if the segment uses an unknown format version.
+ */
+static bool
+pgtsq_read_segment_header(FILE * file, TSQSegmentHeader * header)
+{
+	if (fread(header, sizeof(TSQSegmentHeader), 1, file) == 1 &&
+		header->magic == TSQ_SEGMENT_MAGIC)
+		return header->version <= TSQ_FORMAT_VERSION;
+
+	memset(header, 0, sizeof(TSQSegmentHeader));
+	header->version = TSQ_FORMAT_LEGACY;
+	return fseeko(file, 0, SEEK_SET) == 0;
+}
+
+/*
+ * Writes the header of a new segment
+ */
+bool
+pgtsq_write_segment_header(FILE * file)
+{
+	TSQSegmentHeader	header;
+
+	memset(&header, 0, sizeof(TSQSegmentHeader));
+	header.magic = TSQ_SEGMENT_MAGIC;
+	header.version = TSQ_FORMAT_VERSION;
+	header.codec = TSQ_CODEC_PGLZ;
+	header.created = GetCurrentTimestamp();
+
+	return fwrite(&header, sizeof(TSQSegmentHeader), 1, file) == 1;
+}
+
+/*
+ * Offset of the first row of a segment
+ */
+static inline off_t
+pgtsq_segment_data_offset(TSQSegmentHeader * header)
+{
+	return header->version == TSQ_FORMAT_LEGACY ? 0 : sizeof(TSQSegmentHeader);
+}
+
+/*
+ * Returns the length of the segment up to its last complete row, anything
+ * after it has been left by an interrupted write, and sets its format
+ * version. Empty segments are reported in the current format. Returns -1 if
+ * the segment uses an unknown format version.
+ */
+off_t
+pgtsq_segment_valid_length(const char * path, int * version)
+{
+	FILE				*file = NULL;
+	struct stat			st;
+	TSQSegmentHeader	header;
+	off_t				offset = 0;
+	uint32				row_lz_len = 0;
+	uint32				row_len = 0;
+	off_t				row_size;
+
+	*version = TSQ_FORMAT_VERSION;
+	if (stat(path, &st) < 0 || (file = AllocateFile(path, PG_BINARY_R)) == NULL)
+		return 0;
+
+	if (!pgtsq_read_segment_header(file, &header))
+	{
+		FreeFile(file);
+		*version = header.version;
+		return -1;
+	}
+	offset = pgtsq_segment_data_offset(&header);
+
+	while (fread(&row_lz_len, sizeof(uint32), 1, file) == 1 &&
+		   fread(&row_len, sizeof(uint32), 1, file) == 1)
+	{
+		/* Block footers are stored uncompressed */
+		if (row_lz_len == TSQ_FOOTER_MARKER)
+			row_size = 2 * sizeof(uint32) + row_len;
+		else
+			row_size = 2 * sizeof(uint32) + (row_lz_len > 0 ? row_lz_len : row_len);
+		if (row_len == 0 || offset + row_size > st.st_size)
+			break;
+		offset += row_size;
+		if (fseeko(file, offset, SEEK_SET) != 0)
+			break;
+	}
+	FreeFile(file);
+
+	if (offset > 0)
+		*version = header.version;
+
+	return offset;
+}
+
+/*
+ * Returns the format version of a segment, -1 if it does not exist or can't
+ * be read.
+ */
+static int
+pgtsq_segment_version(const char * path)
+{
+	FILE				*file = NULL;
+	TSQSegmentHeader	header;
+	bool				known;
+
+	if ((file = AllocateFile(path, PG_BINARY_R)) == NULL)
+		return -1;
+	known = pgtsq_read_segment_header(file, &header);
+	FreeFile(file);
+
+	return known ? header.version : -1;
+}
+
+/*
+ * Returns true if the server starts from a restored base backup, to be
+ * recovered as a standby or from the archives. An exclusive backup running
+ * on the server itself also leaves a backup_label, but no recovery
+ * configuration.
+ */
+static bool
+pgtsq_restored_from_backup(void)
+{
+	if (access(BACKUP_LABEL_FILE, F_OK) != 0)
+		return false;
+#if (PG_VERSION_NUM >= 120000)
+	return access(STANDBY_SIGNAL_FILE, F_OK) == 0 ||
+		access(RECOVERY_SIGNAL_FILE, F_OK) == 0;
+#else
+	return access(TSQ_RECOVERY_COMMAND_FILE, F_OK) == 0;
+#endif
+}
+
+/*
+ * Looks for the storage segments left by a previous run and publishes the
+ * end of the newest one as the committed position. The legacy storage file
+ * becomes the first segment. Must be called once, while initializing the
+ * shared state.
+ *
+ * Rows are only appended to segments of the current format: when the newest
+ * segment uses an older one, writers start a new segment and the older one
+ * stays readable until the collector converts it.
+ */
+void
+pgtsq_init_storage(void)
+{
+	DIR				*dir;
+	struct dirent	*de;
+	uint32			segno;
+	uint32			first_segno;
+	uint32			last_segno = 0;
+	bool			found = false;
+	char			path[MAXPGPATH];
+	off_t			length = 0;
+	int				version = TSQ_FORMAT_VERSION;
+	bool			restored = false;
+
+	dir = AllocateDir(PGSTAT_STAT_PERMANENT_DIRECTORY);
+	while ((de = ReadDir(dir, PGSTAT_STAT_PERMANENT_DIRECTORY)) != NULL)
+	{
+		if (!pgtsq_parse_segment_name(de->d_name, &segno))
+			continue;
+		if (!found || segno > last_segno)
+			last_segno = segno;
+		found = true;
+	}
+	FreeDir(dir);
+
+	if (!found && access(TSQ_FILE, F_OK) == 0)
+	{
+		pgtsq_segment_path(path, last_segno);
+		if (durable_rename(TSQ_FILE, path, LOG) == 0)
+			found = true;
+	}
+
+	pgtsqss->convert_pending = false;
+	first_segno = last_segno;
+
+	if (found)
+	{
+		/*
+		 * A base backup copies the segments of the server it is taken from,
+		 * possibly while they are written: they describe another server and
+		 * must not be mixed with entries captured by this one, a standby most
+		 * of the time.
+		 */
+		if ((restored = pgtsq_restored_from_backup()))
+		{
+			ereport(LOG,
+					(errmsg("pg_track_slow_queries: data directory restored from a base backup, segments of the source server discarded")));
+			last_segno = first_segno = TSQNextSegno(last_segno);
+			length = 0;
+		}
+		else
+		{
+			pgtsq_segment_path(path, last_segno);
+			length = pgtsq_segment_valid_length(path, &version);
+			/* Drop the torn end of the segment, if any */
+			if (length >= 0 && truncate(path, length) < 0)
+				ereport(LOG,
+						(errcode_for_file_access(),
+						 errmsg("pg_track_slow_queries: could not truncate file \"%s\": %m",
+								path)));
+		}
+
+		if (length < 0)
+		{
+			ereport(LOG,
+					(errmsg("pg_track_slow_queries: unsupported format version %d of file \"%s\", discarded",
+							version, path)));
+			last_segno = first_segno = TSQNextSegno(last_segno);
+			length = 0;
+		}
+		else if (version != TSQ_FORMAT_VERSION)
+		{
+			pgtsqss->convert_pending = true;
+			pgtsqss->convert_segno = last_segno;
+			last_segno = TSQNextSegno(last_segno);
+			length = 0;
+		}
+		else if (!restored)
+		{
+			/* Conversion of the previous segment has been interrupted */
+			segno = (last_segno - 1) & TSQ_SEGNO_MASK;
+			pgtsq_segment_path(path, segno);
+			version = pgtsq_segment_version(path);
+			if (version >= 0 && version != TSQ_FORMAT_VERSION)
+			{
+				pgtsqss->convert_pending = true;
+				pgtsqss->convert_segno = first_segno = segno;
+			}
+		}
+
+		/*
+		 * Only the segments readers start from are still alive, the others
+		 * have been dropped by a reset before the collector, which is never
+		 * restarted, got rid of them.
+		 */
+		dir = AllocateDir(PGSTAT_STAT_PERMANENT_DIRECTORY);
+		while ((de = ReadDir(dir, PGSTAT_STAT_PERMANENT_DIRECTORY)) != NULL)
+		{
+			if (!pgtsq_parse_segment_name(de->d_name, &segno) ||
+				segno == first_segno || segno == last_segno)
+				continue;
+			pgtsq_segment_path(path, segno);
+			if (unlink(path) < 0)
+				ereport(LOG,
+						(errcode_for_file_access(),
+						 errmsg("pg_track_slow_queries: could not remove file \"%s\": %m",
+								path)));
+			pgtsq_remove_relindex(segno);
+		}
+		FreeDir(dir);
+
+		/* Leftover of an interrupted conversion */
+		if (pgtsqss->convert_pending)
+		{
+			pgtsq_segment_path(path, pgtsqss->convert_segno);
+			strlcat(path, TSQ_CONVERT_SUFFIX, MAXPGPATH);
+			if (unlink(path) < 0 && errno != ENOENT)
+				ereport(LOG,
+						(errcode_for_file_access(),
+						 errmsg("pg_track_slow_queries: could not remove file \"%s\": %m",
+								path)));
+			strlcat(path, TSQ_RELINDEX_SUFFIX, MAXPGPATH);
+			if (unlink(path) < 0 && errno != ENOENT)
+				ereport(LOG,
+						(errcode_for_file_access(),
+						 errmsg("pg_track_slow_queries: could not remove file \"%s\": %m",
+								path)));
+		}
+	}
+
+	pg_atomic_write_u64(&pgtsqss->committed, TSQPosMake(last_segno, length));
+	pg_atomic_init_u32(&pgtsqss->first_segno, first_segno);
+	pgtsqss->oldest_segno = first_segno;
+}
+
+/*
+ * Opens the storage segment for writing at the given offset
+ */
+static FILE *
+pgtsq_open_segment(uint32 segno, off_t offset)
+{
+	char	path[MAXPGPATH];
+	FILE	*file = NULL;
+
+	pgtsq_segment_path(path, segno);
+
+	/*
+	 * An empty segment is (re)created, this drops anything left by a write
+	 * that has never been committed.
+	 */
+	if (offset == 0)
+		return AllocateFile(path, PG_BINARY_W);
+
+	if ((file = AllocateFile(path, TSQ_BINARY_RW)) == NULL)
+		return NULL;
+	if (fseeko(file, offset, SEEK_SET) != 0)
+	{
+		FreeFile(file);
+		return NULL;
+	}
+	return file;
+}
+
+/*
+ * Adds a row / serialized TSQEntry to the summary of its block, and its
+ * relations to relids. Returns false if the row is malformed: its block is
+ * then never skipped.
+ */
+static bool
+pgtsq_block_add_row(TSQBlockFooter * footer, char * row, uint32 length,
+					StringInfo relids)
+{
+	uint32		p = 0;
+	char		header[9];
+	char		value[32];
+	int64		end_time = 0;
+	double		duration = 0;
+	uint64		queryid;
+
+	header[8] = '\0';
+	for (int c = 1; c <= TSQ_ROW_ITEMS; c++)
+	{
+		uint32		item_len;
+
+		if (length - p < 8)
+			goto malformed;
+		memcpy(header, row + p, 8);
+		item_len = (uint32) strtoul(header, NULL, 16);
+		p += 8;
+		if (length - p < item_len)
+			goto malformed;
+
+		switch (c)
+		{
+			case 1:
+			case 3:
+			case 10:
+				if (item_len >= sizeof(value))
+					goto malformed;
+				memcpy(value, row + p, item_len);
+				value[item_len] = '\0';
+				if (c == 1)
+					end_time = (int64) strtoll(value, NULL, 10);
+				else if (c == 3)
+					duration = atof(value);
+				else
+				{
+					queryid = (uint64) strtoll(value, NULL, 10);
+					pgtsq_bloom_add(footer->bloom, TSQ_BLOOM_QUERYID,
+									(char *) &queryid, sizeof(uint64));
+				}
+				break;
+			case 4:
+				pgtsq_bloom_add(footer->bloom, TSQ_BLOOM_USERNAME, row + p, item_len);
+				break;
+			case 5:
+				pgtsq_bloom_add(footer->bloom, TSQ_BLOOM_APPNAME, row + p, item_len);
+				break;
+			case 6:
+				pgtsq_bloom_add(footer->bloom, TSQ_BLOOM_DBNAME, row + p, item_len);
+				break;
+			case 13:
+				appendBinaryStringInfo(relids, row + p, item_len);
+				break;
+		}
+		p += item_len;
+	}
+
+	if (footer->nrows++ == 0)
+	{
+		footer->min_end_time = footer->max_end_time = end_time;
+		footer->min_duration = footer->max_duration = duration;
+		return true;
+	}
+	footer->min_end_time = Min(footer->min_end_time, end_time);
+	footer->max_end_time = Max(footer->max_end_time, end_time);
+	footer->min_duration = Min(footer->min_duration, duration);
+	footer->max_duration = Max(footer->max_duration, duration);
+	return true;
+
+malformed:
+	footer->nrows++;
+	footer->min_end_time = PG_INT64_MIN;
+	footer->max_end_time = PG_INT64_MAX;
+	footer->min_duration = 0;
+	footer->max_duration = DBL_MAX;
+	memset(footer->bloom, 0xFF, sizeof(footer->bloom));
+	return false;
+}
+
+static int
+pgtsq_relid_cmp(const void * a, const void * b)
+{
+	Oid			ra = *(const Oid *) a;
+	Oid			rb = *(const Oid *) b;
+
+	return ra < rb ? -1 : (ra > rb ? 1 : 0);
+}
+
+/*
+ * Sorts the relation OIDs gathered in relids and removes the duplicate and
+ * invalid ones, returns the number left
+ */
+int
+pgtsq_unique_relids(StringInfo relids)
+{
+	Oid			*oids = (Oid *) relids->data;
+	int			noids = relids->len / sizeof(Oid);
+	int			n = 0;
+
+	if (noids > 1)
+		qsort(oids, noids, sizeof(Oid), pgtsq_relid_cmp);
+	for (int i = 0; i < noids; i++)
+	{
+		if (oids[i] == InvalidOid || (n > 0 && oids[i] == oids[n - 1]))
+			continue;
+		oids[n++] = oids[i];
+	}
+	relids->len = n * sizeof(Oid);
+	return n;
+}
+
+/*
+ * Adds a block, from start to end, and the relations its rows use to the
+ * relation index at path, of a segment whose rows end at offset before the
+ * block.
+ * The entries of blocks after offset, left by a write that has never been
+ * committed, are dropped first. Returns false on error, the block is then not
+ * indexed.
+ */
+static bool
+pgtsq_relindex_add(const char * path, off_t offset, off_t start, off_t end,
+				   StringInfo relids)
+{
+	FILE			*file = NULL;
+	struct stat		st;
+	off_t			length;
+	TSQRelIndexEntry entry;
+	Oid				*oids = (Oid *) relids->data;
+	int				noids = pgtsq_unique_relids(relids);
+
+	if (offset == 0 ||
+		((file = AllocateFile(path, TSQ_BINARY_RW)) == NULL && errno == ENOENT))
+		file = AllocateFile(path, PG_BINARY_W);
+	if (file == NULL || fstat(fileno(file), &st) < 0)
+		goto error;
+
+	/* Entries are sorted by block, drop the partial ones too */
+	length = st.st_size - st.st_size % sizeof(TSQRelIndexEntry);
+	while (length > 0)
+	{
+		if (fseeko(file, length - sizeof(TSQRelIndexEntry), SEEK_SET) != 0 ||
+			fread(&entry, sizeof(TSQRelIndexEntry), 1, file) != 1)
+			goto error;
+		if (entry.start < (uint64) offset)
+			break;
+		length -= sizeof(TSQRelIndexEntry);
+	}
+	if ((length != st.st_size && ftruncate(fileno(file), length) < 0) ||
+		fseeko(file, length, SEEK_SET) != 0)
+		goto error;
+
+	memset(&entry, 0, sizeof(TSQRelIndexEntry));
+	entry.start = start;
+	entry.end = end;
+	for (int i = 0; i < noids; i++)
+	{
+		entry.relid = oids[i];
+		if (fwrite(&entry, sizeof(TSQRelIndexEntry), 1, file) != 1)
+			goto error;
+	}
+	/* The block is indexed once all its relations are */
+	entry.relid = InvalidOid;
+	if (fwrite(&entry, sizeof(TSQRelIndexEntry), 1, file) != 1 ||
+		FreeFile(file) != 0)
+	{
+		file = NULL;
+		goto error;
+	}
+	return true;
+
+error:
+	ereport(LOG,
+			(errcode_for_file_access(),
+			 errmsg("pg_track_slow_queries: could not write file \"%s\": %m",
+					path)));
+	if (file)
+		FreeFile(file);
+	return false;
+}
+
+/*
+ * Writes rows / serialized TSQEntry, stored being their encoding by
+ * pgtsq_encode_row(), as a block followed by its footer at the end of file,
+ * which is *end long. The rows that would make the file exceed max_size
+ * bytes, unless it is -1, are left out. The relations of the rows are appended
+ * to relids and *indexed is cleared if one of them is malformed. Returns the
+ * number of rows written, *end being moved after the footer, or -1 on error.
+ */
+int
+pgtsq_write_block(FILE * file, StringInfo * stored, char ** rows, int * lengths,
+				  int nrows, off_t max_size, off_t * end, StringInfo relids,
+				  bool * indexed)
+{
+	uint32		footer_frame[2] = {TSQ_FOOTER_MARKER, 0};
+	TSQBlockFooter	footer;
+	uint32		bloom_size;
+	off_t		block_start = *end;
+	long		row_size;
+	int			nstored = 0;
+
+	memset(&footer, 0, sizeof(TSQBlockFooter));
+	footer.magic = TSQ_FOOTER_MAGIC;
+
+	for (int i = 0; i < nrows; i++)
+	{
+		row_size = stored[i]->len;
+
+		/*
+		 * If max_file_size_kb is set we have to check file size before adding
+		 * a new record. We want to skip new records if file size could exceed
+		 * max_file_size, the footer of the block included.
+		 */
+		if (max_size != -1 &&
+			(*end + row_size + sizeof(footer_frame) +
+			 TSQ_FOOTER_SIZE(TSQ_BLOOM_BITS / 8)) > max_size)
+		{
+			ereport(LOG,
+					(errmsg("pg_track_slow_queries: max_file_size reached")));
+			break;
+		}
+
+		if (fwrite(stored[i]->data, 1, row_size, file) != row_size)
+			return -1;
+		if (!pgtsq_block_add_row(&footer, rows[i], lengths[i], relids))
+			*indexed = false;
+		*end += row_size;
+		nstored++;
+	}
+
+	/* Small blocks get a small filter, the footer ends with its size */
+	if (nstored > 0)
+	{
+		footer.length = *end - block_start;
+		bloom_size = pgtsq_bloom_size(nstored);
+		pgtsq_bloom_fold(footer.bloom, bloom_size);
+		footer_frame[1] = TSQ_FOOTER_SIZE(bloom_size);
+		if (fwrite(footer_frame, sizeof(footer_frame), 1, file) != 1 ||
+			fwrite(&footer, offsetof(TSQBlockFooter, bloom) + bloom_size, 1,
+				   file) != 1 ||
+			fwrite(&footer_frame[1], sizeof(uint32), 1, file) != 1)
+			return -1;
+		*end += sizeof(footer_frame) + footer_frame[1];
+	}
+	return nstored;
+}
+
+/*
+ * Stores a batch of rows / serialized TSQEntry
+ *
+ * Rows are appended after the committed end offset of the current segment,
+ * which is published once the whole batch is written, followed by the footer
+ * of the block they form. Readers never go
+ * beyond it and thus don't need any lock, the LWLock only serializes
+ * writers. If the storage has been reset in the meantime, the batch is left
+ * in the previous segment and is discarded with it.
+ *
+ * Returns the number of rows stored, which is lower than nrows if
+ * max_file_size has been reached, or -1 on error. Timings are reported in
+ * stats if not NULL.
+ */
+int
+pgtsq_store_rows(char ** rows, int * lengths, int nrows, bool compression,
+				 int max_file_size_kb, TSQStoreStats * stats)
+{
+	StringInfo	*stored = NULL;
+	FILE		*file = NULL;
+	char		relpath[MAXPGPATH];
+	off_t		block_start;
+	StringInfoData	relids;
+	bool		indexed = true;
+	uint64		pos;
+	uint32		segno = 0;
+	off_t		offset = 0;
+	off_t		end;
+	int			nstored = 0;
+	instr_time	start;
+	instr_time	duration;
+#ifdef TSQ_USE_PROBES
+	uint64		in_bytes = 0;
+	uint64		out_bytes = 0;
+#endif
+
+	if ((stored = (StringInfo *) palloc0(nrows * sizeof(StringInfo))) == NULL)
+	{
+		ereport(LOG,
+				(errmsg("pg_track_slow_queries: could not allocate memory")));
+		return -1;
+	}
+
+	INSTR_TIME_SET_CURRENT(start);
+
+	/* Compress data if compression is enabled */
+	for (int i = 0; i < nrows; i++)
+	{
+		stored[i] = pgtsq_encode_row(rows[i], lengths[i], compression);
+#ifdef TSQ_USE_PROBES
+		in_bytes += lengths[i];
+		out_bytes += stored[i]->len - 2 * sizeof(uint32);
+#endif
+	}
+
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, start);
+	if (stats)
+		stats->compress_time = INSTR_TIME_GET_MILLISEC(duration);
+	if (compression)
+		TSQ_PROBE4(compress__done, nrows, in_bytes, out_bytes,
+				   INSTR_TIME_GET_MICROSEC(duration));
+	INSTR_TIME_SET_CURRENT(start);
+
+	/* Acquire an exclusive lock before writing the entries */
+	LWLockAcquire(pgtsqss->lock, LW_EXCLUSIVE);
+
+	pos = pg_atomic_read_u64(&pgtsqss->committed);
+	segno = TSQPosSegno(pos);
+	offset = TSQPosOffset(pos);
+	end = offset;
+
+	if ((file = pgtsq_open_segment(segno, offset)) == NULL)
+		goto write_error;
+
+	/* A new segment starts with its header */
+	if (offset == 0)
+	{
+		if (!pgtsq_write_segment_header(file))
+			goto write_error;
+		end = sizeof(TSQSegmentHeader);
+	}
+	block_start = end;
+	initStringInfo(&relids);
+	nstored = pgtsq_write_block(file, stored, rows, lengths, nrows,
+								max_file_size_kb == -1 ? -1 :
+								(off_t) max_file_size_kb * 1024,
+								&end, &relids, &indexed);
+	if (nstored < 0)
+		goto write_error;
+	if (fflush(file) != 0)
+		goto write_error;
+
+	/* Blocks with a malformed row are not indexed */
+	if (nstored > 0 && indexed)
+	{
+		pgtsq_relindex_path(relpath, segno);
+		(void) pgtsq_relindex_add(relpath, offset, block_start, end, &relids);
+	}
+	pfree(relids.data);
+
+	/* Rows are entirely written, make them visible to readers */
+	pg_write_barrier();
+	(void) pg_atomic_compare_exchange_u64(&pgtsqss->committed, &pos,
+										  TSQPosMake(segno, end));
+
+	LWLockRelease(pgtsqss->lock);
+	FreeFile(file);
+
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, start);
+	TSQ_PROBE3(write__done, nstored, (uint64) (end - offset),
+			   INSTR_TIME_GET_MICROSEC(duration));
+	if (stats)
+	{
+		stats->nrows = nstored;
+		stats->bytes = end - offset;
+		stats->write_time = INSTR_TIME_GET_MILLISEC(duration);
+	}
+
+	for (int i = 0; i < nrows; i++)
+	{
+		pfree(stored[i]->data);
+		pfree(stored[i]);
+	}
+	pfree(stored);
+
+	return nstored;
+
+write_error:
+	ereport(LOG,
+			(errcode_for_file_access(),
+			 errmsg("pg_track_slow_queries: could not write storage segment %08X: %m",
+					segno)));
+	if (file)
+	{
+		/* Don't leave partial rows after the committed end of the segment */
+		if (ftruncate(fileno(file), offset) < 0)
+			ereport(LOG,
+					(errcode_for_file_access(),
+					 errmsg("pg_track_slow_queries: could not truncate storage segment %08X: %m",
+							segno)));
+		FreeFile(file);
+	}
+	LWLockRelease(pgtsqss->lock);
+	return -1;
+}
+
+/*
+ * Stores a row / serialized TSQEntry, returns the number of bytes written or
+ * -1 if the row could not be stored.
+ */
+uint32
+pgtsq_store_row(char * row, int length, bool compression, int max_file_size_kb)
+{
+	TSQStoreStats	stats;
+
+	if (pgtsq_store_rows(&row, &length, 1, compression, max_file_size_kb,
+						 &stats) != 1)
+		return -1;
+	return (uint32) stats.bytes;
+}
+
+/*
+ * Opens a segment for reading, up to end or to its end of file if end is -1.
+ * Returns 1 if rows may be read, 0 if the segment is empty or doesn't exist,
+ * -1 on error.
+ */
+int
+pgtsq_open_reader(TSQSegmentReader * reader, uint32 segno, off_t end)
+{
+	char	path[MAXPGPATH];
+	int		ret;
+
+	pgtsq_segment_path(path, segno);
+	ret = pgtsq_open_reader_path(reader, path, end);
+	reader->segno = segno;
+	return ret;
+}
+
+/*
+ * Opens any storage file for reading, like pgtsq_open_reader()
+ */
+int
+pgtsq_open_reader_path(TSQSegmentReader * reader, const char * path, off_t end)
+{
+	memset(reader, 0, sizeof(TSQSegmentReader));
+	reader->end = end;
+	reader->streams = TSQ_STREAMS_ALL;
+	strlcpy(reader->path, path, MAXPGPATH);
+
+	if (end == 0)
+		return 0;
+
+	if ((reader->file = AllocateFile(reader->path, PG_BINARY_R)) == NULL)
+	{
+		/* Nothing has been written in this segment yet */
+		if (errno == ENOENT)
+			return 0;
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("pg_track_slow_queries: could not open file \"%s\": %m",
+						reader->path)));
+		return -1;
+	}
+
+	/* Rows are read according to the format of the segment */
+	if (!pgtsq_read_segment_header(reader->file, &reader->header))
+	{
+		ereport(LOG,
+				(errmsg("pg_track_slow_queries: unsupported format version %d of file \"%s\"",
+						reader->header.version, reader->path)));
+		pgtsq_close_reader(reader);
+		return -1;
+	}
+	reader->offset = pgtsq_segment_data_offset(&reader->header);
+
+	return 1;
+}
+
+/*
+ * Reads the streams of a row of size bytes, the data of a row of a segment in
+ * the current format, and returns them as a serialized entry. The
+ * streams not selected by the reader read as an empty item.
+ */
+static int
+pgtsq_read_streams(TSQSegmentReader * reader, uint32 size, char ** row,
+				   uint32 * length)
+{
+	StringInfoData	buf;
+	TSQStreamHeader	header;
+	uint32			consumed = 0;
+	char			*lz_buff = NULL;
+
+	initStringInfo(&buf);
+	for (int s = 0; s < TSQ_STREAMS; s++)
+	{
+		uint32		stored;
+
+		if (size - consumed < sizeof(TSQStreamHeader))
+			goto decompress_error;
+		if (fread(&header, sizeof(TSQStreamHeader), 1, reader->file) != 1)
+			goto read_error;
+		stored = header.lz_len > 0 ? header.lz_len : header.len;
+		consumed += sizeof(TSQStreamHeader);
+		if (size - consumed < stored)
+			goto decompress_error;
+		consumed += stored;
+
+		/* The metadata is always needed to parse the row */
+		if (s != TSQ_STREAM_META && (reader->streams & (1 << s)) == 0)
+		{
+			if (fseeko(reader->file, stored, SEEK_CUR) != 0)
+				goto read_error;
+			appendStringInfoString(&buf, "00000000");
+			continue;
+		}
+
+		enlargeStringInfo(&buf, header.len);
+		if (header.lz_len > 0)
+		{
+			if (reader->header.codec != TSQ_CODEC_PGLZ)
+				goto decompress_error;
+			if ((lz_buff = (char *) palloc(header.lz_len)) == NULL)
+				goto alloc_error;
+			if (fread(lz_buff, header.lz_len, 1, reader->file) != 1)
+				goto read_error;
+			if (pglz_decompress(lz_buff, header.lz_len, buf.data + buf.len,
+								header.len) != header.len)
+				goto decompress_error;
+			pfree(lz_buff);
+			lz_buff = NULL;
+		}
+		else if (header.len > 0 &&
+				 fread(buf.data + buf.len, header.len, 1, reader->file) != 1)
+			goto read_error;
+		buf.len += header.len;
+		buf.data[buf.len] = '\0';
+	}
+	if (consumed != size)
+		goto decompress_error;
+
+	*row = buf.data;
+	*length = buf.len;
+	return 1;
+
+read_error:
+	ereport(LOG,
+			(errcode_for_file_access(),
+			 errmsg("pg_track_slow_queries: could not read file \"%s\": %m",
+					reader->path)));
+	return -1;
+
+decompress_error:
+	ereport(LOG,
+			(errmsg("pg_track_slow_queries: could not decompress row of file \"%s\"",
+					reader->path)));
+	return -1;
+
+alloc_error:
+	ereport(LOG,
+			(errmsg("pg_track_slow_queries: could not allocate memory")));
+	return -1;
+}
+
+/*
+ * Reads the next row of a segment, decompressed, into the current memory
+ * context. Returns 1 if a row has been read, 0 at the end of the segment, -1
+ * on error.
+ */
+int
+pgtsq_read_row(TSQSegmentReader * reader, char ** row, uint32 * length)
+{
+	uint32		row_len = 0;
+	uint32		row_lz_len = 0;
+	char		*lz_buff = NULL;
+	char		*buff = NULL;
+
+next_row:
+	/* Skip the blocks of the rows not matching the filter */
+	while (reader->next_skipped < reader->nskipped &&
+		   reader->offset == reader->skipped[reader->next_skipped].start)
+	{
+		reader->offset = reader->skipped[reader->next_skipped++].end;
+		if (fseeko(reader->file, reader->offset, SEEK_SET) != 0)
+			goto read_error;
+	}
+
+	if (reader->file == NULL ||
+		(reader->end != -1 && reader->offset + 2 * sizeof(uint32) > reader->end))
+		return 0;
+
+	/* Start by reading compressed row length */
+	if (fread(&row_lz_len, sizeof(uint32), 1, reader->file) != 1)
+	{
+		/* Whole segments are read up to their end of file */
+		if (feof(reader->file))
+			return 0;
+		goto read_error;
+	}
+	if (fread(&row_len, sizeof(uint32), 1, reader->file) != 1)
+		goto read_error;
+
+	/* Block footers are only read by pgtsq_filter_reader() */
+	if (row_lz_len == TSQ_FOOTER_MARKER)
+	{
+		reader->offset += 2 * sizeof(uint32) + row_len;
+		if (fseeko(reader->file, row_len, SEEK_CUR) != 0)
+			goto read_error;
+		goto next_row;
+	}
+	reader->row_offset = reader->offset;
+	reader->offset += 2 * sizeof(uint32) + (row_lz_len > 0 ? row_lz_len : row_len);
+
+	if (reader->header.version != TSQ_FORMAT_LEGACY)
+	{
+		if (row_lz_len > 0)
+			goto decompress_error;
+		return pgtsq_read_streams(reader, row_len, row, length);
+	}
+
+	if ((buff = (char *) palloc0(row_len)) == NULL)
+		goto alloc_error;
+
+	if (row_lz_len > 0)
+	{
+		/* Legacy rows are compressed with pglz as a whole */
+		if ((lz_buff = (char *) palloc0(row_lz_len)) == NULL)
+			goto alloc_error;
+		if (fread(lz_buff, row_lz_len, 1, reader->file) != 1)
+			goto read_error;
+		if (pglz_decompress(lz_buff, row_lz_len, buff, row_len) != row_len)
+			goto decompress_error;
+		pfree(lz_buff);
+	} else {
+		/* Uncompressed row */
+		if (fread(buff, row_len, 1, reader->file) != 1)
+			goto read_error;
+	}
+
+	*row = buff;
+	*length = row_len;
+	return 1;
+
+read_error:
+	ereport(LOG,
+			(errcode_for_file_access(),
+			 errmsg("pg_track_slow_queries: could not read file \"%s\": %m",
+					reader->path)));
+	return -1;
+
+decompress_error:
+	ereport(LOG,
+			(errmsg("pg_track_slow_queries: could not decompress row of file \"%s\"",
+					reader->path)));
+	return -1;
+
+alloc_error:
+	ereport(LOG,
+			(errmsg("pg_track_slow_queries: could not allocate memory")));
+	return -1;
+}
+
+/*
+ * Closes a segment reader, if open
+ */
+void
+pgtsq_close_reader(TSQSegmentReader * reader)
+{
+	if (reader->file)
+		FreeFile(reader->file);
+	reader->file = NULL;
+	if (reader->skipped)
+		pfree(reader->skipped);
+	reader->skipped = NULL;
+	reader->nskipped = reader->next_skipped = reader->maxskipped = 0;
+}
+
 /*
- * TSQEntry serialization function
+ * Returns false if the footer of a block shows none of its rows can match
+ * the filter
  */
-StringInfo pgtsq_serialize_entry(TSQEntry * tsqe)
+bool
+pgtsq_block_match(TSQBlockFooter * footer, TSQBlockFilter * filter)
 {
-	StringInfo	si;
-	si = makeStringInfo();
-	appendStringInfo(si, "%08x%s",
-					 (int) strlen(tsqe->datetime), tsqe->datetime);
-	appendStringInfo(si, "%08x%016.02f",
-					 16, tsqe->duration);
-	appendStringInfo(si, "%08x%s",
-					 (int) strlen(tsqe->username), tsqe->username);
-	appendStringInfo(si, "%08x%s",
-					 (int) strlen(tsqe->appname), tsqe->appname);
-	appendStringInfo(si, "%08x%s",
-					 (int) strlen(tsqe->dbname), tsqe->dbname);
-	appendStringInfo(si, "%08x%016li",
-					 16, tsqe->temp_blks_written);
-	appendStringInfo(si, "%08x%010.06f",
-					 10, tsqe->hitratio);
-	appendStringInfo(si, "%08x%016lu",
-					 16, tsqe->ntuples);
-	appendStringInfo(si, "%08x%s",
-					 (uint32) strlen(tsqe->querytxt), tsqe->querytxt);
-	appendStringInfo(si, "%08x%s",
-					 (uint32) strlen(tsqe->plantxt), tsqe->plantxt);
-	return si;
+	if ((filter->has_since && footer->max_end_time < filter->since) ||
+		(filter->has_until && footer->min_end_time >= filter->until) ||
+		footer->max_duration < filter->min_duration)
+		return false;
+	if (filter->username &&
+		!pgtsq_bloom_test(footer->bloom, TSQ_BLOOM_USERNAME,
+						  filter->username, strlen(filter->username)))
+		return false;
+	if (filter->appname &&
+		!pgtsq_bloom_test(footer->bloom, TSQ_BLOOM_APPNAME,
+						  filter->appname, strlen(filter->appname)))
+		return false;
+	if (filter->dbname &&
+		!pgtsq_bloom_test(footer->bloom, TSQ_BLOOM_DBNAME,
+						  filter->dbname, strlen(filter->dbname)))
+		return false;
+	if (filter->has_queryid &&
+		!pgtsq_bloom_test(footer->bloom, TSQ_BLOOM_QUERYID,
+						  (char *) &filter->queryid, sizeof(uint64)))
+		return false;
+	return true;
 }
 
 /*
- * Stores a row / serialized TSQEntry
+ * Reads the footer of the block of a segment ending at end, whose rows start
+ * after start. Returns the offset of the frame of the footer, or -1 if there
+ * is no valid footer.
  */
-uint32 pgtsq_store_row(char * row, int length, bool compression, int max_file_size_kb)
+static off_t
+pgtsq_read_footer(TSQSegmentReader * reader, off_t start, off_t end,
+				  TSQBlockFooter * footer)
 {
-	char		*buff = NULL;
-	uint32		buff_size = -1;
-	FILE		*file = NULL;
-	off_t		pos = 0;
-	long		row_size = 0;
+	uint32		frame[2];
+	uint32		size;
+	uint32		bloom_size;
+	off_t		footer_start;
 
-	/* Try to compress data if compression is enabled */
-	if (compression)
+	/* The footer ends with its size */
+	if (end - start < (off_t) sizeof(uint32) ||
+		fseeko(reader->file, end - sizeof(uint32), SEEK_SET) != 0 ||
+		fread(&size, sizeof(uint32), 1, reader->file) != 1 ||
+		size < TSQ_FOOTER_SIZE(TSQ_BLOOM_MIN_BITS / 8) ||
+		size > TSQ_FOOTER_SIZE(TSQ_BLOOM_BITS / 8))
+		return -1;
+	bloom_size = TSQ_FOOTER_BLOOM_SIZE(size);
+	if ((bloom_size & (bloom_size - 1)) != 0 ||
+		end - start < (off_t) (sizeof(frame) + size))
+		return -1;
+
+	footer_start = end - sizeof(frame) - size;
+	if (fseeko(reader->file, footer_start, SEEK_SET) != 0 ||
+		fread(frame, sizeof(frame), 1, reader->file) != 1 ||
+		fread(footer, offsetof(TSQBlockFooter, bloom) + bloom_size, 1,
+			  reader->file) != 1)
+		return -1;
+	if (frame[0] != TSQ_FOOTER_MARKER || frame[1] != size ||
+		footer->magic != TSQ_FOOTER_MAGIC ||
+		footer->length > (uint64) (footer_start - start))
+		return -1;
+
+	pgtsq_bloom_unfold(footer->bloom, bloom_size);
+	return footer_start;
+}
+
+/*
+ * Walks the blocks of a segment opened by a reader backward, from the end of
+ * the reader, calling visit on each until it returns false. Returns the
+ * offset the walk stopped at, the end of the rows before the blocks visited,
+ * which are not in blocks when the walk has not been stopped by visit.
+ */
+off_t
+pgtsq_walk_blocks(TSQSegmentReader * reader, TSQBlockVisitor visit, void * arg)
+{
+	struct stat		st;
+	off_t			start = pgtsq_segment_data_offset(&reader->header);
+	off_t			end = reader->end;
+	off_t			footer_start;
+	TSQBlockFooter	footer;
+
+	if (end == -1)
 	{
-		/*
-		 * Allocate a buffer for compression as long as the original string in order
-		 * to be sure to have enough space.
-		 */
-		if ((buff = (char *) palloc0(length)) == NULL)
+		if (reader->file == NULL || fstat(fileno(reader->file), &st) < 0)
+			return start;
+		end = st.st_size;
+	}
+	if (reader->file == NULL || reader->header.version == TSQ_FORMAT_LEGACY)
+		return end;
+
+	while ((footer_start = pgtsq_read_footer(reader, start, end, &footer)) >= 0)
+	{
+		off_t	block_start = footer_start - footer.length;
+
+		if (!visit(arg, reader, block_start, end, &footer))
+			return block_start;
+		end = block_start;
+	}
+	return end;
+}
+
+/*
+ * Adds a block to the ones a reader skips
+ */
+static void
+pgtsq_skip_block(TSQSegmentReader * reader, off_t start, off_t end)
+{
+	if (reader->nskipped == reader->maxskipped)
+	{
+		reader->maxskipped = reader->maxskipped == 0 ? 16 : reader->maxskipped * 2;
+		reader->skipped = reader->skipped == NULL ?
+			(TSQBlockRange *) palloc(reader->maxskipped * sizeof(TSQBlockRange)) :
+			(TSQBlockRange *) repalloc(reader->skipped,
+									   reader->maxskipped * sizeof(TSQBlockRange));
+	}
+	reader->skipped[reader->nskipped].start = start;
+	reader->skipped[reader->nskipped].end = end;
+	reader->nskipped++;
+}
+
+/*
+ * Skips a block if its footer shows none of its rows match the filter
+ */
+static bool
+pgtsq_skip_unmatched_block(void * arg, TSQSegmentReader * reader, off_t start,
+						   off_t end, TSQBlockFooter * footer)
+{
+	if (!pgtsq_block_match(footer, (TSQBlockFilter *) arg))
+		pgtsq_skip_block(reader, start, end);
+	return true;
+}
+
+/*
+ * Adds the blocks of the relation index of a segment, between start and end,
+ * whose rows don't use the given relation to the ones a reader skips
+ */
+static void
+pgtsq_skip_relindex_blocks(TSQSegmentReader * reader, Oid relid, off_t start,
+						   off_t end)
+{
+	char				path[MAXPGPATH];
+	FILE				*file = NULL;
+	TSQRelIndexEntry	entry;
+	bool				matched = false;
+
+	snprintf(path, MAXPGPATH, "%s%s", reader->path, TSQ_RELINDEX_SUFFIX);
+	if ((file = AllocateFile(path, PG_BINARY_R)) == NULL)
+		return;
+
+	while (fread(&entry, sizeof(TSQRelIndexEntry), 1, file) == 1)
+	{
+		/* Blocks not committed yet when the reader has been opened */
+		if (entry.start < (uint64) start || entry.end > (uint64) end ||
+			entry.start >= entry.end)
+			continue;
+		if (entry.relid == relid)
+			matched = true;
+		else if (entry.relid == InvalidOid)
 		{
-			ereport(LOG,
-					(errmsg("pg_track_slow_queries: could not allocate memory")));
-			return -1;
+			if (!matched)
+				pgtsq_skip_block(reader, entry.start, entry.end);
+			matched = false;
 		}
+	}
+	FreeFile(file);
+}
+
+static int
+pgtsq_block_range_cmp(const void * a, const void * b)
+{
+	off_t		sa = ((const TSQBlockRange *) a)->start;
+	off_t		sb = ((const TSQBlockRange *) b)->start;
 
-		buff_size = pglz_compress(row, length, buff, NULL);
+	return sa < sb ? -1 : (sa > sb ? 1 : 0);
+}
+
+/*
+ * Makes a reader opened at the first row of a segment skip the blocks none
+ * of whose rows match the filter, according to their footers. When looking
+ * for a relation, the blocks the relation index of the segment shows don't
+ * use it are skipped too. Rows not in blocks are all read, and rows read
+ * still have to be checked with pgtsq_filter_match().
+ */
+void
+pgtsq_filter_reader(TSQSegmentReader * reader, TSQBlockFilter * filter)
+{
+	struct stat		st;
+	off_t			end = reader->end;
+	int				n = 0;
+
+	if (reader->file == NULL || reader->header.version == TSQ_FORMAT_LEGACY)
+		return;
+	if (end == -1)
+	{
+		if (fstat(fileno(reader->file), &st) < 0)
+			return;
+		end = st.st_size;
 	}
-	if (buff_size == -1)
-		buff_size = 0;
 
-	/* Acquire an exclusive lock before writing the entry */
-	LWLockAcquire(pgtsqss->lock, LW_EXCLUSIVE);
+	(void) pgtsq_walk_blocks(reader, pgtsq_skip_unmatched_block, filter);
+	if (OidIsValid(filter->relid))
+		pgtsq_skip_relindex_blocks(reader, filter->relid, reader->offset, end);
 
-	if ((file = AllocateFile(TSQ_FILE, PG_BINARY_A)) == NULL)
-		goto write_error;
+	/* Blocks skipped for both reasons are only skipped once */
+	if (reader->nskipped > 1)
+		qsort(reader->skipped, reader->nskipped, sizeof(TSQBlockRange),
+			  pgtsq_block_range_cmp);
+	for (int i = 0; i < reader->nskipped; i++)
+		if (n == 0 || reader->skipped[n - 1].start != reader->skipped[i].start)
+			reader->skipped[n++] = reader->skipped[i];
+	reader->nskipped = n;
 
-	/*
-	 * If max_file_size_kb is set we have to check file size before adding
-	 * a new record. We want to skip new records if file size could exceed
-	 * max_file_size.
-	 */
-	if (max_file_size_kb != -1)
+	if (fseeko(reader->file, reader->offset, SEEK_SET) != 0)
+	{
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("pg_track_slow_queries: could not read file \"%s\": %m",
+						reader->path)));
+		pgtsq_close_reader(reader);
+	}
+}
+
+/*
+ * Returns true if an entry matches the filter
+ */
+bool
+pgtsq_filter_match(TSQBlockFilter * filter, TSQEntry * tsqe)
+{
+	return !(filter->has_since && tsqe->end_time < filter->since) &&
+		!(filter->has_until && tsqe->end_time >= filter->until) &&
+		tsqe->duration >= filter->min_duration &&
+		(filter->username == NULL || strcmp(tsqe->username, filter->username) == 0) &&
+		(filter->appname == NULL || strcmp(tsqe->appname, filter->appname) == 0) &&
+		(filter->dbname == NULL || strcmp(tsqe->dbname, filter->dbname) == 0) &&
+		(!filter->has_queryid || tsqe->queryid == filter->queryid) &&
+		(!OidIsValid(filter->relid) ||
+		 bsearch(&filter->relid, tsqe->relids, tsqe->nrelids, sizeof(Oid),
+				 pgtsq_relid_cmp) != NULL);
+}
+
+/*
+ * Returns the first segment readers have to read, pos being their snapshot
+ * of the committed position. A first segment ahead of pos comes from a
+ * concurrent reset, there is then nothing before pos.
+ */
+uint32
+pgtsq_first_segment(uint64 pos)
+{
+	uint32	segno = TSQPosSegno(pos);
+	uint32	first = pg_atomic_read_u32(&pgtsqss->first_segno);
+
+	if (((segno - first) & TSQ_SEGNO_MASK) > TSQ_SEGNO_MASK / 2)
+		return segno;
+	return first;
+}
+
+/*
+ * Finds where the query, plan and relations items of a serialized entry
+ * start, see pgtsq_serialize_entry(). Returns false if the row is malformed.
+ */
+static bool
+pgtsq_row_streams(char * row, uint32 length, uint32 * starts)
+{
+	uint32		p = 0;
+	char		header[9];
+
+	header[8] = '\0';
+	for (int c = 1; c < TSQ_ROW_ITEMS; c++)
+	{
+		uint32		item_len;
+
+		if (length - p < 8)
+			return false;
+		memcpy(header, row + p, 8);
+		item_len = (uint32) strtoul(header, NULL, 16);
+		if (length - p - 8 < item_len)
+			return false;
+		if (c == TSQ_ROW_ITEMS - 2)
+			starts[TSQ_STREAM_QUERY] = p;
+		else if (c == TSQ_ROW_ITEMS - 1)
+			starts[TSQ_STREAM_PLAN] = p;
+		p += 8 + item_len;
+	}
+	starts[TSQ_STREAM_RELATIONS] = p;
+	return true;
+}
+
+/*
+ * Encodes a row as stored: its metadata, query and plan are stored as
+ * separate streams, each compressed if enabled and worth it. Returns the
+ * whole stored row, lengths included.
+ */
+StringInfo
+pgtsq_encode_row(char * row, uint32 length, bool compression)
+{
+	StringInfo		si;
+	uint32			starts[TSQ_STREAMS + 1];
+	uint32			row_lz_len = 0;
+	uint32			row_len;
+
+	starts[TSQ_STREAM_META] = 0;
+	starts[TSQ_STREAMS] = length;
+	/* A malformed row is kept as is, in the metadata stream */
+	if (!pgtsq_row_streams(row, length, starts))
+		starts[TSQ_STREAM_QUERY] = starts[TSQ_STREAM_PLAN] =
+			starts[TSQ_STREAM_RELATIONS] = length;
+
+	/* Streams are compressed on their own, not the whole row */
+	si = makeStringInfo();
+	appendBinaryStringInfo(si, (char *) &row_lz_len, sizeof(uint32));
+	appendBinaryStringInfo(si, (char *) &row_lz_len, sizeof(uint32));
+	for (int s = 0; s < TSQ_STREAMS; s++)
 	{
-		/* Get file current position */
-		pos = ftello(file);
+		TSQStreamHeader	header;
+		int				header_pos = si->len;
+		int32			lz_len = -1;
 
-		/* Row size calculation */
-		row_size += 8;
-		if (buff_size > 0)
+		header.len = starts[s + 1] - starts[s];
+		header.lz_len = 0;
+		appendBinaryStringInfo(si, (char *) &header, sizeof(TSQStreamHeader));
+		if (compression && header.len > 0)
 		{
-			row_size += buff_size;
-		} else {
-			row_size += length;
+			enlargeStringInfo(si, PGLZ_MAX_OUTPUT(header.len));
+			lz_len = pglz_compress(row + starts[s], header.len, si->data + si->len, NULL);
 		}
-
-		if ((pos + row_size) > (max_file_size_kb * 1024))
+		if (lz_len > 0)
 		{
-			ereport(LOG,
-					(errmsg("pg_track_slow_queries: max_file_size reached")));
-			buff_size = -1;
-			goto end;
+			header.lz_len = (uint32) lz_len;
+			si->len += lz_len;
+			memcpy(si->data + header_pos, &header, sizeof(TSQStreamHeader));
 		}
+		else
+			appendBinaryStringInfo(si, row + starts[s], header.len);
 	}
+	row_len = si->len - 2 * sizeof(uint32);
+	memcpy(si->data + sizeof(uint32), &row_len, sizeof(uint32));
+	return si;
+}
 
-	/* Write compressed and original data size */
-	if (fwrite(&buff_size, 1, sizeof(uint32), file) != sizeof(buff_size))
-		goto write_error;
-	if (fwrite(&length, 1, sizeof(int), file) != sizeof(length))
-		goto write_error;
+/*
+ * Appends a row to a file, see pgtsq_encode_row()
+ */
+bool
+pgtsq_write_row(FILE * file, char * row, uint32 length, bool compression)
+{
+	StringInfo	si = pgtsq_encode_row(row, length, compression);
+	bool		written;
+
+	written = fwrite(si->data, si->len, 1, file) == 1;
+	pfree(si->data);
+	pfree(si);
+	return written;
+}
 
-	if (buff_size == 0)
+/* Conversion state, only used by the collector */
+static TSQSegmentReader convert_reader;
+static FILE *convert_file = NULL;
+static char convert_path[MAXPGPATH];
+static char convert_relpath[MAXPGPATH];
+static off_t convert_end = 0;
+static uint64 convert_rows = 0;
+static MemoryContext convert_context = NULL;
+
+/*
+ * Stops the conversion and drops what has been converted so far
+ */
+static void
+pgtsq_convert_cleanup(void)
+{
+	pgtsq_close_reader(&convert_reader);
+	if (convert_file)
 	{
-		/*
-		 * If buff_size == 0 it means pglz_compress hasn't compressed the
-		 * StringInfo for some reasons, probably because there is no gain to
-		 * compress it. In this case, let's store data uncompressed.
-		 */
-		if (fwrite(row, 1, length, file) != length)
+		FreeFile(convert_file);
+		convert_file = NULL;
+		if (unlink(convert_path) < 0 && errno != ENOENT)
+			ereport(LOG,
+					(errcode_for_file_access(),
+					 errmsg("pg_track_slow_queries: could not remove file \"%s\": %m",
+							convert_path)));
+		if (unlink(convert_relpath) < 0 && errno != ENOENT)
+			ereport(LOG,
+					(errcode_for_file_access(),
+					 errmsg("pg_track_slow_queries: could not remove file \"%s\": %m",
+							convert_relpath)));
+	}
+	pgtsqss->convert_pending = false;
+}
+
+/*
+ * Converts the next rows of the segment waiting for conversion to the current
+ * format, by parsing and serializing them again. Each call appends a block of
+ * rows with its footer to a temporary file, and its relations to the relation
+ * index of the file. Both replace the segment and its index once complete, so
+ * readers see either the old or the new segment. Called by the collector
+ * only, returns true when there is nothing left to convert.
+ */
+bool
+pgtsq_convert_segment(bool compression)
+{
+	char			*row;
+	uint32			length;
+	int				ret;
+	MemoryContext	oldcontext;
+	char			*rows[TSQ_CONVERT_CHUNK_ROWS];
+	int				lengths[TSQ_CONVERT_CHUNK_ROWS];
+	StringInfo		stored[TSQ_CONVERT_CHUNK_ROWS];
+	int				nrows = 0;
+	off_t			block_start;
+	StringInfoData	relids;
+	bool			indexed = true;
+	char			path[MAXPGPATH];
+
+	if (!pgtsqss->convert_pending)
+		return true;
+
+	/* The segment has been dropped by a reset */
+	if (pg_atomic_read_u32(&pgtsqss->first_segno) != pgtsqss->convert_segno)
+	{
+		pgtsq_convert_cleanup();
+		return true;
+	}
+
+	if (convert_file == NULL)
+	{
+		ret = pgtsq_open_reader(&convert_reader, pgtsqss->convert_segno, -1);
+		if (ret <= 0 || convert_reader.header.version == TSQ_FORMAT_VERSION)
+		{
+			pgtsq_convert_cleanup();
+			return true;
+		}
+
+		snprintf(convert_path, MAXPGPATH, "%s" TSQ_CONVERT_SUFFIX,
+				 convert_reader.path);
+		snprintf(convert_relpath, MAXPGPATH, "%s" TSQ_RELINDEX_SUFFIX,
+				 convert_path);
+		if ((convert_file = AllocateFile(convert_path, PG_BINARY_W)) == NULL ||
+			!pgtsq_write_segment_header(convert_file))
 			goto write_error;
-	} else {
-		if (fwrite(buff, 1, buff_size, file) != buff_size)
+		convert_end = sizeof(TSQSegmentHeader);
+		convert_rows = 0;
+		if (convert_context == NULL)
+			convert_context = AllocSetContextCreate(TopMemoryContext,
+							"PGTSQConvert", ALLOCSET_DEFAULT_SIZES);
+
+		ereport(LOG,
+				(errmsg("pg_track_slow_queries: converting storage segment %08X from format version %d to %d",
+						convert_reader.segno, convert_reader.header.version,
+						TSQ_FORMAT_VERSION)));
+	}
+
+	oldcontext = MemoryContextSwitchTo(convert_context);
+	while (nrows < TSQ_CONVERT_CHUNK_ROWS &&
+		   (ret = pgtsq_read_row(&convert_reader, &row, &length)) > 0)
+	{
+		TSQEntry	tsqe;
+		StringInfo	si;
+
+		/* Rows are parsed in their format and serialized in the current one */
+		memset(&tsqe, 0, sizeof(TSQEntry));
+		if (!pgtsq_parse_row(row, convert_reader.header.version, &tsqe))
+		{
+			ereport(LOG,
+					(errmsg("pg_track_slow_queries: could not parse row, skipped")));
+			continue;
+		}
+		si = pgtsq_serialize_entry(&tsqe);
+		rows[nrows] = si->data;
+		lengths[nrows] = si->len;
+		stored[nrows] = pgtsq_encode_row(si->data, si->len, compression);
+		nrows++;
+	}
+
+	/* The rows read form a block, like a batch stored by the collector */
+	if (ret >= 0 && nrows > 0)
+	{
+		block_start = convert_end;
+		initStringInfo(&relids);
+		if (pgtsq_write_block(convert_file, stored, rows, lengths, nrows, -1,
+							  &convert_end, &relids, &indexed) < 0)
+		{
+			MemoryContextSwitchTo(oldcontext);
+			MemoryContextReset(convert_context);
 			goto write_error;
+		}
+		if (indexed)
+			(void) pgtsq_relindex_add(convert_relpath, block_start,
+									  block_start, convert_end, &relids);
+		convert_rows += nrows;
+	}
+	MemoryContextSwitchTo(oldcontext);
+	MemoryContextReset(convert_context);
+	if (ret < 0)
+	{
+		/* The segment is left as is, it is still readable */
+		pgtsq_convert_cleanup();
+		return true;
 	}
+	if (ret > 0)
+		return false;
 
-end:
-	LWLockRelease(pgtsqss->lock);
-	FreeFile(file);
+	/* Whole segment converted, it can replace the old one */
+	if (fflush(convert_file) != 0 || pg_fsync(fileno(convert_file)) != 0)
+		goto write_error;
+	FreeFile(convert_file);
+	convert_file = NULL;
+	pgtsq_close_reader(&convert_reader);
 
-	if (buff != NULL)
-		pfree(buff);
+	/*
+	 * Readers don't use the relation index of segments in an older format,
+	 * the index of the converted segment can replace it first
+	 */
+	pgtsq_relindex_path(path, convert_reader.segno);
+	if ((access(convert_relpath, F_OK) == 0 &&
+		 durable_rename(convert_relpath, path, LOG) != 0) ||
+		durable_rename(convert_path, convert_reader.path, LOG) != 0)
+	{
+		unlink(convert_path);
+		unlink(convert_relpath);
+		pgtsq_remove_relindex(convert_reader.segno);
+		pgtsqss->convert_pending = false;
+		return true;
+	}
 
-	return buff_size;
+	ereport(LOG,
+			(errmsg("pg_track_slow_queries: storage segment %08X converted, " UINT64_FORMAT " rows",
+					convert_reader.segno, convert_rows)));
+	pgtsqss->convert_pending = false;
+	return true;
 
 write_error:
-	if (pgtsqss->lock)
-		LWLockRelease(pgtsqss->lock);
-	if (file)
-		FreeFile(file);
 	ereport(LOG,
 			(errcode_for_file_access(),
 			 errmsg("pg_track_slow_queries: could not write file \"%s\": %m",
-					TSQ_FILE)));
-	return -1;
+					convert_path)));
+	pgtsq_convert_cleanup();
+	return true;
+}
+
+/*
+ * Sends a row to the collector, prefixed by the message header. Returns false
+ * if the message could not be sent entirely.
+ */
+bool
+pgtsq_send_row(TSQMsgHeader * header, char * row, int length)
+{
+	struct iovec	iov[2];
+	struct msghdr	msg;
+	ssize_t			sent;
+
+	iov[0].iov_base = header;
+	iov[0].iov_len = sizeof(TSQMsgHeader);
+	iov[1].iov_base = row;
+	iov[1].iov_len = length;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+	sent = sendmsg(pgtsqss->socket, &msg, 0);
+	TSQ_PROBE2(send__done, length, sent);
+
+	return sent == sizeof(TSQMsgHeader) + length;
 }
 
 /*
@@ -165,7 +1686,10 @@ pgtsq_parse_item(char * buffer, uint32 p, TSQItem * item)
 		item = NULL;
 		return;
 	}
-	item->data = pnstrdup(buffer + p + 8, msg_length);
+	/* Not pnstrdup(): binary plan snapshots may contain NUL bytes */
+	item->data = palloc(msg_length + 1);
+	memcpy(item->data, buffer + p + 8, msg_length);
+	item->data[msg_length] = '\0';
 	item->length = msg_length;
 }
 
@@ -185,7 +1709,7 @@ pgtsq_check_row(char * row)
 		return false;
 	}
 
-	for (int c = 1; c <= TSQ_COLS; c++)
+	for (int c = 1; c <= TSQ_ROW_ITEMS; c++)
 	{
 		pgtsq_parse_item(row, p, item);
 
@@ -201,13 +1725,17 @@ pgtsq_check_row(char * row)
 
 
 /*
- * Parses a row (serialized)
+ * Parses a row (serialized) of the given format version. Legacy rows start
+ * with the end datetime as text, and have neither start time, computed from
+ * the duration, query identifier nor relations.
  */
 bool
-pgtsq_parse_row(char * row, TSQEntry * tsqe)
+pgtsq_parse_row(char * row, int version, TSQEntry * tsqe)
 {
 	uint32		p = 0;
 	TSQItem		*item = NULL;
+	bool		legacy = (version == TSQ_FORMAT_LEGACY);
+	int			nitems = legacy ? TSQ_ROW_ITEMS - 3 : TSQ_ROW_ITEMS;
 
 	if ((item = (TSQItem *)palloc(sizeof(TSQItem))) == NULL)
 	{
@@ -217,7 +1745,7 @@ pgtsq_parse_row(char * row, TSQEntry * tsqe)
 	}
 
 	/* Row items parsing and type conversion if needed*/
-	for (int c = 1; c <= TSQ_COLS; c++)
+	for (int c = 1; c <= nitems; c++)
 	{
 		pgtsq_parse_item(row, p, item);
 
@@ -226,51 +1754,76 @@ pgtsq_parse_row(char * row, TSQEntry * tsqe)
 
 		p += item->length + 8;
 
-		switch (c)
+		/* Legacy rows have no start time nor query identifier item */
+		switch (legacy && c > 1 ? (c > 8 ? c + 2 : c + 1) : c)
 		{
 			case 1:
-				/* datetime */
-				tsqe->datetime = item->data;
+				/* end_time */
+				if (legacy)
+					tsqe->end_time = DatumGetTimestampTz(
+						DirectFunctionCall3(timestamptz_in,
+											CStringGetDatum(item->data),
+											ObjectIdGetDatum(InvalidOid),
+											Int32GetDatum(-1)));
+				else
+					tsqe->end_time = (TimestampTz) strtoll(item->data, NULL, 10);
+				pfree(item->data);
 				break;
 			case 2:
+				/* start_time */
+				tsqe->start_time = (TimestampTz) strtoll(item->data, NULL, 10);
+				pfree(item->data);
+				break;
+			case 3:
 				/* duration */
 				tsqe->duration = atof(item->data);
 				pfree(item->data);
 				break;
-			case 3:
+			case 4:
 				/* username */
 				tsqe->username = item->data;
 				break;
-			case 4:
+			case 5:
 				/* appname */
 				tsqe->appname = item->data;
 				break;
-			case 5:
+			case 6:
 				/* dbname */
 				tsqe->dbname = item->data;
 				break;
-			case 6:
+			case 7:
 				/* temp_blks_written */
 				tsqe->temp_blks_written = atoi(item->data);
 				pfree(item->data);
 				break;
-			case 7:
+			case 8:
 				/* hitratio */
 				tsqe->hitratio = atof(item->data);
 				pfree(item->data);
 				break;
-			case 8:
+			case 9:
 				/* ntuples */
 				tsqe->ntuples = atoi(item->data);
 				pfree(item->data);
 				break;
-			case 9:
+			case 10:
+				/* queryid */
+				tsqe->queryid = (uint64) strtoll(item->data, NULL, 10);
+				pfree(item->data);
+				break;
+			case 11:
 				/* querytxt */
 				tsqe->querytxt = item->data;
 				break;
-			case 10:
+			case 12:
 				/* plantxt */
 				tsqe->plantxt = item->data;
+				tsqe->planlen = item->length;
+				break;
+			case 13:
+				/* relids, the item data is palloc'ed hence aligned */
+				tsqe->relids = (Oid *) item->data;
+				tsqe->nrelids = item->length / sizeof(Oid);
 				break;
 			default:
 				/* Not yet implemented */
@@ -278,24 +1831,88 @@ pgtsq_parse_row(char * row, TSQEntry * tsqe)
 		}
 	}
 	pfree(item);
+
+	if (legacy)
+	{
+		tsqe->start_time = tsqe->end_time -
+			(TimestampTz) (tsqe->duration * 1000.0);
+		tsqe->queryid = 0;
+	}
+
 	return true;
 }
 
 /*
- * Truncates storage file
+ * Empties the storage by pointing writers and readers to a new segment. The
+ * new segment is created with its header and synced before it is published,
+ * so that a restart starts from it instead of bringing the entries back: the
+ * segments before it are removed then, or later by the collector. Readers
+ * still holding them go on reading them until they close them.
  */
 void
-pgtsq_truncate_file(void)
+pgtsq_switch_segment(void)
 {
+	uint32	segno;
+	char	path[MAXPGPATH];
 	FILE	*file = NULL;
 
+	/* Writers must not append to the segment while it is created */
 	LWLockAcquire(pgtsqss->lock, LW_EXCLUSIVE);
-	file = AllocateFile(TSQ_FILE, PG_BINARY_W);
-	LWLockRelease(pgtsqss->lock);
-	if (file == NULL)
+
+	segno = TSQNextSegno(TSQPosSegno(pg_atomic_read_u64(&pgtsqss->committed)));
+	pgtsq_segment_path(path, segno);
+	pgtsq_remove_relindex(segno);
+	if ((file = pgtsq_open_segment(segno, 0)) == NULL ||
+		!pgtsq_write_segment_header(file) ||
+		fflush(file) != 0 ||
+		pg_fsync(fileno(file)) != 0)
+	{
+		int		save_errno = errno;
+
+		if (file != NULL)
+			FreeFile(file);
+		LWLockRelease(pgtsqss->lock);
+		errno = save_errno;
 		ereport(ERROR,
 				(errcode_for_file_access(),
-				 errmsg("pg_track_slow_queries: could not write file \"%s\": %m",
-					TSQ_FILE)));
+				 errmsg("pg_track_slow_queries: could not create file \"%s\": %m",
+						path)));
+	}
 	FreeFile(file);
+	fsync_fname(PGSTAT_STAT_PERMANENT_DIRECTORY, true);
+
+	/* Readers seeing the new position must not read older segments */
+	pg_atomic_write_u32(&pgtsqss->first_segno, segno);
+	pg_write_barrier();
+	pg_atomic_write_u64(&pgtsqss->committed,
+						TSQPosMake(segno, sizeof(TSQSegmentHeader)));
+
+	LWLockRelease(pgtsqss->lock);
+}
+
+/*
+ * Removes the segments left behind by storage resets. Called by the
+ * collector only.
+ */
+void
+pgtsq_remove_old_segments(void)
+{
+	uint32	segno;
+	char	path[MAXPGPATH];
+
+	segno = pg_atomic_read_u32(&pgtsqss->first_segno);
+	while (pgtsqss->oldest_segno != segno)
+	{
+		pgtsq_segment_path(path, pgtsqss->oldest_segno);
+		if (unlink(path) < 0 && errno != ENOENT)
+		{
+			ereport(LOG,
+					(errcode_for_file_access(),
+					 errmsg("pg_track_slow_queries: could not remove file \"%s\": %m",
+						path)));
+			break;
+		}
+		pgtsq_remove_relindex(pgtsqss->oldest_segno);
+		pgtsqss->oldest_segno = TSQNextSegno(pgtsqss->oldest_segno);
+	}
 }
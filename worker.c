@@ -5,9 +5,27 @@
 #include "storage/latch.h"
 #include "storage/lwlock.h"
 #include "storage/ipc.h"
+#include "storage/spin.h"
+#include "port/atomics.h"
 #include "utils/guc.h"
+#include "utils/memutils.h"
+#include "utils/timestamp.h"
 #include "pg_track_slow_queries.h"
 
+/* Rows received from backends and not stored yet */
+typedef struct TSQBatch {
+	int			nrows;
+	Size		size;
+	char		*rows[TSQ_BATCH_SIZE];
+	int			lengths[TSQ_BATCH_SIZE];
+	TSQMsgHeader headers[TSQ_BATCH_SIZE];
+} TSQBatch;
+
+static void pgtsq_worker_flush(TSQBatch * batch, bool compression,
+							   int max_file_size_kb, double regression_ratio,
+							   uint32 nmessages);
+static void pgtsq_worker_forward_config(void);
+
 
 /* flags set by signal handlers */
 static volatile sig_atomic_t got_sighup = false;
@@ -20,15 +38,22 @@ void
 pgtsq_worker(Datum main_arg)
 {
 	fd_set			rfds;
+	fd_set			wfds;
+	int				maxfd;
 	struct timeval	tv;
 	int				timeout = 1;
 	int				retval;
 	char			msgbuf[MSG_BUFFER_SIZE];
 	int				n;
+	TSQBatch		batch;
+	uint32			nmessages;
+	MemoryContext	batch_context;
 	bool			compression = true;
 	int				max_file_size_kb = 1024 * 1024;
+	double			regression_ratio = 2.0;
 	const char		*guc_compression_value;
 	const char		*guc_max_file_size_value;
+	const char		*guc_regression_ratio_value;
 
 	/* Establish signal handlers before unblocking signals. */
 	pqsignal(SIGHUP, pgtsq_worker_sighup);
@@ -37,6 +62,13 @@ pgtsq_worker(Datum main_arg)
 	/* We're now ready to receive signals */
 	BackgroundWorkerUnblockSignals();
 
+	/* Let the stress test find us to measure our CPU usage */
+	pgtsqss->collector_pid = MyProcPid;
+
+	/* Received rows are kept there until their batch is stored */
+	batch_context = AllocSetContextCreate(TopMemoryContext,
+						"PGTSQWorkerBatch", ALLOCSET_DEFAULT_SIZES);
+
 	/* Get pg_track_slow_queries.compress GUC value and enabled/disable
 	 * compression */
 	if ((guc_compression_value = GetConfigOption(
@@ -49,28 +81,60 @@ pgtsq_worker(Datum main_arg)
 		max_file_size_kb = (int) strtol(guc_max_file_size_value,
 										(char **)NULL, 10);
 
+	/* Get pg_track_slow_queries.plan_regression_ratio GUC value */
+	if ((guc_regression_ratio_value = GetConfigOption(
+					"pg_track_slow_queries.plan_regression_ratio", true, false)) != NULL)
+		regression_ratio = strtod(guc_regression_ratio_value, (char **)NULL);
+
+	pgtsq_worker_forward_config();
+
 	/*
 	 * Main loop: do this until the SIGTERM handler tells us to terminate
 	 */
 	while (!got_sigterm)
 	{
-		tv.tv_sec = timeout;
+		/* Don't wait for messages while a segment is being converted */
+		tv.tv_sec = pgtsqss->convert_pending ? 0 : timeout;
 		tv.tv_usec = 0;
 
 		FD_ZERO(&rfds);
+		FD_ZERO(&wfds);
 		FD_SET(pgtsqss->socket, &rfds);
-		retval = select(pgtsqss->socket+1, &rfds, NULL, NULL, &tv);
-		if (retval > 0)
+		maxfd = Max(pgtsqss->socket, pgtsq_forward_fds(&rfds, &wfds));
+		retval = select(maxfd+1, &rfds, &wfds, NULL, &tv);
+		if (retval > 0 && FD_ISSET(pgtsqss->socket, &rfds))
 		{
+			MemoryContext	oldcontext;
+
+			oldcontext = MemoryContextSwitchTo(batch_context);
+			batch.nrows = 0;
+			batch.size = 0;
+			nmessages = 0;
+
 			memset(msgbuf, 0, sizeof(msgbuf));
 			while ((n = recv(pgtsqss->socket, msgbuf, sizeof(msgbuf), 0)) > 0)
 			{
-				if (pgtsq_check_row(msgbuf))
+				char	*row = msgbuf + sizeof(TSQMsgHeader);
+				int		length = n - sizeof(TSQMsgHeader);
+
+				TSQ_PROBE1(receive, n);
+				nmessages++;
+				if (n > sizeof(TSQMsgHeader) && pgtsq_check_row(row))
 				{
-					if (pgtsq_store_row(msgbuf, n, compression, max_file_size_kb) == -1)
+					memcpy(&batch.headers[batch.nrows], msgbuf, sizeof(TSQMsgHeader));
+					batch.rows[batch.nrows] = (char *) palloc(length);
+					memcpy(batch.rows[batch.nrows], row, length);
+					batch.lengths[batch.nrows] = length;
+					batch.nrows++;
+					batch.size += length;
+
+					if (batch.nrows == TSQ_BATCH_SIZE ||
+						batch.size >= TSQ_BATCH_MAX_SIZE)
 					{
-						ereport(LOG,
-								(errmsg("pg_track_slow_queries: could not store data")));
+						pgtsq_worker_flush(&batch, compression,
+										   max_file_size_kb, regression_ratio,
+										   nmessages);
+						MemoryContextReset(batch_context);
 					}
 				} else {
 					ereport(LOG,
@@ -79,9 +143,24 @@ pgtsq_worker(Datum main_arg)
 				memset(msgbuf, 0, sizeof(msgbuf));
 				CHECK_FOR_INTERRUPTS();
 			}
+			if (batch.nrows > 0)
+				pgtsq_worker_flush(&batch, compression, max_file_size_kb,
+								   regression_ratio, nmessages);
+
+			MemoryContextSwitchTo(oldcontext);
+			MemoryContextReset(batch_context);
 		}
 		CHECK_FOR_INTERRUPTS();
 
+		/* Exchange with the aggregator, if forwarding is enabled */
+		pgtsq_forward();
+
+		/* Convert the next rows of a segment in an older format, if any */
+		pgtsq_convert_segment(compression);
+
+		/* Get rid of the segments dropped by storage resets */
+		pgtsq_remove_old_segments();
+
 		/*
 		 * In case of a SIGHUP, just reload the configuration.
 		 */
@@ -98,12 +177,76 @@ pgtsq_worker(Datum main_arg)
 					"pg_track_slow_queries.max_file_size", true, false)) != NULL)
 				max_file_size_kb = (int) strtol(guc_max_file_size_value,
 												(char **)NULL, 10);
+			if ((guc_regression_ratio_value = GetConfigOption(
+					"pg_track_slow_queries.plan_regression_ratio", true, false)) != NULL)
+				regression_ratio = strtod(guc_regression_ratio_value, (char **)NULL);
+			pgtsq_worker_forward_config();
 		}
 	}
 
 	proc_exit(1);
 }
 
+/*
+ * Stores a batch of rows, then accounts its timings, the latency of its
+ * entries and their plans. nmessages is the number of messages read from the
+ * socket so far on this wakeup.
+ */
+static void
+pgtsq_worker_flush(TSQBatch * batch, bool compression, int max_file_size_kb,
+				   double regression_ratio, uint32 nmessages)
+{
+	TSQStoreStats	stats;
+	TSQHistogram	latency;
+	TimestampTz		now;
+
+	memset(&stats, 0, sizeof(stats));
+	memset(&latency, 0, sizeof(latency));
+
+	if (pgtsq_store_rows(batch->rows, batch->lengths, batch->nrows,
+						 compression, max_file_size_kb, &stats) == -1)
+	{
+		ereport(LOG,
+				(errmsg("pg_track_slow_queries: could not store data")));
+	}
+
+	/* Rows left out by max_file_size are forwarded all the same */
+	pgtsq_forward_rows(batch->rows, batch->lengths, batch->nrows, compression);
+
+	/* Rows are now visible to readers */
+	now = GetCurrentTimestamp();
+	for (int i = 0; i < stats.nrows; i++)
+		pgtsq_histogram_add(&latency, (now - batch->headers[i].captured) / 1000.0);
+
+	pgtsq_report_batch(&stats, &latency, nmessages);
+
+	/* Plans of all the rows received, stored or not */
+	pgtsq_track_plans(batch->headers, batch->rows, batch->nrows,
+					  regression_ratio);
+
+	batch->nrows = 0;
+	batch->size = 0;
+}
+
+/*
+ * Gets the forwarding GUC values and applies them
+ */
+static void
+pgtsq_worker_forward_config(void)
+{
+	const char	*guc_forward_to_value;
+	const char	*guc_spool_size_value;
+	int			spool_size_kb = -1;
+
+	guc_forward_to_value = GetConfigOption(
+					"pg_track_slow_queries.forward_to", true, false);
+	if ((guc_spool_size_value = GetConfigOption(
+					"pg_track_slow_queries.forward_spool_size", true, false)) != NULL)
+		spool_size_kb = (int) strtol(guc_spool_size_value, (char **)NULL, 10);
+
+	pgtsq_forward_configure(guc_forward_to_value, spool_size_kb);
+}
+
 /*
  * Signal handler for SIGTERM
  * Set a flag to let the main loop to terminate, and set our latch to wake